@@ -18,11 +18,13 @@ struct bbb_gpio_pin
 const char * gpio_path = "/sys/class/gpio/gpio%d";  
 const char * gpio_value_path = "/sys/class/gpio/gpio%d/value";  
 const char * gpio_dir_path = "/sys/class/gpio/gpio%d/direction";  
+const char * gpio_edge_path = "/sys/class/gpio/gpio%d/edge";  
 const char * gpio_export_path = "/sys/class/gpio/export";  
 const char * gpio_unexport_path = "/sys/class/gpio/unexport"; 
 
 
 const char * dirstr[]  = { "in","out"}; 
+const char * edgestr[]  = { "none","rising","falling","both"}; 
 
 //#define LOCK_GPIO_ACCESS 
 
@@ -167,6 +169,36 @@ bbb_gpio_direction_t bbb_gpio_get_direction(bbb_gpio_pin_t * pin)
   return letter == 'o'  ? BBB_OUT : BBB_IN; 
 }
 
+int bbb_gpio_set_edge(bbb_gpio_pin_t * pin, bbb_gpio_edge_t edge) 
+{
+  char buf[512]; 
+  sprintf(buf, gpio_edge_path, pin->num); 
+  int fd = open(buf, O_WRONLY); 
+  if (fd < 0) 
+  {
+    fprintf(stderr,"Could not open %s. Does GPIO %d support interrupts?\n", buf, pin->num); 
+    return -1; 
+  }
+
+  int ret = write(fd, edgestr[edge], strlen(edgestr[edge])); 
+  close(fd); 
+
+  if (ret < 0) 
+  {
+    fprintf(stderr,"Trouble setting edge to \"%s\" for GPIO %d\n", edgestr[edge], pin->num); 
+    return -1; 
+  }
+
+  //read the value once so that only edges from now on count 
+  bbb_gpio_get(pin); 
+  return 0; 
+}
+
+int bbb_gpio_get_fd(const bbb_gpio_pin_t * pin) 
+{
+  return pin->value_fd; 
+}
+
 int bbb_gpio_close(bbb_gpio_pin_t * pin, int unexport)
 {
 #ifdef LOCK_GPIO_ACCESS
@@ -21,6 +21,15 @@ typedef enum bbb_gpio_direction
   BBB_OUT
 } bbb_gpio_direction_t; 
 
+/** which edges of an input trigger an interrupt */ 
+typedef enum bbb_gpio_edge
+{
+  BBB_EDGE_NONE, 
+  BBB_EDGE_RISING, 
+  BBB_EDGE_FALLING, 
+  BBB_EDGE_BOTH
+} bbb_gpio_edge_t; 
+
 
 
 /** open the given pin GPIO . Will allocate memory and return an opaque pointer if successful, 0 otherwise.
@@ -51,5 +60,13 @@ int bbb_gpio_get_pin_number(const bbb_gpio_pin_t * pin);
 /** Gets the direction. */ 
 bbb_gpio_direction_t bbb_gpio_get_direction(bbb_gpio_pin_t * pin); 
 
+/** Set which edges generate an interrupt (the pin should be an input). Returns 0 on success, -1 if something went wrong. */ 
+int bbb_gpio_set_edge(bbb_gpio_pin_t * pin, bbb_gpio_edge_t edge); 
+
+/** Returns the file descriptor of the value file, for use with poll(). After bbb_gpio_set_edge, 
+ * an edge shows up as POLLPRI | POLLERR, and stays that way until the value is read again (e.g. with bbb_gpio_get). 
+ */ 
+int bbb_gpio_get_fd(const bbb_gpio_pin_t * pin); 
+
 
 #endif
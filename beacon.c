@@ -3,19 +3,26 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <time.h> 
+#include <pthread.h> 
 
 //these need to be incremented if the structs change incompatibly
 //and then generic_*_read must be updated to delegate appropriately. 
-#define BEACON_HEADER_VERSION 2
-#define BEACON_EVENT_VERSION 0 
+#define BEACON_HEADER_VERSION 4
+#define BEACON_EVENT_VERSION 1 
 #define BEACON_STATUS_VERSION 2 
 #define BEACON_HK_VERSION 1 
+#define BEACON_BEAMS_VERSION 0 
+#define BEACON_POWERSUM_VERSION 0 
+#define BEACON_TIMING_VERSION 0 
 
 
 #define BEACON_HEADER_MAGIC 0xbe  
 #define BEACON_EVENT_MAGIC  0xac 
 #define BEACON_STATUS_MAGIC 0x04 
 #define BEACON_HK_MAGIC     0xcc 
+#define BEACON_BEAMS_MAGIC  0xbb 
+#define BEACON_POWERSUM_MAGIC 0x95 
+#define BEACON_TIMING_MAGIC 0x71 
 
 
 //TODO there are apparently much faster versions of these 
@@ -189,10 +196,71 @@ typedef struct beacon_header_v1
   uint32_t dynamic_beam_mask;                         //!< the automatic beam masker 
 } beacon_header_v1_t; 
 
+typedef struct beacon_header_v2
+{
+  uint64_t event_number;                              //!< A unique identifier for this event. If only one board, will match readout number. Otherwise, might skip if the boards are out of sync. 
+  uint64_t trig_number;                               //!< the sequential (since reset) trigger number assigned to this event. 
+  uint16_t buffer_length;                             //!< the buffer length. Stored both here and in the event. 
+  uint16_t pretrigger_samples;                        //!< Number of samples that are pretrigger
+  uint32_t readout_time[BN_MAX_BOARDS];          //!< CPU time of readout, seconds
+  uint32_t readout_time_ns[BN_MAX_BOARDS];       //!< CPU time of readout, nanoseconds 
+  uint64_t trig_time[BN_MAX_BOARDS];             //!< Board trigger time (raw units) 
+  uint32_t approx_trigger_time;                       //!< Board trigger time converted to real units (approx secs), master only
+  uint32_t approx_trigger_time_nsecs;                 //!< Board trigger time converted to real units (approx nnsecs), master only
+  uint32_t triggered_beams;                           //!< The beams that triggered 
+  uint32_t beam_mask;                                 //!< The enabled beams
+  uint32_t beam_power;                                //!< The power in the triggered beam
+  uint32_t deadtime[BN_MAX_BOARDS];              //!< ??? Will we have this available? If so, this will be a fraction. (store for slave board as well) 
+  uint8_t buffer_number;                              //!< the buffer number (do we need this?) 
+  uint8_t channel_mask;                               //!< The channels allowed to participate in the trigger
+  uint8_t channel_read_mask[BN_MAX_BOARDS];      //!< The channels actually read
+  uint8_t gate_flag;                                  //!< gate flag  (used to be channel_overflow but that was never used) 
+  uint8_t buffer_mask;                                //!< The buffer mask at time of read out (do we want this?)   
+  uint8_t board_id[BN_MAX_BOARDS];               //!< The board number assigned at startup. If board_id[1] == 0, no slave. 
+  beacon_trig_type_t trig_type;                      //!< The trigger type?
+  beacon_trigger_polarization_t trig_pol;            //!< The trigger polarization
+  uint8_t calpulser;                                  //!< Was the calpulser on? 
+  uint8_t sync_problem;                               //!< Various sync problems. TODO convert to enum 
+  uint32_t pps_counter;                               //!< value of the pps timer at the time of the event
+  uint32_t dynamic_beam_mask;                         //!< the automatic beam masker 
+  uint32_t veto_deadtime_counter;                     //!< deadtime counter
+} beacon_header_v2_t; 
+
+typedef struct beacon_header_v3
+{
+  uint64_t event_number;                              //!< A unique identifier for this event. If only one board, will match readout number. Otherwise, might skip if the boards are out of sync. 
+  uint64_t trig_number;                               //!< the sequential (since reset) trigger number assigned to this event. 
+  uint16_t buffer_length;                             //!< the buffer length. Stored both here and in the event. 
+  uint16_t pretrigger_samples;                        //!< Number of samples that are pretrigger
+  uint32_t readout_time[BN_MAX_BOARDS];          //!< CPU time of readout, seconds
+  uint32_t readout_time_ns[BN_MAX_BOARDS];       //!< CPU time of readout, nanoseconds 
+  uint64_t trig_time[BN_MAX_BOARDS];             //!< Board trigger time (raw units) 
+  uint32_t approx_trigger_time;                       //!< Board trigger time converted to real units (approx secs), master only
+  uint32_t approx_trigger_time_nsecs;                 //!< Board trigger time converted to real units (approx nnsecs), master only
+  uint32_t triggered_beams;                           //!< The beams that triggered 
+  uint32_t beam_mask;                                 //!< The enabled beams
+  uint32_t beam_power;                                //!< The power in the triggered beam
+  uint32_t deadtime[BN_MAX_BOARDS];              //!< ??? Will we have this available? If so, this will be a fraction. (store for slave board as well) 
+  uint8_t buffer_number;                              //!< the buffer number (do we need this?) 
+  uint8_t channel_mask;                               //!< The channels allowed to participate in the trigger
+  uint8_t channel_read_mask[BN_MAX_BOARDS];      //!< The channels actually read
+  uint8_t gate_flag;                                  //!< gate flag  (used to be channel_overflow but that was never used) 
+  uint8_t buffer_mask;                                //!< The buffer mask at time of read out (do we want this?)   
+  uint8_t board_id[BN_MAX_BOARDS];               //!< The board number assigned at startup. If board_id[1] == 0, no slave. 
+  beacon_trig_type_t trig_type;                      //!< The trigger type?
+  beacon_trigger_polarization_t trig_pol;            //!< The trigger polarization
+  uint8_t calpulser;                                  //!< Was the calpulser on? 
+  uint8_t sync_problem;                               //!< Various sync problems. TODO convert to enum 
+  uint32_t pps_counter;                               //!< value of the pps timer at the time of the event
+  uint32_t dynamic_beam_mask;                         //!< the automatic beam masker 
+  uint32_t veto_deadtime_counter;                     //!< deadtime counter
+  uint16_t readout_window_start;                      //!< The first sample read out, if only a window around the trigger was, otherwise 0. 
+} beacon_header_v3_t; 
+
 
 
 /* Offsets from start of structs for headers */ 
-const int beacon_header_sizes []=  { sizeof(beacon_header_v0_t), sizeof(beacon_header_v1_t), sizeof(beacon_header_t) }; 
+const int beacon_header_sizes []=  { sizeof(beacon_header_v0_t), sizeof(beacon_header_v1_t), sizeof(beacon_header_v2_t), sizeof(beacon_header_v3_t), sizeof(beacon_header_t) }; 
 
 
 
@@ -257,6 +325,21 @@ static int beacon_header_generic_read(struct generic_file gf, beacon_header_t *h
       h->pps_counter = 0; 
       h->dynamic_beam_mask = 0; 
       h->veto_deadtime_counter = 0; 
+      h->readout_window_start = 0; 
+      h->waveforms_skipped = 0; 
+      break; 
+   case 2: 
+      wanted = sizeof(beacon_header_v2_t); 
+      got = generic_read(gf, wanted, h); 
+      cksum = stupid_fletcher16(wanted, h); 
+      h->readout_window_start = 0; 
+      h->waveforms_skipped = 0; 
+      break; 
+   case 3: 
+      wanted = sizeof(beacon_header_v3_t); 
+      got = generic_read(gf, wanted, h); 
+      cksum = stupid_fletcher16(wanted, h); 
+      h->waveforms_skipped = 0; 
       break; 
  
    case BEACON_HEADER_VERSION: //this is the most recent header!
@@ -285,31 +368,81 @@ static int beacon_header_generic_read(struct generic_file gf, beacon_header_t *h
 }
 
 
+/* Where an event body lives in memory, so beacon_event_t and beacon_compact_event_t can share the on-disk format. 
+ * In a beacon_event_t, each waveform takes BN_MAX_WAVEFORM_LENGTH. In a compact event, they're buffer_length apart. 
+ */ 
+struct event_view 
+{
+  uint64_t * event_number; 
+  uint16_t * buffer_length; 
+  uint8_t * board_id; // BN_MAX_BOARDS of these 
+  uint8_t * channel_read_mask; // and these 
+  uint8_t * data; 
+  int compact; 
+  uint16_t max_length; 
+}; 
+
+static struct event_view view_event(const beacon_event_t * ev) 
+{
+  beacon_event_t * e = (beacon_event_t*) ev; 
+  struct event_view v = { &e->event_number, &e->buffer_length, &e->board_id[0], &e->channel_read_mask[0], &e->data[0][0][0], 0, BN_MAX_WAVEFORM_LENGTH }; 
+  return v; 
+}
+
+static struct event_view view_compact(const beacon_compact_event_t * ev) 
+{
+  beacon_compact_event_t * e = (beacon_compact_event_t*) ev; 
+  struct event_view v = { &e->event_number, &e->buffer_length, &e->board_id[0], &e->channel_read_mask[0], e->data, 1, e->max_length }; 
+  return v; 
+}
+
+static uint8_t * view_waveform(const struct event_view * v, int ibd, int ichan) 
+{
+  return v->data + (ibd * BN_NUM_CHAN + ichan) * (v->compact ? *v->buffer_length : BN_MAX_WAVEFORM_LENGTH); 
+}
+
+
+/* The channels written for a board. Events not filled by the readout may not have a mask, which means everything. */ 
+static uint8_t view_channel_mask(const struct event_view * v, int ibd) 
+{
+  if (!v->board_id[ibd]) return 0; 
+  return v->channel_read_mask[ibd] ? v->channel_read_mask[ibd] : 0xff; 
+}
+
+
 /* The on-disk format is just packet_start followed by the newest version of the
  * the event struct. Note that we only write (and compute the checksum for) buffer length bytes for each event. 
  *
+ * Since version 1, the channel read mask of each board follows the board ids, and only the channels 
+ * in it are written. Version 0 has no mask and always has all of them. 
+ *
  * very time the version changes,if we have data we care about, 
  * we need to increment the version. 
  */
 
-static int beacon_event_generic_write(struct generic_file gf, const beacon_event_t *ev)
+static int beacon_event_generic_write(struct generic_file gf, const struct event_view * ev)
 {
   struct packet_start start; 
   int written; 
   int i,ibd; 
+  uint16_t len = *ev->buffer_length; 
+  uint8_t mask[BN_MAX_BOARDS]; 
   start.magic = BEACON_EVENT_MAGIC; 
   start.ver = BEACON_EVENT_VERSION; 
 
-  start.cksum = stupid_fletcher16(sizeof(ev->event_number), &ev->event_number); 
-  start.cksum = stupid_fletcher16_append(sizeof(ev->buffer_length), &ev->buffer_length,start.cksum); 
-  start.cksum = stupid_fletcher16_append(sizeof(ev->board_id), &ev->board_id, start.cksum); 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++) mask[ibd] = view_channel_mask(ev, ibd); 
+
+  start.cksum = stupid_fletcher16(sizeof(*ev->event_number), ev->event_number); 
+  start.cksum = stupid_fletcher16_append(sizeof(*ev->buffer_length), ev->buffer_length,start.cksum); 
+  start.cksum = stupid_fletcher16_append(BN_MAX_BOARDS, ev->board_id, start.cksum); 
+  start.cksum = stupid_fletcher16_append(BN_MAX_BOARDS, mask, start.cksum); 
 
   for (ibd = 0; ibd <BN_MAX_BOARDS ; ibd++)
   {
-    if (!ev->board_id[ibd]) continue; 
     for (i = 0; i < BN_NUM_CHAN; i++) 
     {
-     start.cksum = stupid_fletcher16_append(ev->buffer_length, ev->data[ibd][i], start.cksum); 
+     if ((mask[ibd] & (1 << i)) == 0) continue; 
+     start.cksum = stupid_fletcher16_append(len, view_waveform(ev,ibd,i), start.cksum); 
     }
   }
 
@@ -320,34 +453,54 @@ static int beacon_event_generic_write(struct generic_file gf, const beacon_event
     return BN_ERR_NOT_ENOUGH_BYTES; 
   }
 
-  written = generic_write(gf, sizeof(ev->event_number), &ev->event_number); 
+  written = generic_write(gf, sizeof(*ev->event_number), ev->event_number); 
 
-  if (written != sizeof(ev->event_number))
+  if (written != sizeof(*ev->event_number))
   {
     return BN_ERR_NOT_ENOUGH_BYTES; 
   }
 
 
-  written = generic_write(gf, sizeof(ev->buffer_length), &ev->buffer_length); 
-  if (written != sizeof(ev->buffer_length))
+  written = generic_write(gf, sizeof(*ev->buffer_length), ev->buffer_length); 
+  if (written != sizeof(*ev->buffer_length))
   {
     return BN_ERR_NOT_ENOUGH_BYTES; 
   }
 
-  written = generic_write(gf, sizeof(ev->board_id), &ev->board_id); 
+  written = generic_write(gf, BN_MAX_BOARDS, ev->board_id); 
 
-  if (written != sizeof(ev->board_id)) 
+  if (written != BN_MAX_BOARDS) 
+  {
+      return BN_ERR_NOT_ENOUGH_BYTES; 
+  }
+
+  written = generic_write(gf, BN_MAX_BOARDS, mask); 
+
+  if (written != BN_MAX_BOARDS) 
   {
       return BN_ERR_NOT_ENOUGH_BYTES; 
   }
  
   for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++)
   {
-    if (!ev->board_id[ibd]) continue; 
+    if (!mask[ibd]) continue; 
+
+    //in a compact event, a board's waveforms are contiguous 
+    if (ev->compact && mask[ibd] == 0xff) 
+    {
+      written = generic_write(gf, BN_NUM_CHAN * len, view_waveform(ev,ibd,0)); 
+      if (written != BN_NUM_CHAN * len) 
+      {
+        return BN_ERR_NOT_ENOUGH_BYTES; 
+      }
+      continue; 
+    }
+
     for (i = 0; i <BN_NUM_CHAN; i++)
     {
-      written = generic_write(gf, ev->buffer_length, &ev->data[ibd][i][0]); 
-      if (written != ev->buffer_length) 
+      if ((mask[ibd] & (1 << i)) == 0) continue; 
+      written = generic_write(gf, len, view_waveform(ev,ibd,i)); 
+      if (written != len) 
       {
         return BN_ERR_NOT_ENOUGH_BYTES; 
       }
@@ -358,7 +511,7 @@ static int beacon_event_generic_write(struct generic_file gf, const beacon_event
 }
 
 
-static int beacon_event_generic_read(struct generic_file gf, beacon_event_t *ev) 
+static int beacon_event_generic_read(struct generic_file gf, struct event_view * ev) 
 {
   struct packet_start start; 
   int got; 
@@ -372,41 +525,79 @@ static int beacon_event_generic_read(struct generic_file gf, beacon_event_t *ev)
 
   //add additional cases if necessary for compatibility
   //
-  if (start.ver == BEACON_EVENT_VERSION) 
+  if (start.ver <= BEACON_EVENT_VERSION) 
   {
-      wanted = sizeof(ev->event_number); 
-      got = generic_read(gf, wanted, &ev->event_number); 
+      wanted = sizeof(*ev->event_number); 
+      got = generic_read(gf, wanted, ev->event_number); 
       if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
-      cksum = stupid_fletcher16(wanted, &ev->event_number); 
+      cksum = stupid_fletcher16(wanted, ev->event_number); 
 
-      wanted = sizeof(ev->buffer_length); 
-      got = generic_read(gf, wanted, &ev->buffer_length); 
+      wanted = sizeof(*ev->buffer_length); 
+      got = generic_read(gf, wanted, ev->buffer_length); 
       if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
-      cksum = stupid_fletcher16_append(wanted, &ev->buffer_length,cksum); 
+      cksum = stupid_fletcher16_append(wanted, ev->buffer_length,cksum); 
 
-      wanted = sizeof(ev->board_id); 
-      got = generic_read(gf, wanted, &ev->board_id); 
+      if (*ev->buffer_length > ev->max_length) 
+      {
+        fprintf(stderr,"Buffer length %d is longer than the %d there is room for\n", *ev->buffer_length, ev->max_length); 
+        *ev->buffer_length = 0; 
+        return BN_ERR_NOT_ENOUGH_BYTES; 
+      }
+
+      wanted = BN_MAX_BOARDS; 
+      got = generic_read(gf, wanted, ev->board_id); 
       if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
-      cksum = stupid_fletcher16_append(wanted, &ev->board_id,cksum); 
+      cksum = stupid_fletcher16_append(wanted, ev->board_id,cksum); 
 
       int ibd; 
+      if (start.ver >= 1) 
+      {
+        wanted = BN_MAX_BOARDS; 
+        got = generic_read(gf, wanted, ev->channel_read_mask); 
+        if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
+        cksum = stupid_fletcher16_append(wanted, ev->channel_read_mask,cksum); 
+      }
+      else //everything was written 
+      {
+        for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++) ev->channel_read_mask[ibd] = ev->board_id[ibd] ? 0xff : 0; 
+      }
+
       for (ibd = 0; ibd <BN_MAX_BOARDS; ibd++)
       {
-        if (!ev->board_id[ibd]) 
+        uint8_t mask = ev->board_id[ibd] ? ev->channel_read_mask[ibd] : 0; 
+        if (!mask) 
+        {
+          memset(view_waveform(ev,ibd,0),0, BN_NUM_CHAN * (ev->compact ? *ev->buffer_length : BN_MAX_WAVEFORM_LENGTH)); 
+          continue; 
+        }
+
+        if (ev->compact && mask == 0xff) //one read for the whole board (but the checksum has to go channel by channel) 
         {
-          memset(ev->data[ibd],0, sizeof(ev->data[ibd])); 
+          wanted = BN_NUM_CHAN * *ev->buffer_length; 
+          got = generic_read(gf, wanted, view_waveform(ev,ibd,0)); 
+          if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
+          for (i = 0; i < BN_NUM_CHAN; i++) 
+          {
+            cksum = stupid_fletcher16_append(*ev->buffer_length, view_waveform(ev,ibd,i), cksum); 
+          }
           continue; 
         }
 
         for (i = 0; i < BN_NUM_CHAN; i++)
         {
-          wanted = ev->buffer_length; 
-          got = generic_read(gf, wanted, ev->data[ibd][i]); 
+          if ((mask & (1 << i)) == 0) //not read out, so not written 
+          {
+            memset(view_waveform(ev,ibd,i), 0, ev->compact ? *ev->buffer_length : BN_MAX_WAVEFORM_LENGTH); 
+            continue; 
+          }
+
+          wanted = *ev->buffer_length; 
+          got = generic_read(gf, wanted, view_waveform(ev,ibd,i)); 
           if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
-          cksum = stupid_fletcher16_append(wanted, ev->data[ibd][i], cksum); 
+          cksum = stupid_fletcher16_append(wanted, view_waveform(ev,ibd,i), cksum); 
 
           // zero out the rest of the memory 
-          memset(ev->data[ibd][i] + wanted, 0, BN_MAX_WAVEFORM_LENGTH - wanted); 
+          if (!ev->compact) memset(view_waveform(ev,ibd,i) + wanted, 0, BN_MAX_WAVEFORM_LENGTH - wanted); 
         }
       }
 
@@ -426,6 +617,252 @@ static int beacon_event_generic_read(struct generic_file gf, beacon_event_t *ev)
   return 0; 
 }
 
+/* Compact events are allocated together with their data, which starts on the next cache line */ 
+#define COMPACT_ALIGN 64 
+
+static size_t compact_event_size(uint16_t max_length) 
+{
+  size_t head = (sizeof(beacon_compact_event_t) + COMPACT_ALIGN - 1) & ~(size_t) (COMPACT_ALIGN - 1); 
+  size_t data = (BN_MAX_BOARDS * BN_NUM_CHAN * (size_t) max_length + COMPACT_ALIGN - 1) & ~(size_t) (COMPACT_ALIGN - 1); 
+  return head + data; 
+}
+
+static void compact_event_init(beacon_compact_event_t * ev, uint16_t max_length) 
+{
+  memset(ev, 0, sizeof(*ev)); 
+  ev->max_length = max_length; 
+  ev->data = (uint8_t*) ev + compact_event_size(0); 
+}
+
+beacon_compact_event_t * beacon_compact_event_alloc(uint16_t max_length) 
+{
+  beacon_compact_event_t * ev = aligned_alloc(COMPACT_ALIGN, compact_event_size(max_length)); 
+  if (!ev) return 0; 
+  compact_event_init(ev, max_length); 
+  return ev; 
+}
+
+void beacon_compact_event_free(beacon_compact_event_t * ev) 
+{
+  free(ev); 
+}
+
+int beacon_compact_event_from_event(beacon_compact_event_t * dest, const beacon_event_t * src) 
+{
+  int ibd, ichan; 
+  if (src->buffer_length > dest->max_length) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  dest->event_number = src->event_number; 
+  dest->buffer_length = src->buffer_length; 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++) 
+  {
+    dest->board_id[ibd] = src->board_id[ibd]; 
+    dest->channel_read_mask[ibd] = src->channel_read_mask[ibd]; 
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++) 
+    {
+      memcpy(beacon_compact_event_waveform(dest, ibd, ichan), src->data[ibd][ichan], src->buffer_length); 
+    }
+  }
+  return 0; 
+}
+
+void beacon_compact_event_to_event(const beacon_compact_event_t * src, beacon_event_t * dest) 
+{
+  int ibd, ichan; 
+  dest->event_number = src->event_number; 
+  dest->buffer_length = src->buffer_length; 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++) 
+  {
+    dest->board_id[ibd] = src->board_id[ibd]; 
+    dest->channel_read_mask[ibd] = src->channel_read_mask[ibd]; 
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++) 
+    {
+      memcpy(dest->data[ibd][ichan], beacon_compact_event_waveform(src, ibd, ichan), src->buffer_length); 
+      memset(dest->data[ibd][ichan] + src->buffer_length, 0, BN_MAX_WAVEFORM_LENGTH - src->buffer_length); 
+    }
+  }
+}
+
+/* The pool is one big allocation, with a stack of the events not handed out */ 
+struct beacon_compact_pool 
+{
+  uint8_t * slab; 
+  size_t event_size; 
+  unsigned n; 
+  unsigned nfree; 
+  beacon_compact_event_t ** free_stack; 
+  pthread_mutex_t mut; 
+}; 
+
+beacon_compact_pool_t * beacon_compact_pool_create(unsigned n, uint16_t max_length) 
+{
+  unsigned i; 
+  beacon_compact_pool_t * pool = calloc(1, sizeof(beacon_compact_pool_t)); 
+  if (!pool) return 0; 
+
+  pool->event_size = compact_event_size(max_length); 
+  pool->n = n; 
+  pool->slab = aligned_alloc(COMPACT_ALIGN, n * pool->event_size); 
+  pool->free_stack = malloc(n * sizeof(*pool->free_stack)); 
+  if (!pool->slab || !pool->free_stack) 
+  {
+    fprintf(stderr,"Could not allocate a pool of %u events of length %u\n", n, max_length); 
+    free(pool->slab); 
+    free(pool->free_stack); 
+    free(pool); 
+    return 0; 
+  }
+
+  //hand out the first ones first 
+  for (i = 0; i < n; i++) 
+  {
+    beacon_compact_event_t * ev = (beacon_compact_event_t*) (pool->slab + (n - 1 - i) * pool->event_size); 
+    compact_event_init(ev, max_length); 
+    pool->free_stack[i] = ev; 
+  }
+  pool->nfree = n; 
+  pthread_mutex_init(&pool->mut, 0); 
+  return pool; 
+}
+
+beacon_compact_event_t * beacon_compact_pool_get(beacon_compact_pool_t * pool) 
+{
+  beacon_compact_event_t * ev = 0; 
+  pthread_mutex_lock(&pool->mut); 
+  if (pool->nfree) ev = pool->free_stack[--pool->nfree]; 
+  pthread_mutex_unlock(&pool->mut); 
+  return ev; 
+}
+
+void beacon_compact_pool_put(beacon_compact_pool_t * pool, beacon_compact_event_t * ev) 
+{
+  if (!ev) return; 
+  pthread_mutex_lock(&pool->mut); 
+  pool->free_stack[pool->nfree++] = ev; 
+  pthread_mutex_unlock(&pool->mut); 
+}
+
+unsigned beacon_compact_pool_available(beacon_compact_pool_t * pool) 
+{
+  pthread_mutex_lock(&pool->mut); 
+  unsigned nfree = pool->nfree; 
+  pthread_mutex_unlock(&pool->mut); 
+  return nfree; 
+}
+
+void beacon_compact_pool_destroy(beacon_compact_pool_t * pool) 
+{
+  if (!pool) return; 
+  pthread_mutex_destroy(&pool->mut); 
+  free(pool->slab); 
+  free(pool->free_stack); 
+  free(pool); 
+}
+
+/* Each entry of an event pool holds on to one event of a compact pool for good, 
+ * and the free entries are kept on a stack the same way */ 
+struct beacon_event_pool 
+{
+  beacon_compact_pool_t * events; 
+  beacon_pooled_event_t * entries; 
+  unsigned n; 
+  unsigned nfree; 
+  uint16_t max_length; 
+  beacon_pooled_event_t ** free_stack; 
+  pthread_mutex_t mut; 
+}; 
+
+beacon_event_pool_t * beacon_event_pool_create(unsigned n, uint16_t max_length) 
+{
+  unsigned i; 
+  beacon_event_pool_t * pool = calloc(1, sizeof(beacon_event_pool_t)); 
+  if (!pool) return 0; 
+
+  pool->n = n; 
+  pool->max_length = max_length; 
+  pool->events = beacon_compact_pool_create(n, max_length); 
+  pool->entries = calloc(n, sizeof(beacon_pooled_event_t)); 
+  pool->free_stack = malloc(n * sizeof(*pool->free_stack)); 
+  if (!pool->events || !pool->entries || !pool->free_stack) 
+  {
+    fprintf(stderr,"Could not allocate a pool of %u header / event pairs\n", n); 
+    beacon_compact_pool_destroy(pool->events); 
+    free(pool->entries); 
+    free(pool->free_stack); 
+    free(pool); 
+    return 0; 
+  }
+
+  for (i = 0; i < n; i++) 
+  {
+    pool->entries[i].event = beacon_compact_pool_get(pool->events); 
+    pool->entries[i].pool = pool; 
+    pool->free_stack[n - 1 - i] = &pool->entries[i]; 
+  }
+  pool->nfree = n; 
+  pthread_mutex_init(&pool->mut, 0); 
+  return pool; 
+}
+
+beacon_pooled_event_t * beacon_event_pool_acquire(beacon_event_pool_t * pool) 
+{
+  beacon_pooled_event_t * ev = 0; 
+  pthread_mutex_lock(&pool->mut); 
+  if (pool->nfree) ev = pool->free_stack[--pool->nfree]; 
+  pthread_mutex_unlock(&pool->mut); 
+  if (ev) __atomic_store_n(&ev->refs, 1, __ATOMIC_RELAXED); 
+  return ev; 
+}
+
+beacon_pooled_event_t * beacon_pooled_event_ref(beacon_pooled_event_t * ev) 
+{
+  __atomic_add_fetch(&ev->refs, 1, __ATOMIC_RELAXED); 
+  return ev; 
+}
+
+void beacon_pooled_event_release(beacon_pooled_event_t * ev) 
+{
+  if (!ev) return; 
+
+  //whoever drops the last reference has to see everything the others did to it 
+  int refs = __atomic_sub_fetch(&ev->refs, 1, __ATOMIC_ACQ_REL); 
+  if (refs > 0) return; 
+  if (refs < 0) 
+  {
+    fprintf(stderr,"Pooled event %"PRIu64" released too many times!\n", ev->header.event_number); 
+    return; 
+  }
+
+  beacon_event_pool_t * pool = ev->pool; 
+  pthread_mutex_lock(&pool->mut); 
+  pool->free_stack[pool->nfree++] = ev; 
+  pthread_mutex_unlock(&pool->mut); 
+}
+
+unsigned beacon_event_pool_available(beacon_event_pool_t * pool) 
+{
+  pthread_mutex_lock(&pool->mut); 
+  unsigned nfree = pool->nfree; 
+  pthread_mutex_unlock(&pool->mut); 
+  return nfree; 
+}
+
+uint16_t beacon_event_pool_max_length(const beacon_event_pool_t * pool) 
+{
+  return pool->max_length; 
+}
+
+void beacon_event_pool_destroy(beacon_event_pool_t * pool) 
+{
+  if (!pool) return; 
+  pthread_mutex_destroy(&pool->mut); 
+  beacon_compact_pool_destroy(pool->events); 
+  free(pool->entries); 
+  free(pool->free_stack); 
+  free(pool); 
+}
+
+
 typedef struct beacon_status_v0
 {
   uint16_t global_scalers[BN_NUM_SCALERS];
@@ -635,25 +1072,57 @@ static int beacon_hk_generic_read(struct generic_file gf, beacon_hk_t *hk)
 int beacon_event_write(FILE * f, const beacon_event_t * ev) 
 {
   struct generic_file gf=  { .type = STDIO, .handle.f = f }; 
-  return beacon_event_generic_write(gf, ev); 
+  struct event_view v = view_event(ev); 
+  return beacon_event_generic_write(gf, &v); 
 }
 
 int beacon_event_gzwrite(gzFile f, const beacon_event_t * ev) 
 {
   struct generic_file gf=  { .type = ZLIB, .handle.gzf = f }; 
-  return beacon_event_generic_write(gf, ev); 
+  struct event_view v = view_event(ev); 
+  return beacon_event_generic_write(gf, &v); 
 }
 
 int beacon_event_read(FILE * f, beacon_event_t * ev) 
 {
   struct generic_file gf=  { .type = STDIO, .handle.f = f }; 
-  return beacon_event_generic_read(gf, ev); 
+  struct event_view v = view_event(ev); 
+  return beacon_event_generic_read(gf, &v); 
 }
 
 int beacon_event_gzread(gzFile f, beacon_event_t * ev) 
 {
   struct generic_file gf=  { .type = ZLIB, .handle.gzf = f }; 
-  return beacon_event_generic_read(gf, ev); 
+  struct event_view v = view_event(ev); 
+  return beacon_event_generic_read(gf, &v); 
+}
+
+int beacon_compact_event_write(FILE * f, const beacon_compact_event_t * ev) 
+{
+  struct generic_file gf=  { .type = STDIO, .handle.f = f }; 
+  struct event_view v = view_compact(ev); 
+  return beacon_event_generic_write(gf, &v); 
+}
+
+int beacon_compact_event_gzwrite(gzFile f, const beacon_compact_event_t * ev) 
+{
+  struct generic_file gf=  { .type = ZLIB, .handle.gzf = f }; 
+  struct event_view v = view_compact(ev); 
+  return beacon_event_generic_write(gf, &v); 
+}
+
+int beacon_compact_event_read(FILE * f, beacon_compact_event_t * ev) 
+{
+  struct generic_file gf=  { .type = STDIO, .handle.f = f }; 
+  struct event_view v = view_compact(ev); 
+  return beacon_event_generic_read(gf, &v); 
+}
+
+int beacon_compact_event_gzread(gzFile f, beacon_compact_event_t * ev) 
+{
+  struct generic_file gf=  { .type = ZLIB, .handle.gzf = f }; 
+  struct event_view v = view_compact(ev); 
+  return beacon_event_generic_read(gf, &v); 
 }
 
 int beacon_status_write(FILE * f, const beacon_status_t * ev) 
@@ -729,6 +1198,228 @@ int beacon_hk_gzread(gzFile f, beacon_hk_t * h)
 }
 
 
+/* Beams and power sums are both an event number, a length, and then that much of each of BN_NUM_BEAMS 
+ * rows of elements (with the rows max_length apart in memory). Only the first length of each row is written. 
+ */ 
+struct beam_view 
+{
+  uint8_t magic; 
+  uint8_t ver; 
+  uint64_t * event_number; 
+  uint16_t * length; 
+  uint8_t * data; 
+  int element_size; 
+  uint16_t max_length; 
+}; 
+
+static struct beam_view view_beams(const beacon_beams_t * b) 
+{
+  beacon_beams_t * bb = (beacon_beams_t*) b; 
+  struct beam_view v = { BEACON_BEAMS_MAGIC, BEACON_BEAMS_VERSION, &bb->event_number, &bb->buffer_length, &bb->data[0][0], 
+                         sizeof(bb->data[0][0]), BN_MAX_WAVEFORM_LENGTH }; 
+  return v; 
+}
+
+static struct beam_view view_powersum(const beacon_powersum_t * p) 
+{
+  beacon_powersum_t * pp = (beacon_powersum_t*) p; 
+  struct beam_view v = { BEACON_POWERSUM_MAGIC, BEACON_POWERSUM_VERSION, &pp->event_number, &pp->nsums, (uint8_t*) &pp->data[0][0], 
+                         sizeof(pp->data[0][0]), BN_MAX_POWERSUMS }; 
+  return v; 
+}
+
+static int beam_generic_write(struct generic_file gf, const struct beam_view * v) 
+{
+  struct packet_start start; 
+  int written, ibeam; 
+  int row = *v->length * v->element_size; 
+  start.magic = v->magic; 
+  start.ver = v->ver; 
+
+  start.cksum = stupid_fletcher16(sizeof(*v->event_number), v->event_number); 
+  start.cksum = stupid_fletcher16_append(sizeof(*v->length), v->length, start.cksum); 
+  for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++) 
+  {
+    start.cksum = stupid_fletcher16_append(row, v->data + ibeam * v->max_length * v->element_size, start.cksum); 
+  }
+
+  written = generic_write(gf, sizeof(start), &start); 
+  if (written != sizeof(start)) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  written = generic_write(gf, sizeof(*v->event_number), v->event_number); 
+  if (written != sizeof(*v->event_number)) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  written = generic_write(gf, sizeof(*v->length), v->length); 
+  if (written != sizeof(*v->length)) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++) 
+  {
+    written = generic_write(gf, row, v->data + ibeam * v->max_length * v->element_size); 
+    if (written != row) return BN_ERR_NOT_ENOUGH_BYTES; 
+  }
+
+  return 0; 
+}
+
+static int beam_generic_read(struct generic_file gf, struct beam_view * v) 
+{
+  struct packet_start start; 
+  int got, wanted, ibeam; 
+  uint16_t cksum; 
+
+  got = packet_start_read(gf, &start, v->magic, v->ver); 
+  if (got) return got; 
+
+  wanted = sizeof(*v->event_number); 
+  got = generic_read(gf, wanted, v->event_number); 
+  if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
+  cksum = stupid_fletcher16(wanted, v->event_number); 
+
+  wanted = sizeof(*v->length); 
+  got = generic_read(gf, wanted, v->length); 
+  if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
+  cksum = stupid_fletcher16_append(wanted, v->length, cksum); 
+
+  if (*v->length > v->max_length) 
+  {
+    fprintf(stderr,"Length %d is longer than the %d there is room for\n", *v->length, v->max_length); 
+    *v->length = 0; 
+    return BN_ERR_NOT_ENOUGH_BYTES; 
+  }
+
+  for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++) 
+  {
+    uint8_t * row = v->data + ibeam * v->max_length * v->element_size; 
+    wanted = *v->length * v->element_size; 
+    got = generic_read(gf, wanted, row); 
+    if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
+    cksum = stupid_fletcher16_append(wanted, row, cksum); 
+    memset(row + wanted, 0, (v->max_length - *v->length) * v->element_size); 
+  }
+
+  if (cksum != start.cksum) 
+  {
+    return BN_ERR_CHECKSUM_FAILED; 
+  }
+
+  return 0; 
+}
+
+int beacon_beams_write(FILE * f, const beacon_beams_t * b) 
+{
+  struct generic_file gf = { .type = STDIO, .handle.f = f }; 
+  struct beam_view v = view_beams(b); 
+  return beam_generic_write(gf, &v); 
+}
+
+int beacon_beams_gzwrite(gzFile f, const beacon_beams_t * b) 
+{
+  struct generic_file gf = { .type = ZLIB, .handle.gzf = f }; 
+  struct beam_view v = view_beams(b); 
+  return beam_generic_write(gf, &v); 
+}
+
+int beacon_beams_read(FILE * f, beacon_beams_t * b) 
+{
+  struct generic_file gf = { .type = STDIO, .handle.f = f }; 
+  struct beam_view v = view_beams(b); 
+  return beam_generic_read(gf, &v); 
+}
+
+int beacon_beams_gzread(gzFile f, beacon_beams_t * b) 
+{
+  struct generic_file gf = { .type = ZLIB, .handle.gzf = f }; 
+  struct beam_view v = view_beams(b); 
+  return beam_generic_read(gf, &v); 
+}
+
+int beacon_powersum_write(FILE * f, const beacon_powersum_t * p) 
+{
+  struct generic_file gf = { .type = STDIO, .handle.f = f }; 
+  struct beam_view v = view_powersum(p); 
+  return beam_generic_write(gf, &v); 
+}
+
+int beacon_powersum_gzwrite(gzFile f, const beacon_powersum_t * p) 
+{
+  struct generic_file gf = { .type = ZLIB, .handle.gzf = f }; 
+  struct beam_view v = view_powersum(p); 
+  return beam_generic_write(gf, &v); 
+}
+
+int beacon_powersum_read(FILE * f, beacon_powersum_t * p) 
+{
+  struct generic_file gf = { .type = STDIO, .handle.f = f }; 
+  struct beam_view v = view_powersum(p); 
+  return beam_generic_read(gf, &v); 
+}
+
+int beacon_powersum_gzread(gzFile f, beacon_powersum_t * p) 
+{
+  struct generic_file gf = { .type = ZLIB, .handle.gzf = f }; 
+  struct beam_view v = view_powersum(p); 
+  return beam_generic_read(gf, &v); 
+}
+
+static int beacon_timing_generic_write(struct generic_file gf, const beacon_readout_timing_t * t) 
+{
+  struct packet_start start; 
+  int written; 
+  start.magic = BEACON_TIMING_MAGIC; 
+  start.ver = BEACON_TIMING_VERSION; 
+  start.cksum = stupid_fletcher16(sizeof(beacon_readout_timing_t), t); 
+
+  written = generic_write(gf, sizeof(start), &start); 
+  if (written != sizeof(start)) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  written = generic_write(gf, sizeof(beacon_readout_timing_t), t); 
+  if (written != sizeof(beacon_readout_timing_t)) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  return 0; 
+}
+
+static int beacon_timing_generic_read(struct generic_file gf, beacon_readout_timing_t * t) 
+{
+  struct packet_start start; 
+  int got, wanted; 
+
+  got = packet_start_read(gf, &start, BEACON_TIMING_MAGIC, BEACON_TIMING_VERSION); 
+  if (got) return got; 
+
+  //add cases here if the struct ever changes 
+  wanted = sizeof(beacon_readout_timing_t); 
+  got = generic_read(gf, wanted, t); 
+  if (wanted != got) return BN_ERR_NOT_ENOUGH_BYTES; 
+
+  if (stupid_fletcher16(wanted, t) != start.cksum) return BN_ERR_CHECKSUM_FAILED; 
+
+  return 0; 
+}
+
+int beacon_readout_timing_write(FILE * f, const beacon_readout_timing_t * t) 
+{
+  struct generic_file gf = { .type = STDIO, .handle.f = f }; 
+  return beacon_timing_generic_write(gf, t); 
+}
+
+int beacon_readout_timing_gzwrite(gzFile f, const beacon_readout_timing_t * t) 
+{
+  struct generic_file gf = { .type = ZLIB, .handle.gzf = f }; 
+  return beacon_timing_generic_write(gf, t); 
+}
+
+int beacon_readout_timing_read(FILE * f, beacon_readout_timing_t * t) 
+{
+  struct generic_file gf = { .type = STDIO, .handle.f = f }; 
+  return beacon_timing_generic_read(gf, t); 
+}
+
+int beacon_readout_timing_gzread(gzFile f, beacon_readout_timing_t * t) 
+{
+  struct generic_file gf = { .type = ZLIB, .handle.gzf = f }; 
+  return beacon_timing_generic_read(gf, t); 
+}
+
 
 
 /* pretty prints */ 
@@ -763,6 +1454,7 @@ const char* beacon_trigger_polarization_name(beacon_trigger_polarization_t pol){
 }
 
 static const char * trig_type_names[4]  = { "NONE", "SW", "RF" ,"EXT" } ; 
+static const char * skip_reason_names[4] = { "not", "prescaled", "selected", "dropped" } ; 
 
 
 int beacon_header_print(FILE *f, const beacon_header_t *hd)
@@ -781,7 +1473,8 @@ int beacon_header_print(FILE *f, const beacon_header_t *hd)
     fprintf(f, " %d", hd->board_id[i]); 
   }
   fprintf(f , " sync_problem: %x\n", hd->sync_problem); 
-  fprintf(f, "\tbuf len: %u ; pretrig: %u\n", hd->buffer_length, hd->pretrigger_samples); 
+  fprintf(f, "\tbuf len: %u ; pretrig: %u ; window start: %u\n", hd->buffer_length, hd->pretrigger_samples, hd->readout_window_start); 
+  if (hd->waveforms_skipped) fprintf(f, "\twaveforms skipped (%s)\n", hd->waveforms_skipped < 4 ? skip_reason_names[hd->waveforms_skipped] : "?"); 
   fprintf(f,"\tbuf num: %u, buf_mask: %x\n", hd->buffer_number, hd->buffer_mask); 
   for (i = 0; i < BN_MAX_BOARDS; i++) 
   {
@@ -849,6 +1542,83 @@ int beacon_event_print(FILE *f, const beacon_event_t *ev, char sep)
   return 0; 
 }
 
+int beacon_compact_event_print(FILE *f, const beacon_compact_event_t *ev, char sep)
+{
+  int ichan, isamp, ibd ; 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++)
+  {
+    if (!ev->board_id[ibd]) continue;
+    fprintf(f, "EVENT NUMBER:%c %"PRIu64" %c BOARD: %c %d %c LENGTH: %c %d \n", sep,ev->event_number,sep,sep,ev->board_id[ibd], sep,sep,ev->buffer_length ); 
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      const uint8_t * wf = beacon_compact_event_waveform(ev, ibd, ichan); 
+      for (isamp = 0; isamp < ev->buffer_length; isamp++) 
+      {
+        fprintf(f, "%d%c", wf[isamp], isamp < ev->buffer_length - 1 ? sep : '\n'); 
+      }
+    }
+  }
+
+  return 0; 
+}
+
+int beacon_beams_print(FILE *f, const beacon_beams_t *b, char sep)
+{
+  int ibeam, isamp; 
+  fprintf(f, "EVENT NUMBER:%c %"PRIu64" %c BEAMS %c LENGTH: %c %d \n", sep,b->event_number,sep,sep,sep,b->buffer_length ); 
+  for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++)
+  {
+    for (isamp = 0; isamp < b->buffer_length; isamp++) 
+    {
+      fprintf(f, "%d%c", b->data[ibeam][isamp], isamp < b->buffer_length - 1 ? sep : '\n'); 
+    }
+  }
+
+  return 0; 
+}
+
+int beacon_powersum_print(FILE *f, const beacon_powersum_t *p, char sep)
+{
+  int ibeam, i; 
+  fprintf(f, "EVENT NUMBER:%c %"PRIu64" %c POWER SUMS %c NSUMS: %c %d \n", sep,p->event_number,sep,sep,sep,p->nsums ); 
+  for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++)
+  {
+    for (i = 0; i < p->nsums; i++) 
+    {
+      fprintf(f, "%u%c", p->data[ibeam][i], i < p->nsums - 1 ? sep : '\n'); 
+    }
+  }
+
+  return 0; 
+}
+
+// microseconds from a to b, or nothing if either is missing 
+static void print_step(FILE * f, const char * what, uint64_t a, uint64_t b) 
+{
+  if (a && b) fprintf(f, " %s: %.1f us", what, (b - a) / 1e3); 
+}
+
+int beacon_readout_timing_print(FILE * f, const beacon_readout_timing_t * t) 
+{
+  int i; 
+  uint64_t waveforms = 0; 
+  fprintf(f, "EVENT %"PRIu64" READOUT TIMING:", t->event_number); 
+  print_step(f, "ready->start", t->ready_ns, t->start_ns); 
+  print_step(f, "metadata", t->start_ns, t->metadata_ns); 
+  for (i = 0; i < BN_MAX_BOARDS; i++) 
+  {
+    char what[32]; 
+    snprintf(what, sizeof(what), "bd %d waveforms", i); 
+    print_step(f, what, t->waveforms_start_ns, t->waveforms_ns[i]); 
+    if (t->waveforms_ns[i] > waveforms) waveforms = t->waveforms_ns[i]; 
+  }
+  print_step(f, "products", waveforms, t->products_ns); 
+  print_step(f, "clear", t->products_ns ? t->products_ns : waveforms, t->clear_ns); 
+  print_step(f, "total", t->ready_ns ? t->ready_ns : t->start_ns, t->clear_ns); 
+  fprintf(f, "\n"); 
+  return 0; 
+}
+
 int beacon_hk_print(FILE * f, const beacon_hk_t *hk) 
 {
   struct tm*  tim; 
@@ -54,14 +54,24 @@ extern "C" {
 /** The maximum length of a waveform */ 
 #define BN_MAX_WAVEFORM_LENGTH 4096  
 
-//master + slave 
+/** The maximum number of boards read out together (master + slaves). 
+ *  This sizes the per-board arrays in the header and event, so it is part of
+ *  the file format: everything that includes this must agree on it (see MAX_BOARDS in the Makefile). */
+#ifndef BN_MAX_BOARDS
 #define BN_MAX_BOARDS 1  
+#endif
 
 /** The number of trigger beams available */ 
 #define BN_NUM_BEAMS 24 
 
 #define BN_NUM_SCALERS 3
 
+/** The number of samples in each power sum */ 
+#define BN_POWERSUM_SAMPLES 4 
+
+/** The maximum number of power sums per beam */ 
+#define BN_MAX_POWERSUMS (BN_MAX_WAVEFORM_LENGTH / BN_POWERSUM_SAMPLES) 
+
 /** Error codes for read/write */ 
 typedef enum 
 {
@@ -82,6 +92,15 @@ typedef enum beacon_trigger_type
   BN_TRIG_EXT    //!< triggered by external trigger 
 } beacon_trig_type_t;
 
+/** Why an event's waveforms weren't read out (the header's waveforms_skipped) */ 
+typedef enum beacon_skip_reason 
+{
+  BN_SKIP_NONE = 0,      //!< they were read 
+  BN_SKIP_PRESCALED = 1, //!< the waveform prescaler for the trigger type passed over the event (see beacon_set_waveform_prescale) 
+  BN_SKIP_SELECTED = 2,  //!< the event selector said not to read them (see beacon_set_event_selector) 
+  BN_SKIP_DROPPED = 3    //!< the event selector dropped the event, so it doesn't need to be kept at all 
+} beacon_skip_reason_t; 
+
 
 typedef enum beacon_trigger_polarization
 {
@@ -135,6 +154,8 @@ typedef struct beacon_header
   uint32_t pps_counter;                               //!< value of the pps timer at the time of the event
   uint32_t dynamic_beam_mask;                         //!< the automatic beam masker 
   uint32_t veto_deadtime_counter;                     //!< deadtime counter
+  uint16_t readout_window_start;                      //!< The first sample read out, if only a window around the trigger was (see beacon_set_readout_window), otherwise 0. Sample i of the waveforms is sample readout_window_start + i of the buffer. 
+  uint8_t waveforms_skipped;                          //!< Why the waveforms weren't read out (a beacon_skip_reason_t), 0 if they were. The event then has a buffer_length of 0. 
 } beacon_header_t; 
 
 /**beacon event body.
@@ -147,9 +168,89 @@ typedef struct beacon_event
   uint64_t event_number;  //!< The event number. Should match event header.  
   uint16_t buffer_length; //!< The buffer length that is actually filled. Also available in event header. 
   ARRAY1D(uint8_t, board_id, BN_MAX_BOARDS);     //!< The board number assigned at startup. If the second board_id is zero, that indicates there is no slave device. 
+  ARRAY1D(uint8_t, channel_read_mask, BN_MAX_BOARDS); //!< The channels read on each board (the others are zero and aren't written to disk). 0 is taken to mean all of them. 
   ARRAY3D(uint8_t, data,BN_MAX_BOARDS,BN_NUM_CHAN,BN_MAX_WAVEFORM_LENGTH); //!< The waveform data. Only the first buffer_length bytes of each are important. The second array is only filled if there is a slave-device.
 } beacon_event_t; 
 
+/** A compact event body, holding the same thing as beacon_event_t.
+ *
+ * The waveforms are packed back to back, buffer_length apart, instead of each taking BN_MAX_WAVEFORM_LENGTH, 
+ * so for the usual buffer lengths this takes several times less memory. Get one from beacon_compact_event_alloc 
+ * or from a beacon_compact_pool_t (the data is allocated along with it). The on-disk format is the same as for 
+ * beacon_event_t, so either one can read what the other wrote. 
+ */ 
+typedef struct beacon_compact_event
+{
+  uint64_t event_number;  //!< The event number. Should match event header.  
+  uint16_t buffer_length; //!< The buffer length, which is also the distance between waveforms in data 
+  uint16_t max_length;    //!< The longest buffer length there is room for 
+  ARRAY1D(uint8_t, board_id, BN_MAX_BOARDS);     //!< The board number assigned at startup, 0 if there is no such board
+  ARRAY1D(uint8_t, channel_read_mask, BN_MAX_BOARDS); //!< The channels read on each board, as in beacon_event_t
+  uint8_t * data;         //!< BN_MAX_BOARDS * BN_NUM_CHAN waveforms, board by board. Use beacon_compact_event_waveform. 
+} beacon_compact_event_t; 
+
+/** The waveform for a board and channel in a compact event (buffer_length long) */ 
+static inline uint8_t * beacon_compact_event_waveform(const beacon_compact_event_t * ev, int board, int chan) 
+{
+  return ev->data + (board * BN_NUM_CHAN + chan) * ev->buffer_length; 
+}
+
+/** A preallocated set of compact events */ 
+typedef struct beacon_compact_pool beacon_compact_pool_t; 
+
+/** A preallocated set of reference counted header / event pairs */ 
+typedef struct beacon_event_pool beacon_event_pool_t; 
+
+/** A header and event from a beacon_event_pool_t. 
+ *
+ * It goes back to the pool when the last reference to it is released, so one event can be handed to 
+ * e.g. a writer, a monitor and a forwarder (each taking a reference with beacon_pooled_event_ref and 
+ * releasing it when done) without copying it. Nobody should change it once it's been shared. 
+ */ 
+typedef struct beacon_pooled_event 
+{
+  beacon_header_t header;          //!< The header 
+  beacon_compact_event_t * event;  //!< The event (always the same one for this entry) 
+  beacon_event_pool_t * pool;      //!< The pool this belongs to  
+  int refs;                        //!< The number of references (don't touch, use beacon_pooled_event_ref / release) 
+} beacon_pooled_event_t; 
+
+
+/** The beamformed waveforms the FPGA triggers on, read out along with an event (see beacon_read_multiple_products). 
+ * Only the master does beamforming. The samples cover the same part of the buffer as the event. 
+ */ 
+typedef struct beacon_beams
+{
+  uint64_t event_number;  //!< The event number. Should match event header.  
+  uint16_t buffer_length; //!< The number of samples in each beam 
+  ARRAY2D(uint8_t, data, BN_NUM_BEAMS, BN_MAX_WAVEFORM_LENGTH); //!< The beams. Only the first buffer_length samples of each are important. 
+} beacon_beams_t; 
+
+/** The FPGA's power sums for each beam, each over BN_POWERSUM_SAMPLES samples of the beam (see beacon_read_multiple_products) */ 
+typedef struct beacon_powersum
+{
+  uint64_t event_number;  //!< The event number. Should match event header.  
+  uint16_t nsums;         //!< The number of power sums for each beam (buffer_length / BN_POWERSUM_SAMPLES) 
+  ARRAY2D(uint32_t, data, BN_NUM_BEAMS, BN_MAX_POWERSUMS); //!< The power sums. Only the first nsums of each are important. 
+} beacon_powersum_t; 
+
+/** When each step of an event's readout happened, to see where the time (and deadtime) goes. 
+ * All times are CLOCK_MONOTONIC, in ns. Events read in the same call share ready_ns, start_ns and metadata_ns, 
+ * then have their waveforms read and their buffers cleared one after the other (buffers whose waveforms are skipped are 
+ * cleared first). 
+ * Time spent by whoever consumes the events shows up as the gap between one event's clear_ns and the next's ready_ns. 
+ */ 
+typedef struct beacon_readout_timing
+{
+  uint64_t event_number;       //!< The event number. Should match event header. 
+  uint64_t ready_ns;           //!< When beacon_wait saw the buffer was ready (0 if it wasn't waited for) 
+  uint64_t start_ns;           //!< When the readout started 
+  uint64_t metadata_ns;        //!< When the metadata (for all the buffers read together) was read 
+  uint64_t waveforms_start_ns; //!< When this event's waveforms started being read 
+  ARRAY1D(uint64_t, waveforms_ns, BN_MAX_BOARDS); //!< When each board's waveforms were read (0 if there is no such board) 
+  uint64_t products_ns;        //!< When the beams and power sums were read (0 if they weren't) 
+  uint64_t clear_ns;           //!< When the buffer's clear was sent (with deferred clears, along with a later SPI message) 
+} beacon_readout_timing_t; 
 
 
 typedef enum beacon_scaler_type
@@ -264,6 +365,70 @@ int beacon_event_gzwrite(gzFile f, const beacon_event_t * ev);
 /** Read the event body from a compressed file. Returns 0 on success. The number of bytes read is not sizeof(beacon_event_t). */ 
 int beacon_event_gzread(gzFile f, beacon_event_t * ev); 
 
+/** Write a compact event body to a file, in the same format as beacon_event_write. Returns 0 on success. */ 
+int beacon_compact_event_write(FILE * f, const beacon_compact_event_t * ev); 
+
+/** Write a compact event body to a compressed file, in the same format as beacon_event_gzwrite. Returns 0 on success. */ 
+int beacon_compact_event_gzwrite(gzFile f, const beacon_compact_event_t * ev); 
+
+/** Read an event body (written by either beacon_event_write or beacon_compact_event_write) from a file. 
+ * Returns 0 on success, or BN_ERR_NOT_ENOUGH_BYTES if the buffer length is longer than ev->max_length. */ 
+int beacon_compact_event_read(FILE * f, beacon_compact_event_t * ev); 
+
+/** Read an event body from a compressed file. Returns 0 on success. See beacon_compact_event_read. */ 
+int beacon_compact_event_gzread(gzFile f, beacon_compact_event_t * ev); 
+
+/** Print a compact event the same way as beacon_event_print */ 
+int beacon_compact_event_print(FILE *f, const beacon_compact_event_t * ev, char sep) ; 
+
+/** Allocate a compact event with room for buffer lengths up to max_length. Free with beacon_compact_event_free. Returns 0 on failure. */ 
+beacon_compact_event_t * beacon_compact_event_alloc(uint16_t max_length); 
+
+/** Free a compact event from beacon_compact_event_alloc (not one from a pool!) */ 
+void beacon_compact_event_free(beacon_compact_event_t * ev); 
+
+/** Copy an event into a compact event. Returns 0 on success, or BN_ERR_NOT_ENOUGH_BYTES if it doesn't fit. */ 
+int beacon_compact_event_from_event(beacon_compact_event_t * dest, const beacon_event_t * src); 
+
+/** Copy a compact event into an event (zeroing the rest of each waveform) */ 
+void beacon_compact_event_to_event(const beacon_compact_event_t * src, beacon_event_t * dest); 
+
+/** Allocate n compact events with room for buffer lengths up to max_length, all at once. Returns 0 on failure. */ 
+beacon_compact_pool_t * beacon_compact_pool_create(unsigned n, uint16_t max_length); 
+
+/** Take an event from the pool. Returns 0 if they're all taken. Thread safe. */ 
+beacon_compact_event_t * beacon_compact_pool_get(beacon_compact_pool_t * pool); 
+
+/** Give an event back to the pool it came from. Thread safe. */ 
+void beacon_compact_pool_put(beacon_compact_pool_t * pool, beacon_compact_event_t * ev); 
+
+/** How many events are left in the pool */ 
+unsigned beacon_compact_pool_available(beacon_compact_pool_t * pool); 
+
+/** Free the pool, and so all of its events (taken or not) */ 
+void beacon_compact_pool_destroy(beacon_compact_pool_t * pool); 
+
+/** Allocate n header / event pairs with room for buffer lengths up to max_length, all at once. Returns 0 on failure. */ 
+beacon_event_pool_t * beacon_event_pool_create(unsigned n, uint16_t max_length); 
+
+/** Take a header / event pair from the pool, holding one reference. Returns 0 if they're all taken. Thread safe. */ 
+beacon_pooled_event_t * beacon_event_pool_acquire(beacon_event_pool_t * pool); 
+
+/** Take another reference to ev, e.g. before handing it to another thread. Returns ev. Thread safe. */ 
+beacon_pooled_event_t * beacon_pooled_event_ref(beacon_pooled_event_t * ev); 
+
+/** Release a reference to ev. When the last one is released, ev goes back to its pool. Thread safe. */ 
+void beacon_pooled_event_release(beacon_pooled_event_t * ev); 
+
+/** How many header / event pairs are left in the pool */ 
+unsigned beacon_event_pool_available(beacon_event_pool_t * pool); 
+
+/** The longest buffer length the pool's events have room for */ 
+uint16_t beacon_event_pool_max_length(const beacon_event_pool_t * pool); 
+
+/** Free the pool and all of its events. Nothing may still be holding any of them. */ 
+void beacon_event_pool_destroy(beacon_event_pool_t * pool); 
+
 /** Write the status to a file. Returns 0 on success. The number of bytes written is not sizeof(beacon_status_t). */ 
 int beacon_status_write(FILE * f, const beacon_status_t * ev); 
 
@@ -288,6 +453,51 @@ int beacon_hk_read(FILE * f, beacon_hk_t * h);
 /** read this hk from compressed file. The size will be different than sizeof(beacon_hk_t). Returns 0 on success. */ 
 int beacon_hk_gzread(gzFile  f, beacon_hk_t * h); 
 
+/** Write the beams to a file (only buffer_length samples of each). Returns 0 on success. */ 
+int beacon_beams_write(FILE * f, const beacon_beams_t * b); 
+
+/** Write the beams to a compressed file. Returns 0 on success. */ 
+int beacon_beams_gzwrite(gzFile f, const beacon_beams_t * b); 
+
+/** Read beams from a file. Returns 0 on success. */ 
+int beacon_beams_read(FILE * f, beacon_beams_t * b); 
+
+/** Read beams from a compressed file. Returns 0 on success. */ 
+int beacon_beams_gzread(gzFile f, beacon_beams_t * b); 
+
+/** Print the beams, like beacon_event_print */ 
+int beacon_beams_print(FILE * f, const beacon_beams_t * b, char sep); 
+
+/** Write the power sums to a file (only nsums of each). Returns 0 on success. */ 
+int beacon_powersum_write(FILE * f, const beacon_powersum_t * p); 
+
+/** Write the power sums to a compressed file. Returns 0 on success. */ 
+int beacon_powersum_gzwrite(gzFile f, const beacon_powersum_t * p); 
+
+/** Read power sums from a file. Returns 0 on success. */ 
+int beacon_powersum_read(FILE * f, beacon_powersum_t * p); 
+
+/** Read power sums from a compressed file. Returns 0 on success. */ 
+int beacon_powersum_gzread(gzFile f, beacon_powersum_t * p); 
+
+/** Print the power sums, like beacon_event_print */ 
+int beacon_powersum_print(FILE * f, const beacon_powersum_t * p, char sep); 
+
+/** Write a readout timing record to a file. Returns 0 on success. */ 
+int beacon_readout_timing_write(FILE * f, const beacon_readout_timing_t * t); 
+
+/** Write a readout timing record to a compressed file. Returns 0 on success. */ 
+int beacon_readout_timing_gzwrite(gzFile f, const beacon_readout_timing_t * t); 
+
+/** Read a readout timing record from a file. Returns 0 on success. */ 
+int beacon_readout_timing_read(FILE * f, beacon_readout_timing_t * t); 
+
+/** Read a readout timing record from a compressed file. Returns 0 on success. */ 
+int beacon_readout_timing_gzread(gzFile f, beacon_readout_timing_t * t); 
+
+/** Print a readout timing record, as the time each step took */ 
+int beacon_readout_timing_print(FILE * f, const beacon_readout_timing_t * t); 
+
 #undef ARRAY1D
 #undef ARRAY2D
 #undef ARRAY3D
@@ -0,0 +1,335 @@
+#include "beaconacq.h"
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Background acquisition into a single-producer / single-consumer ring. See beaconacq.h.
+ *
+ * The acquisition thread is the only one that writes head, and the consumer the only one that
+ * writes tail, so the ring itself needs no lock. The mutex and condition variable are only used
+ * when one side has to sleep until the other does something. Each side sets its waiting flag
+ * before checking one last time, and the other side checks that flag after moving its index.
+ * All of these are sequentially consistent, so a wakeup can't get lost between them.
+ */
+
+// how long the acquisition thread waits for buffers before checking if it should stop (seconds)
+#define ACQ_WAIT_TIMEOUT 0.1
+
+// how long to back off if someone else is in beacon_wait (us)
+#define ACQ_BUSY_SLEEP 10000
+
+struct beacon_acq
+{
+  beacon_dev_t * d;
+  beacon_acq_full_policy_t policy;
+  uint32_t capacity; // a power of 2
+
+  beacon_header_t * hd;
+  beacon_event_t * ev;
+
+  // where events go when the ring is full and we're dropping
+  beacon_header_t * spare_hd;
+  beacon_event_t * spare_ev;
+
+  // the indices only ever increase (mod 2^64), kept on separate cache lines
+  uint64_t head __attribute__((aligned(64))); // written by the acquisition thread
+  uint64_t tail __attribute__((aligned(64))); // written by the consumer
+
+  int producer_waiting __attribute__((aligned(64))); // for room in the ring (BN_ACQ_BLOCK)
+  int consumer_waiting; // for an event (beacon_acq_pop_wait)
+  int quit;
+  int stopped;
+
+  pthread_mutex_t mut;
+  pthread_cond_t room;
+  pthread_cond_t data;
+  pthread_t thread;
+  int thread_running;
+
+  // statistics, written by the acquisition thread (except npopped)
+  uint64_t nread;
+  uint64_t npushed;
+  uint64_t npopped;
+  uint64_t ndropped;
+  uint64_t nrejected;
+  uint64_t nerrors;
+  uint32_t max_occupancy;
+};
+
+static uint32_t ring_free(beacon_acq_t * acq)
+{
+  return acq->capacity - (uint32_t) (acq->head - __atomic_load_n(&acq->tail, __ATOMIC_SEQ_CST));
+}
+
+static void wake(beacon_acq_t * acq, int * waiting, pthread_cond_t * cond)
+{
+  if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&acq->mut);
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(&acq->mut);
+  }
+}
+
+// for BN_ACQ_BLOCK: wait until there are at least n free slots. Returns 0 if we should stop instead.
+static int wait_for_room(beacon_acq_t * acq, uint32_t n)
+{
+  pthread_mutex_lock(&acq->mut);
+  __atomic_store_n(&acq->producer_waiting, 1, __ATOMIC_SEQ_CST);
+  while (ring_free(acq) < n && !__atomic_load_n(&acq->quit, __ATOMIC_SEQ_CST))
+  {
+    pthread_cond_wait(&acq->room, &acq->mut);
+  }
+  __atomic_store_n(&acq->producer_waiting, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&acq->mut);
+  return !__atomic_load_n(&acq->quit, __ATOMIC_SEQ_CST);
+}
+
+static void * acq_main(void * arg)
+{
+  beacon_acq_t * acq = arg;
+  beacon_header_t * hd_ptr[BN_NUM_BUFFER];
+  beacon_event_t * ev_ptr[BN_NUM_BUFFER];
+
+  while (!__atomic_load_n(&acq->quit, __ATOMIC_SEQ_CST))
+  {
+    beacon_buffer_mask_t mask = 0;
+    int ret = beacon_wait(acq->d, &mask, ACQ_WAIT_TIMEOUT, MASTER);
+
+    if (ret == EBUSY)
+    {
+      usleep(ACQ_BUSY_SLEEP);
+      continue;
+    }
+    if (!mask) continue;
+
+    uint32_t n = __builtin_popcount(mask);
+    if (acq->policy == BN_ACQ_BLOCK && ring_free(acq) < n && !wait_for_room(acq, n)) break;
+
+    //read as many as fit straight into the ring, and the rest into the spares
+    uint32_t nfit = ring_free(acq);
+    uint32_t i;
+    if (nfit > n) nfit = n;
+    for (i = 0; i < n; i++)
+    {
+      uint32_t slot = (acq->head + i) & (acq->capacity - 1);
+      hd_ptr[i] = i < nfit ? &acq->hd[slot] : &acq->spare_hd[i];
+      ev_ptr[i] = i < nfit ? &acq->ev[slot] : &acq->spare_ev[i];
+    }
+
+    if (beacon_read_multiple_ptr(acq->d, mask, hd_ptr, ev_ptr))
+    {
+      __atomic_add_fetch(&acq->nerrors, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    //leave out what the event selector dropped, moving the rest up (spares too, if that made room)
+    uint32_t nkept = 0, nrejected = 0;
+    for (i = 0; i < n; i++)
+    {
+      uint32_t slot = (acq->head + nkept) & (acq->capacity - 1);
+      if (hd_ptr[i]->waveforms_skipped == BN_SKIP_DROPPED) nrejected++;
+      else if (nkept < nfit)
+      {
+        if (hd_ptr[i] != &acq->hd[slot])
+        {
+          acq->hd[slot] = *hd_ptr[i];
+          memcpy(&acq->ev[slot], ev_ptr[i], sizeof(beacon_event_t));
+        }
+        nkept++;
+      }
+    }
+
+    __atomic_add_fetch(&acq->nread, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&acq->nrejected, nrejected, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&acq->ndropped, n - nrejected - nkept, __ATOMIC_RELAXED);
+    if (!nkept) continue;
+
+    __atomic_store_n(&acq->head, acq->head + nkept, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&acq->npushed, nkept, __ATOMIC_RELAXED);
+
+    uint32_t occupancy = acq->capacity - ring_free(acq);
+    if (occupancy > acq->max_occupancy) __atomic_store_n(&acq->max_occupancy, occupancy, __ATOMIC_RELAXED);
+
+    wake(acq, &acq->consumer_waiting, &acq->data);
+  }
+
+  pthread_mutex_lock(&acq->mut);
+  __atomic_store_n(&acq->stopped, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&acq->data);
+  pthread_mutex_unlock(&acq->mut);
+  return 0;
+}
+
+beacon_acq_t * beacon_acq_start(beacon_dev_t * d, unsigned capacity, beacon_acq_full_policy_t policy)
+{
+  uint32_t cap = BN_NUM_BUFFER;
+  while (cap < capacity) cap <<= 1;
+
+  //the indices are cache line aligned, which calloc doesn't promise
+  beacon_acq_t * acq = aligned_alloc(64, sizeof(beacon_acq_t));
+  if (!acq)
+  {
+    fprintf(stderr,"Could not allocate acquisition\n");
+    return 0;
+  }
+  memset(acq, 0, sizeof(beacon_acq_t));
+
+  acq->d = d;
+  acq->policy = policy;
+  acq->capacity = cap;
+  acq->hd = calloc(cap, sizeof(beacon_header_t));
+  acq->ev = calloc(cap, sizeof(beacon_event_t));
+  acq->spare_hd = calloc(BN_NUM_BUFFER, sizeof(beacon_header_t));
+  acq->spare_ev = calloc(BN_NUM_BUFFER, sizeof(beacon_event_t));
+
+  if (!acq->hd || !acq->ev || !acq->spare_hd || !acq->spare_ev)
+  {
+    fprintf(stderr,"Could not allocate a ring of %u events\n", cap);
+    goto fail;
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&acq->mut, 0);
+  pthread_cond_init(&acq->room, &attr);
+  pthread_cond_init(&acq->data, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&acq->thread, 0, acq_main, acq))
+  {
+    fprintf(stderr,"Could not start acquisition thread\n");
+    pthread_cond_destroy(&acq->room);
+    pthread_cond_destroy(&acq->data);
+    pthread_mutex_destroy(&acq->mut);
+    goto fail;
+  }
+  acq->thread_running = 1;
+  return acq;
+
+fail:
+  free(acq->hd);
+  free(acq->ev);
+  free(acq->spare_hd);
+  free(acq->spare_ev);
+  free(acq);
+  return 0;
+}
+
+// pop without waking up the acquisition thread
+static int take(beacon_acq_t * acq, beacon_header_t * hd, beacon_event_t * ev)
+{
+  uint64_t tail = acq->tail;
+  if (tail == __atomic_load_n(&acq->head, __ATOMIC_SEQ_CST)) return 0;
+
+  uint32_t slot = tail & (acq->capacity - 1);
+  if (hd) memcpy(hd, &acq->hd[slot], sizeof(beacon_header_t));
+  if (ev) memcpy(ev, &acq->ev[slot], sizeof(beacon_event_t));
+
+  __atomic_store_n(&acq->tail, tail + 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&acq->npopped, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+int beacon_acq_pop(beacon_acq_t * acq, beacon_header_t * hd, beacon_event_t * ev)
+{
+  if (!take(acq, hd, ev)) return 0;
+  wake(acq, &acq->producer_waiting, &acq->room);
+  return 1;
+}
+
+int beacon_acq_pop_wait(beacon_acq_t * acq, beacon_header_t * hd, beacon_event_t * ev, float timeout)
+{
+  struct timespec deadline;
+  int got = beacon_acq_pop(acq, hd, ev);
+  if (got) return got;
+
+  if (timeout >= 0)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t) timeout;
+    deadline.tv_nsec += (long) ((timeout - (time_t) timeout) * 1e9);
+    if (deadline.tv_nsec >= 1000000000)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
+  //can't wake up the acquisition thread while holding the mutex, so use take, and wake it after
+  pthread_mutex_lock(&acq->mut);
+  __atomic_store_n(&acq->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+  while (!(got = take(acq, hd, ev)))
+  {
+    if (__atomic_load_n(&acq->stopped, __ATOMIC_SEQ_CST))
+    {
+      //one last look, in case it pushed something on the way out
+      got = take(acq, hd, ev) ? 1 : -1;
+      break;
+    }
+    if (timeout < 0) pthread_cond_wait(&acq->data, &acq->mut);
+    else if (pthread_cond_timedwait(&acq->data, &acq->mut, &deadline) == ETIMEDOUT)
+    {
+      got = take(acq, hd, ev);
+      break;
+    }
+  }
+  __atomic_store_n(&acq->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&acq->mut);
+
+  if (got == 1) wake(acq, &acq->producer_waiting, &acq->room);
+  return got;
+}
+
+unsigned beacon_acq_occupancy(const beacon_acq_t * acq)
+{
+  return __atomic_load_n(&acq->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&acq->tail, __ATOMIC_SEQ_CST);
+}
+
+int beacon_acq_get_stats(const beacon_acq_t * acq, beacon_acq_stats_t * stats)
+{
+  stats->nread = __atomic_load_n(&acq->nread, __ATOMIC_RELAXED);
+  stats->npushed = __atomic_load_n(&acq->npushed, __ATOMIC_RELAXED);
+  stats->npopped = __atomic_load_n(&acq->npopped, __ATOMIC_RELAXED);
+  stats->ndropped = __atomic_load_n(&acq->ndropped, __ATOMIC_RELAXED);
+  stats->nrejected = __atomic_load_n(&acq->nrejected, __ATOMIC_RELAXED);
+  stats->nerrors = __atomic_load_n(&acq->nerrors, __ATOMIC_RELAXED);
+  stats->capacity = acq->capacity;
+  stats->occupancy = beacon_acq_occupancy(acq);
+  stats->max_occupancy = __atomic_load_n(&acq->max_occupancy, __ATOMIC_RELAXED);
+  return 0;
+}
+
+int beacon_acq_stop(beacon_acq_t * acq)
+{
+  if (!acq->thread_running) return 0;
+
+  pthread_mutex_lock(&acq->mut);
+  __atomic_store_n(&acq->quit, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&acq->room);
+  pthread_mutex_unlock(&acq->mut);
+
+  //beacon_wait times out often enough that we don't need to cancel it
+  int ret = pthread_join(acq->thread, 0);
+  acq->thread_running = 0;
+  return ret;
+}
+
+void beacon_acq_close(beacon_acq_t * acq)
+{
+  if (!acq) return;
+  beacon_acq_stop(acq);
+  pthread_cond_destroy(&acq->room);
+  pthread_cond_destroy(&acq->data);
+  pthread_mutex_destroy(&acq->mut);
+  free(acq->hd);
+  free(acq->ev);
+  free(acq->spare_hd);
+  free(acq->spare_ev);
+  free(acq);
+}
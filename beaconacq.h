@@ -0,0 +1,87 @@
+#ifndef _beaconacq_h
+#define _beaconacq_h
+
+#include "beacondaq.h"
+
+/** \file beaconacq.h
+ *
+ * Background acquisition.
+ *
+ * Starts a thread that runs the wait, read and clear loop (what
+ * beacon_wait_for_and_read_multiple_events does) by itself. It puts each
+ * header and event into a preallocated ring, which the caller empties at its
+ * own pace. So writing files or doing analysis in the caller's thread no
+ * longer stops the readout. Without this, the board's BN_NUM_BUFFER buffers
+ * fill up within milliseconds, and the board goes dead until they're read.
+ *
+ * The ring has one producer (the acquisition thread) and one consumer, and
+ * popping from it is lock free. Only one thread may pop at a time. Events
+ * are read straight into the ring, so nothing is copied until they're
+ * popped.
+ *
+ * When the ring is full, the thread either keeps reading and throws the
+ * new events away (counting them as dropped), or stops reading until
+ * there's room. Stopping leaves the events in the board, where they cause
+ * deadtime instead.
+ *
+ * While the acquisition runs, it owns beacon_wait (others get EBUSY) and
+ * the event readout. Other calls, such as housekeeping or thresholds, are
+ * fine, as long as the device was opened with locking.
+ */
+
+typedef struct beacon_acq beacon_acq_t;
+
+/** What to do when the ring is full */
+typedef enum beacon_acq_full_policy
+{
+  BN_ACQ_DROP = 0,  //!< keep reading out, dropping the new events (no deadtime, but events are lost)
+  BN_ACQ_BLOCK = 1  //!< stop reading out until there's room (events wait in the board, causing deadtime)
+} beacon_acq_full_policy_t;
+
+/** Acquisition statistics */
+typedef struct beacon_acq_stats
+{
+  uint64_t nread;         //!< events read out of the board
+  uint64_t npushed;       //!< events put into the ring
+  uint64_t npopped;       //!< events taken out of the ring
+  uint64_t ndropped;      //!< events read out but dropped since the ring was full
+  uint64_t nrejected;     //!< events the event selector dropped (see beacon_set_event_selector), which never go in the ring
+  uint64_t nerrors;       //!< failed readouts
+  uint32_t capacity;      //!< number of events the ring holds
+  uint32_t occupancy;     //!< events currently in the ring
+  uint32_t max_occupancy; //!< the most events that have been in the ring at once
+} beacon_acq_stats_t;
+
+/** Start reading out d in the background into a ring of (at least) capacity events.
+ * Capacity is rounded up to a power of 2, and to at least BN_NUM_BUFFER.
+ * Each event takes sizeof(beacon_header_t) + sizeof(beacon_event_t) of memory.
+ * Returns 0 on failure.
+ */
+beacon_acq_t * beacon_acq_start(beacon_dev_t * d, unsigned capacity, beacon_acq_full_policy_t policy);
+
+/** Take the oldest event out of the ring, if there is one, copying it to hd and ev.
+ * Doesn't block. Returns 1 if there was an event, 0 if not.
+ */
+int beacon_acq_pop(beacon_acq_t * acq, beacon_header_t * hd, beacon_event_t * ev);
+
+/** Same as beacon_acq_pop, but waits up to timeout seconds (forever if negative) for an event.
+ * Returns 1 if there was an event, 0 on timeout, or -1 if the ring is empty and the
+ * acquisition has stopped (or was stopped while waiting).
+ */
+int beacon_acq_pop_wait(beacon_acq_t * acq, beacon_header_t * hd, beacon_event_t * ev, float timeout);
+
+/** Number of events waiting in the ring */
+unsigned beacon_acq_occupancy(const beacon_acq_t * acq);
+
+/** Get the acquisition statistics */
+int beacon_acq_get_stats(const beacon_acq_t * acq, beacon_acq_stats_t * stats);
+
+/** Stop the acquisition thread, without freeing anything, so the ring can still be emptied.
+ * Anyone blocked in beacon_acq_pop_wait is woken up once the ring is empty. Returns 0 on success.
+ */
+int beacon_acq_stop(beacon_acq_t * acq);
+
+/** Stop the acquisition (if it's still running) and free everything. Events left in the ring are lost. */
+void beacon_acq_close(beacon_acq_t * acq);
+
+#endif
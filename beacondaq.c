@@ -5,6 +5,7 @@
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -16,6 +17,8 @@
 #include <errno.h> 
 #include <endian.h>
 #include "bbb_gpio.h" 
+#include "beaconregs.h" 
+#include "beacontransport.h" 
 #include <math.h>
 
 #define BN_ADDRESS_MAX 256
@@ -24,10 +27,22 @@
 #define BN_NUM_REGISTER 256
 #define BUF_MASK 0xf
 #define MAX_PRETRIGGER 8 
+#define NUM_TRIG_TYPES 4 // the trigger type is 2 bits of REG_TRIG_INFO 
 #define BOARD_CLOCK_HZ 500000000/16
 
-// master
-#define NBD(d) (1)
+// number of boards (master + slaves) 
+#define NBD(d) ((d)->nboards)
+// the BN_MAX_BOARDS check lets the compiler drop slave code in single-board builds 
+#define HAS_SLAVES(d) (BN_MAX_BOARDS > 1 && NBD(d) > 1)
+
+// when waiting on the data ready line, still check over SPI this often (in ms), in case we miss an edge 
+#define READY_RECHECK_MS 100 
+
+// adaptive polling: how much each new measurement counts in the smoothed rate / poll time, 
+// how many polls to aim for per expected event, and the longest we'll go without polling (in us) 
+#define ADAPT_ALPHA 0.2 
+#define ADAPT_POLLS_PER_EVENT 4 
+#define ADAPT_MAX_INTERVAL 100000 
 
 #define MIN_GOOD_MAX_V 20 
 #define MAX_MISERY 100 
@@ -40,84 +55,8 @@
 #define SPI_CLOCK 20000000
 //#define SPI_CLOCK 1000000
 
-#define MAX_XFERS 511
-
 /* #define DEBUG_PRINTOUTS 1  */
 
-//register map TODO
-typedef enum
-{
-  REG_FIRMWARE_VER       = 0x01, 
-  REG_FIRMWARE_DATE      = 0x02, 
-  REG_SCALER_READ        = 0x03, 
-  REG_CHIPID_LOW         = 0x04,  
-  REG_CHIPID_MID         = 0x05,  
-  REG_CHIPID_HI          = 0x06,  
-  REG_STATUS             = 0x07, 
-  REG_CLEAR_STATUS       = 0x09, 
-  REG_EVENT_COUNTER_LOW  = 0xa, 
-  REG_EVENT_COUNTER_HIGH = 0xb, 
-  REG_TRIG_COUNTER_LOW   = 0xc, 
-  REG_TRIG_COUNTER_HIGH  = 0xd, 
-  REG_TRIG_TIME_LOW      = 0xe, 
-  REG_TRIG_TIME_HIGH     = 0xf, 
-  REG_DEADTIME           = 0x10, 
-  REG_TRIG_INFO          = 0x11, //bits 23-22 : event buffer ; bit 21: calpulse, bits 19-17: pretrig window,  bits16-15: trig type ; bits 14-4: 0: bits 3-0: value of REG_TRIG_POLARIZATION
-  REG_CH_MASKS           = 0x12, // bits 22-15 : channel mask ; bits 14-0 : beam mask
-  REG_LAST_BEAM          = 0x14, 
-  REG_TRIG_BEAM_POWER    = 0x15, 
-  REG_PPS_COUNTER        = 0x16, 
-  REG_HD_DYN_MASK        = 0x17, 
-  REG_USER_MASK          = 0x18,  
-  REG_VETO_DEADTIME_CTR  = 0x19, 
-  REG_VETO_STATUS        = 0x21, 
-  REG_ST_DYN_MASK        = 0x22, 
-  REG_CHUNK              = 0x23, //which 32-bit chunk  + i 
-  REG_SYNC               = 0x27, 
-  REG_UPDATE_SCALERS     = 0x28, 
-  REG_PICK_SCALER        = 0x29, 
-  REG_CALPULSE           = 0x2a, //cal pulse
-  REG_LATCHED_PPS_LOW    = 0x2c, 
-  REG_LATCHED_PPS_HIGH   = 0x2d, 
-  REG_CHANNEL_MASK       = 0x30, 
-  REG_ATTEN_012          = 0x32, 
-  REG_ATTEN_345          = 0x33, 
-  REG_ATTEN_67           = 0x34, 
-  REG_ATTEN_APPLY        = 0x35, 
-  REG_ADC_CLK_RST        = 0x37,  
-  REG_ADC_DELAYS         = 0x38, //add buffer number to get all 
-  REG_TRIG_DELAY_012     = 0x3d, 
-  REG_TRIG_DELAY_345     = 0x3e, 
-  REG_TRIG_DELAY_67      = 0x3f, 
-  REG_FORCE_TRIG         = 0x40, 
-  REG_CHANNEL            = 0x41, //select channel to read
-  REG_MODE               = 0x42, //readout mode
-  REG_RAM_ADDR           = 0x45, //ram address
-  REG_READ               = 0x47, //send data to spi miso 
-  REG_EXT_INPUT_CONFIG   = 0x4b, 
-  REG_PRETRIGGER         = 0x4c, 
-  REG_CLEAR              = 0x4d, //clear buffers 
-  REG_BUFFER             = 0x4e,
-  REG_TRIG_POLARIZATION  = 0x4f, // which polarization(s) to trigger on, LSB 0=H, 1=V, 2=both (unimplemented)
-  REG_TRIGGER_MASK       = 0x50, 
-  REG_TRIG_HOLDOFF       = 0x51, 
-  REG_TRIG_ENABLE        = 0x52, 
-  REG_TRIGOUT_CONFIG     = 0x53, 
-  REG_PHASED_TRIGGER     = 0x54, 
-  REG_VERIFICATION_MODE  = 0x55, 
-  REG_TIMESTAMP_SELECT   = 0x58, 
-  REG_TRIGGER_VETOS      = 0x5f,
-  REG_VETO_CUT_0         = 0x60, 
-  REG_VETO_CUT_1         = 0x61, 
-  REG_SET_READ_REG       = 0x6d, 
-  REG_TRIGGER_LOWPASS    = 0x5a, 
-  REG_DYN_MASK           = 0x5d, 
-  REG_DYN_HOLDOFF        = 0x5e, 
-  REG_RESET_COUNTER      = 0x7e, 
-  REG_RESET_ALL          = 0x7f,
-  REG_THRESHOLDS         = 0x81 // add the threshold to this to get the right register
-
-} beacon_register_t; 
 
 
 void easy_break_point()
@@ -127,41 +66,181 @@ void easy_break_point()
 }
 
 
-//readout modes 
-typedef enum 
+
+// Lock-free ring of SPI timing records. Any thread doing SPI grabs a slot
+// with an atomic increment, and marks it complete by storing its sequence
+// number. The (single) drainer uses the sequence numbers to tell complete
+// records from ones still being written or already overwritten. 
+struct beacon_spi_trace
+{
+  int enabled; 
+  beacon_spi_trace_record_t * ring; 
+  uint64_t * seq;  // index + 1 of the record in each slot, 0 while being written 
+  uint64_t head;   // next index to write 
+  uint64_t tail;   // next index to drain 
+  uint64_t nlost; 
+}; 
+
+// A precompiled list of transfers that reads all the waveforms of one buffer on one board. 
+// The transfers only depend on the buffer, channel read mask, buffer length and duplex mode, 
+// so we build them once and just patch the destination pointers for each event. 
+// a plan's rx offsets are a channel and the offset within it, since how far apart channels are depends on the event type 
+#define PLAN_RX(chan, offset) ((chan) << 16 | (offset)) 
+#define PLAN_RX_CHAN(rx) ((rx) >> 16) 
+#define PLAN_RX_OFFSET(rx) ((rx) & 0xffff) 
+
+// how long a step of the readout takes, binned 8 bins per factor of 2 starting at 1 us (see timing_bin) 
+#define TIMING_NBINS 256 
+struct timing_hist 
+{
+  uint64_t n; 
+  uint64_t max_ns; 
+  uint32_t counts[TIMING_NBINS]; 
+}; 
+
+struct xfer_plan
+{
+  int valid; 
+  uint8_t channel_mask; 
+  uint16_t first_addr; // the RAM addresses read (from 0, the board's start at 1) 
+  uint16_t naddr; 
+  int full_duplex; 
+  int n; 
+  int capacity; 
+  struct spi_ioc_transfer * xfers; 
+  int32_t * rx_offset; // where each rx_buf goes (see PLAN_RX), or -1 for nowhere 
+  const uint8_t * last_channel; // the last channel selected, which the board is left at 
+}; 
+
+// What we think each board's registers contain, so writes that wouldn't change anything can be skipped 
+// and getters can be answered without going over the bus. Entries become valid once we write or read the register 
+// and are invalidated whenever we can't be sure anymore (failed transfers, resets). See shadow_flags for which 
+// registers are shadowed. 
+#define MAX_PENDING_READS 64 
+struct reg_shadow
+{
+  uint32_t value[BN_NUM_REGISTER]; 
+  uint8_t valid[BN_NUM_REGISTER]; 
+  // register reads in the transfer queue, which update the shadow once sent 
+  int npending; 
+  uint8_t pending_addr[MAX_PENDING_READS]; 
+  const uint8_t * pending_result[MAX_PENDING_READS]; 
+  uint64_t nskipped; 
+  uint64_t ncached; 
+}; 
+
+// State for adaptive polling in beacon_wait. The rate estimate is kept up to date whether or not 
+// adaptive polling is on. 
+struct poll_adapt
+{
+  unsigned max_latency_us;  // 0 if off 
+  float max_bus_fraction; 
+  double mean_dt;           // smoothed time between events (s), 0 until we've seen two 
+  uint64_t last_arrival;    // when we last saw a new buffer (ns), 0 if never 
+  beacon_buffer_mask_t last_mask; 
+  double poll_time;         // smoothed time a status poll takes (s) 
+  unsigned interval_us;     // current poll period 
+  uint64_t npolls; 
+  uint64_t nevents; 
+}; 
+
+// The thread behind beacon_notify_fd. It sits in beacon_wait, and when buffers are ready, pokes fd and 
+// stops looking until those buffers are read (or the consumer acknowledges a cancel). 
+struct notifier
+{
+  pthread_t thread; 
+  pthread_mutex_t mut; 
+  pthread_cond_t cond; 
+  int fd;                        // eventfd handed out, -1 if not started 
+  beacon_which_board_t which; 
+  beacon_buffer_mask_t pending;  // buffers reported and not read yet 
+  beacon_buffer_mask_t mask;     // buffers reported and not acknowledged yet 
+  int cancelled;                 // a wait was cancelled and not acknowledged yet 
+  int armed;                     // should be looking for buffers 
+  int quit; 
+}; 
+
+typedef int (*board_job_fn)(beacon_dev_t * d, int ibd, void * arg); 
+
+// A thread that does work on one (slave) board, so the boards can be read out concurrently. 
+// Jobs only touch their own board's transport, transfer buffers and plans. 
+struct board_worker
 {
-  MODE_REGISTER=0,
-  MODE_WAVEFORMS=1,
-  MODE_BEAMS=2,
-  MODE_POWERSUM=3
-} beacon_readout_mode_t; 
+  pthread_t thread; 
+  pthread_mutex_t mut; 
+  pthread_cond_t cond; 
+  beacon_dev_t * d; 
+  int ibd; 
+  board_job_fn fn; 
+  void * arg; 
+  int pending; 
+  int ret; 
+  int quit; 
+}; 
 
-//TODO . In general it would be better to write everything so it's BN_NUM_BOARDS agnostic, but whatever
-//leave these at 2 so we can avoid touching most of the code for now!!!  
+//the per-board arrays are indexed by board, master first 
 struct beacon_dev
 {
-  const char * device_name[2]; //master,slave
-  int fd[2];  //master, slave
+  const char * device_name[BN_MAX_BOARDS]; 
+  beacon_transport_t * tp[BN_MAX_BOARDS]; 
+  int nboards; 
   int power_gpio; //gpio for enable 
   int enable_locking; 
   uint64_t readout_number_offset; 
   uint64_t event_counter;  // should match device...we'll keep this to complain if it doesn't
   uint16_t buffer_length; 
-  pthread_mutex_t mut; //mutex for the SPI (not for the gpio though). Only used if enable_locking is true
+  uint16_t window_pre, window_post; // samples read before and after the trigger, both 0 to read the whole buffer 
+  unsigned waveform_prescale[NUM_TRIG_TYPES]; // read the waveforms of one in this many events of each trigger type, see beacon_set_waveform_prescale 
+  uint64_t nprescaled[NUM_TRIG_TYPES]; // events of each trigger type seen by the prescaler 
+  beacon_event_selector_t selector; // decides which waveforms to read, see beacon_set_event_selector 
+  void * selector_arg; 
+  pthread_mutex_t mut; //mutex for the readout state (see USING below). Only used if enable_locking is true
+  pthread_mutex_t bd_mut[BN_MAX_BOARDS]; //mutex for the SPI of each board (not for the gpio though). Only used if enable_locking is true
   pthread_mutex_t wait_mut; //mutex for the waiting. Only used if enable_locking is true
-  uint8_t board_id[2]; 
-  uint8_t channel_read_mask[2];// read mask... right now it's always 0xf, but we can make it configurable later
+  uint8_t board_id[BN_MAX_BOARDS]; 
+  uint8_t channel_read_mask[BN_MAX_BOARDS];// the channels read out on each board, see beacon_set_channel_read_mask
   volatile int cancel_wait; // needed for signal handlers 
+  int cancel_fd; // eventfd beacon_cancel_wait pokes to wake up beacon_wait if it's blocked in poll() 
+
+  // what beacon_wait blocks on instead of polling over SPI, -1 for nothing  
+  int ready_fd; 
+  bbb_gpio_pin_t * ready_pin; // if the data ready line is a gpio (which we own) 
   struct timespec start_time; //the time of the last clock reset
 
   uint8_t next_read_buffer; //what buffer to read next 
   uint8_t hardware_next; // what buffer the hardware things we should read next 
 
+  // buffer status read in the same SPI message as the last buffer clear (protected by the master board lock), 
+  // so beacon_wait doesn't have to poll again right after a readout 
+  struct 
+  {
+    int valid; 
+    beacon_buffer_mask_t mask; 
+    uint8_t next; 
+    uint64_t nused; // times beacon_wait used it instead of polling 
+  } after_clear; 
+
+  // clears waiting to go out with the next message to the master, see beacon_set_deferred_clear 
+  // (protected by the master board lock, except enabled, which is protected by mut) 
+  struct 
+  {
+    int enabled; 
+    beacon_buffer_mask_t pending; // not queued yet 
+    beacon_buffer_mask_t queued; // in the master's queue, along with a status read into status 
+    uint8_t status[BN_SPI_BYTES]; 
+    uint64_t nriding; // buffers whose clear went out with another message instead of its own 
+  } deferred_clear; 
+
   /* uint32_t min_threshold;  */
   uint16_t poll_interval; 
+  struct poll_adapt adapt; 
+  pthread_mutex_t adapt_mut; //protects adapt, so it can be looked at while someone is waiting. Only used if enable_locking is true 
+  uint64_t ready_ns[BN_NUM_BUFFER]; // when beacon_wait first saw each buffer ready, 0 once cleared (also protected by adapt_mut) 
+  uint64_t cleared_ns[BN_NUM_BUFFER]; // when each buffer's last clear was sent, which may be well after it was asked for (also protected by adapt_mut) 
   int spi_clock; 
   int cs_change; 
   int delay_us; 
+  int full_duplex; //read waveforms full duplex (overlapping each chunk read with the next chunk select)
 
   uint8_t pretrigger; 
 
@@ -169,14 +248,38 @@ struct beacon_dev
   beacon_event_t calib_ev;
   beacon_header_t calib_hd;
 
-  //spi buffer 
-  struct spi_ioc_transfer buf[2][MAX_XFERS]; 
+  //spi buffer, sized for the largest message the transports take  
+  struct spi_ioc_transfer * buf[BN_MAX_BOARDS]; 
+  int max_xfers; 
+
+  int nused[BN_MAX_BOARDS]; 
+
+  struct beacon_spi_trace trace; 
 
-  int nused[2]; 
+  //transfer plans for reading waveforms, per board and buffer 
+  struct xfer_plan plan[BN_MAX_BOARDS][BN_NUM_BUFFER]; 
 
-  // device state 
-  int current_buf[2]; 
-  int current_mode[2]; 
+  // readout statistics (per board, since the boards are read out concurrently) 
+  uint64_t nmessages[BN_MAX_BOARDS]; 
+  uint64_t nxfers[BN_MAX_BOARDS]; 
+  uint64_t nplans_built[BN_MAX_BOARDS]; 
+  uint64_t nevents_read; 
+
+  // readout timing of the last few events, and a histogram of each step (protected by mut) 
+  beacon_readout_timing_t timing[BN_READOUT_TIMING_HISTORY]; 
+  unsigned ntimed; 
+  struct timing_hist timing_hist[BN_NUM_READOUT_STEPS]; 
+
+  // register shadow 
+  struct reg_shadow shadow[BN_MAX_BOARDS]; 
+  int shadow_enabled; 
+
+  // worker threads for the slaves (the master is handled by the calling thread), 
+  // only started if there is more than one board 
+  struct board_worker workers[BN_MAX_BOARDS]; 
+  int nworkers; 
+
+  struct notifier notify; 
 
   bbb_gpio_pin_t * gpio_pin; 
 
@@ -188,25 +291,104 @@ struct beacon_dev
   
 }; 
 
-//some macros 
+/* Locking (only done if enable_locking is true) 
+ *
+ *  - d->mut protects the readout bookkeeping (the next buffer to read, the event counter, ...) and 
+ *    is held for all of beacon_read_multiple_ptr, so only one thread reads out events at a time. 
+ *  - d->bd_mut[ibd] protects everything involved in talking to board ibd: its transport, transfer queue, 
+ *    plans and current buffer / mode. Settings the SPI code for every board depends on 
+ *    (buffer length, duplex mode, max transfers...) are only changed while holding all the board locks. 
+ *    So e.g. reading the status of one board doesn't have to wait for the other board's waveforms. 
+ *  - d->wait_mut only keeps more than one thread from being in beacon_wait. 
+ *  - d->adapt_mut protects the adaptive polling state, and is never held for long. 
+ *
+ * Lock order: d->mut first, then the board locks in increasing board order (master first). Anything that 
+ * needs more than one board at once (e.g. synchronized_command) takes all of them with USING_ALL. 
+ * Never take d->mut while holding a board lock. d->adapt_mut and the notifier's lock come last: nothing else 
+ * is taken while holding them. 
+ */ 
 #define USING(d) if (d->enable_locking) pthread_mutex_lock(&d->mut);
 #define DONE(d)  if (d->enable_locking) pthread_mutex_unlock(&d->mut);
+#define USING_BD(d,ibd) if (d->enable_locking) pthread_mutex_lock(&d->bd_mut[ibd]);
+#define DONE_BD(d,ibd)  if (d->enable_locking) pthread_mutex_unlock(&d->bd_mut[ibd]);
+#define USING_ALL(d) lock_boards(d); 
+#define DONE_ALL(d) unlock_boards(d); 
+
+static void lock_boards(beacon_dev_t * d) 
+{
+  int ibd; 
+  if (!d->enable_locking) return; 
+  for (ibd = 0; ibd < NBD(d); ibd++) 
+  {
+    pthread_mutex_lock(&d->bd_mut[ibd]); 
+  }
+}
+
+static void unlock_boards(beacon_dev_t * d) 
+{
+  int ibd; 
+  if (!d->enable_locking) return; 
+  for (ibd = NBD(d)-1; ibd >= 0; ibd--) 
+  {
+    pthread_mutex_unlock(&d->bd_mut[ibd]); 
+  }
+}
+
+
+static uint64_t trace_now(void) 
+{
+  struct timespec now; 
+  clock_gettime(CLOCK_MONOTONIC, &now); 
+  return now.tv_sec * (uint64_t) 1000000000 + now.tv_nsec; 
+}
+
+// returns the start time if tracing is on, otherwise 0 
+static uint64_t trace_start(const beacon_transport_t * tp) 
+{
+  if (!tp->trace || !__atomic_load_n(&tp->trace->enabled, __ATOMIC_ACQUIRE)) return 0; 
+  return trace_now(); 
+}
+
+static void trace_record(beacon_transport_t * tp, uint64_t start, beacon_spi_trace_op_t op, int nxfers, int nbytes, int ret) 
+{
+  struct beacon_spi_trace * tr = tp->trace; 
+  uint64_t end = trace_now(); 
+  uint64_t idx = __atomic_fetch_add(&tr->head, 1, __ATOMIC_RELAXED); 
+  size_t slot = idx & (BN_SPI_TRACE_SIZE - 1); 
+
+  __atomic_store_n(&tr->seq[slot], 0, __ATOMIC_RELAXED); 
+  __atomic_thread_fence(__ATOMIC_RELEASE); 
+
+  beacon_spi_trace_record_t * r = &tr->ring[slot]; 
+  r->start_ns = start; 
+  r->duration_ns = end - start; 
+  r->nbytes = ret > 0 ? ret : nbytes; 
+  r->fd = tp->fd; 
+  r->nxfers = nxfers; 
+  r->op = op; 
+  r->failed = ret < 0; 
+  r->reserved = 0; 
+
+  __atomic_store_n(&tr->seq[slot], idx + 1, __ATOMIC_RELEASE); 
+}
 
 
-//Wrappers for io functions to add printouts 
-static int do_xfer(int fd, int n, struct spi_ioc_transfer * xfer) 
+//Wrappers for io functions to add printouts and tracing
+static int do_xfer(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfer) 
 {
 #ifdef DEBUG_PRINTOUTS
   struct timespec start; 
   struct timespec end; 
   clock_gettime(CLOCK_REALTIME, &start) ; 
 #endif
-  int ret = ioctl(fd,SPI_IOC_MESSAGE(n), xfer); 
+  uint64_t trace_t0 = trace_start(tp); 
+  int ret = tp->ops->xfer(tp, n, xfer); 
+  if (trace_t0) trace_record(tp, trace_t0, BN_SPI_TRACE_XFER, n, n * BN_SPI_BYTES, ret); 
 
 #ifdef DEBUG_PRINTOUTS
   clock_gettime(CLOCK_REALTIME, &end) ; 
   int i; 
-  printf("START BULK TRANSFER (fd=%d, t = %lu.%lu)\n", fd,start.tv_sec, start.tv_nsec); 
+  printf("START BULK TRANSFER (fd=%d, t = %lu.%lu)\n", tp->fd,start.tv_sec, start.tv_nsec); 
   for (i = 0; i < n; i++)
   {
       printf("\tXFR %03d\t",i); 
@@ -222,25 +404,29 @@ static int do_xfer(int fd, int n, struct spi_ioc_transfer * xfer)
       }
       printf("\n"); 
   }
-  printf("END BULK TRANSFER (fd=%d,t= %lu.%lu)\n", fd,end.tv_sec, end.tv_nsec); 
+  printf("END BULK TRANSFER (fd=%d,t= %lu.%lu)\n", tp->fd,end.tv_sec, end.tv_nsec); 
 #endif 
   return ret; 
 }
 
-static int do_write(int fd, const uint8_t * p)
+static int do_write(beacon_transport_t * tp, const uint8_t * p)
 {
-  int ret = write(fd,p, BN_SPI_BYTES); 
+  uint64_t trace_t0 = trace_start(tp); 
+  int ret = tp->ops->write(tp, p); 
+  if (trace_t0) trace_record(tp, trace_t0, BN_SPI_TRACE_WRITE, 1, BN_SPI_BYTES, ret); 
 #ifdef DEBUG_PRINTOUTS
-  printf("WRITE(%d): [0x%02x 0x%02x 0x%02x 0x%02x]\n",fd, p[0],p[1],p[2],p[3]); 
+  printf("WRITE(%d): [0x%02x 0x%02x 0x%02x 0x%02x]\n",tp->fd, p[0],p[1],p[2],p[3]); 
 #endif
   return ret; 
 }
 
-static int do_read(int fd, uint8_t * p)
+static int do_read(beacon_transport_t * tp, uint8_t * p)
 {
-  int ret = read(fd,p, BN_SPI_BYTES); 
+  uint64_t trace_t0 = trace_start(tp); 
+  int ret = tp->ops->read(tp, p); 
+  if (trace_t0) trace_record(tp, trace_t0, BN_SPI_TRACE_READ, 1, BN_SPI_BYTES, ret); 
 #ifdef DEBUG_PRINTOUTS
-  printf("READ(%d): [0x%02x 0x%02x 0x%02x 0x%02x]\n",fd, p[0],p[1],p[2],p[3]); 
+  printf("READ(%d): [0x%02x 0x%02x 0x%02x 0x%02x]\n",tp->fd, p[0],p[1],p[2],p[3]); 
 #endif
   return ret; 
 }
@@ -255,6 +441,7 @@ static int do_read(int fd, uint8_t * p)
 static uint8_t buf_mode[BN_NUM_MODE][BN_SPI_BYTES];
 static uint8_t buf_set_read_reg[BN_NUM_REGISTER][BN_SPI_BYTES];
 static uint8_t buf_channel[BN_NUM_CHAN][BN_SPI_BYTES];
+static uint8_t buf_beam[BN_NUM_BEAMS][BN_SPI_BYTES]; // in the beam and power sum modes, the channel register picks a beam 
 static uint8_t buf_buffer[BN_NUM_BUFFER][BN_SPI_BYTES];
 static uint8_t buf_chunk[BN_NUM_CHUNK][BN_SPI_BYTES];
 static uint8_t buf_ram_addr[BN_ADDRESS_MAX][BN_SPI_BYTES];
@@ -273,6 +460,11 @@ static uint8_t buf_reset_counter[BN_SPI_BYTES] = {REG_RESET_COUNTER,0,0,1};
 static uint8_t buf_adc_clk_rst[BN_SPI_BYTES] = {REG_ADC_CLK_RST,0,0,0}; 
 static uint8_t buf_apply_attenuation[BN_SPI_BYTES] = {REG_ATTEN_APPLY,0,0,0}; 
 
+// which registers the shadow keeps track of 
+#define SHADOW_WRITE 1 // writing the same value again does nothing, so it can be skipped 
+#define SHADOW_READ 2  // only we (or nothing) change it, so reads can come from the shadow 
+static uint8_t shadow_flags[BN_NUM_REGISTER]; 
+
 static void fillBuffers() __attribute__((constructor)); //this will fill them
 
 
@@ -302,6 +494,15 @@ void fillBuffers()
     buf_channel[i][3] = 1<<i; 
   }
 
+  memset(buf_beam,0,sizeof(buf_beam)); 
+  for (i = 0; i < BN_NUM_BEAMS; i++) 
+  {
+    buf_beam[i][0] = REG_CHANNEL; 
+    buf_beam[i][1] = ((1<<i) >> 16) & 0xff; 
+    buf_beam[i][2] = ((1<<i) >> 8) & 0xff; 
+    buf_beam[i][3] = (1<<i) & 0xff; 
+  }
+
   memset(buf_buffer,0,sizeof(buf_buffer)); 
   for (i = 0; i < BN_NUM_BUFFER; i++) 
   {
@@ -336,49 +537,221 @@ void fillBuffers()
     buf_pick_scaler[i][0]=REG_PICK_SCALER; 
     buf_pick_scaler[i][3]=i;  
   }
+
+  //configuration, which reads back what we wrote 
+  static const uint8_t config_regs[] = { REG_CHANNEL_MASK, REG_ATTEN_012, REG_ATTEN_345, REG_ATTEN_67, 
+                                         REG_TRIG_DELAY_012, REG_TRIG_DELAY_345, REG_TRIG_DELAY_67, 
+                                         REG_EXT_INPUT_CONFIG, REG_TRIG_POLARIZATION, REG_TRIGGER_MASK, 
+                                         REG_TRIG_HOLDOFF, REG_TRIG_ENABLE, REG_TRIGOUT_CONFIG, 
+                                         REG_VERIFICATION_MODE, REG_TRIGGER_VETOS, REG_VETO_CUT_0, 
+                                         REG_VETO_CUT_1, REG_TRIGGER_LOWPASS, REG_DYN_MASK, REG_DYN_HOLDOFF }; 
+
+  //state we only ever write 
+  static const uint8_t write_only_regs[] = { REG_MODE, REG_BUFFER, REG_CHANNEL, REG_CALPULSE, 
+                                             REG_PRETRIGGER, REG_PHASED_TRIGGER, REG_TIMESTAMP_SELECT }; 
+
+  //constants 
+  static const uint8_t constant_regs[] = { REG_FIRMWARE_VER, REG_FIRMWARE_DATE, 
+                                           REG_CHIPID_LOW, REG_CHIPID_MID, REG_CHIPID_HI }; 
+
+  memset(shadow_flags,0,sizeof(shadow_flags)); 
+  for (i = 0; i < (int) sizeof(config_regs); i++) shadow_flags[config_regs[i]] = SHADOW_WRITE | SHADOW_READ; 
+  for (i = 0; i < BN_NUM_BEAMS; i++) shadow_flags[REG_THRESHOLDS+i] = SHADOW_WRITE | SHADOW_READ; 
+  for (i = 0; i < (int) sizeof(write_only_regs); i++) shadow_flags[write_only_regs[i]] = SHADOW_WRITE; 
+  for (i = 0; i < (int) sizeof(constant_regs); i++) shadow_flags[constant_regs[i]] = SHADOW_READ; 
 }
 
 
+/* Register shadow helpers. All of these must hold the board lock. */ 
 
-static void setup_xfers( beacon_dev_t *d)
+static uint32_t word_value(const uint8_t * w) 
+{
+  return (w[1] << 16) | (w[2] << 8) | w[3]; 
+}
+
+static void shadow_invalidate(beacon_dev_t * d, beacon_which_board_t which) 
+{
+  memset(d->shadow[which].valid, 0, sizeof(d->shadow[which].valid)); 
+  d->shadow[which].npending = 0; 
+}
+
+// would writing w leave the board as it is? 
+static int shadow_unchanged(const beacon_dev_t * d, beacon_which_board_t which, const uint8_t * w) 
+{
+  const struct reg_shadow * s = &d->shadow[which]; 
+  return d->shadow_enabled && (shadow_flags[w[0]] & SHADOW_WRITE) && s->valid[w[0]] && s->value[w[0]] == word_value(w); 
+}
+
+// record that w was (or is queued to be) written 
+static void shadow_write(beacon_dev_t * d, beacon_which_board_t which, const uint8_t * w) 
+{
+  struct reg_shadow * s = &d->shadow[which]; 
+  int i; 
+
+  if (w[0] == REG_RESET_ALL) 
+  {
+    shadow_invalidate(d, which); 
+    return; 
+  }
+
+  if (!shadow_flags[w[0]]) return; 
+  s->value[w[0]] = word_value(w); 
+  s->valid[w[0]] = 1; 
+
+  //a read of this register queued before now would be stale 
+  for (i = 0; i < s->npending; i++) 
+  {
+    if (s->pending_addr[i] == w[0]) s->pending_result[i] = 0; 
+  }
+}
+
+// the queued reads have been sent, so we know what's in those registers 
+static void shadow_fill_pending(beacon_dev_t * d, beacon_which_board_t which) 
+{
+  struct reg_shadow * s = &d->shadow[which]; 
+  int i; 
+  for (i = 0; i < s->npending; i++) 
+  {
+    const uint8_t * r = s->pending_result[i]; 
+    if (r && r[0] == s->pending_addr[i]) 
+    {
+      s->value[r[0]] = word_value(r); 
+      s->valid[r[0]] = 1; 
+    }
+  }
+  s->npending = 0; 
+}
+
+
+
+static void invalidate_plans(beacon_dev_t * d); 
+
+// must hold all the board locks
+static void init_xfers( beacon_dev_t *d)
 {
   int i, b; 
-  USING(d); 
   for (b = 0; b < NBD(d); b++)
   {
-    for (i = 0; i < MAX_XFERS; i++)
+    for (i = 0; i < d->max_xfers; i++)
     {
       d->buf[b][i].len = BN_SPI_BYTES; 
       d->buf[b][i].cs_change =d->cs_change; //deactivate cs between transfers
       d->buf[b][i].delay_usecs = d->delay_us;//? 
     }
   }
-  DONE(d); 
+  invalidate_plans(d); 
 }
 
+static void setup_xfers( beacon_dev_t *d)
+{
+  USING_ALL(d); 
+  init_xfers(d); 
+  DONE_ALL(d); 
+}
 
-static int buffer_send(beacon_dev_t * d, beacon_which_board_t which)
+
+static int send_xfers(beacon_dev_t * d, beacon_which_board_t which, int n, struct spi_ioc_transfer * xfers)
 {
-  int wrote; 
-  if (!d->nused[which]) return 0; 
-  wrote = do_xfer(d->fd[which], d->nused[which], d->buf[which]); 
-  if (wrote < d->nused[which] * BN_SPI_BYTES) 
+  int wrote = do_xfer(d->tp[which], n, xfers); 
+  if (wrote < n * BN_SPI_BYTES) 
   {
     fprintf(stderr,"IOCTL failed! returned: %d\n",wrote); 
     return -1; 
   }
+  d->nmessages[which]++; 
+  d->nxfers[which] += n; 
+  return 0; 
+}
+
+static void save_status_after_clear(beacon_dev_t * d, const uint8_t * status, int ok); 
+static void buffers_cleared(beacon_dev_t * d, beacon_buffer_mask_t buf); 
+
+static int buffer_send(beacon_dev_t * d, beacon_which_board_t which)
+{
+  int ret = 0; 
+  if (!d->nused[which]) return 0; 
+  if (send_xfers(d, which, d->nused[which], d->buf[which])) 
+  {
+    shadow_invalidate(d, which); 
+    ret = -1; 
+  }
+  else
+  {
+    shadow_fill_pending(d, which); 
+  }
+
+  //either way the queue is done with. A failed message can't go out again with the next one, since 
+  //what it points to (often on the caller's stack) is gone by then. 
   d->nused[which] = 0; 
 
+  //a deferred clear went out (see append_deferred_clear) 
+  if (which == MASTER && d->deferred_clear.queued) 
+  {
+    save_status_after_clear(d, d->deferred_clear.status, !ret); 
+    buffers_cleared(d, d->deferred_clear.queued); 
+    d->deferred_clear.queued = 0; 
+  }
+
+  return ret; 
+}
+
+static int transport_max_xfers(beacon_dev_t * d) 
+{
+  int ibd; 
+  int max = beacon_transport_max_xfers(d->tp[0]); 
+  for (ibd = 1; ibd < NBD(d); ibd++)
+  {
+    int bdmax = beacon_transport_max_xfers(d->tp[ibd]); 
+    if (bdmax < max) max = bdmax; 
+  }
+  return max; 
+}
+
+// (re)size the transfer arrays, anything queued must already have been sent. 
+// 0 means as many as the transports allow. Must hold all the board locks. 
+static int alloc_xfers(beacon_dev_t * d, int n) 
+{
+  int ibd; 
+  int max = transport_max_xfers(d); 
+  if (n <= 0) n = max; 
+  if (n > max) 
+  {
+    fprintf(stderr,"Transport can only take %d transfers per message, using that instead of %d\n", max, n); 
+    n = max; 
+  }
+
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    int i; 
+    struct spi_ioc_transfer * buf = realloc(d->buf[ibd], n * sizeof(struct spi_ioc_transfer)); 
+    if (!buf) return -1; 
+    memset(buf, 0, n * sizeof(struct spi_ioc_transfer)); 
+    //same as init_xfers, but the plans don't depend on the batch size so they can stay 
+    for (i = 0; i < n; i++)
+    {
+      buf[i].len = BN_SPI_BYTES; 
+      buf[i].cs_change = d->cs_change; 
+      buf[i].delay_usecs = d->delay_us; 
+    }
+    d->buf[ibd] = buf; 
+  }
+  d->max_xfers = n; 
   return 0; 
 }
 
 
 
-// this will send if full!  
+// this will send if full! Writes that wouldn't change anything are dropped. 
 static int buffer_append(beacon_dev_t * d, beacon_which_board_t which, const uint8_t * txbuf, const uint8_t * rxbuf) 
 {
+  if (txbuf && !rxbuf && shadow_unchanged(d, which, txbuf)) 
+  {
+    d->shadow[which].nskipped++; 
+    return 0; 
+  }
+
   //check if full 
-  if (d->nused[which] >= MAX_XFERS) //greater than just in case, but it already means something went horribly wrong 
+  if (d->nused[which] >= d->max_xfers) //greater than just in case, but it already means something went horribly wrong 
   {
     if (buffer_send(d,which))
     {
@@ -389,51 +762,96 @@ static int buffer_append(beacon_dev_t * d, beacon_which_board_t which, const uin
   d->buf[which][d->nused[which]].tx_buf = SPI_CAST txbuf; 
   d->buf[which][d->nused[which]].rx_buf = SPI_CAST rxbuf; 
   d->nused[which]++; 
+  if (txbuf) shadow_write(d, which, txbuf); 
   return 0; 
 }
 
+// result is filled when the queue is sent, unless the shadow has it already, in which case it's filled right away 
 static int append_read_register(beacon_dev_t *d, beacon_which_board_t which, uint8_t address, uint8_t * result)
 {
   int ret = 0; 
+  struct reg_shadow * s = &d->shadow[which]; 
+
+  if (d->shadow_enabled && (shadow_flags[address] & SHADOW_READ) && s->valid[address]) 
+  {
+    result[0] = address; 
+    result[1] = (s->value[address] >> 16) & 0xff; 
+    result[2] = (s->value[address] >> 8) & 0xff; 
+    result[3] = s->value[address] & 0xff; 
+    s->ncached++; 
+    return 0; 
+  }
+
   ret += buffer_append(d,which, buf_set_read_reg[address],0);
   ret += buffer_append(d,which,0,result); 
+
+  if (!ret && (shadow_flags[address] & SHADOW_READ) && s->npending < MAX_PENDING_READS) 
+  {
+    s->pending_addr[s->npending] = address; 
+    s->pending_result[s->npending++] = result; 
+  }
   return ret; 
 }
 
+// write one word right away (not through the queue), unless it wouldn't change anything 
+static int write_word(beacon_dev_t * d, beacon_which_board_t which, const uint8_t * w) 
+{
+  if (shadow_unchanged(d, which, w)) 
+  {
+    d->shadow[which].nskipped++; 
+    return BN_SPI_BYTES; 
+  }
+
+  int wrote = do_write(d->tp[which], w); 
+  if (wrote == BN_SPI_BYTES) shadow_write(d, which, w); 
+  else shadow_invalidate(d, which); 
+  return wrote; 
+}
+
 
 
 /* internal synchronized command if reg_to_read_after is not zero, will read a
  * register after (for example to see if something worked) and store the result
- * in the appropriate place. 
+ * for each board in results (which then needs NBD(d) entries). 
  **/ 
 
-static int synchronized_command(beacon_dev_t *d, const uint8_t * cmd, uint8_t reg_to_read_after,
-                                  uint8_t * result_master, uint8_t * result_slave) {
+static int synchronized_command_status(beacon_dev_t *d, const uint8_t * cmd, uint8_t reg_to_read_after,
+                                       uint8_t (*results)[BN_SPI_BYTES], uint8_t * master_status) {
   
+  int ibd; 
+
   //just do a normal command
-  if (NBD(d) < 2) 
+  if (!HAS_SLAVES(d)) 
   {
     int ret =0; 
-    USING(d); 
+    USING_BD(d,MASTER); 
     ret += buffer_append(d,MASTER,cmd,0); 
     if (reg_to_read_after)
     {
-      ret+=append_read_register(d,MASTER, reg_to_read_after, result_master); 
+      ret+=append_read_register(d,MASTER, reg_to_read_after, results[MASTER]); 
+    }
+    if (master_status) 
+    {
+      ret+=append_read_register(d,MASTER, REG_STATUS, master_status); 
     }
     ret+= buffer_send(d,MASTER); 
-    DONE(d); 
+    DONE_BD(d,MASTER); 
     return ret; 
   }
 
-  USING(d); 
+  //this has to touch every board, so takes all the board locks (in order) 
+  USING_ALL(d); 
 
   int ret = 0;
   //send sync on to master
   ret+=buffer_append(d,MASTER, buf_sync_on,0); 
   ret+=buffer_send(d, MASTER); 
-  //send command to slave 
-  ret+=buffer_append(d, SLAVE, cmd,0); 
-  ret+=buffer_send(d,SLAVE); 
+  //send command to the slaves (they hold it until sync goes off) 
+  for (ibd = 1; ibd < NBD(d); ibd++)
+  {
+    ret+=buffer_append(d, ibd, cmd,0); 
+    ret+=buffer_send(d,ibd); 
+  }
 
   //send command, and then sync off to master
   ret+=buffer_append(d,MASTER, cmd,0); 
@@ -443,61 +861,108 @@ static int synchronized_command(beacon_dev_t *d, const uint8_t * cmd, uint8_t re
 
   if (reg_to_read_after) 
   {
-    ret+=append_read_register(d, MASTER, reg_to_read_after, result_master); 
-    ret+=append_read_register(d, SLAVE, reg_to_read_after, result_slave); 
-    ret+=buffer_send(d,SLAVE); 
+    for (ibd = 0; ibd < NBD(d); ibd++)
+    {
+      ret+=append_read_register(d, ibd, reg_to_read_after, results[ibd]); 
+      if (ibd == MASTER && master_status) ret+=append_read_register(d, MASTER, REG_STATUS, master_status); 
+      ret+=buffer_send(d,ibd); 
+    }
+  }
+  else if (master_status) 
+  {
+    ret+=append_read_register(d, MASTER, REG_STATUS, master_status); 
     ret+=buffer_send(d,MASTER); 
   }
 
 
-  DONE(d); 
+  DONE_ALL(d); 
   return ret; 
 }
 
-static int mark_buffers_done(beacon_dev_t * d,  beacon_buffer_mask_t buf)
+/* Same as synchronized_command_status, without reading the status after. */ 
+static int synchronized_command(beacon_dev_t *d, const uint8_t * cmd, uint8_t reg_to_read_after,
+                                  uint8_t (*results)[BN_SPI_BYTES]) {
+  return synchronized_command_status(d, cmd, reg_to_read_after, results, 0); 
+}
+
+// remember what a status read along with a clear said (or that it failed). Must hold the master board lock. 
+static void save_status_after_clear(beacon_dev_t * d, const uint8_t * status, int ok) 
+{
+  d->after_clear.valid = ok; 
+  d->after_clear.mask = status[3] & BUF_MASK; 
+  d->after_clear.next = (status[2] >> 4) & 0x3; 
+}
+
+static void notify_buffers_cleared(beacon_dev_t * d, beacon_buffer_mask_t buf); 
+
+/* Bookkeeping for buffers whose clear was just sent, whether or not it worked (a buffer that's still full 
+ * just shows up again on the next poll). Fine to call holding a board lock, see the lock order. */ 
+static void buffers_cleared(beacon_dev_t * d, beacon_buffer_mask_t buf) 
+{
+  //so beacon_wait counts these as new events when they fill up again 
+  uint64_t now = trace_now(); 
+  if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+  d->adapt.last_mask &= ~buf; 
+  for (int ibuf = 0; ibuf < BN_NUM_BUFFER; ibuf++) 
+  {
+    if (!(buf & (1 << ibuf))) continue; 
+    d->ready_ns[ibuf] = 0; 
+    d->cleared_ns[ibuf] = now; 
+  }
+  if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
+
+  notify_buffers_cleared(d, buf); 
+}
+
+/* Clears the buffers, and reads which buffers are ready in the same SPI message, 
+ * so whoever waits next already knows (see take_status_after_clear). */ 
+static int send_buffer_clear(beacon_dev_t * d,  beacon_buffer_mask_t buf)
 {
+  uint8_t status[BN_SPI_BYTES] = {0}; 
 
   if (NBD(d) < 2) //no slave device, so no sync needed
   {
 
-    USING(d); 
+    USING_BD(d,MASTER); 
     int ret = 0; 
     uint8_t data_status[4]; 
     ret += buffer_append(d, MASTER, buf_clear[buf],0); 
     ret+=append_read_register(d,MASTER,  REG_CLEAR_STATUS, data_status); 
+    ret+=append_read_register(d,MASTER,  REG_STATUS, status); 
     ret+=buffer_send(d,MASTER); //flush so we can clear the buffer immediately 
+    save_status_after_clear(d, status, !ret); 
     if (data_status[3] & (buf))
     {
 //      fprintf(stderr,"Did not clear buffer mask %x ? (or rate too high? buf mask after clearing: %x))\n", buf, data_status[3] & 0xf) ; 
  //     easy_break_point(); 
     }
-    DONE(d); 
+    DONE_BD(d,MASTER); 
     return ret; 
   }
 
 
   else
   {
-    uint8_t cleared_master[BN_SPI_BYTES]; 
-    uint8_t cleared_slave[BN_SPI_BYTES]; 
+    uint8_t cleared[BN_MAX_BOARDS][BN_SPI_BYTES]; 
 
-    int ret = synchronized_command(d, buf_clear[buf], REG_CLEAR_STATUS, cleared_master, cleared_slave); 
-//    printf("Clearing %d on both\n", buf2clr); 
+    int ret = synchronized_command_status(d, buf_clear[buf], REG_CLEAR_STATUS, cleared, status); 
+    USING_BD(d,MASTER); 
+    save_status_after_clear(d, status, !ret); 
+    DONE_BD(d,MASTER); 
+//    printf("Clearing %d on all\n", buf2clr); 
     if (!ret)
     {
-      if (cleared_master[3] & ( buf))
-      {
-//        fprintf(stderr,"Did not clear buffer mask %x for master ? (or rate too high? buf mask after clearing: %x))\n", buf, cleared_master[3] & 0xf) ; 
-//       easy_break_point(); 
-      }
-
-      if (cleared_slave[3] & (buf))
+      int ibd; 
+      for (ibd = 0; ibd < NBD(d); ibd++)
       {
-//        fprintf(stderr,"Did not clear buffer %x for master ? (or rate too high? buf mask after clearing: %x))\n", buf, cleared_slave[3] & 0xf) ; 
-//       easy_break_point(); 
+        if (cleared[ibd][3] & ( buf))
+        {
+//          fprintf(stderr,"Did not clear buffer mask %x for board %d ? (or rate too high? buf mask after clearing: %x))\n", buf, ibd, cleared[ibd][3] & 0xf) ; 
+//         easy_break_point(); 
+        }
       }
 
-//      if ((cleared_slave[3] & 0xf) != (cleared_master[3] & 0xf))
+//      if ((cleared[SLAVE][3] & 0xf) != (cleared[MASTER][3] & 0xf))
 //      {
 //        //TODO this might occasionally legimitately happen? maybe? 
 //        fprintf(stderr," master and slave free buffers don't match!: slave: 0x%x, master: 0x%x\n", cleared_slave[3] & 0xf, cleared_master[3] & 0xf); 
@@ -514,6 +979,59 @@ static int mark_buffers_done(beacon_dev_t * d,  beacon_buffer_mask_t buf)
   return 0;
 }
 
+/* Queue up any deferred clears (see beacon_set_deferred_clear) on the master, all in one, with a status read after 
+ * them like send_buffer_clear does. They go out with whatever is sent to the master next. riding is whether 
+ * that's something that would have been sent anyway. Must hold the master board lock. */ 
+static int append_deferred_clear(beacon_dev_t * d, int riding) 
+{
+  int ret = 0; 
+  beacon_buffer_mask_t buf = d->deferred_clear.pending; 
+  if (!buf) return 0; 
+
+  ret += buffer_append(d, MASTER, buf_clear[buf], 0); 
+  ret += append_read_register(d, MASTER, REG_STATUS, d->deferred_clear.status); 
+  d->deferred_clear.pending = 0; 
+  d->deferred_clear.queued |= buf; 
+  if (riding) d->deferred_clear.nriding += __builtin_popcount(buf); 
+  return ret; 
+}
+
+/* Send any deferred clears that haven't gone out yet, now */ 
+static int send_deferred_clear(beacon_dev_t * d) 
+{
+  int ret = 0; 
+  USING_BD(d,MASTER); 
+  if (d->deferred_clear.pending) 
+  {
+    ret += append_deferred_clear(d, 0); 
+    ret += buffer_send(d, MASTER); 
+  }
+  DONE_BD(d,MASTER); 
+  return ret; 
+}
+
+/* Clear the buffers, right away, or (if defer and deferred clears are on) with the next message to the master. 
+ * Deferred clears need the boards to clear in sync, so only work with just the master. */ 
+static int mark_buffers_done(beacon_dev_t * d,  beacon_buffer_mask_t buf, int defer)
+{
+  int ret = 0; 
+  if (defer && d->deferred_clear.enabled && !HAS_SLAVES(d)) 
+  {
+    //the rest happens when the clear goes out (see buffer_send). Until then, a status read with an 
+    //earlier clear mustn't hand these out again. 
+    USING_BD(d,MASTER); 
+    d->deferred_clear.pending |= buf; 
+    d->after_clear.mask &= ~buf; 
+    DONE_BD(d,MASTER); 
+  }
+  else 
+  {
+    ret = send_buffer_clear(d, buf); 
+    buffers_cleared(d, buf); 
+  }
+  return ret; 
+}
+
 
 
 
@@ -544,8 +1062,9 @@ static int loop_over_chunks_half_duplex(beacon_dev_t * d, beacon_which_board_t w
   return 0; 
 }
 
-static int __attribute__((unused)) 
-loop_over_chunks_full_duplex(beacon_dev_t * d, beacon_which_board_t which,  uint8_t naddr, uint8_t start_address, uint8_t * result)  
+// The firmware clocks out the chunk latched by the previous REG_CHUNK write, so we can read chunk i-1 while selecting chunk i.
+// This needs 5 transfers per address (plus one at the very end) instead of 9.  
+static int loop_over_chunks_full_duplex(beacon_dev_t * d, beacon_which_board_t which,  uint16_t naddr, uint16_t start_address, uint8_t * result)  
 {
 
   int iaddr; 
@@ -573,68 +1092,263 @@ loop_over_chunks_full_duplex(beacon_dev_t * d, beacon_which_board_t which,  uint
   return 0; 
 }
 
-
-
-int beacon_read_raw(beacon_dev_t *d,  uint8_t buffer, uint8_t channel, uint8_t start, uint8_t finish, uint8_t * data, beacon_which_board_t which) 
+static int loop_over_chunks(beacon_dev_t * d, beacon_which_board_t which,  uint16_t naddr, uint16_t start_address, uint8_t * result)  
 {
-
-  uint8_t naddress = finish - start + 1; 
-  int ret = 0; 
-
-  USING(d);  //have to lock for the duration otherwise channel /read mode may be changed form underneath us.  
-            // we don't lock before these because there is no way we sent enough transfers to trigger a read 
-            //
-  ret += buffer_append(d,which, buf_mode[MODE_WAVEFORMS], 0);  if (ret) return 0; 
-  d->current_mode[which] = MODE_WAVEFORMS; 
-  ret += buffer_append(d,which, buf_buffer[buffer], 0);  if (ret) return 0; 
-  d->current_buf[which] = buffer; 
-  ret += buffer_append(d,which, buf_channel[channel], 0);  if (ret) return 0; 
-  ret += loop_over_chunks_half_duplex(d,which, naddress, start, data);
-  if(!ret) ret = buffer_send(d,which); //pick up the stragglers. 
-  DONE(d);  
-
-  return ret; 
+  return d->full_duplex ? loop_over_chunks_full_duplex(d, which, naddr, start_address, result)
+                        : loop_over_chunks_half_duplex(d, which, naddr, start_address, result); 
 }
 
 
-
-int beacon_read_register(beacon_dev_t * d, uint8_t address, uint8_t *result, beacon_which_board_t which)
+// must hold the lock for all the plan functions 
+static void invalidate_plans(beacon_dev_t * d) 
 {
+  int ibd, ibuf; 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++)
+  {
+    for (ibuf = 0; ibuf < BN_NUM_BUFFER; ibuf++)
+    {
+      d->plan[ibd][ibuf].valid = 0; 
+    }
+  }
+}
 
-  int ret; 
-  /* if (address >= BN_NUM_REGISTER) return -1;   */
-  USING(d); 
-  ret =  append_read_register(d,which, address,result); 
-  ret += buffer_send(d,which); 
-  DONE(d);
-
-  if ( result[0] != address) 
+static int plan_append(beacon_dev_t * d, struct xfer_plan * p, const uint8_t * txbuf, int32_t rx_offset) 
+{
+  if (p->n >= p->capacity) 
   {
-    fprintf(stderr,"WARNING: read register mismatch. Expected 0x%x, got 0x%x\n", address, result[0]); 
-    ret++; 
+    int capacity = p->capacity ? 2 * p->capacity : 256; 
+    struct spi_ioc_transfer * xfers = realloc(p->xfers, capacity * sizeof(*xfers)); 
+    if (!xfers) return -1; 
+    p->xfers = xfers; 
+    int32_t * rx_offset = realloc(p->rx_offset, capacity * sizeof(*rx_offset)); 
+    if (!rx_offset) return -1; 
+    p->rx_offset = rx_offset; 
+    p->capacity = capacity; 
   }
 
-  return ret; 
+  struct spi_ioc_transfer * xfer = &p->xfers[p->n]; 
+  memset(xfer, 0, sizeof(*xfer)); 
+  xfer->len = BN_SPI_BYTES; 
+  xfer->cs_change = d->cs_change; 
+  xfer->delay_usecs = d->delay_us; 
+  xfer->tx_buf = SPI_CAST txbuf; 
+  p->rx_offset[p->n++] = rx_offset; 
+  return 0; 
 }
 
+#define SAMPLES_PER_ADDR (BN_SPI_BYTES * BN_NUM_CHUNK) 
 
-int beacon_sw_trigger(beacon_dev_t * d ) 
+/* The RAM addresses a readout covers: all of the buffer length, or just enough 
+ * to cover the readout window around the trigger (which is pretrigger samples in). 
+ */ 
+struct readout_range
 {
-  const uint8_t buf[4] = { REG_FORCE_TRIG, 0,0, 1};  
-  int ret = 0; 
-
+  uint16_t first_addr; 
+  uint16_t naddr; 
+}; 
+
+static struct readout_range get_readout_range(const beacon_dev_t * d) 
+{
+  struct readout_range r = { 0, d->buffer_length / SAMPLES_PER_ADDR }; 
+  if (!d->window_pre && !d->window_post) return r; 
+
+  int trigger = d->pretrigger * 8 * 16; 
+  int first = trigger - d->window_pre; 
+  int last = (trigger + d->window_post + SAMPLES_PER_ADDR - 1) / SAMPLES_PER_ADDR; 
+  if (first < 0) first = 0; 
+  first /= SAMPLES_PER_ADDR; 
+  if (last > r.naddr) last = r.naddr; 
+  if (first > last) first = last; 
+
+  r.first_addr = first; 
+  r.naddr = last - first; 
+  return r; 
+}
+
+//this follows the same pattern as loop_over_chunks
+static int build_plan(beacon_dev_t * d, beacon_which_board_t which, uint8_t buffer, struct readout_range range) 
+{
+  struct xfer_plan * p = &d->plan[which][buffer]; 
+  uint16_t naddr = range.naddr; 
+  int ichan, iaddr, ichunk; 
+  int ret = 0; 
+
+  p->valid = 0; 
+  p->n = 0; 
+  p->last_channel = 0; 
+  ret += plan_append(d, p, buf_mode[MODE_WAVEFORMS], -1); 
+  ret += plan_append(d, p, buf_buffer[buffer], -1); 
+
+  for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+  {
+    if ((d->channel_read_mask[which] & (1 << ichan)) == 0) continue; 
+
+    ret += plan_append(d, p, buf_channel[ichan], -1); 
+    p->last_channel = buf_channel[ichan]; 
+    for (iaddr = 0; iaddr < naddr; iaddr++)
+    {
+      ret += plan_append(d, p, buf_ram_addr[1 + range.first_addr + iaddr], -1); 
+      for (ichunk = 0; ichunk < BN_NUM_CHUNK; ichunk++)
+      {
+        int32_t offset = PLAN_RX(ichan, BN_NUM_CHUNK * BN_SPI_BYTES * iaddr + ichunk * BN_SPI_BYTES); 
+        if (d->full_duplex) 
+        {
+          ret += plan_append(d, p, buf_chunk[ichunk], iaddr == 0 && ichunk == 0 ? -1 : offset - BN_SPI_BYTES); 
+          if (iaddr == naddr - 1 && ichunk == BN_NUM_CHUNK - 1) 
+          {
+            ret += plan_append(d, p, 0, offset); 
+          }
+        }
+        else
+        {
+          ret += plan_append(d, p, buf_chunk[ichunk], -1); 
+          ret += plan_append(d, p, 0, offset); 
+        }
+      }
+    }
+  }
+
+  if (ret) 
+  {
+    fprintf(stderr,"Could not allocate transfer plan!\n"); 
+    return -1; 
+  }
+
+  p->channel_mask = d->channel_read_mask[which]; 
+  p->first_addr = range.first_addr; 
+  p->naddr = range.naddr; 
+  p->full_duplex = d->full_duplex; 
+  p->valid = 1; 
+  return 0; 
+}
+
+// read the waveforms (range of them) in a buffer into data (which is the board's part of the event), with channels stride bytes apart 
+static int run_plan(beacon_dev_t * d, beacon_which_board_t which, uint8_t buffer, struct readout_range range, uint8_t * data, uint32_t stride) 
+{
+  struct xfer_plan * p = &d->plan[which][buffer]; 
+  int i; 
+  int first = 0; 
+
+  if (!p->valid || p->channel_mask != d->channel_read_mask[which] || p->first_addr != range.first_addr
+      || p->naddr != range.naddr || p->full_duplex != d->full_duplex) 
+  {
+    if (build_plan(d, which, buffer, range)) return -1; 
+    d->nplans_built[which]++; 
+  }
+
+  for (i = 0; i < p->n; i++) 
+  {
+    int32_t rx = p->rx_offset[i]; 
+    p->xfers[i].rx_buf = rx < 0 ? 0 : SPI_CAST (data + PLAN_RX_CHAN(rx) * stride + PLAN_RX_OFFSET(rx)); 
+  }
+
+  //the plan starts by selecting the mode and buffer, which we can skip if the board is already there 
+  if (shadow_unchanged(d, which, buf_mode[MODE_WAVEFORMS])) 
+  {
+    first = shadow_unchanged(d, which, buf_buffer[buffer]) ? 2 : 1; 
+    d->shadow[which].nskipped += first; 
+  }
+
+  //anything already queued (e.g. the last buffer's clear) has to go first, so it goes out with the start of the plan 
+  if (which == MASTER && append_deferred_clear(d, 1)) return -1; 
+  if (d->nused[which] && d->nused[which] < d->max_xfers) 
+  {
+    int n = d->max_xfers - d->nused[which]; 
+    if (n > p->n - first) n = p->n - first; 
+    memcpy(d->buf[which] + d->nused[which], p->xfers + first, n * sizeof(struct spi_ioc_transfer)); 
+    d->nused[which] += n; 
+    first += n; 
+  }
+  if (buffer_send(d, which)) return -1; 
+
+  for (i = first; i < p->n; i += d->max_xfers) 
+  {
+    if (send_xfers(d, which, p->n - i < d->max_xfers ? p->n - i : d->max_xfers, p->xfers + i)) 
+    {
+      shadow_invalidate(d, which); 
+      return -1; 
+    }
+  }
+
+  shadow_write(d, which, buf_mode[MODE_WAVEFORMS]); 
+  shadow_write(d, which, buf_buffer[buffer]); 
+  if (p->last_channel) shadow_write(d, which, p->last_channel); 
+  return 0; 
+}
+
+static void free_plans(beacon_dev_t * d) 
+{
+  int ibd, ibuf; 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++)
+  {
+    for (ibuf = 0; ibuf < BN_NUM_BUFFER; ibuf++)
+    {
+      free(d->plan[ibd][ibuf].xfers); 
+      free(d->plan[ibd][ibuf].rx_offset); 
+    }
+  }
+}
+
+
+
+int beacon_read_raw(beacon_dev_t *d,  uint8_t buffer, uint8_t channel, uint8_t start, uint8_t finish, uint8_t * data, beacon_which_board_t which) 
+{
+
+  uint8_t naddress = finish - start + 1; 
+  int ret = 0; 
+
+  USING_BD(d,which);  //have to lock for the duration otherwise channel /read mode may be changed form underneath us.  
+            // we don't lock before these because there is no way we sent enough transfers to trigger a read 
+            //
+  ret += buffer_append(d,which, buf_mode[MODE_WAVEFORMS], 0);  
+  if (!ret) ret += buffer_append(d,which, buf_buffer[buffer], 0);  
+  if (!ret) ret += buffer_append(d,which, buf_channel[channel], 0);  
+  if (!ret) ret += loop_over_chunks(d,which, naddress, start, data);
+  if(!ret) ret = buffer_send(d,which); //pick up the stragglers. 
+  DONE_BD(d,which);  
+
+  return ret; 
+}
+
+
+
+int beacon_read_register(beacon_dev_t * d, uint8_t address, uint8_t *result, beacon_which_board_t which)
+{
+
+  int ret; 
+  /* if (address >= BN_NUM_REGISTER) return -1;   */
+  USING_BD(d,which); 
+  ret =  append_read_register(d,which, address,result); 
+  ret += buffer_send(d,which); 
+  DONE_BD(d,which);
+
+  if ( result[0] != address) 
+  {
+    fprintf(stderr,"WARNING: read register mismatch. Expected 0x%x, got 0x%x\n", address, result[0]); 
+    ret++; 
+  }
+
+  return ret; 
+}
+
+
+int beacon_sw_trigger(beacon_dev_t * d ) 
+{
+  const uint8_t buf[4] = { REG_FORCE_TRIG, 0,0, 1};  
+  int ret = 0; 
+
 
   if (NBD(d) < 2) 
   {
-    USING(d); 
+    USING_BD(d,MASTER); 
     int wrote; 
-    wrote = do_write(d->fd[0], buf); //always the master
+    wrote = write_word(d, 0, buf); //always the master
     ret = wrote == BN_SPI_BYTES ? 0 : -1;  
-    DONE(d); 
+    DONE_BD(d,MASTER); 
   }
   else
   {
-    ret = synchronized_command(d, buf, 0,0,0); 
+    ret = synchronized_command(d, buf, 0,0); 
   }
 
 
@@ -647,72 +1361,180 @@ int beacon_calpulse(beacon_dev_t * d, unsigned state)
   uint8_t buf[4] = { REG_CALPULSE, 0,0, state};  
   int ret = 0;
   int i = 0; 
-  USING(d); 
-  for (i = 0; i < BN_MAX_BOARDS; i++) 
+  for (i = 0; i < NBD(d); i++) 
   {
-    if (d->fd[i])
-      ret = do_write(d->fd[i], buf); 
+    USING_BD(d,i); 
+    ret = write_word(d, i, buf); 
+    DONE_BD(d,i); 
   }
-  DONE(d); 
   return ret == BN_SPI_BYTES ? 0 : 1 ;
 }
 
 
-static int board_id_counter =1; 
-
-beacon_dev_t * beacon_open(const char * devicename_master,
-                             const char * devicename_slave,
-                             int gpio_number, int locking)
+static void * board_worker_main(void * arg) 
 {
-  int locked, fd[2]; 
-  beacon_dev_t * dev; 
+  struct board_worker * w = arg; 
 
-  fd[0] = open(devicename_master, O_RDWR); 
-  if (fd[0] < 0) 
+  pthread_mutex_lock(&w->mut); 
+  while (1) 
   {
-    fprintf(stderr,"Could not open %s\n", devicename_master); 
-    return 0; 
+    while (!w->pending && !w->quit) pthread_cond_wait(&w->cond, &w->mut); 
+    if (w->quit) break; 
+
+    pthread_mutex_unlock(&w->mut); 
+    int ret = w->fn(w->d, w->ibd, w->arg); 
+    pthread_mutex_lock(&w->mut); 
+
+    w->ret = ret; 
+    w->pending = 0; 
+    pthread_cond_broadcast(&w->cond); 
   }
+  pthread_mutex_unlock(&w->mut); 
+
+  return 0; 
+}
 
-  locked = flock(fd[0],LOCK_EX | LOCK_NB); 
-  if (locked < 0) 
+// one thread per slave board 
+static int start_workers(beacon_dev_t * d) 
+{
+  int ibd; 
+  for (ibd = 1; ibd < NBD(d); ibd++)
   {
-    fprintf(stderr,"Could not get exclusive access to %s\n", devicename_master); 
-    close(fd[0]); 
-    return 0; 
+    struct board_worker * w = &d->workers[ibd]; 
+    w->d = d; 
+    w->ibd = ibd; 
+    pthread_mutex_init(&w->mut,0); 
+    pthread_cond_init(&w->cond,0); 
+    if (pthread_create(&w->thread, 0, board_worker_main, w))
+    {
+      pthread_cond_destroy(&w->cond); 
+      pthread_mutex_destroy(&w->mut); 
+      return -1; 
+    }
+    d->nworkers++; 
+  }
+  return 0; 
+}
+
+static void stop_workers(beacon_dev_t * d) 
+{
+  int ibd; 
+  for (ibd = 1; ibd <= d->nworkers; ibd++)
+  {
+    struct board_worker * w = &d->workers[ibd]; 
+    pthread_mutex_lock(&w->mut); 
+    w->quit = 1; 
+    pthread_cond_broadcast(&w->cond); 
+    pthread_mutex_unlock(&w->mut); 
+    pthread_join(w->thread, 0); 
+    pthread_cond_destroy(&w->cond); 
+    pthread_mutex_destroy(&w->mut); 
   }
+  d->nworkers = 0; 
+}
 
+// Runs fn on all the boards at once, the master on the calling thread and
+// each slave on its worker, and waits for them all to finish. Returns the sum of what fn returned. 
+// Must hold d->mut (so only one thread uses the workers); fn takes its own board's lock. 
+static int run_on_boards(beacon_dev_t * d, board_job_fn fn, void * arg) 
+{
+  int ibd; 
+  int ret = 0; 
 
+  for (ibd = 1; ibd < NBD(d); ibd++)
+  {
+    struct board_worker * w = &d->workers[ibd]; 
+    pthread_mutex_lock(&w->mut); 
+    w->fn = fn; 
+    w->arg = arg; 
+    w->pending = 1; 
+    pthread_cond_broadcast(&w->cond); 
+    pthread_mutex_unlock(&w->mut); 
+  }
 
+  ret += fn(d, MASTER, arg); 
 
-  if (devicename_slave) 
+  for (ibd = 1; ibd < NBD(d); ibd++)
   {
-    fd[1] = open(devicename_slave, O_RDWR); 
-    if(fd[1] < 0) 
-    {
+    struct board_worker * w = &d->workers[ibd]; 
+    pthread_mutex_lock(&w->mut); 
+    while (w->pending) pthread_cond_wait(&w->cond, &w->mut); 
+    ret += w->ret; 
+    pthread_mutex_unlock(&w->mut); 
+  }
 
-      fprintf(stderr, "Could not open %s\n" ,devicename_slave); 
-      close(fd[0]); 
-      return 0; 
-    }
+  return ret; 
+}
 
-    locked = flock(fd[1], LOCK_EX | LOCK_NB); 
-    if (locked < 0) 
-    {
 
-      fprintf(stderr,"Could not get exclusive access to %s\n", devicename_master); 
-      close(fd[0]); 
-      close(fd[1]); 
+static int board_id_counter =1; 
+
+beacon_dev_t * beacon_open(const char * devicename_master,
+                             const char * devicename_slave,
+                             int gpio_number, int locking)
+{
+  const char * names[2] = { devicename_master, devicename_slave }; 
+  return beacon_open_boards(names, devicename_slave ? 2 : 1, gpio_number, locking); 
+}
+
+beacon_dev_t * beacon_open_boards(const char ** names, int nboards, int gpio_number, int locking) 
+{
+  beacon_transport_t * tp[BN_MAX_BOARDS]; 
+  beacon_dev_t * dev; 
+  int ibd; 
+
+  if (nboards < 1 || nboards > BN_MAX_BOARDS) 
+  {
+    fprintf(stderr,"Can't open %d boards, compiled for at most %d (see BN_MAX_BOARDS)\n", nboards, BN_MAX_BOARDS); 
+    return 0; 
+  }
+
+  for (ibd = 0; ibd < nboards; ibd++)
+  {
+    // slaves get the master's transport, so that emulated boards can be linked 
+    tp[ibd] = beacon_transport_open(names[ibd], ibd ? tp[0] : 0); 
+    if (!tp[ibd]) 
+    {
+      while (ibd--) beacon_transport_close(tp[ibd]); 
       return 0; 
     }
   }
-  else
+
+  dev = beacon_open_transports(tp, nboards, gpio_number, locking); 
+  if (dev) 
   {
-    fd[1] = 0; 
+    for (ibd = 0; ibd < nboards; ibd++) 
+    {
+      dev->device_name[ibd] = names[ibd]; 
+    }
   }
 
+  return dev; 
+}
+
+beacon_dev_t * beacon_open_transport(beacon_transport_t * master, beacon_transport_t * slave, 
+                                     int gpio_number, int locking) 
+{
+  beacon_transport_t * tps[2] = { master, slave }; 
+  return beacon_open_transports(tps, slave ? 2 : 1, gpio_number, locking); 
+}
 
+static int start_workers(beacon_dev_t * d); 
+
+beacon_dev_t * beacon_open_transports(beacon_transport_t ** tps, int nboards, 
+                                      int gpio_number, int locking) 
+{
+  beacon_dev_t * dev; 
   bbb_gpio_pin_t * gpio_pin = 0;
+  int ibd = 0;
+  int itrig; 
+
+  if (nboards < 1 || nboards > BN_MAX_BOARDS) 
+  {
+    fprintf(stderr,"Can't open %d boards, compiled for at most %d (see BN_MAX_BOARDS)\n", nboards, BN_MAX_BOARDS); 
+    for (ibd = nboards-1; ibd >= 0; ibd--) beacon_transport_close(tps[ibd]); 
+    return 0; 
+  }
 
   if (gpio_number) 
   {
@@ -721,56 +1543,77 @@ beacon_dev_t * beacon_open(const char * devicename_master,
   }
 
   //make sure sync is off 
-  if (fd[1]) do_write(fd[0], buf_sync_off); 
+  if (nboards > 1) do_write(tps[0], buf_sync_off); 
 
 
 
   dev = malloc(sizeof(beacon_dev_t)); 
-  dev->poll_interval = 500; 
   memset(dev,0,sizeof(*dev)); 
+  dev->poll_interval = 500; 
   dev->gpio_pin = gpio_pin; 
-  dev->device_name[0] = devicename_master; 
-  dev->device_name[1] = devicename_slave; 
-  memcpy(dev->fd,fd,sizeof(fd));
+  dev->nboards = nboards; 
+  for (ibd = 0; ibd < nboards; ibd++)
+  {
+    dev->device_name[ibd] = tps[ibd]->ops->name; 
+    dev->tp[ibd] = tps[ibd]; 
+    tps[ibd]->trace = &dev->trace; 
+  }
   dev->spi_clock = SPI_CLOCK; 
   dev->cancel_wait = 0; 
   dev->event_counter = 0; 
   dev->next_read_buffer = 0; 
   dev->cs_change =BN_CS_CHANGE; 
   dev->delay_us =BN_DELAY_USECS; 
-  dev->current_buf[0] = -1; 
-  dev->current_buf[1] = -1; 
-  dev->current_mode[0] = -1; 
-  dev->current_mode[1] = -1; 
+  dev->full_duplex = 1; 
+  dev->shadow_enabled = 1; 
+  dev->ready_fd = -1; 
+  dev->notify.fd = -1; 
+  dev->cancel_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
 
   /* dev->min_threshold = 5000;  */
 
-  //Configure the SPI protocol 
-  uint8_t mode = SPI_MODE_0;  //we could change the chip select here too 
-  int ifd = 0;
-
-  for (ifd = 0; ifd < NBD(dev); ifd++)
+  //Configure the SPI clock (the transport takes care of the mode) 
+  for (ibd = 0; ibd < NBD(dev); ibd++)
   {
-      ioctl(dev->fd[ifd], SPI_IOC_WR_MODE, &mode); 
-      ioctl(dev->fd[ifd], SPI_IOC_WR_MAX_SPEED_HZ, &dev->spi_clock); 
+      dev->tp[ibd]->ops->set_speed(dev->tp[ibd], dev->spi_clock); 
   }
 
   // if this is still running in 20 years, someone will have to fix the y2k38 problem 
   dev->readout_number_offset = ((uint64_t)time(0)) << 32; 
   dev->buffer_length = 624; 
-  dev->channel_read_mask[0] = 0xff; 
-  dev->channel_read_mask[1] = fd[1] ? 0xf : 0; 
-  dev->board_id[0] = board_id_counter++; 
-  dev->board_id[1] = fd[1] ? board_id_counter++ : 0; 
+  for (itrig = 0; itrig < NUM_TRIG_TYPES; itrig++) dev->waveform_prescale[itrig] = 1; 
+  for (ibd = 0; ibd < NBD(dev); ibd++)
+  {
+    dev->channel_read_mask[ibd] = ibd ? 0xf : 0xff; 
+    dev->board_id[ibd] = board_id_counter++; 
+  }
 
   dev->enable_locking = locking; 
   memset(dev->nused,0,sizeof(dev->nused)); 
-  setup_xfers(dev); 
 
   if (locking) 
   {
     pthread_mutex_init(&dev->mut,0); 
     pthread_mutex_init(&dev->wait_mut,0); 
+    pthread_mutex_init(&dev->adapt_mut,0); 
+    for (ibd = 0; ibd < NBD(dev); ibd++) 
+    {
+      pthread_mutex_init(&dev->bd_mut[ibd],0); 
+    }
+  }
+
+  if (alloc_xfers(dev, 0))
+  {
+    fprintf(stderr,"Could not allocate SPI transfers\n"); 
+    beacon_close(dev); 
+    return 0; 
+  }
+
+  if (start_workers(dev)) 
+  {
+    fprintf(stderr,"Could not start board threads\n"); 
+    beacon_close(dev); 
+    return 0; 
   }
 
 
@@ -783,12 +1626,12 @@ beacon_dev_t * beacon_open(const char * devicename_master,
    fprintf(stderr,"WARNING! The device chosen as master does not identify as master.\n"); 
  }
 
- if (fd[1])
+ for (ibd = 1; ibd < NBD(dev); ibd++)
  {
-   beacon_read_register(dev,  REG_FIRMWARE_VER, fwver, SLAVE); 
+   beacon_read_register(dev,  REG_FIRMWARE_VER, fwver, ibd); 
    if (fwver[1])
    {
-     fprintf(stderr,"WARNING! The device chosen as slave does not identify as slave.\n"); 
+     fprintf(stderr,"WARNING! The device chosen as slave %d does not identify as slave.\n", ibd); 
    }
  }
 
@@ -811,13 +1654,24 @@ beacon_dev_t * beacon_open(const char * devicename_master,
 
 void beacon_set_board_id(beacon_dev_t * d, uint8_t id, beacon_which_board_t which)
 {
+  if ((int) which >= NBD(d)) return; 
   if (id <= board_id_counter) board_id_counter = id+1; 
   d->board_id[which] = id; 
 }
 
 uint8_t beacon_get_board_id(const beacon_dev_t * d, beacon_which_board_t which) 
 {
-  return d->board_id[which]; 
+  return (int) which < NBD(d) ? d->board_id[which] : 0; 
+}
+
+beacon_transport_t * beacon_get_transport(beacon_dev_t * d, beacon_which_board_t which) 
+{
+  return (int) which < NBD(d) ? d->tp[which] : 0; 
+}
+
+int beacon_get_num_boards(const beacon_dev_t * d) 
+{
+  return NBD(d); 
 }
 
 void beacon_set_readout_number_offset(beacon_dev_t * d, uint64_t offset) 
@@ -828,16 +1682,78 @@ void beacon_set_readout_number_offset(beacon_dev_t * d, uint64_t offset)
 
 void beacon_set_buffer_length(beacon_dev_t * d, uint16_t length)
 {
-  USING(d); //definitely do not want to change this mid readout 
+  USING_ALL(d); //definitely do not want to change this mid readout 
   d->buffer_length = length; 
-  DONE(d); 
+  invalidate_plans(d); 
+  DONE_ALL(d); 
 }
 
-uint16_t beacon_get_bufferlength(const beacon_dev_t * d) 
+uint16_t beacon_get_buffer_length(const beacon_dev_t * d) 
 {
   return d->buffer_length; 
 }
 
+int beacon_set_channel_read_mask(beacon_dev_t * d, uint8_t mask, beacon_which_board_t which) 
+{
+  if ((int) which >= NBD(d)) return -1; 
+  //not mid readout, since the event and header record the mask too (the plans notice the change by themselves) 
+  USING(d); 
+  USING_ALL(d); 
+  d->channel_read_mask[which] = mask; 
+  DONE_ALL(d); 
+  DONE(d); 
+  return 0; 
+}
+
+uint8_t beacon_get_channel_read_mask(const beacon_dev_t * d, beacon_which_board_t which) 
+{
+  return (int) which < NBD(d) ? d->channel_read_mask[which] : 0; 
+}
+
+void beacon_set_readout_window(beacon_dev_t * d, uint16_t pre, uint16_t post) 
+{
+  USING(d); //the event and header have to agree on the window 
+  USING_ALL(d); 
+  d->window_pre = pre; 
+  d->window_post = post; 
+  DONE_ALL(d); 
+  DONE(d); 
+}
+
+void beacon_get_readout_window(const beacon_dev_t * d, uint16_t * pre, uint16_t * post) 
+{
+  if (pre) *pre = d->window_pre; 
+  if (post) *post = d->window_post; 
+}
+
+uint16_t beacon_get_readout_length(const beacon_dev_t * d) 
+{
+  return get_readout_range(d).naddr * SAMPLES_PER_ADDR; 
+}
+
+int beacon_set_waveform_prescale(beacon_dev_t * d, beacon_trig_type_t type, unsigned prescale) 
+{
+  if ((unsigned) type >= NUM_TRIG_TYPES) return -1; 
+  USING(d); 
+  d->waveform_prescale[type] = prescale; 
+  d->nprescaled[type] = 0; 
+  DONE(d); 
+  return 0; 
+}
+
+unsigned beacon_get_waveform_prescale(const beacon_dev_t * d, beacon_trig_type_t type) 
+{
+  return (unsigned) type < NUM_TRIG_TYPES ? d->waveform_prescale[type] : 0; 
+}
+
+void beacon_set_event_selector(beacon_dev_t * d, beacon_event_selector_t selector, void * arg) 
+{
+  USING(d); //not mid readout 
+  d->selector = selector; 
+  d->selector_arg = arg; 
+  DONE(d); 
+}
+
 
 int beacon_fwinfo(beacon_dev_t * d, beacon_fwinfo_t * info, beacon_which_board_t which)
 {
@@ -850,7 +1766,7 @@ int beacon_fwinfo(beacon_dev_t * d, beacon_fwinfo_t * info, beacon_which_board_t
   uint8_t dna_mid[BN_SPI_BYTES]; 
   uint8_t dna_hi[BN_SPI_BYTES]; 
 
-  USING(d); 
+  USING_BD(d,which); 
   ret+=append_read_register(d, which,REG_FIRMWARE_VER, version); 
   ret+=append_read_register(d, which,REG_FIRMWARE_DATE, date); 
   ret+=append_read_register(d, which,REG_CHIPID_LOW, dna_low); 
@@ -858,7 +1774,7 @@ int beacon_fwinfo(beacon_dev_t * d, beacon_fwinfo_t * info, beacon_which_board_t
   ret+=append_read_register(d, which,REG_CHIPID_HI, dna_hi); 
 
   ret+=buffer_send(d, which); 
-  DONE(d); 
+  DONE_BD(d,which); 
   info->ver.major = version[3] >>4 ; 
   info->ver.minor = version[3] & 0x0f; 
   info->ver.master = version[1] & 1; 
@@ -876,12 +1792,16 @@ int beacon_fwinfo(beacon_dev_t * d, beacon_fwinfo_t * info, beacon_which_board_t
 }
 
 
+static void stop_notifier(beacon_dev_t * d); 
+
 int beacon_close(beacon_dev_t * d) 
 {
   int ret = 0; 
+  stop_notifier(d); 
   beacon_cancel_wait(d); 
   int ibd;
   USING(d); 
+  USING_ALL(d); 
 
   //clear the buffers! 
   for (ibd = 0; ibd < NBD(d); ibd++)
@@ -892,6 +1812,11 @@ int beacon_close(beacon_dev_t * d)
   if (d->enable_locking)
   {
     //this should be allowed? 
+    DONE_ALL(d); 
+    for (ibd = 0; ibd < NBD(d); ibd++) 
+    {
+      ret += 32* pthread_mutex_destroy(&d->bd_mut[ibd]); 
+    }
     pthread_mutex_unlock(&d->mut); 
     ret += 64* pthread_mutex_destroy(&d->mut); 
 
@@ -903,6 +1828,7 @@ int beacon_close(beacon_dev_t * d)
 
     pthread_mutex_unlock(&d->wait_mut); 
     ret += 128* pthread_mutex_destroy(&d->wait_mut); 
+    ret += 128* pthread_mutex_destroy(&d->adapt_mut); 
 
     d->enable_locking = 0; 
   }
@@ -912,16 +1838,25 @@ int beacon_close(beacon_dev_t * d)
    ret += 256*bbb_gpio_close(d->gpio_pin,0); 
   }
 
-
-  if (d->fd[1])
+  if (d->ready_pin) 
   {
-    ret += flock(d->fd[1], LOCK_UN); 
-    ret += 4*close(d->fd[1]); 
+   ret += 256*bbb_gpio_close(d->ready_pin,0); 
   }
-  ret += 8*flock(d->fd[0], LOCK_UN); 
-  ret += 16*close(d->fd[0]); 
 
+  if (d->cancel_fd >= 0) close(d->cancel_fd); 
+
+  stop_workers(d); 
+
+  //slaves first 
+  for (ibd = NBD(d)-1; ibd >= 0; ibd--)
+  {
+    beacon_transport_close(d->tp[ibd]); 
+    free(d->buf[ibd]); 
+  }
 
+  free_plans(d); 
+  free(d->trace.ring); 
+  free(d->trace.seq); 
 
   free(d); 
   return ret; 
@@ -929,7 +1864,158 @@ int beacon_close(beacon_dev_t * d)
 
 void beacon_cancel_wait(beacon_dev_t *d) 
 {
+  uint64_t one = 1; 
   d->cancel_wait = 1;  
+  //write is async-signal-safe, so this is still ok from a signal handler 
+  if (d->cancel_fd >= 0 && write(d->cancel_fd, &one, sizeof(one)) < 0) 
+  {
+    //can only fail if it's already been poked a ridiculous number of times 
+  }
+}
+
+static void drain_fd(int fd) 
+{
+  uint64_t count; 
+  if (read(fd, &count, sizeof(count)) < 0) 
+  {
+    // EAGAIN, nothing there 
+  }
+}
+
+// Block until the data ready line fires, beacon_cancel_wait is called or timeout_ms passes. 
+static void wait_for_ready(beacon_dev_t * d, int timeout_ms) 
+{
+  struct pollfd fds[2]; 
+  int nfds = 1; 
+
+  fds[0].fd = d->ready_fd; 
+  fds[0].events = d->ready_pin ? POLLPRI | POLLERR : POLLIN; 
+  if (d->cancel_fd >= 0) 
+  {
+    fds[1].fd = d->cancel_fd; 
+    fds[1].events = POLLIN; 
+    nfds++; 
+  }
+
+  if (poll(fds, nfds, timeout_ms) <= 0) return; 
+
+  //acknowledge, so the next poll only returns for a new edge 
+  if (fds[0].revents) 
+  {
+    if (d->ready_pin) bbb_gpio_get(d->ready_pin); 
+    else drain_fd(d->ready_fd); 
+  }
+}
+
+static void set_ready_source(beacon_dev_t * d, int fd, bbb_gpio_pin_t * pin) 
+{
+  if (d->enable_locking) pthread_mutex_lock(&d->wait_mut); 
+  if (d->ready_pin) bbb_gpio_close(d->ready_pin, 0); 
+  d->ready_pin = pin; 
+  d->ready_fd = fd; 
+  if (d->enable_locking) pthread_mutex_unlock(&d->wait_mut); 
+}
+
+int beacon_set_ready_gpio(beacon_dev_t * d, int gpio_number) 
+{
+  bbb_gpio_pin_t * pin; 
+
+  if (!gpio_number) 
+  {
+    set_ready_source(d, -1, 0); 
+    return 0; 
+  }
+
+  pin = bbb_gpio_open(gpio_number); 
+  if (!pin) return -1; 
+
+  if (bbb_gpio_set_direction(pin, BBB_IN) || bbb_gpio_set_edge(pin, BBB_EDGE_RISING)) 
+  {
+    fprintf(stderr,"Could not use GPIO %d as the data ready line, sticking with polling\n", gpio_number); 
+    bbb_gpio_close(pin, 0); 
+    return -1; 
+  }
+
+  set_ready_source(d, bbb_gpio_get_fd(pin), pin); 
+  return 0; 
+}
+
+int beacon_set_ready_fd(beacon_dev_t * d, int fd) 
+{
+  set_ready_source(d, fd < 0 ? -1 : fd, 0); 
+  return 0; 
+}
+
+// The poll period for adaptive polling: a few polls per expected event, but no further apart 
+// than the latency target and no closer together than the bus budget allows. Must hold adapt_mut. 
+static unsigned adaptive_interval(struct poll_adapt * a, uint64_t now) 
+{
+  double dt = a->mean_dt; 
+  double interval = a->max_latency_us * 1e-6; 
+
+  //if it's been longer than usual since the last event, the rate has probably gone down 
+  if (a->last_arrival && (now - a->last_arrival) * 1e-9 > dt) dt = (now - a->last_arrival) * 1e-9; 
+  if (dt > 0 && dt / ADAPT_POLLS_PER_EVENT < interval) interval = dt / ADAPT_POLLS_PER_EVENT; 
+
+  //a poll every interval uses poll_time / (interval + poll_time) of the bus 
+  if (a->max_bus_fraction > 0 && a->max_bus_fraction < 1) 
+  {
+    double min_interval = a->poll_time * (1 - a->max_bus_fraction) / a->max_bus_fraction; 
+    if (interval < min_interval) interval = min_interval; 
+  }
+
+  if (interval > ADAPT_MAX_INTERVAL * 1e-6) interval = ADAPT_MAX_INTERVAL * 1e-6; 
+  return interval * 1e6; 
+}
+
+// bookkeeping for one status poll that took poll_ns and found mask (poll_ns is 0 if there was no poll) 
+static void adapt_update(beacon_dev_t * d, uint64_t now, uint64_t poll_ns, beacon_buffer_mask_t mask) 
+{
+  struct poll_adapt * a = &d->adapt; 
+  if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+
+  if (poll_ns) // 0 if the status came along with the last clear, which isn't a poll 
+  {
+    a->npolls++; 
+    a->poll_time = a->poll_time ? (1 - ADAPT_ALPHA) * a->poll_time + ADAPT_ALPHA * poll_ns * 1e-9 : poll_ns * 1e-9; 
+  }
+
+  //buffers that weren't ready last time are new events 
+  int nnew = __builtin_popcount(mask & ~a->last_mask); 
+  a->last_mask = mask; 
+  if (nnew) 
+  {
+    if (a->last_arrival) 
+    {
+      double dt = (now - a->last_arrival) * 1e-9 / nnew; 
+      a->mean_dt = a->mean_dt ? (1 - ADAPT_ALPHA) * a->mean_dt + ADAPT_ALPHA * dt : dt; 
+    }
+    a->last_arrival = now; 
+    a->nevents += nnew; 
+  }
+
+  if (a->max_latency_us) a->interval_us = adaptive_interval(a, now); 
+  if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
+}
+
+/* If the status read with the last clear found ready buffers, use it (once) instead of polling. 
+ * Nothing but a clear empties a buffer, so those buffers are still waiting to be read. */ 
+static int take_status_after_clear(beacon_dev_t * d, beacon_which_board_t which, beacon_buffer_mask_t * mask) 
+{
+  int have = 0; 
+  if (which != MASTER) return 0; 
+
+  USING_BD(d,MASTER); 
+  if (d->after_clear.valid && d->after_clear.mask) 
+  {
+    *mask = d->after_clear.mask; 
+    d->hardware_next = d->after_clear.next; 
+    d->after_clear.nused++; 
+    have = 1; 
+  }
+  d->after_clear.valid = 0; 
+  DONE_BD(d,MASTER); 
+  return have; 
 }
 
 int beacon_wait(beacon_dev_t * d, beacon_buffer_mask_t * ready_buffers, float timeout, beacon_which_board_t which) 
@@ -958,6 +2044,7 @@ int beacon_wait(beacon_dev_t * d, beacon_buffer_mask_t * ready_buffers, float ti
   if (d->cancel_wait) 
   {
     d->cancel_wait = 0; 
+    if (d->cancel_fd >= 0) drain_fd(d->cancel_fd); 
     if (d->enable_locking) pthread_mutex_unlock(&d->wait_mut);   //unlock the mutex
     return EAGAIN; 
   }
@@ -965,41 +2052,56 @@ int beacon_wait(beacon_dev_t * d, beacon_buffer_mask_t * ready_buffers, float ti
 
 
   beacon_buffer_mask_t something = 0; 
-  struct timespec start; 
-  if (timeout >0) clock_gettime(CLOCK_MONOTONIC, &start); 
+  uint64_t deadline = timeout > 0 ? trace_now() + (uint64_t) (timeout * 1e9) : 0; // monotonic, in ns 
 
-  float waited = 0; 
-  // keep trying until we either get something, are cancelled, or exceed our timeout (if we have a timeout) 
-  while(!something && (timeout <= 0 || waited < timeout))
+  // keep trying until we either get something, are cancelled, or reach the deadline (if we have one) 
+  while (1) 
   {
+      uint64_t poll_start = trace_now(); 
+      int polled = !take_status_after_clear(d, which, &something); 
+      if (polled) something = beacon_check_buffers(d,&d->hardware_next,which); 
+      uint64_t now = trace_now(); 
+      adapt_update(d, now, polled ? now - poll_start : 0, something); 
 
-      something = beacon_check_buffers(d,&d->hardware_next,which); 
+      if (something || d->cancel_wait) break; 
+      if (deadline && now >= deadline) break; 
 
-      if (d->cancel_wait) break; 
-      if (!something)
-      {
+      // how long until the deadline, in us (rounded up) 
+      uint64_t left_us = deadline ? (deadline - now + 999) / 1000 : UINT64_MAX; 
 
-        if(d->poll_interval)
-        {
-          usleep(d->poll_interval); 
-        }
-        else
-        {
-          sched_yield();
-        }
-
-        if (timeout >0)
-        {
-          struct timespec now; 
-          clock_gettime(CLOCK_REALTIME, &now); 
-          waited = (now.tv_sec - start.tv_nsec) * 1e-9f  * (now.tv_nsec - start.tv_nsec); 
-        }
+      if (d->ready_fd >= 0) 
+      {
+        int timeout_ms = READY_RECHECK_MS; 
+        if (left_us < 1000 * (uint64_t) timeout_ms) timeout_ms = (left_us + 999) / 1000; 
+        wait_for_ready(d, timeout_ms); 
+      }
+      else
+      {
+        //only we change interval_us while waiting 
+        unsigned interval = d->adapt.max_latency_us ? d->adapt.interval_us : d->poll_interval; 
+        if (interval > left_us) interval = left_us; 
+        if (interval) usleep(interval); 
+        else sched_yield(); 
       }
   }
   int interrupted = d->cancel_wait; //were we interrupted? 
 
+  // remember when buffers were first seen, for the readout timing 
+  if (something && which == MASTER) 
+  {
+    uint64_t now = trace_now(); 
+    int ibuf; 
+    if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+    for (ibuf = 0; ibuf < BN_NUM_BUFFER; ibuf++) 
+    {
+      if ((something & (1 << ibuf)) && !d->ready_ns[ibuf]) d->ready_ns[ibuf] = now; 
+    }
+    if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
+  }
+
   if (ready_buffers) *ready_buffers = something;  //save to ready
   d->cancel_wait = 0;  //clear the wait
+  if (d->cancel_fd >= 0) drain_fd(d->cancel_fd); 
   if (d->enable_locking) pthread_mutex_unlock(&d->wait_mut);   //unlock the mutex
   return interrupted ? EINTR : 0; 
 
@@ -1008,6 +2110,154 @@ int beacon_wait(beacon_dev_t * d, beacon_buffer_mask_t * ready_buffers, float ti
 
 
 
+static void * notifier_main(void * arg) 
+{
+  beacon_dev_t * d = arg; 
+  struct notifier * n = &d->notify; 
+  uint64_t one = 1; 
+
+  pthread_mutex_lock(&n->mut); 
+  while (1) 
+  {
+    while (!n->armed && !n->quit) pthread_cond_wait(&n->cond, &n->mut); 
+    if (n->quit) break; 
+    pthread_mutex_unlock(&n->mut); 
+
+    beacon_buffer_mask_t mask = 0; 
+    int ret = beacon_wait(d, &mask, -1, n->which); 
+
+    pthread_mutex_lock(&n->mut); 
+    if (n->quit) break; 
+
+    if (ret == EBUSY) // someone else is in beacon_wait, they shouldn't be
+    {
+      pthread_mutex_unlock(&n->mut); 
+      usleep(1000 * READY_RECHECK_MS); 
+      pthread_mutex_lock(&n->mut); 
+      continue; 
+    }
+
+    if (mask || ret == EINTR || ret == EAGAIN) 
+    {
+      n->mask |= mask; 
+      n->pending |= mask; 
+      n->cancelled = !mask; 
+      n->armed = 0; 
+      if (write(n->fd, &one, sizeof(one)) < 0) 
+      {
+        //only fails if the counter would overflow, in which case it's readable anyway 
+      }
+    }
+  }
+  pthread_mutex_unlock(&n->mut); 
+  return 0; 
+}
+
+int beacon_notify_fd(beacon_dev_t * d, beacon_which_board_t which) 
+{
+  struct notifier * n = &d->notify; 
+  if (n->fd >= 0) return n->fd; 
+
+  n->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); 
+  if (n->fd < 0) 
+  {
+    fprintf(stderr,"Could not create eventfd (errno: %d)\n", errno); 
+    return -1; 
+  }
+
+  pthread_mutex_init(&n->mut, 0); 
+  pthread_cond_init(&n->cond, 0); 
+  n->which = which; 
+  n->pending = 0; 
+  n->mask = 0; 
+  n->cancelled = 0; 
+  n->armed = 1; 
+  n->quit = 0; 
+
+  if (pthread_create(&n->thread, 0, notifier_main, d)) 
+  {
+    fprintf(stderr,"Could not start notifier thread\n"); 
+    pthread_cond_destroy(&n->cond); 
+    pthread_mutex_destroy(&n->mut); 
+    close(n->fd); 
+    n->fd = -1; 
+    return -1; 
+  }
+
+  return n->fd; 
+}
+
+int beacon_notify_ack(beacon_dev_t * d, beacon_buffer_mask_t * ready) 
+{
+  struct notifier * n = &d->notify; 
+  int cancelled; 
+  if (n->fd < 0) return -1; 
+
+  drain_fd(n->fd); 
+  pthread_mutex_lock(&n->mut); 
+  if (ready) *ready = n->mask; 
+  cancelled = n->cancelled; 
+  n->mask = 0; 
+  n->cancelled = 0; 
+
+  //nothing to read, so start looking again right away
+  if (!n->pending && !n->armed) 
+  {
+    n->armed = 1; 
+    pthread_cond_signal(&n->cond); 
+  }
+  pthread_mutex_unlock(&n->mut); 
+
+  return cancelled ? EINTR : 0; 
+}
+
+static void notify_buffers_cleared(beacon_dev_t * d, beacon_buffer_mask_t buf) 
+{
+  struct notifier * n = &d->notify; 
+  if (n->fd < 0) return; 
+
+  pthread_mutex_lock(&n->mut); 
+  n->pending &= ~buf; 
+  if (!n->pending && !n->mask && !n->cancelled && !n->armed) 
+  {
+    n->armed = 1; 
+    pthread_cond_signal(&n->cond); 
+  }
+  pthread_mutex_unlock(&n->mut); 
+}
+
+static void stop_notifier(beacon_dev_t * d) 
+{
+  struct notifier * n = &d->notify; 
+  if (n->fd < 0) return; 
+
+  pthread_mutex_lock(&n->mut); 
+  n->quit = 1; 
+  pthread_cond_signal(&n->cond); 
+  pthread_mutex_unlock(&n->mut); 
+
+  //in case it's in beacon_wait 
+  beacon_cancel_wait(d); 
+  pthread_join(n->thread, 0); 
+
+  pthread_cond_destroy(&n->cond); 
+  pthread_mutex_destroy(&n->mut); 
+  close(n->fd); 
+  n->fd = -1; 
+}
+
+int beacon_notify_close(beacon_dev_t * d) 
+{
+  if (d->notify.fd < 0) return -1; 
+  stop_notifier(d); 
+
+  //don't leave our cancel around for the next beacon_wait 
+  d->cancel_wait = 0; 
+  if (d->cancel_fd >= 0) drain_fd(d->cancel_fd); 
+  return 0; 
+}
+
+
 beacon_buffer_mask_t beacon_check_buffers(beacon_dev_t * d, uint8_t * next, beacon_which_board_t which) 
 {
 
@@ -1015,10 +2265,12 @@ beacon_buffer_mask_t beacon_check_buffers(beacon_dev_t * d, uint8_t * next, beac
   beacon_buffer_mask_t mask; 
   int ret = 0; 
 
-  USING(d); 
+  USING_BD(d,which); 
+  if (which == MASTER) ret += append_deferred_clear(d, 1); //a poll during a readout mustn't see buffers already read 
   ret+=append_read_register(d, which,REG_STATUS, result); 
   ret+= buffer_send(d,which); 
-  DONE(d); 
+  DONE_BD(d,which); 
+  if (ret) return 0; //don't make up buffers if we couldn't talk to the board 
   mask  = result[3] &  BUF_MASK; // only keep lower 4 bits.
   if (next) *next = (result[2] >> 4) & 0x3; 
   return mask; 
@@ -1028,7 +2280,7 @@ beacon_buffer_mask_t beacon_check_buffers(beacon_dev_t * d, uint8_t * next, beac
 int beacon_set_pretrigger(beacon_dev_t * d, uint8_t pretrigger)
 {
   uint8_t pretrigger_buf[] = { REG_PRETRIGGER, 0, 0, pretrigger & 0xf};
-  int ret = synchronized_command(d, pretrigger_buf,0,0,0); 
+  int ret = synchronized_command(d, pretrigger_buf, 0,0); 
   if (!ret) d->pretrigger = pretrigger; 
   return ret; 
 }
@@ -1045,9 +2297,9 @@ int beacon_set_channel_mask(beacon_dev_t * d, uint8_t mask)
 {
     uint8_t channel_mask_buf_master[BN_SPI_BYTES]= { REG_CHANNEL_MASK, 0, 0, mask & 0xff}; 
 
-    USING(d); 
-    int written = do_write(d->fd[MASTER], channel_mask_buf_master); 
-    DONE(d); 
+    USING_BD(d,MASTER); 
+    int written = write_word(d, MASTER, channel_mask_buf_master); 
+    DONE_BD(d,MASTER); 
 
     return written != BN_SPI_BYTES; 
 }
@@ -1061,7 +2313,7 @@ uint16_t beacon_get_channel_mask(beacon_dev_t* d)
   beacon_read_register(d, REG_CHANNEL_MASK, buf_master, MASTER); 
   mask = buf_master[3]; 
 
-  if (d->fd[SLAVE]) 
+  if (NBD(d) > SLAVE) 
   {
     beacon_read_register(d, REG_CHANNEL_MASK, buf_slave, SLAVE); 
     mask = mask |  ( buf_slave[3] << 8); 
@@ -1074,9 +2326,9 @@ uint16_t beacon_get_channel_mask(beacon_dev_t* d)
 int beacon_set_trigger_mask(beacon_dev_t * d, uint32_t mask)
 {
   uint8_t trigger_mask_buf[]= { REG_TRIGGER_MASK, (mask >> 16) & 0xff, (mask >> 8) & 0xff, mask & 0xff}; 
-  USING(d); 
-  int written = do_write(d->fd[MASTER], trigger_mask_buf); 
-  DONE(d); 
+  USING_BD(d,MASTER); 
+  int written = write_word(d, MASTER, trigger_mask_buf); 
+  DONE_BD(d,MASTER); 
   return written !=4; 
 }
 
@@ -1095,7 +2347,7 @@ uint32_t beacon_get_trigger_mask(beacon_dev_t *d)
 int beacon_set_thresholds(beacon_dev_t *d, const uint32_t * trigger_thresholds, uint32_t dont) 
 {
   uint8_t thresholds_buf[BN_NUM_BEAMS][BN_SPI_BYTES]; 
-  USING(d); 
+  USING_BD(d,MASTER); 
   int i; 
   int ret = 0; 
   for (i = 0; i < BN_NUM_BEAMS; i++)
@@ -1116,7 +2368,7 @@ int beacon_set_thresholds(beacon_dev_t *d, const uint32_t * trigger_thresholds,
   }
     
   ret += buffer_send(d,MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
 
   return ret; 
 }
@@ -1137,13 +2389,13 @@ int beacon_get_thresholds(beacon_dev_t *d, uint32_t * thresholds)
   uint8_t thresholds_buf[BN_NUM_BEAMS][BN_SPI_BYTES]; 
   int i; 
   int ret = 0; 
-  USING(d); 
+  USING_BD(d,MASTER); 
   for (i = 0; i < BN_NUM_BEAMS; i++)
   {
     ret+= append_read_register(d, MASTER, REG_THRESHOLDS+i, thresholds_buf[i]); 
   }
   ret += buffer_send(d,MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
 
   if (ret) 
   {
@@ -1201,45 +2453,75 @@ void reverse_buf_bits(uint8_t * buf)
 
 
 
+static int set_board_attenuation(beacon_dev_t * d, beacon_which_board_t which, const uint8_t * attenuation) 
+{
+  int ret = 0; 
+  uint8_t attenuation_012[BN_SPI_BYTES] = { REG_ATTEN_012, attenuation[2], attenuation[1], attenuation[0] }; 
+  uint8_t attenuation_345[BN_SPI_BYTES] = { REG_ATTEN_345, attenuation[5], attenuation[4], attenuation[3] };
+  uint8_t attenuation_067[BN_SPI_BYTES] = { REG_ATTEN_67, 0x0, attenuation[7], attenuation[6] }; 
+  reverse_buf_bits(attenuation_012);
+  reverse_buf_bits(attenuation_345);
+  reverse_buf_bits(attenuation_067);
+
+  USING_BD(d,which); 
+  ret += buffer_append(d,which, attenuation_012,0); 
+  ret += buffer_append(d,which, attenuation_345,0); 
+  ret += buffer_append(d,which, attenuation_067,0); 
+  ret += buffer_send(d,which); 
+  DONE_BD(d,which); 
+
+  return ret; 
+}
+
+static int get_board_attenuation(beacon_dev_t * d, beacon_which_board_t which, uint8_t * attenuation) 
+{
+  int ret = 0; 
+  uint8_t attenuation_012[BN_SPI_BYTES];
+  uint8_t attenuation_345[BN_SPI_BYTES];
+  uint8_t attenuation_067[BN_SPI_BYTES];
+
+  USING_BD(d,which); 
+  ret += append_read_register(d,which,REG_ATTEN_012, attenuation_012); 
+  ret += append_read_register(d,which,REG_ATTEN_345, attenuation_345); 
+  ret += append_read_register(d,which,REG_ATTEN_67 , attenuation_067); 
+  ret += buffer_send(d,which); 
+  DONE_BD(d,which)
+
+  reverse_buf_bits(attenuation_012);
+  reverse_buf_bits(attenuation_345);
+  reverse_buf_bits(attenuation_067);
+
+  if (!ret) 
+  {
+    attenuation[0] =  attenuation_012[3]; 
+    attenuation[1] =  attenuation_012[2]; 
+    attenuation[2] =  attenuation_012[1]; 
+    attenuation[3] =  attenuation_345[3]; 
+    attenuation[4] =  attenuation_345[2]; 
+    attenuation[5] =  attenuation_345[1]; 
+    attenuation[6] =  attenuation_067[3]; 
+    attenuation[7] =  attenuation_067[2]; 
+  }
+
+  return ret; 
+}
+
 int beacon_set_attenuation(beacon_dev_t * d, const uint8_t * attenuation_master, const uint8_t * attenuation_slave)
 {
   int ret = 0; 
+  int ibd; 
   if (attenuation_master)
   {
-    uint8_t attenuation_012[BN_SPI_BYTES] = { REG_ATTEN_012, attenuation_master[2], attenuation_master[1], attenuation_master[0] }; 
-    uint8_t attenuation_345[BN_SPI_BYTES] = { REG_ATTEN_345, attenuation_master[5], attenuation_master[4], attenuation_master[3] };
-    uint8_t attenuation_067[BN_SPI_BYTES] = { REG_ATTEN_67, 0x0, attenuation_master[7], attenuation_master[6] }; 
-    reverse_buf_bits(attenuation_012);
-    reverse_buf_bits(attenuation_345);
-    reverse_buf_bits(attenuation_067);
-
-    USING(d); 
-    ret += buffer_append(d,MASTER, attenuation_012,0); 
-    ret += buffer_append(d,MASTER, attenuation_345,0); 
-    ret += buffer_append(d,MASTER, attenuation_067,0); 
-    ret += buffer_send(d,MASTER); 
-    DONE(d); 
+    ret += set_board_attenuation(d, MASTER, attenuation_master); 
   }
 
-  if (attenuation_slave && d->fd[SLAVE])
+  //all the slaves get the same attenuation 
+  for (ibd = 1; attenuation_slave && ibd < NBD(d); ibd++)
   {
-    uint8_t attenuation_012[BN_SPI_BYTES] = { REG_ATTEN_012, attenuation_slave[2], attenuation_slave[1], attenuation_slave[0] }; 
-    uint8_t attenuation_345[BN_SPI_BYTES] = { REG_ATTEN_345, attenuation_slave[5], attenuation_slave[4], attenuation_slave[3] };
-    uint8_t attenuation_067[BN_SPI_BYTES] = { REG_ATTEN_67, 0x0, attenuation_slave[7], attenuation_slave[6] }; 
-    reverse_buf_bits(attenuation_012);
-    reverse_buf_bits(attenuation_345);
-    reverse_buf_bits(attenuation_067);
-    USING(d); 
-    ret += buffer_append(d,SLAVE, attenuation_012,0); 
-    ret += buffer_append(d,SLAVE, attenuation_345,0); 
-    ret += buffer_append(d,SLAVE, attenuation_067,0); 
-    ret += buffer_send(d,SLAVE); 
-    DONE(d); 
+    ret += set_board_attenuation(d, ibd, attenuation_slave); 
   }
 
-  USING(d); 
-  ret += synchronized_command(d, buf_apply_attenuation, 0,0,0); 
-  DONE(d); 
+  ret += synchronized_command(d, buf_apply_attenuation, 0,0); 
 
   return ret; 
 }
@@ -1247,64 +2529,15 @@ int beacon_set_attenuation(beacon_dev_t * d, const uint8_t * attenuation_master,
 int beacon_get_attenuation(beacon_dev_t * d, uint8_t * attenuation_master, uint8_t * attenuation_slave)
 {
   int ret = 0; 
-  uint8_t attenuation_012[BN_SPI_BYTES];
-  uint8_t attenuation_345[BN_SPI_BYTES];
-  uint8_t attenuation_067[BN_SPI_BYTES];
-
 
   if (attenuation_master) 
   {
-    USING(d); 
-    ret += append_read_register(d,MASTER,REG_ATTEN_012, attenuation_012); 
-    ret += append_read_register(d,MASTER,REG_ATTEN_345, attenuation_345); 
-    ret += append_read_register(d,MASTER,REG_ATTEN_67 , attenuation_067); 
-    ret += buffer_send(d,MASTER); 
-    DONE(d)
-
-
-    reverse_buf_bits(attenuation_012);
-    reverse_buf_bits(attenuation_345);
-    reverse_buf_bits(attenuation_067);
-
-    if (!ret) 
-    {
-      attenuation_master[0] =  attenuation_012[3]; 
-      attenuation_master[1] =  attenuation_012[2]; 
-      attenuation_master[2] =  attenuation_012[1]; 
-      attenuation_master[3] =  attenuation_345[3]; 
-      attenuation_master[4] =  attenuation_345[2]; 
-      attenuation_master[5] =  attenuation_345[1]; 
-      attenuation_master[6] =  attenuation_067[3]; 
-      attenuation_master[7] =  attenuation_067[2]; 
-    }
+    ret += get_board_attenuation(d, MASTER, attenuation_master); 
   }
 
-  if (!ret && attenuation_slave && d->fd[SLAVE])
+  if (!ret && attenuation_slave && NBD(d) > SLAVE)
   {
-    USING(d); 
-    ret += append_read_register(d,MASTER,REG_ATTEN_012, attenuation_012); 
-    ret += append_read_register(d,MASTER,REG_ATTEN_345, attenuation_345); 
-    ret += append_read_register(d,MASTER,REG_ATTEN_67 , attenuation_067); 
-    ret += buffer_send(d,MASTER); 
-    DONE(d)
-
-    reverse_buf_bits(attenuation_012);
-    reverse_buf_bits(attenuation_345);
-    reverse_buf_bits(attenuation_067);
-
-    if (!ret) 
-    {
-      attenuation_slave[0] =  attenuation_012[3]; 
-      attenuation_slave[1] =  attenuation_012[2]; 
-      attenuation_slave[2] =  attenuation_012[1]; 
-      attenuation_slave[3] =  attenuation_345[3]; 
-      attenuation_slave[4] =  attenuation_345[2]; 
-      attenuation_slave[5] =  attenuation_345[1]; 
-      attenuation_slave[6] =  attenuation_067[3]; 
-      attenuation_slave[7] =  attenuation_067[2]; 
-    }
-
-
+    ret += get_board_attenuation(d, SLAVE, attenuation_slave); 
   }
 
   return ret; 
@@ -1316,9 +2549,9 @@ int beacon_set_trigger_enables(beacon_dev_t * d, beacon_trigger_enable_t enables
   uint8_t trigger_enable_buf[BN_SPI_BYTES] = {REG_TRIG_ENABLE, 0, enables.enable_beam8 | (enables.enable_beam4a << 1) | (enables.enable_beam4b << 2), enables.enable_beamforming}; 
 
 //  printf("Setting trigger enables: [0x%x 0x%x 0x%x 0x%x]\n", trigger_enable_buf[0], trigger_enable_buf[1], trigger_enable_buf[2], trigger_enable_buf[3]); 
-  USING(d); 
-  int written = do_write(d->fd[w], trigger_enable_buf); 
-  DONE(d); 
+  USING_BD(d,w); 
+  int written = write_word(d, w, trigger_enable_buf); 
+  DONE_BD(d,w); 
   return written != BN_SPI_BYTES ; 
 }
 
@@ -1343,9 +2576,9 @@ int beacon_set_trigger_polarization(beacon_dev_t * d, beacon_trigger_polarizatio
 
   uint8_t trigger_pol_buf[BN_SPI_BYTES] = {REG_TRIG_POLARIZATION, 0, 0, pol}; 
 //  printf("Setting trigger polarization: [0x%x 0x%x 0x%x 0x%x]\n", trigger_pol_buf[0], trigger_pol_buf[1], trigger_pol_buf[2], trigger_pol_buf[3]);
-  USING(d);
-  int written = do_write(d->fd[MASTER], trigger_pol_buf);
-  DONE(d);
+  USING_BD(d,MASTER);
+  int written = write_word(d, MASTER, trigger_pol_buf);
+  DONE_BD(d,MASTER);
   return written != BN_SPI_BYTES;
 }
 
@@ -1368,10 +2601,13 @@ int beacon_phased_trigger_readout(beacon_dev_t * d, int phased)
 {
 
   uint8_t trigger_buf[BN_SPI_BYTES] = {REG_PHASED_TRIGGER, 0, 0, phased & 1}; 
-  USING(d); 
-  if (d->fd[SLAVE]) do_write(d->fd[SLAVE], trigger_buf); 
-  do_write(d->fd[MASTER], trigger_buf); 
-  DONE(d); 
+  int ibd; 
+  for (ibd = NBD(d)-1; ibd >= 0; ibd--) 
+  {
+    USING_BD(d,ibd); 
+    write_word(d, ibd, trigger_buf); 
+    DONE_BD(d,ibd); 
+  }
   
   return 0; 
 
@@ -1380,9 +2616,9 @@ int beacon_phased_trigger_readout(beacon_dev_t * d, int phased)
 int set_trigger_holdoff(beacon_dev_t * d, uint16_t trigger_holdoff)
 {
   uint8_t trigger_holdoff_buf[BN_SPI_BYTES] = {REG_TRIG_HOLDOFF, 0, (trigger_holdoff >> 8) & 0xf, trigger_holdoff &0xff}; 
-  USING(d); 
-  int written = do_write(d->fd[MASTER], trigger_holdoff_buf); 
-  DONE(d); 
+  USING_BD(d,MASTER); 
+  int written = write_word(d, MASTER, trigger_holdoff_buf); 
+  DONE_BD(d,MASTER); 
   return (written != BN_SPI_BYTES) ;
 }
 
@@ -1438,6 +2674,19 @@ int beacon_read_multiple_array(beacon_dev_t *d, beacon_buffer_mask_t mask, beaco
   return beacon_read_multiple_ptr(d,mask,hd_ptr_array, ev_ptr_array); 
 }
 
+int beacon_read_multiple_array_and_check(beacon_dev_t *d, beacon_buffer_mask_t mask, beacon_header_t * headers, 
+                                         beacon_event_t * events, beacon_buffer_mask_t * ready) 
+{
+  int ret = beacon_read_multiple_array(d, mask, headers, events); 
+  if (ready) 
+  {
+    //hand it out here instead of to the next beacon_wait, which would otherwise read the same buffers again 
+    *ready = 0; 
+    take_status_after_clear(d, MASTER, ready); 
+  }
+  return ret; 
+}
+
 
 
 //lazy error checking macro 
@@ -1446,120 +2695,385 @@ int beacon_read_multiple_array(beacon_dev_t *d, beacon_buffer_mask_t mask, beaco
 
 
 
-int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon_header_t ** hd, beacon_event_t ** ev)
+// raw metadata for one buffer on one board, as clocked out of the registers (big endian) 
+struct raw_metadata
+{
+  uint32_t event_counter[2]; 
+  uint32_t trig_counter[2]; 
+  uint32_t trig_time[2]; 
+  uint32_t deadtime; 
+  uint32_t tinfo; 
+  // these are only read for the master 
+  uint32_t tmask; 
+  uint32_t user_mask; 
+  uint32_t last_beam; 
+  uint32_t beam_power; 
+  uint32_t pps_counter; 
+  uint32_t dyn_mask; 
+  uint32_t veto_deadtime; 
+}; 
+
+static int append_read_metadata(beacon_dev_t * d, beacon_which_board_t ibd, uint8_t ibuf, struct raw_metadata * m) 
+{
+  int ret = 0; 
+  ret += buffer_append(d, ibd,  buf_buffer[ibuf],0); 
+  ret += append_read_register(d,ibd,REG_EVENT_COUNTER_LOW, (uint8_t*) &m->event_counter[0]); 
+  ret += append_read_register(d,ibd,REG_EVENT_COUNTER_HIGH, (uint8_t*) &m->event_counter[1]); 
+  ret += append_read_register(d,ibd,REG_TRIG_COUNTER_LOW, (uint8_t*) &m->trig_counter[0]); 
+  ret += append_read_register(d,ibd,REG_TRIG_COUNTER_HIGH,(uint8_t*)  &m->trig_counter[1]); 
+  ret += append_read_register(d,ibd,REG_TRIG_TIME_LOW,(uint8_t*)  &m->trig_time[0]); 
+  ret += append_read_register(d,ibd,REG_TRIG_TIME_HIGH,(uint8_t*)  &m->trig_time[1]); 
+  ret += append_read_register(d,ibd,REG_DEADTIME, (uint8_t*) &m->deadtime); 
+  ret += append_read_register(d,ibd,REG_TRIG_INFO, (uint8_t*) &m->tinfo); 
+
+  if (ibd == MASTER)  // these don't make sense for a slave
+  {
+    ret += append_read_register(d,ibd,REG_CH_MASKS,(uint8_t*) &m->tmask); 
+    ret += append_read_register(d,ibd,REG_USER_MASK,(uint8_t*) &m->user_mask); 
+    ret += append_read_register(d,ibd,REG_LAST_BEAM, (uint8_t*) &m->last_beam); 
+    ret += append_read_register(d,ibd, REG_TRIG_BEAM_POWER, (uint8_t*)  &m->beam_power); 
+    ret += append_read_register(d,ibd, REG_PPS_COUNTER, (uint8_t*)  &m->pps_counter); 
+    ret += append_read_register(d,ibd, REG_HD_DYN_MASK, (uint8_t*)  &m->dyn_mask); 
+    ret += append_read_register(d,ibd, REG_VETO_DEADTIME_CTR, (uint8_t*)  &m->veto_deadtime); 
+  }
+  return ret; 
+}
+
+// board jobs for beacon_read_multiple_ptr (see run_on_boards) 
+struct metadata_job
+{
+  int nbuf; 
+  const uint8_t * bufs; 
+  struct raw_metadata (*meta)[BN_MAX_BOARDS]; 
+}; 
+
+static int read_metadata_job(beacon_dev_t * d, int ibd, void * arg) 
+{
+  struct metadata_job * job = arg; 
+  int iout; 
+  int ret = 0; 
+  USING_BD(d,ibd); 
+  for (iout = 0; !ret && iout < job->nbuf; iout++)
+  {
+    ret += append_read_metadata(d, ibd, job->bufs[iout], &job->meta[iout][ibd]); 
+  }
+  if (!ret) ret = buffer_send(d, ibd); 
+  DONE_BD(d,ibd); 
+  return ret ? 1 : 0; 
+}
+
+// where the readout puts an event body: either a beacon_event_t or a beacon_compact_event_t 
+struct event_dest 
+{
+  uint64_t * event_number; 
+  uint16_t * buffer_length; 
+  uint8_t * board_id; 
+  uint8_t * channel_read_mask; 
+  uint8_t * data; // the first channel of the first board 
+  uint32_t stride; // between channels (and BN_NUM_CHAN of them between boards) 
+}; 
+
+static void dest_event(struct event_dest * dest, beacon_event_t * ev) 
+{
+  dest->event_number = &ev->event_number; 
+  dest->buffer_length = &ev->buffer_length; 
+  dest->board_id = &ev->board_id[0]; 
+  dest->channel_read_mask = &ev->channel_read_mask[0]; 
+  dest->data = &ev->data[0][0][0]; 
+  dest->stride = BN_MAX_WAVEFORM_LENGTH; 
+}
+
+static void dest_compact(struct event_dest * dest, beacon_compact_event_t * ev, uint16_t buffer_length) 
+{
+  dest->event_number = &ev->event_number; 
+  dest->buffer_length = &ev->buffer_length; 
+  dest->board_id = &ev->board_id[0]; 
+  dest->channel_read_mask = &ev->channel_read_mask[0]; 
+  dest->data = ev->data; 
+  dest->stride = buffer_length; 
+}
+
+static uint8_t * dest_waveform(const struct event_dest * dest, int ibd, int ichan) 
+{
+  return dest->data + (ibd * BN_NUM_CHAN + ichan) * dest->stride; 
+}
+
+struct waveform_job
+{
+  uint8_t buffer; 
+  struct readout_range range; 
+  struct event_dest * dest; 
+  uint64_t done_ns[BN_MAX_BOARDS]; // when each board was done 
+}; 
+
+static int read_waveforms_job(beacon_dev_t * d, int ibd, void * arg) 
+{
+  struct waveform_job * job = arg; 
+  int ichan; 
+
+  USING_BD(d,ibd); 
+  int ret = run_plan(d, ibd, job->buffer, job->range, dest_waveform(job->dest, ibd, 0), job->dest->stride); 
+  DONE_BD(d,ibd); 
+  if (ret) return 1; 
+
+  for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+  {
+    if ( (d->channel_read_mask[ibd] & ( 1 << ichan)) == 0 )
+    {
+      memset(dest_waveform(job->dest, ibd, ichan), 0 , job->range.naddr * SAMPLES_PER_ADDR); 
+    }
+  }
+  job->done_ns[ibd] = trace_now(); 
+  return 0; 
+}
+
+
+/* Read the beams and / or power sums (either may be 0) for a buffer from the master, which does the beamforming. 
+ * They're read the same way as waveforms (in their own readout modes), over the same range of the buffer. 
+ * Each 32-bit chunk of a power sum beam is one (big-endian) sum. 
+ */ 
+static int read_beam_products(beacon_dev_t * d, uint8_t buffer, struct readout_range range, 
+                              beacon_beams_t * beams, beacon_powersum_t * ps) 
+{
+  int ibeam, i; 
+  int ret = 0; 
+
+  USING_BD(d,MASTER); 
+  if (beams) 
+  {
+    ret += buffer_append(d, MASTER, buf_mode[MODE_BEAMS], 0); 
+    if (!ret) ret += buffer_append(d, MASTER, buf_buffer[buffer], 0); 
+    for (ibeam = 0; !ret && ibeam < BN_NUM_BEAMS; ibeam++) 
+    {
+      ret += buffer_append(d, MASTER, buf_beam[ibeam], 0); 
+      if (!ret) ret += loop_over_chunks(d, MASTER, range.naddr, 1 + range.first_addr, beams->data[ibeam]); 
+    }
+  }
+
+  if (ps) 
+  {
+    if (!ret) ret += buffer_append(d, MASTER, buf_mode[MODE_POWERSUM], 0); 
+    if (!ret) ret += buffer_append(d, MASTER, buf_buffer[buffer], 0); 
+    for (ibeam = 0; !ret && ibeam < BN_NUM_BEAMS; ibeam++) 
+    {
+      ret += buffer_append(d, MASTER, buf_beam[ibeam], 0); 
+      if (!ret) ret += loop_over_chunks(d, MASTER, range.naddr, 1 + range.first_addr, (uint8_t*) ps->data[ibeam]); 
+    }
+  }
+
+  if (!ret) ret = buffer_send(d, MASTER); 
+  DONE_BD(d,MASTER); 
+  if (ret) return ret; 
+
+  if (beams) 
+  {
+    beams->buffer_length = range.naddr * SAMPLES_PER_ADDR; 
+    for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++) 
+    {
+      memset(beams->data[ibeam] + beams->buffer_length, 0, BN_MAX_WAVEFORM_LENGTH - beams->buffer_length); 
+    }
+  }
+
+  if (ps) 
+  {
+    ps->nsums = range.naddr * SAMPLES_PER_ADDR / BN_POWERSUM_SAMPLES; 
+    for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++) 
+    {
+      for (i = 0; i < ps->nsums; i++) ps->data[ibeam][i] = be32toh(ps->data[ibeam][i]); 
+      memset(ps->data[ibeam] + ps->nsums, 0, (BN_MAX_POWERSUMS - ps->nsums) * sizeof(ps->data[ibeam][0])); 
+    }
+  }
+
+  return 0; 
+}
+
+
+static int timing_bin(uint64_t ns) 
+{
+  if (ns < 1000) return 0; 
+  int bin = 1 + (int) (8 * log2(ns / 1e3)); 
+  return bin < TIMING_NBINS ? bin : TIMING_NBINS - 1; 
+}
+
+// the top of a bin, in us 
+static float timing_bin_top(int bin) 
+{
+  return pow(2, bin / 8.); 
+}
+
+// add the time from a to b to a step's histogram (if both happened). must hold mut. 
+static void timing_add(beacon_dev_t * d, beacon_readout_step_t step, uint64_t a, uint64_t b) 
 {
-  int ibuf,ichan;
-  int iout = 0; 
+  struct timing_hist * h = &d->timing_hist[step]; 
+  if (!a || !b || b < a) return; 
+  h->n++; 
+  h->counts[timing_bin(b - a)]++; 
+  if (b - a > h->max_ns) h->max_ns = b - a; 
+}
+
+// keep an event's timing and add its steps to the histograms. must hold mut. 
+static void timing_record(beacon_dev_t * d, const beacon_readout_timing_t * t, int first) 
+{
+  int ibd; 
+  uint64_t waveforms = 0; 
+  for (ibd = 0; ibd < BN_MAX_BOARDS; ibd++) 
+  {
+    if (t->waveforms_ns[ibd] > waveforms) waveforms = t->waveforms_ns[ibd]; 
+  }
+
+  timing_add(d, BN_STEP_LATENCY, t->ready_ns, t->start_ns); 
+  if (first) timing_add(d, BN_STEP_METADATA, t->start_ns, t->metadata_ns); // the others shared it 
+  timing_add(d, BN_STEP_WAVEFORMS, t->waveforms_start_ns, waveforms); 
+  timing_add(d, BN_STEP_PRODUCTS, waveforms, t->products_ns); 
+  timing_add(d, BN_STEP_CLEAR, t->products_ns ? t->products_ns : waveforms, t->clear_ns); 
+  timing_add(d, BN_STEP_TOTAL, t->ready_ns ? t->ready_ns : t->start_ns, t->clear_ns); 
+
+  d->timing[d->ntimed++ % BN_READOUT_TIMING_HISTORY] = *t; 
+}
+
+// what to do with an event's waveforms, now that its header is decoded: ask the selector (if any), and then the 
+// prescaler, unless it's an internal read. Narrows range to a region of interest if the selector asks for one. 
+// Returns a beacon_skip_reason_t. must hold mut. 
+static int select_event(beacon_dev_t * d, const beacon_header_t * hd, struct readout_range * range, int internal) 
+{
+  //our own reads need the waveforms, and mustn't throw off which of the user's events get them 
+  if (internal) return BN_SKIP_NONE; 
+
+  if (d->selector) 
+  {
+    uint16_t start = hd->readout_window_start; 
+    uint16_t length = hd->buffer_length; 
+    int first, last; 
+
+    switch (d->selector(hd, &start, &length, d->selector_arg)) 
+    {
+      case BN_SELECT_SKIP: 
+        return BN_SKIP_SELECTED; 
+      case BN_SELECT_DROP: 
+        return BN_SKIP_DROPPED; 
+      case BN_SELECT_ROI: 
+        first = start / SAMPLES_PER_ADDR; 
+        last = (start + length + SAMPLES_PER_ADDR - 1) / SAMPLES_PER_ADDR; 
+        if (first < range->first_addr) first = range->first_addr; 
+        if (last > range->first_addr + range->naddr) last = range->first_addr + range->naddr; 
+        if (last <= first) return BN_SKIP_SELECTED; 
+        range->first_addr = first; 
+        range->naddr = last - first; 
+        break; 
+      default: 
+        break; 
+    }
+  }
+
+  unsigned prescale = d->waveform_prescale[hd->trig_type & 0x3]; 
+  if (!prescale || d->nprescaled[hd->trig_type & 0x3]++ % prescale) return BN_SKIP_PRESCALED; 
+  return BN_SKIP_NONE; 
+}
+
+// the guts of beacon_read_multiple_ptr / beacon_read_multiple_compact. Exactly one of ev and cev is not 0. 
+// beams and ps are optional. internal is set for our own reads (calibration, clock qualification, see read_single_internal). 
+static int read_multiple(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon_header_t ** hd, 
+                         beacon_event_t ** ev, beacon_compact_event_t ** cev, 
+                         beacon_beams_t ** beams, beacon_powersum_t ** ps, int internal)
+{
+  int iout; 
   int ret = 0; 
   struct timespec now; 
+  struct event_dest dest[BN_NUM_BUFFER]; 
 
   // we need to store some stuff in an intermediate format 
   // prior to putting into the header since the bits don't match 
-  uint64_t event_counter[2]; 
-  uint64_t trig_counter[2]; 
-  uint64_t trig_time[2]; 
-  uint32_t deadtime; 
-  uint32_t tmask; 
-  uint32_t last_beam; 
-  uint32_t tinfo; 
+  struct raw_metadata meta[BN_NUM_BUFFER][BN_MAX_BOARDS]; 
+  uint8_t bufs[BN_NUM_BUFFER]; 
+  uint64_t sw_event_counter[BN_NUM_BUFFER]; 
+  struct readout_range ranges[BN_NUM_BUFFER]; // what's read of each buffer (see select_event) 
+  int nbuf = __builtin_popcount(mask); 
+  beacon_buffer_mask_t todo = mask; 
+  int all_read = 0; // got to the end without a problem 
 
-  int iibuf; 
   int ibd; 
 
+  // the jobs take the board locks, this keeps other readers out
+  USING(d); 
+
+  beacon_readout_timing_t timing[BN_NUM_BUFFER]; 
+  memset(timing, 0, sizeof(timing)); 
+  uint64_t start_ns = trace_now(); 
+
+  struct readout_range range = get_readout_range(d); 
+  uint16_t length = range.naddr * SAMPLES_PER_ADDR; 
 
-  for (iibuf = 0; iibuf < __builtin_popcount(mask); iibuf++)
+  for (iout = 0; iout < nbuf; iout++)
   {
+    if (ev) dest_event(&dest[iout], ev[iout]); 
+    else if (cev[iout]->max_length < length) 
+    {
+      fprintf(stderr,"Compact event only has room for %d samples, not %d\n", cev[iout]->max_length, length); 
+      DONE(d); 
+      return 1; 
+    }
+    else dest_compact(&dest[iout], cev[iout], length); 
+  }
 
-    ibuf = d->next_read_buffer; 
-    hd[iout]->sync_problem = 0; 
-    for (ibd = 0; ibd < NBD(d); ibd++)
+  //figure out what order to read the buffers in 
+  for (iout = 0; iout < nbuf; iout++)
+  {
+    //we are not reading this event right now
+    if ( (todo & (1 << d->next_read_buffer)) == 0)
     {
+      fprintf(stderr,"Sync issue? d->next_read_buffer=%d, mask=0x%x, hardware next: %d\n", d->next_read_buffer, mask, d->hardware_next); 
+      easy_break_point(); 
+      d->next_read_buffer =  __builtin_ctz(todo); //pick the lowest buffer to read next 
+    }
 
-      //we are not reading this event right now
-      if ( (mask & (1 << ibuf)) == 0)
-      {
-        fprintf(stderr,"Sync issue? d->next_read_buffer=%d, mask=0x%x, hardware next: %d\n", d->next_read_buffer, mask, d->hardware_next); 
-        easy_break_point(); 
-        d->next_read_buffer =  __builtin_ctz(mask); //pick the lowest buffer to read next 
-        ibuf = d->next_read_buffer; 
-        break; 
-      }
+    bufs[iout] = d->next_read_buffer; 
+    todo &= ~(1 << bufs[iout]); 
+    d->next_read_buffer = (d->next_read_buffer + 1) %BN_NUM_BUFFER; 
+    sw_event_counter[iout] = ++d->event_counter; 
+  }
 
-      clock_gettime(CLOCK_REALTIME, &now); 
+  if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+  for (iout = 0; iout < nbuf; iout++) timing[iout].ready_ns = d->ready_ns[bufs[iout]]; 
+  if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
 
-      //grab the metadata 
-      //set the buffer 
-      USING(d); 
-      if (ibd == 0) 
-      {
-        d->event_counter++; 
-        d->next_read_buffer = (d->next_read_buffer + 1) %BN_NUM_BUFFER; 
-      }
-      CHK(buffer_append(d, ibd,  buf_buffer[ibuf],0)) 
-      d->current_buf[ibd] = ibuf; 
-
-      /**Grab metadata! */ 
-      //switch to register mode  
-
-      //we will pretend like we are bigendian so we can just call be64toh on the u64
-      CHK(append_read_register(d,ibd,REG_EVENT_COUNTER_LOW, (uint8_t*) &event_counter[0])) 
-      CHK(append_read_register(d,ibd,REG_EVENT_COUNTER_HIGH, (uint8_t*) &event_counter[1])) 
-      CHK(append_read_register(d,ibd,REG_TRIG_COUNTER_LOW, (uint8_t*) &trig_counter[0])) 
-      CHK(append_read_register(d,ibd,REG_TRIG_COUNTER_HIGH,(uint8_t*)  &trig_counter[1])) 
-      CHK(append_read_register(d,ibd,REG_TRIG_TIME_LOW,(uint8_t*)  &trig_time[0])) 
-      CHK(append_read_register(d,ibd,REG_TRIG_TIME_HIGH,(uint8_t*)  &trig_time[1])) 
-      CHK(append_read_register(d,ibd,REG_DEADTIME, (uint8_t*) &deadtime)) 
-      CHK(append_read_register(d,ibd,REG_TRIG_INFO, (uint8_t*) &tinfo)) 
-
-      if (ibd == MASTER)  // these don't make sense for a slave
-      {
-        CHK(append_read_register(d,ibd,REG_CH_MASKS,(uint8_t*) &tmask)) 
-        CHK(append_read_register(d,ibd,REG_USER_MASK,(uint8_t*) &hd[iout]->beam_mask)) 
-        CHK(append_read_register(d,ibd,REG_LAST_BEAM, (uint8_t*) &last_beam)) 
-        CHK(append_read_register(d,ibd, REG_TRIG_BEAM_POWER, (uint8_t*)  &hd[iout]->beam_power)); 
-        CHK(append_read_register(d,ibd, REG_PPS_COUNTER, (uint8_t*)  &hd[iout]->pps_counter)); 
-        CHK(append_read_register(d,ibd, REG_HD_DYN_MASK, (uint8_t*)  &hd[iout]->dynamic_beam_mask)); 
-        CHK(append_read_register(d,ibd, REG_VETO_DEADTIME_CTR, (uint8_t*)  &hd[iout]->veto_deadtime_counter)); 
-      }
+  /**Grab metadata for all the buffers at once, on all the boards at once! */ 
+  struct metadata_job mjob = { nbuf, bufs, meta }; 
+  CHK(run_on_boards(d, read_metadata_job, &mjob)); 
+  uint64_t metadata_ns = trace_now(); 
 
-     //flush the metadata .  we could get slightly faster throughput by storing metadata 
-      //read locations for each buffer and not flushing.
-      // If it ends up mattering, I'll change it. 
-      
-      CHK(buffer_send(d,ibd)); 
-      DONE(d);//yield  
+  clock_gettime(CLOCK_REALTIME, &now); 
+
+  // decode all the headers and check that the boards agree, so we know what to do with the waveforms 
+  for (iout = 0; iout < nbuf; iout++)
+  {
+    uint8_t ibuf = bufs[iout]; 
+    hd[iout]->sync_problem = 0; 
+
+    for (ibd = 0; ibd < NBD(d); ibd++)
+    {
+      struct raw_metadata * m = &meta[iout][ibd]; 
 
 #ifdef DEBUG_PRINTOUTS
-      printf("Raw tinfo: %x\n", tinfo) ;
+      printf("Raw tinfo: %x\n", m->tinfo) ;
 #endif 
       
       // check the event counter
-      event_counter[0] = be32toh(event_counter[0]) & 0xffffff; 
-      event_counter[1] = be32toh(event_counter[1]) & 0xffffff; 
-      trig_counter[0] = be32toh(trig_counter[0]) & 0xffffff; 
-      trig_counter[1] = be32toh(trig_counter[1]) & 0xffffff; 
-      trig_time[0] = be32toh(trig_time[0]) & 0xffffff; 
-      trig_time[1] = be32toh(trig_time[1]) & 0xffffff; 
-
-#ifdef DEBUG_PRINTOUTS
-//      printf("Raw event_counter: %x %x\n", event_counter[0], event_counter[1]) ;
-//      printf("Raw trig_counter: %x %x\n", trig_counter[0], trig_counter[1]) ;
-//      printf("Raw trig_time: %x %x \n", trig_time[0], trig_time[1]) ;
-#endif 
-
+      uint64_t event_counter[2] = { be32toh(m->event_counter[0]) & 0xffffff, be32toh(m->event_counter[1]) & 0xffffff }; 
+      uint64_t trig_counter[2] = { be32toh(m->trig_counter[0]) & 0xffffff, be32toh(m->trig_counter[1]) & 0xffffff }; 
+      uint64_t trig_time[2] = { be32toh(m->trig_time[0]) & 0xffffff, be32toh(m->trig_time[1]) & 0xffffff }; 
 
       uint64_t big_event_counter = event_counter[0] + (event_counter[1] << 24); 
 
-      if (d->event_counter !=  big_event_counter)
+      if (sw_event_counter[iout] !=  big_event_counter)
       {
-        fprintf(stderr,"Event counter mismatch!!! (bd: %s sw: %"PRIu64", hw: %"PRIu64")\n", ibd ? "SLAVE" : "MASTER" , d->event_counter, big_event_counter); 
+        fprintf(stderr,"Event counter mismatch!!! (bd: %d sw: %"PRIu64", hw: %"PRIu64")\n", ibd, sw_event_counter[iout], big_event_counter); 
         easy_break_point(); 
       }
 
       //now fill in header data 
-      tinfo = be32toh(tinfo); 
-      tmask = be32toh(tmask); 
-      last_beam = be32toh(last_beam); 
+      uint32_t tinfo = be32toh(m->tinfo); 
+      uint32_t tmask = be32toh(m->tmask); 
+      uint32_t last_beam = be32toh(m->last_beam); 
 
       uint8_t hwbuf =  (tinfo >> 22) & 0x3; 
       if ( hwbuf  != ibuf)
@@ -1574,7 +3088,7 @@ int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon
       hd[iout]->readout_time_ns[ibd] = now.tv_nsec; 
       hd[iout]->trig_time[ibd] =trig_time[0] + (trig_time[1] << 24); 
       hd[iout]->channel_read_mask[ibd] = d->channel_read_mask[ibd]; 
-      hd[iout]->deadtime[ibd] = be32toh(deadtime) & 0xffffff; 
+      hd[iout]->deadtime[ibd] = be32toh(m->deadtime) & 0xffffff; 
       hd[iout]->board_id[ibd] = d->board_id[ibd]; 
  
       //values that we only save for the master
@@ -1583,7 +3097,8 @@ int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon
         double elapsed; 
         hd[iout]->event_number = d->readout_number_offset + big_event_counter; 
         hd[iout]->trig_number = trig_counter[0] + (trig_counter[1] << 24); 
-        hd[iout]->buffer_length = d->buffer_length; 
+        hd[iout]->buffer_length = length; 
+        hd[iout]->readout_window_start = range.first_addr * SAMPLES_PER_ADDR; 
         hd[iout]->pretrigger_samples = d->pretrigger* 8 * 16; //TODO define these constants somewhere
         elapsed = hd[iout]->trig_time[ibd] * 1./ (BOARD_CLOCK_HZ); 
         hd[iout]->approx_trigger_time= (int) (d->start_time.tv_sec + elapsed); 
@@ -1595,11 +3110,11 @@ int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon
         }
 
         hd[iout]->triggered_beams = last_beam & 0xffffff; 
-        hd[iout]->beam_mask = be32toh(hd[iout]->beam_mask) & 0xffffff; 
-        hd[iout]->beam_power = be32toh(hd[iout]->beam_power) & 0xffffff; 
-        hd[iout]->pps_counter = be32toh(hd[iout]->pps_counter) & 0xffffff; 
-        hd[iout]->dynamic_beam_mask = be32toh(hd[iout]->dynamic_beam_mask) & 0xffffff; 
-        hd[iout]->veto_deadtime_counter = be32toh(hd[iout]->veto_deadtime_counter) & 0xffffff; 
+        hd[iout]->beam_mask = be32toh(m->user_mask) & 0xffffff; 
+        hd[iout]->beam_power = be32toh(m->beam_power) & 0xffffff; 
+        hd[iout]->pps_counter = be32toh(m->pps_counter) & 0xffffff; 
+        hd[iout]->dynamic_beam_mask = be32toh(m->dyn_mask) & 0xffffff; 
+        hd[iout]->veto_deadtime_counter = be32toh(m->veto_deadtime) & 0xffffff; 
         hd[iout]->buffer_number = hwbuf; 
         hd[iout]->gate_flag = (tmask >> 23) & 1; 
         hd[iout]->buffer_mask = mask; //this is the current buffer mask
@@ -1610,10 +3125,6 @@ int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon
 	// (we could query REG_TRIG_POLARIZATION directly but this avoids another read)
         hd[iout]->trig_pol = (tinfo & 0xf);
 
-        //event stuff
-        ev[iout]->buffer_length = d->buffer_length; 
-        ev[iout]->event_number = hd[iout]->event_number; 
- 
       }
       else if (BN_MAX_BOARDS > 1)  //do some checks
       {
@@ -1625,7 +3136,7 @@ int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon
           hd[iout]->sync_problem |= 2; 
         }
 
-        if (abs(hd[iout]->trig_time[ibd] -  hd[iout]->trig_time[0]) > 2)
+        if (llabs((int64_t) (hd[iout]->trig_time[ibd] -  hd[iout]->trig_time[0])) > 2)
         {
           static unsigned nprinted = 0; 
 
@@ -1646,78 +3157,195 @@ int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon
         }
       }
 
+      dest[iout].board_id[ibd] = d->board_id[ibd]; 
+      dest[iout].channel_read_mask[ibd] = d->channel_read_mask[ibd]; 
+    }
 
-      ev[iout]->board_id[ibd] = d->board_id[ibd]; 
+    //zero out things that don't make sense for boards we don't have
+    for (ibd = NBD(d); ibd < BN_MAX_BOARDS; ibd++) 
+    {
+      hd[iout]->readout_time[ibd] = 0; 
+      hd[iout]->readout_time_ns[ibd] = 0; 
+      hd[iout]->trig_time[ibd] = 0; 
+      hd[iout]->deadtime[ibd] = 0; 
+      hd[iout]->channel_read_mask[ibd] = 0; 
+      hd[iout]->board_id[ibd] = 0; 
+      dest[iout].board_id[ibd] = 0; 
+      dest[iout].channel_read_mask[ibd] = 0; 
+    }
 
-      //now start to read the data 
-      for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
-      {
-        if ( d->channel_read_mask[ibd] & ( 1 << ichan) )
-        {
-          USING(d);  
-          if (d->current_mode[ibd] != MODE_WAVEFORMS)
-          {
-            CHK(buffer_append(d,ibd, buf_mode[MODE_WAVEFORMS],0))
-            d->current_mode[ibd] = MODE_WAVEFORMS; 
-          }
+    //now that we have the header, see what to read 
+    ranges[iout] = range; 
+    hd[iout]->waveforms_skipped = select_event(d, hd[iout], &ranges[iout], internal); 
+    uint16_t event_length = hd[iout]->waveforms_skipped ? 0 : ranges[iout].naddr * SAMPLES_PER_ADDR; 
+    if (event_length) 
+    {
+      hd[iout]->readout_window_start = ranges[iout].first_addr * SAMPLES_PER_ADDR; 
+      hd[iout]->buffer_length = event_length; 
+    }
+    if (cev) dest_compact(&dest[iout], cev[iout], event_length); 
+
+    //event stuff
+    *dest[iout].buffer_length = event_length; 
+    *dest[iout].event_number = hd[iout]->event_number; 
+    if (beams) beams[iout]->event_number = hd[iout]->event_number; 
+    if (ps) ps[iout]->event_number = hd[iout]->event_number; 
+    if (!event_length && beams) 
+    {
+      beams[iout]->buffer_length = 0; 
+      memset(beams[iout]->data, 0, sizeof(beams[iout]->data)); 
+    }
+    if (!event_length && ps) 
+    {
+      ps[iout]->nsums = 0; 
+      memset(ps[iout]->data, 0, sizeof(ps[iout]->data)); 
+    }
 
-          if (d->current_buf[ibd] != ibuf)
-          {
-            CHK(buffer_append(d,ibd, buf_buffer[ibuf],0))
-          }
+    //zero the waveforms that won't be read: the boards we don't have, or all of them 
+    for (ibd = event_length ? NBD(d) : 0; ibd < BN_MAX_BOARDS; ibd++) 
+    {
+      memset(dest_waveform(&dest[iout], ibd, 0),0, BN_NUM_CHAN * dest[iout].stride); 
+    }
+  }
 
-          if (d->channel_read_mask[ibd] & (1 << ichan)) //TODO is this backwards?!??? 
-          {
-            CHK(buffer_append(d,ibd, buf_channel[ichan],0)) 
-            CHK(loop_over_chunks_half_duplex(d,ibd, d->buffer_length / (BN_SPI_BYTES * BN_NUM_CHUNK),1, &ev[iout]->data[ibd][ichan][0]))
-          }
-          DONE(d); 
-        }
-        else
-        {
-          memset(&ev[iout]->data[ibd][ichan][0], 0 , d->buffer_length); 
-        }
-      }
+  //the buffers whose waveforms we aren't reading are done with already, so let them all go now 
+  //rather than after the waveforms of the ones before them 
+  beacon_buffer_mask_t skipped = 0; 
+  for (iout = 0; iout < nbuf; iout++) 
+  {
+    timing[iout].start_ns = start_ns; 
+    timing[iout].metadata_ns = metadata_ns; 
+    if (hd[iout]->waveforms_skipped) skipped |= 1 << bufs[iout]; 
+  }
+  if (skipped) mark_buffers_done(d, skipped, 1); 
 
+  //now stream the waveforms (all boards at once), clearing each buffer as soon as we are done with it
+  for (iout = 0; iout < nbuf; iout++)
+  {
+    if (hd[iout]->waveforms_skipped) continue; 
 
-      //zero out things that don't make sense if there is no slave
-      if (NBD(d) < BN_MAX_BOARDS) 
-      {
-        int iibd; 
-        for (iibd = 0; iibd < BN_MAX_BOARDS; iibd++) 
-        {
-          hd[iout]->readout_time[1] = 0; 
-          hd[iout]->readout_time_ns[1] = 0; 
-          hd[iout]->trig_time[1] = 0; 
-          hd[iout]->deadtime[1] = 0; 
-          hd[iout]->board_id[1] = 0; 
-          memset(ev[iout]->data[1],0, BN_NUM_CHAN * BN_MAX_WAVEFORM_LENGTH); 
-        }
+    struct waveform_job wjob = { bufs[iout], ranges[iout], &dest[iout], {0} }; 
+    timing[iout].waveforms_start_ns = trace_now(); 
+    CHK(run_on_boards(d, read_waveforms_job, &wjob)); 
+    memcpy(timing[iout].waveforms_ns, wjob.done_ns, sizeof(wjob.done_ns)); 
+    if (beams || ps) 
+    {
+      CHK(read_beam_products(d, bufs[iout], ranges[iout], beams ? beams[iout] : 0, ps ? ps[iout] : 0)); 
+      timing[iout].products_ns = trace_now(); 
+    }
+    mark_buffers_done(d, 1 << bufs[iout], 1); 
+  }
 
-      }
+  d->nevents_read += nbuf; 
+  all_read = 1; 
 
-      USING(d); 
-      CHK(buffer_send(d,ibd)); 
-      DONE(d); 
+  the_end:
+  //the last clear goes out now, so the buffer doesn't wait on whatever we do next (the status read with it saves the next poll) 
+  if (send_deferred_clear(d)) ret++; 
+
+  //only now have all the clears gone out (deferred ones with a later message), so only now do we know when 
+  if (all_read) 
+  {
+    if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+    for (iout = 0; iout < nbuf; iout++) timing[iout].clear_ns = d->cleared_ns[bufs[iout]]; 
+    if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
+
+    for (iout = 0; iout < nbuf; iout++) 
+    {
+      timing[iout].event_number = hd[iout]->event_number; 
+      timing_record(d, &timing[iout], iout == 0); 
+    }
+  }
+  //TODO add some printout here in case of falure/ 
+  DONE(d); 
+
+  return ret; 
+}
+
+
+int beacon_read_multiple_ptr(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon_header_t ** hd, beacon_event_t ** ev)
+{
+  return read_multiple(d, mask, hd, ev, 0, 0, 0, 0); 
+}
+
+// reads a buffer into calib_hd / calib_ev for ourselves, with all its waveforms 
+static int read_single_internal(beacon_dev_t * d, uint8_t buffer) 
+{
+  beacon_header_t * hd = &d->calib_hd; 
+  beacon_event_t * ev = &d->calib_ev; 
+  return read_multiple(d, 1 << buffer, &hd, &ev, 0, 0, 0, 1); 
+}
+
+int beacon_read_multiple_products(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon_header_t ** hd, beacon_event_t ** ev, 
+                                  beacon_beams_t ** beams, beacon_powersum_t ** ps)
+{
+  return read_multiple(d, mask, hd, ev, 0, beams, ps, 0); 
+}
+
+int beacon_read_multiple_compact(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon_header_t ** hd, beacon_compact_event_t ** ev)
+{
+  return read_multiple(d, mask, hd, 0, ev, 0, 0, 0); 
+}
+
+int beacon_read_multiple_pooled(beacon_dev_t * d, beacon_buffer_mask_t mask, beacon_event_pool_t * pool, 
+                                beacon_pooled_event_t ** out) 
+{
+  beacon_header_t * hd[BN_NUM_BUFFER]; 
+  beacon_compact_event_t * ev[BN_NUM_BUFFER]; 
+  int i, n = 0; 
+
+  while (n < __builtin_popcount(mask) && (out[n] = beacon_event_pool_acquire(pool))) n++; 
+  if (!n) return 0; 
+
+  //if the pool is running low, read what fits, in the order the board wants them read 
+  if (n < __builtin_popcount(mask)) 
+  {
+    beacon_buffer_mask_t some = 0; 
+    USING(d); 
+    uint8_t ibuf = d->next_read_buffer; 
+    DONE(d); 
+    while (__builtin_popcount(some) < n) 
+    {
+      if (mask & (1 << ibuf)) some |= 1 << ibuf; 
+      ibuf = (ibuf + 1) % BN_NUM_BUFFER; 
     }
-    mark_buffers_done(d, 1 << ibuf); 
-    iout++; 
-
+    mask = some; 
   }
 
+  for (i = 0; i < n; i++) 
+  {
+    hd[i] = &out[i]->header; 
+    ev[i] = out[i]->event; 
+  }
 
-  the_end:
-  //TODO add some printout here in case of falure/ 
-  //also, need to unlock mutex if it's locked 
+  if (read_multiple(d, mask, hd, 0, ev, 0, 0, 0)) 
+  {
+    for (i = 0; i < n; i++) beacon_pooled_event_release(out[i]); 
+    return -1; 
+  }
 
-  return ret; 
+  //the events the selector dropped go right back 
+  int nkept = 0; 
+  for (i = 0; i < n; i++) 
+  {
+    if (out[i]->header.waveforms_skipped == BN_SKIP_DROPPED) beacon_pooled_event_release(out[i]); 
+    else out[nkept++] = out[i]; 
+  }
+  return nkept; 
 }
 
+int beacon_wait_for_and_read_multiple_pooled(beacon_dev_t * d, beacon_event_pool_t * pool, beacon_pooled_event_t ** out) 
+{
+  beacon_buffer_mask_t mask = 0; 
+  beacon_wait(d,&mask,-1,MASTER); 
+  if (!mask) return 0; 
+  return beacon_read_multiple_pooled(d, mask, pool, out); 
+}
 
 int beacon_clear_buffer(beacon_dev_t *d, beacon_buffer_mask_t mask) 
 {
   USING(d); 
-  int ret = mark_buffers_done(d,mask); 
+  int ret = mark_buffers_done(d,mask,0); 
   DONE(d); 
   return ret; 
 }
@@ -1725,20 +3353,22 @@ int beacon_clear_buffer(beacon_dev_t *d, beacon_buffer_mask_t mask)
 int beacon_write(beacon_dev_t *d, const uint8_t* buffer)
 {
   int written = 0; 
-  USING(d); 
-  written = do_write(d->fd[0], buffer); 
-  if (d->fd[1]) 
-  written += do_write(d->fd[1], buffer); 
-  DONE(d); 
-  return written == d->fd[1] ? 2 * BN_SPI_BYTES : BN_SPI_BYTES ? 0 : -1; 
+  int ibd; 
+  for (ibd = 0; ibd < NBD(d); ibd++) 
+  {
+    USING_BD(d,ibd); 
+    written += write_word(d, ibd, buffer); 
+    DONE_BD(d,ibd); 
+  }
+  return written == NBD(d) * BN_SPI_BYTES ? 0 : -1; 
 }
 
 int beacon_read(beacon_dev_t *d,uint8_t* buffer, beacon_which_board_t which)
 {
   int got = 0; 
-  USING(d); 
-  got = do_read(d->fd[which], buffer); 
-  DONE(d); 
+  USING_BD(d,which); 
+  got = do_read(d->tp[which], buffer); 
+  DONE_BD(d,which); 
   return got == BN_SPI_BYTES ? 0 : -1; 
 }
 
@@ -1756,9 +3386,8 @@ int beacon_read_status(beacon_dev_t *d, beacon_status_t * st, beacon_which_board
 
   st->board_id = d->board_id[which]; 
 
-  USING(d); 
+  USING_BD(d,which); 
   ret+=buffer_append(d, which,buf_mode[MODE_REGISTER],0); 
-  d->current_mode[which] = MODE_REGISTER; 
   ret+=buffer_append(d,which, buf_update_scalers,0); 
 
   for (i = 0; i < N_SCALER_REGISTERS; i++) 
@@ -1781,7 +3410,7 @@ int beacon_read_status(beacon_dev_t *d, beacon_status_t * st, beacon_which_board
   
   clock_gettime(CLOCK_REALTIME, &now); 
   ret+= buffer_send(d,which); 
-  DONE(d); 
+  DONE_BD(d,which); 
 
   ret+= beacon_get_thresholds(d, &st->trigger_thresholds[0]); 
 
@@ -1901,7 +3530,7 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
   
   if (reset_type == BN_RESET_GLOBAL) 
   {
-    if (synchronized_command(d,buf_reset_all,0,0,0))
+    if (synchronized_command(d, buf_reset_all, 0,0))
     {
         return 1;
     }
@@ -1916,7 +3545,9 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
   {
     for (ibd = 0; ibd < NBD(d); ibd++)
     {
-      wrote = do_write(d->fd[ibd], buf_reset_almost_all); 
+      USING_BD(d,ibd); 
+      wrote = write_word(d, ibd, buf_reset_almost_all); 
+      DONE_BD(d,ibd); 
 
       if (wrote != BN_SPI_BYTES) 
       {
@@ -1953,8 +3584,11 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
   for (ibd = 0; ibd < NBD(d); ibd++)
   {
     //clear all buffers, and reset to zero
-    wrote = do_write (d->fd[ibd], buf_clear[0xf]); 
-    wrote += do_write (d->fd[ibd], buf_reset_buf); 
+    USING_BD(d,ibd); 
+    wrote = write_word(d, ibd, buf_clear[0xf]); 
+    wrote += write_word(d, ibd, buf_reset_buf); 
+    if (ibd == MASTER) d->after_clear.valid = 0; 
+    DONE_BD(d,ibd); 
 
     if (wrote != 2*BN_SPI_BYTES) 
     {
@@ -1988,7 +3622,10 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
 
     //temporarily set the buffer length to the maximum 
     uint16_t old_buf_length = d->buffer_length; 
+    uint16_t old_window[2] = { d->window_pre, d->window_post }; 
     d->buffer_length = 1024; 
+    d->window_pre = 0; 
+    d->window_post = 0; 
 
     //we need to turn off the phased trigger to not overwhelm ARA 
     beacon_trigger_enable_t old_enables = beacon_get_trigger_enables(d, MASTER); 
@@ -2015,9 +3652,9 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
           break; 
         }
 
-        if (d->fd[1]) //synchronize the buf_adc_clk_rst
+        if (NBD(d) > 1) //synchronize the buf_adc_clk_rst
         {
-          if(synchronized_command(d, buf_adc_clk_rst, 0,0,0))  
+          if(synchronized_command(d, buf_adc_clk_rst, 0,0))  
           {
             fprintf(stderr,"problem sending buf_adc_clk_rst\n"); 
             continue;
@@ -2026,7 +3663,9 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
         }
         else
         {
-          wrote = do_write(d->fd[0], buf_adc_clk_rst); 
+          USING_BD(d,MASTER); 
+          wrote = write_word(d, MASTER, buf_adc_clk_rst); 
+          DONE_BD(d,MASTER); 
           if ( wrote != BN_SPI_BYTES) 
           {
             fprintf(stderr,"When adc_clk_rst, expected %d got %d\n", BN_SPI_BYTES, wrote);  
@@ -2055,13 +3694,13 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
 
 
       //read in the first buffer (should really be  0 most of the time.) 
-      beacon_read_single(d, __builtin_ctz(mask),  &d->calib_hd, &d->calib_ev); 
+      read_single_internal(d, __builtin_ctz(mask)); 
 
       // now loop over the samples and get the things we need 
       uint16_t min_max_i = BN_MAX_WAVEFORM_LENGTH; 
       uint16_t max_max_i = 0; 
       uint8_t min_max_v = 255; 
-      uint16_t max_i[2][BN_NUM_CHAN];
+      uint16_t max_i[BN_MAX_BOARDS][BN_NUM_CHAN];
       memset(max_i,0,sizeof(max_i)); 
 
       //loop through and find where the maxes are
@@ -2120,7 +3759,9 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
           if (delay > 0) 
           {
             uint8_t buf[BN_SPI_BYTES] = {REG_ADC_DELAYS + iadc, 0, (delay & 0xf) | (1 << 4) , (delay & 0xf)  | (1 << 4) }; 
-            wrote = do_write(d->fd[ibd], buf); 
+            USING_BD(d,ibd); 
+            wrote = write_word(d, ibd, buf); 
+            DONE_BD(d,ibd); 
             if (wrote < BN_SPI_BYTES) 
             {
               fprintf(stderr,"Should have written %d but wrote %d\n", BN_SPI_BYTES, wrote); 
@@ -2135,12 +3776,16 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
     }
 
     d->buffer_length = old_buf_length; 
+    d->window_pre = old_window[0]; 
+    d->window_post = old_window[1]; 
     beacon_calpulse(d, 0); 
 
     // reclear the buffers 
     for (ibd = 0; ibd < NBD(d); ibd++) 
     {
-      do_write(d->fd[ibd], buf_clear[0xf]); 
+      USING_BD(d,ibd); 
+      write_word(d, ibd, buf_clear[0xf]); 
+      DONE_BD(d,ibd); 
     }
 
     beacon_set_trigger_enables(d, old_enables, MASTER); 
@@ -2155,7 +3800,9 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
    for(ibd = 0; ibd < NBD(d); ibd++) 
    {
      const uint8_t buf_ts[BN_SPI_BYTES] ={REG_TIMESTAMP_SELECT,0,0,1} ;
-     do_write(d->fd[ibd], buf_ts);
+     USING_BD(d,ibd); 
+     write_word(d, ibd, buf_ts);
+     DONE_BD(d,ibd); 
    }
 
 
@@ -2165,7 +3812,7 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
    if (NBD(d) > 1) 
    {
      clock_gettime(CLOCK_REALTIME,&tbefore); 
-     if (synchronized_command(d, buf_reset_counter,0,0,0))
+     if (synchronized_command(d, buf_reset_counter, 0,0))
      {
         fprintf(stderr, "Unable to reset counters. Aborting reset\n"); 
         return 1; 
@@ -2175,7 +3822,9 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
    else
    {
      clock_gettime(CLOCK_REALTIME,&tbefore); 
-     wrote = do_write(d->fd[0], buf_reset_counter); 
+     USING_BD(d,MASTER); 
+     wrote = write_word(d, MASTER, buf_reset_counter); 
+     DONE_BD(d,MASTER); 
      clock_gettime(CLOCK_REALTIME,&tafter); 
      if (wrote != BN_SPI_BYTES) 
      {
@@ -2188,6 +3837,13 @@ int beacon_reset(beacon_dev_t * d, beacon_reset_t reset_type)
     //take average for the start time
     d->start_time = avg_time(tbefore,tafter); 
 
+    //the reset may have changed any of the registers we keep track of 
+    if (beacon_resync_registers(d))
+    {
+      fprintf(stderr, "Unable to read back the registers after reset\n"); 
+      return 1; 
+    }
+
    int ret  = 0; 
 
    return ret ; 
@@ -2198,16 +3854,155 @@ int beacon_set_spi_clock(beacon_dev_t *d, unsigned clock)
 
   int ibd;
   d->spi_clock = clock*1000000; 
-  USING(d); 
   for (ibd = 0; ibd < NBD(d); ibd++)
   {
-    ioctl(d->fd[ibd], SPI_IOC_WR_MAX_SPEED_HZ, &d->spi_clock); 
+    USING_BD(d,ibd); 
+    d->tp[ibd]->ops->set_speed(d->tp[ibd], d->spi_clock); 
+    DONE_BD(d,ibd); 
   }
-  DONE(d); 
 
   return 0; //check? 
 }
 
+unsigned beacon_get_spi_clock(const beacon_dev_t *d) 
+{
+  return d->spi_clock / 1000000; 
+}
+
+static int compare_unsigned(const void * a, const void * b) 
+{
+  unsigned ua = *(const unsigned*) a; 
+  unsigned ub = *(const unsigned*) b; 
+  return ua < ub ? -1 : ua > ub; 
+}
+
+// reads all the channels we read of one buffer on all boards 
+static int qualify_read(beacon_dev_t * d, uint8_t buffer, uint8_t finish, uint8_t (*data)[BN_NUM_CHAN][BN_MAX_WAVEFORM_LENGTH]) 
+{
+  int ibd, ichan; 
+  int ret = 0; 
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      if ((d->channel_read_mask[ibd] & (1 << ichan)) == 0) continue; 
+      ret += beacon_read_raw(d, buffer, ichan, 1, finish, data[ibd][ichan], ibd); 
+    }
+  }
+  return ret; 
+}
+
+static uint64_t count_bit_errors(beacon_dev_t * d, int nbytes, uint8_t (*a)[BN_NUM_CHAN][BN_MAX_WAVEFORM_LENGTH], uint8_t (*b)[BN_NUM_CHAN][BN_MAX_WAVEFORM_LENGTH], uint64_t * nbits) 
+{
+  int ibd, ichan, i; 
+  uint64_t nerr = 0; 
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      if ((d->channel_read_mask[ibd] & (1 << ichan)) == 0) continue; 
+      for (i = 0; i < nbytes; i++)
+      {
+        nerr += __builtin_popcount(a[ibd][ichan][i] ^ b[ibd][ichan][i]); 
+      }
+      *nbits += 8 * nbytes; 
+    }
+  }
+  return nerr; 
+}
+
+int beacon_qualify_spi_clock(beacon_dev_t *d, const unsigned * clocks, int nclocks, int nreads, 
+                             float margin, int apply, beacon_spi_clock_qualification_t * result) 
+{
+  static const unsigned default_clocks[] = {4,8,12,16,20,24,28,32,36,40,44,48}; 
+  unsigned original_clock = beacon_get_spi_clock(d); 
+  int original_verification = beacon_query_verification_mode(d); 
+  int ret = 0; 
+  int i, iread; 
+
+  if (!clocks) 
+  {
+    clocks = default_clocks; 
+    nclocks = sizeof(default_clocks) / sizeof(*default_clocks); 
+  }
+
+  if (nclocks > BN_MAX_QUALIFY_CLOCKS) nclocks = BN_MAX_QUALIFY_CLOCKS; 
+  memset(result, 0, sizeof(*result)); 
+  result->nclocks = nclocks; 
+  memcpy(result->clock, clocks, nclocks * sizeof(*clocks)); 
+  qsort(result->clock, nclocks, sizeof(*result->clock), compare_unsigned); 
+
+  // the raw read takes 8-bit addresses 
+  int naddr = d->buffer_length / (BN_SPI_BYTES * BN_NUM_CHUNK); 
+  if (naddr > 255) naddr = 255; 
+  int nbytes = naddr * BN_SPI_BYTES * BN_NUM_CHUNK; 
+
+  uint8_t (*ref)[BN_NUM_CHAN][BN_MAX_WAVEFORM_LENGTH] = calloc(BN_MAX_BOARDS, sizeof(*ref)); 
+  uint8_t (*data)[BN_NUM_CHAN][BN_MAX_WAVEFORM_LENGTH] = calloc(BN_MAX_BOARDS, sizeof(*data)); 
+
+  beacon_set_spi_clock(d, BN_QUALIFY_REFERENCE_CLOCK); 
+  beacon_enable_verification_mode(d,1); 
+
+  beacon_buffer_mask_t mask = 0; 
+  beacon_sw_trigger(d); 
+  beacon_wait(d,&mask,1,MASTER); 
+  if (!mask) 
+  {
+    fprintf(stderr,"No buffers ready after SW trigger, can't qualify SPI clock\n"); 
+    ret = -1; 
+    goto restore; 
+  }
+
+  uint8_t buffer = (mask & (1 << d->next_read_buffer)) ? d->next_read_buffer : __builtin_ctz(mask); 
+
+  //read the reference twice, to make sure it's stable 
+  uint64_t ref_bits = 0; 
+  if (qualify_read(d, buffer, naddr, ref) || qualify_read(d, buffer, naddr, data) 
+      || count_bit_errors(d, nbytes, ref, data, &ref_bits)) 
+  {
+    fprintf(stderr,"Reference readout at %u MHz is not stable, can't qualify SPI clock\n", BN_QUALIFY_REFERENCE_CLOCK); 
+    ret = -1; 
+  }
+
+  for (i = 0; !ret && i < nclocks; i++) 
+  {
+    beacon_set_spi_clock(d, result->clock[i]); 
+    for (iread = 0; iread < nreads; iread++) 
+    {
+      memset(data, 0, BN_MAX_BOARDS * sizeof(*data)); 
+      qualify_read(d, buffer, naddr, data); 
+      result->nbit_errors[i] += count_bit_errors(d, nbytes, ref, data, &result->nbits[i]); 
+    }
+
+    if (result->nbit_errors[i] == 0 && (i == 0 || result->fastest_clean == result->clock[i-1])) 
+    {
+      result->fastest_clean = result->clock[i]; 
+    }
+  }
+
+  for (i = 0; i < nclocks; i++) 
+  {
+    if (result->clock[i] <= result->fastest_clean && result->clock[i] <= (1 - margin) * result->fastest_clean) 
+    {
+      result->chosen = result->clock[i]; 
+    }
+  }
+
+  //if the margin excluded everything, take the slowest clean one
+  if (!result->chosen && result->fastest_clean) result->chosen = result->clock[0]; 
+
+  // read it out properly so the buffer is cleared and our bookkeeping stays in sync 
+  beacon_set_spi_clock(d, BN_QUALIFY_REFERENCE_CLOCK); 
+  read_single_internal(d, buffer); 
+
+restore: 
+  beacon_enable_verification_mode(d, original_verification == 1); 
+  beacon_set_spi_clock(d, apply && result->chosen ? result->chosen : original_clock); 
+  free(ref); 
+  free(data); 
+  return ret; 
+}
+
 int beacon_set_toggle_chipselect(beacon_dev_t *d, int cs) 
 {
   d->cs_change = cs;
@@ -2222,6 +4017,287 @@ int beacon_set_transaction_delay(beacon_dev_t *d, unsigned delay)
   return 0; 
 }
 
+int beacon_set_full_duplex(beacon_dev_t *d, int full_duplex) 
+{
+  USING_ALL(d); 
+  d->full_duplex = full_duplex; 
+  invalidate_plans(d); 
+  DONE_ALL(d); 
+  return 0; 
+}
+
+int beacon_get_full_duplex(const beacon_dev_t *d) 
+{
+  return d->full_duplex; 
+}
+
+int beacon_set_deferred_clear(beacon_dev_t *d, int defer) 
+{
+  USING(d); //not mid readout, so nothing is left waiting 
+  d->deferred_clear.enabled = defer; 
+  DONE(d); 
+  return 0; 
+}
+
+int beacon_get_deferred_clear(const beacon_dev_t *d) 
+{
+  return d->deferred_clear.enabled; 
+}
+
+int beacon_set_max_xfers(beacon_dev_t *d, int max_xfers) 
+{
+  int ret = 0; 
+  int ibd; 
+  USING_ALL(d); 
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    ret += buffer_send(d, ibd); 
+  }
+  if (!ret) ret = alloc_xfers(d, max_xfers); 
+  DONE_ALL(d); 
+  return ret; 
+}
+
+int beacon_get_max_xfers(const beacon_dev_t *d) 
+{
+  return d->max_xfers; 
+}
+
+int beacon_set_spi_trace(beacon_dev_t *d, int enable) 
+{
+  struct beacon_spi_trace * tr = &d->trace; 
+  int ret = 0; 
+
+  USING(d); 
+  if (enable && !tr->ring) 
+  {
+    tr->ring = calloc(BN_SPI_TRACE_SIZE, sizeof(*tr->ring)); 
+    tr->seq = calloc(BN_SPI_TRACE_SIZE, sizeof(*tr->seq)); 
+    if (!tr->ring || !tr->seq)
+    {
+      fprintf(stderr,"Could not allocate SPI trace ring\n"); 
+      free(tr->ring); 
+      free(tr->seq); 
+      tr->ring = 0; 
+      tr->seq = 0; 
+      ret = -1; 
+    }
+  }
+  if (!ret) __atomic_store_n(&tr->enabled, enable ? 1 : 0, __ATOMIC_RELEASE); 
+  DONE(d); 
+
+  return ret; 
+}
+
+int beacon_drain_spi_trace(beacon_dev_t *d, FILE * f) 
+{
+  struct beacon_spi_trace * tr = &d->trace; 
+  beacon_spi_trace_block_t block; 
+  beacon_spi_trace_record_t * out; 
+  uint64_t head, idx; 
+  uint32_t n = 0; 
+
+  if (!tr->ring) return 0; 
+
+  out = malloc(BN_SPI_TRACE_SIZE * sizeof(*out)); 
+  if (!out) return -1; 
+
+  head = __atomic_load_n(&tr->head, __ATOMIC_ACQUIRE); 
+
+  //we fell behind, anything older than a ring's worth is gone 
+  if (head - tr->tail > BN_SPI_TRACE_SIZE) 
+  {
+    tr->nlost += head - BN_SPI_TRACE_SIZE - tr->tail; 
+    tr->tail = head - BN_SPI_TRACE_SIZE; 
+  }
+
+  for (idx = tr->tail; idx < head; idx++) 
+  {
+    size_t slot = idx & (BN_SPI_TRACE_SIZE - 1); 
+    uint64_t seq = __atomic_load_n(&tr->seq[slot], __ATOMIC_ACQUIRE); 
+
+    // still being written, pick it up next time
+    if (seq < idx + 1) break; 
+
+    out[n] = tr->ring[slot]; 
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); 
+
+    // overwritten (before or while we were copying it)
+    if (seq != idx + 1 || __atomic_load_n(&tr->seq[slot], __ATOMIC_RELAXED) != seq) 
+    {
+      tr->nlost++; 
+      continue; 
+    }
+    n++; 
+  }
+  tr->tail = idx; 
+
+  block.magic = BN_SPI_TRACE_MAGIC; 
+  block.record_size = sizeof(beacon_spi_trace_record_t); 
+  block.nrecords = n; 
+  block.nlost = tr->nlost; 
+  tr->nlost = 0; 
+
+  int ret = n; 
+  if (fwrite(&block, sizeof(block), 1, f) != 1 || (n && fwrite(out, sizeof(*out), n, f) != n)) 
+  {
+    fprintf(stderr,"Could not write SPI trace\n"); 
+    ret = -1; 
+  }
+
+  free(out); 
+  return ret; 
+}
+
+int beacon_get_readout_stats(beacon_dev_t *d, beacon_readout_stats_t * stats) 
+{
+  int ibd; 
+  USING(d); 
+  USING_ALL(d); 
+  stats->nevents = d->nevents_read; 
+  stats->nmessages = 0; 
+  stats->nxfers = 0; 
+  stats->nplans_built = 0; 
+  stats->nwrites_skipped = 0; 
+  stats->nreads_cached = 0; 
+  stats->nstatus_after_clear = d->after_clear.nused; 
+  stats->nclears_riding = d->deferred_clear.nriding; 
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    stats->nmessages += d->nmessages[ibd]; 
+    stats->nxfers += d->nxfers[ibd]; 
+    stats->nplans_built += d->nplans_built[ibd]; 
+    stats->nwrites_skipped += d->shadow[ibd].nskipped; 
+    stats->nreads_cached += d->shadow[ibd].ncached; 
+  }
+  DONE_ALL(d); 
+  DONE(d); 
+  return 0; 
+}
+
+void beacon_reset_readout_stats(beacon_dev_t *d) 
+{
+  int ibd; 
+  USING(d); 
+  USING_ALL(d); 
+  d->nevents_read = 0; 
+  memset(d->nmessages, 0, sizeof(d->nmessages)); 
+  memset(d->nxfers, 0, sizeof(d->nxfers)); 
+  memset(d->nplans_built, 0, sizeof(d->nplans_built)); 
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    d->shadow[ibd].nskipped = 0; 
+    d->shadow[ibd].ncached = 0; 
+  }
+  d->after_clear.nused = 0; 
+  d->deferred_clear.nriding = 0; 
+  memset(d->timing_hist, 0, sizeof(d->timing_hist)); 
+  DONE_ALL(d); 
+  DONE(d); 
+}
+
+int beacon_get_readout_timing(beacon_dev_t *d, uint64_t event_number, beacon_readout_timing_t * timing) 
+{
+  int i, ret = -1; 
+  USING(d); 
+  for (i = 0; i < BN_READOUT_TIMING_HISTORY && i < (int) d->ntimed; i++) 
+  {
+    if (d->timing[i].event_number == event_number) 
+    {
+      *timing = d->timing[i]; 
+      ret = 0; 
+      break; 
+    }
+  }
+  DONE(d); 
+  return ret; 
+}
+
+// the top of the bin the qth quantile is in, in us 
+static float timing_quantile(const struct timing_hist * h, double q) 
+{
+  uint64_t want = ceil(q * h->n); 
+  uint64_t sum = 0; 
+  int bin; 
+  for (bin = 0; bin < TIMING_NBINS; bin++) 
+  {
+    sum += h->counts[bin]; 
+    if (sum >= want) break; 
+  }
+  float top = timing_bin_top(bin); 
+  return top < h->max_ns / 1e3 ? top : h->max_ns / 1e3; //can't be more than the max 
+}
+
+int beacon_get_readout_timing_summary(beacon_dev_t *d, beacon_readout_timing_summary_t * summary) 
+{
+  int i; 
+  memset(summary, 0, sizeof(*summary)); 
+  USING(d); 
+  for (i = 0; i < BN_NUM_READOUT_STEPS; i++) 
+  {
+    const struct timing_hist * h = &d->timing_hist[i]; 
+    summary->n[i] = h->n; 
+    if (!h->n) continue; 
+    summary->p50_us[i] = timing_quantile(h, 0.5); 
+    summary->p90_us[i] = timing_quantile(h, 0.9); 
+    summary->p99_us[i] = timing_quantile(h, 0.99); 
+    summary->max_us[i] = h->max_ns / 1e3; 
+  }
+  DONE(d); 
+  return 0; 
+}
+
+int beacon_readout_timing_summary_print(FILE * f, const beacon_readout_timing_summary_t * summary) 
+{
+  static const char * names[BN_NUM_READOUT_STEPS] = { "ready->start", "metadata", "waveforms", "products", "clear", "total" }; 
+  int i; 
+  fprintf(f, "%14s %10s %10s %10s %10s %10s\n", "step (us)", "n", "p50", "p90", "p99", "max"); 
+  for (i = 0; i < BN_NUM_READOUT_STEPS; i++) 
+  {
+    if (!summary->n[i]) continue; 
+    fprintf(f, "%14s %10"PRIu64" %10.1f %10.1f %10.1f %10.1f\n", names[i], summary->n[i], 
+            summary->p50_us[i], summary->p90_us[i], summary->p99_us[i], summary->max_us[i]); 
+  }
+  return 0; 
+}
+
+
+int beacon_resync_registers(beacon_dev_t *d) 
+{
+  uint8_t result[BN_NUM_REGISTER][BN_SPI_BYTES]; 
+  int ibd, addr; 
+  int ret = 0; 
+
+  for (ibd = 0; ibd < NBD(d); ibd++)
+  {
+    USING_BD(d,ibd); 
+    shadow_invalidate(d, ibd); 
+    for (addr = 0; addr < BN_NUM_REGISTER; addr++)
+    {
+      if (shadow_flags[addr] & SHADOW_READ) ret += append_read_register(d, ibd, addr, result[addr]); 
+    }
+    ret += buffer_send(d, ibd); 
+    DONE_BD(d,ibd); 
+  }
+
+  return ret; 
+}
+
+int beacon_set_register_cache(beacon_dev_t *d, int enable) 
+{
+  int ibd; 
+  USING_ALL(d); 
+  d->shadow_enabled = enable; 
+  for (ibd = 0; ibd < NBD(d); ibd++) shadow_invalidate(d, ibd); 
+  DONE_ALL(d); 
+  return 0; 
+}
+
+int beacon_get_register_cache(const beacon_dev_t *d) 
+{
+  return d->shadow_enabled; 
+}
+
 
 int beacon_get_trigger_output(beacon_dev_t *d, beacon_trigger_output_config_t * config) 
 {
@@ -2245,9 +4321,9 @@ int beacon_configure_trigger_output(beacon_dev_t *d, beacon_trigger_output_confi
                                      | ((config.send_1Hz & 1) << 2) 
                                   }; 
 
-  USING(d); 
-  int written = do_write(d->fd[MASTER], cfg_buf); 
-  DONE(d); 
+  USING_BD(d,MASTER); 
+  int written = write_word(d, MASTER, cfg_buf); 
+  DONE_BD(d,MASTER); 
   return written != BN_SPI_BYTES; 
 }
 int beacon_configure_ext_trigger_in(beacon_dev_t * d, beacon_ext_input_config_t config) 
@@ -2256,9 +4332,9 @@ int beacon_configure_ext_trigger_in(beacon_dev_t * d, beacon_ext_input_config_t
                                    config.trig_delay >> 8,
                                    config.trig_delay & 8,
                                    (config.use_as_trigger & 1) } ; 
-  USING(d); 
-  int written = do_write(d->fd[MASTER], cfg_buf); 
-  DONE(d); 
+  USING_BD(d,MASTER); 
+  int written = write_word(d, MASTER, cfg_buf); 
+  DONE_BD(d,MASTER); 
   return written != BN_SPI_BYTES; 
 }
 
@@ -2277,9 +4353,9 @@ int beacon_get_ext_trigger_in(beacon_dev_t * d, beacon_ext_input_config_t * conf
 int beacon_enable_verification_mode(beacon_dev_t * d, int mode) 
 {
   uint8_t buf[BN_SPI_BYTES] = { REG_VERIFICATION_MODE,0,0, mode & 1}; 
-  USING(d);
-  int written = do_write(d->fd[MASTER], buf); 
-  DONE(d); 
+  USING_BD(d,MASTER);
+  int written = write_word(d, MASTER, buf); 
+  DONE_BD(d,MASTER); 
   return written != BN_SPI_BYTES;
 }
 
@@ -2297,6 +4373,40 @@ int beacon_set_poll_interval(beacon_dev_t * d, uint16_t interval)
   return 0; 
 }
 
+int beacon_set_adaptive_polling(beacon_dev_t * d, unsigned max_latency_us, float max_bus_fraction) 
+{
+  if (max_bus_fraction < 0 || max_bus_fraction > 1) 
+  {
+    fprintf(stderr,"Bus fraction must be between 0 and 1, not %g\n", max_bus_fraction); 
+    return -1; 
+  }
+
+  if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+  d->adapt.max_latency_us = max_latency_us; 
+  d->adapt.max_bus_fraction = max_bus_fraction; 
+  d->adapt.interval_us = max_latency_us ? adaptive_interval(&d->adapt, trace_now()) : 0; 
+  if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
+  return 0; 
+}
+
+int beacon_get_poll_stats(beacon_dev_t * d, beacon_poll_stats_t * st) 
+{
+  if (d->enable_locking) pthread_mutex_lock(&d->adapt_mut); 
+  const struct poll_adapt * a = &d->adapt; 
+  double dt = a->mean_dt; 
+  uint64_t now = trace_now(); 
+  if (a->last_arrival && (now - a->last_arrival) * 1e-9 > dt) dt = (now - a->last_arrival) * 1e-9; 
+
+  st->rate_hz = dt > 0 ? 1. / dt : 0; 
+  st->interval_us = a->max_latency_us ? a->interval_us : d->poll_interval; 
+  st->poll_time_us = a->poll_time * 1e6; 
+  st->bus_fraction = a->poll_time > 0 ? a->poll_time / (a->poll_time + st->interval_us * 1e-6) : 0; 
+  st->npolls = a->npolls; 
+  st->nevents = a->nevents; 
+  if (d->enable_locking) pthread_mutex_unlock(&d->adapt_mut); 
+  return 0; 
+}
+
 
 int beacon_set_trigger_delays(beacon_dev_t *d, const uint8_t * delays)
 {
@@ -2304,12 +4414,12 @@ int beacon_set_trigger_delays(beacon_dev_t *d, const uint8_t * delays)
   uint8_t del_345[BN_SPI_BYTES] = {REG_TRIG_DELAY_345, delays[5], delays[4], delays[3]}; 
   uint8_t del_67[BN_SPI_BYTES] = {REG_TRIG_DELAY_67, 0, delays[7], delays[6]}; 
   int ret = 0;  
-  USING(d); 
+  USING_BD(d,MASTER); 
   buffer_append(d, MASTER, del_012,0); 
   buffer_append(d, MASTER, del_345,0); 
   buffer_append(d, MASTER, del_67,0); 
   ret = buffer_send(d,MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
   return  ret; 
 }
 
@@ -2321,12 +4431,12 @@ int beacon_get_trigger_delays(beacon_dev_t *d, uint8_t * delays)
   uint8_t del_67[BN_SPI_BYTES] =  {0,0,0,0}; 
   int ret = 0;  
 
-  USING(d); 
+  USING_BD(d,MASTER); 
   append_read_register(d, MASTER, REG_TRIG_DELAY_012, del_012); 
   append_read_register(d, MASTER, REG_TRIG_DELAY_345, del_345); 
   append_read_register(d, MASTER, REG_TRIG_DELAY_67, del_67); 
   ret = buffer_send(d,MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
 
   delays[0] = del_012[3]; 
   delays[1] = del_012[2]; 
@@ -2352,9 +4462,9 @@ int beacon_set_trigger_path_low_pass(beacon_dev_t * d, int on)
 
   int ret; 
   uint8_t buf[BN_SPI_BYTES] = { REG_TRIGGER_LOWPASS, 0, 0, on & 1 }; 
-  USING(d); 
-  ret = do_write(d->fd[0], buf); 
-  DONE(d); 
+  USING_BD(d,MASTER); 
+  ret = write_word(d, 0, buf); 
+  DONE_BD(d,MASTER); 
   return ret == BN_SPI_BYTES ? 0 : 1; 
 }
 
@@ -2379,11 +4489,11 @@ int beacon_set_dynamic_masking(beacon_dev_t * d, int enable, uint8_t threshold,
   int ret; 
   uint8_t buf0[BN_SPI_BYTES] = { REG_DYN_MASK, 0, enable & 1, threshold }; 
   uint8_t buf1[BN_SPI_BYTES] = { REG_DYN_HOLDOFF, 0, holdoff >> 8 , holdoff & 0xff }; 
-  USING(d); 
+  USING_BD(d,MASTER); 
   buffer_append(d, MASTER, buf0,0); 
   buffer_append(d, MASTER, buf1,0); 
   ret = buffer_send(d, MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
   return ret; 
 }
 
@@ -2392,11 +4502,11 @@ int beacon_get_dynamic_masking(beacon_dev_t * d, int * enable, uint8_t * thresho
   int ret; 
   uint8_t buf0[BN_SPI_BYTES];
   uint8_t buf1[BN_SPI_BYTES]; 
-  USING(d); 
+  USING_BD(d,MASTER); 
   append_read_register(d, MASTER, REG_DYN_MASK,buf0); 
   append_read_register(d, MASTER, REG_DYN_HOLDOFF,buf1); 
   ret = buffer_send(d, MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
   if (ret) return ret; 
 
   *enable = buf0[2] &1; 
@@ -2417,12 +4527,12 @@ int beacon_set_veto_options(beacon_dev_t * d, const beacon_veto_options_t * opt)
   uint8_t veto_cut_0[BN_SPI_BYTES] = { REG_VETO_CUT_0, opt->sideswipe_cut_value, opt->cw_cut_value, opt->saturation_cut_value }; 
   uint8_t veto_cut_1[BN_SPI_BYTES] = { REG_VETO_CUT_1, 0, 0, opt->extended_cut_value }; 
 
-  USING(d); 
+  USING_BD(d,MASTER); 
   buffer_append(d, MASTER, trigger_vetos, 0); 
   buffer_append(d, MASTER, veto_cut_0, 0); 
   buffer_append(d, MASTER, veto_cut_1, 0); 
   ret = buffer_send(d,MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
 
   return ret; 
 }
@@ -2435,12 +4545,12 @@ int beacon_get_veto_options(beacon_dev_t * d, beacon_veto_options_t * opt)
   uint8_t veto_cut_0[BN_SPI_BYTES];
   uint8_t veto_cut_1[BN_SPI_BYTES]; 
 
-  USING(d); 
+  USING_BD(d,MASTER); 
   append_read_register(d, MASTER, REG_TRIGGER_VETOS,trigger_vetos); 
   append_read_register(d, MASTER, REG_VETO_CUT_0,veto_cut_0); 
   append_read_register(d, MASTER, REG_VETO_CUT_1,veto_cut_1); 
   ret = buffer_send(d,MASTER); 
-  DONE(d); 
+  DONE_BD(d,MASTER); 
 
   if (!ret) 
   {
@@ -2,6 +2,7 @@
 #define _beacondaq_h
 
 #include "beacon.h" 
+#include "beacontransport.h" 
 
 /** \file beacondaq.h  
  *
@@ -55,6 +56,7 @@ typedef struct beacon_ext_input_config
   uint16_t trig_delay;         //if used as trigger, delay  is 128 ns * this 
 } beacon_ext_input_config_t; 
 
+/** Which board. With more than one slave, slaves are numbered 1 to beacon_get_num_boards()-1 in the order they were opened. */
 typedef enum beacon_which_board
 {
   MASTER = 0, 
@@ -118,8 +120,9 @@ typedef struct beacon_veto_options
  *
  * If that turns out to be too slow, I guess we can write a kernel driver. 
  *
- * Optionally, a mutex can be created to help synchronize access to this device
- * from multiple threads. 
+ * Optionally, mutexes can be created to help synchronize access to this device
+ * from multiple threads. Each board has its own lock, so e.g. a housekeeping thread 
+ * reading the status of one board doesn't have to wait for the readout of another. 
  *
  * For now, the device handle also keeps track of the board id, buffer length
  * and the readout number offset. On initialization, the board id is set to the next
@@ -132,6 +135,11 @@ typedef struct beacon_veto_options
  * process can hold it. 
  *
  *
+ * The device names are passed to beacon_transport_open, so besides spidev devices, 
+ * "emu" (optionally followed by options, e.g. "emu:rate=1000") will open an emulated board instead. 
+ * "record:FILE:DEVICE" and "replay:FILE" record an SPI session or play one back. 
+ * See beacontransport.h, beaconemu.h and beaconreplay.h. 
+ *
  * @param spi_master_device_name The master SPI device (likely something like /dev/spidev2.0) 
  * @param spi_slave_device_name The slave SPI device (likely something like /dev/spidev1.0) , or 0 for single board mode
  * @param power_gpio_number If positive, the GPIO that controls the board (and should be enabled at start) 
@@ -146,6 +154,45 @@ beacon_dev_t * beacon_open(const char * spi_master_device_name,
                              int power_gpio_number, 
                              int thread_safe) ; 
 
+/** Like beacon_open, but with already-opened transports. 
+ *
+ * The device takes ownership of the transports (they will be closed by beacon_close, or if this fails). 
+ *
+ * @param master the master transport
+ * @param slave the slave transport, or 0 for single board mode
+ * @param power_gpio_number If positive, the GPIO that controls the board (and should be enabled at start) 
+ * @param thread_safe  If non-zero a mutex will be initialized that will control concurrent access 
+ * @returns a pointer to the device handle, or 0 if something went wrong. 
+ */ 
+beacon_dev_t * beacon_open_transport(beacon_transport_t * master, 
+                                     beacon_transport_t * slave, 
+                                     int power_gpio_number, 
+                                     int thread_safe); 
+
+/** Like beacon_open, but for any number of boards (up to BN_MAX_BOARDS). 
+ *
+ * The first device is the master, the rest are slaves. When there is more than
+ * one board, each slave gets a thread so that the boards are read out at the same time. 
+ *
+ * @param spi_device_names the device names, master first 
+ * @param nboards the number of boards 
+ * @param power_gpio_number If positive, the GPIO that controls the board (and should be enabled at start) 
+ * @param thread_safe  If non-zero a mutex will be initialized that will control concurrent access 
+ * @returns a pointer to the device handle, or 0 if something went wrong. 
+ */
+beacon_dev_t * beacon_open_boards(const char ** spi_device_names, 
+                                  int nboards, 
+                                  int power_gpio_number, 
+                                  int thread_safe); 
+
+/** Like beacon_open_boards, but with already-opened transports (master first). 
+ * The device takes ownership of the transports (they will be closed by beacon_close, or if this fails). 
+ */
+beacon_dev_t * beacon_open_transports(beacon_transport_t ** transports, 
+                                      int nboards, 
+                                      int power_gpio_number, 
+                                      int thread_safe); 
+
 /** Deinitialize the phased array device and frees all memory. Do not attempt to use the device after closing. */ 
 int beacon_close(beacon_dev_t * d); 
 
@@ -170,6 +217,7 @@ void beacon_set_readout_number_offset(beacon_dev_t * d, uint64_t offset);
  * @param d the board to reset
  * @param type The type of reset to do. See the documentation for beacon_reset_t 
  * After reset, the phased trigger will be disabled and will need to be enabled if desired. 
+ * The register cache is resynchronized at the end (see beacon_resync_registers). 
  * @returns 0 on success
  */
 int beacon_reset(beacon_dev_t *d, beacon_reset_t type); 
@@ -177,6 +225,12 @@ int beacon_reset(beacon_dev_t *d, beacon_reset_t type);
 /**Retrieve the board id for the current event. */
 uint8_t beacon_get_board_id(const beacon_dev_t * d, beacon_which_board_t which_board) ; 
 
+/** Retrieve the transport used to talk to a board (e.g. to pass to beacon_emu_set_trigger_rate), or 0 if there is no such board */ 
+beacon_transport_t * beacon_get_transport(beacon_dev_t * d, beacon_which_board_t which); 
+
+/** The number of boards (master + slaves) */ 
+int beacon_get_num_boards(const beacon_dev_t * d); 
+
 
 /** Set the length of the readout buffer. Can be anything between 0 and 2048. (default is 624). */ 
 void beacon_set_buffer_length(beacon_dev_t *d, uint16_t buffer); 
@@ -184,6 +238,69 @@ void beacon_set_buffer_length(beacon_dev_t *d, uint16_t buffer);
 /** Retrieves the current buffer length */ 
 uint16_t beacon_get_buffer_length(const beacon_dev_t *d); 
 
+/** Set which channels are read out on a board (bit i for channel i). The default is all 8 on the master, 
+ * and the first 4 on the slave. Channels that aren't read are zeroed in events, cost no SPI time and aren't 
+ * written to disk, so e.g. dead antennas can be left out. Returns -1 if there is no such board. */ 
+int beacon_set_channel_read_mask(beacon_dev_t *d, uint8_t mask, beacon_which_board_t which); 
+
+/** Retrieves the channels read out on a board, 0 if there is no such board */ 
+uint8_t beacon_get_channel_read_mask(const beacon_dev_t *d, beacon_which_board_t which); 
+
+/** Only read out a window of the buffer around the trigger, from pre samples before it to post samples 
+ * after it (the trigger being pretrigger samples into the buffer, see beacon_set_pretrigger). Readout time 
+ * goes with the number of samples read, so this helps when only the pulse matters, e.g. in high-rate 
+ * calibration runs. The window is rounded out to the 16 samples the board reads at a time, and kept inside 
+ * the buffer length. Events then have a buffer_length of the samples actually read, and the header's 
+ * readout_window_start says where they start in the buffer. Both 0 (the default) reads the whole buffer. 
+ */ 
+void beacon_set_readout_window(beacon_dev_t *d, uint16_t pre, uint16_t post); 
+
+/** Retrieves the readout window (either may be 0) */ 
+void beacon_get_readout_window(const beacon_dev_t *d, uint16_t * pre, uint16_t * post); 
+
+/** The number of samples per waveform a readout gets now: the buffer length, or less with a readout window */ 
+uint16_t beacon_get_readout_length(const beacon_dev_t *d); 
+
+/** Only read the waveforms of one in every prescale events of a trigger type (BN_TRIG_SW, BN_TRIG_RF or BN_TRIG_EXT), 
+ * e.g. to keep up with a high RF rate in a noisy period. Every event still gets its header, and its buffer is cleared 
+ * right after the metadata is read, so the buffers turn over much faster. The others are flagged with 
+ * BN_SKIP_PRESCALED in the header's waveforms_skipped, and their events (and beams and power sums) have no samples. 
+ * 1 (the default) reads every event, 0 none. Only events the event selector (if any) wants read count towards it. 
+ * The reads beacon_reset and beacon_qualify_spi_clock do for themselves are neither prescaled nor counted. 
+ * Returns -1 if there is no such trigger type. 
+ */ 
+int beacon_set_waveform_prescale(beacon_dev_t *d, beacon_trig_type_t type, unsigned prescale); 
+
+/** Retrieves the waveform prescaler for a trigger type (0 if there is no such trigger type) */ 
+unsigned beacon_get_waveform_prescale(const beacon_dev_t *d, beacon_trig_type_t type); 
+
+/** What an event selector wants done with an event */ 
+typedef enum beacon_selection 
+{
+  BN_SELECT_READ = 0, //!< read the waveforms (subject to the prescaler) 
+  BN_SELECT_ROI,      //!< only read the region of interest the selector filled in (subject to the prescaler) 
+  BN_SELECT_SKIP,     //!< keep the header, but don't read the waveforms (BN_SKIP_SELECTED) 
+  BN_SELECT_DROP      //!< don't read the waveforms, and drop the event where possible (BN_SKIP_DROPPED) 
+} beacon_selection_t; 
+
+/** Decides what to do with an event from its decoded header (e.g. beam_power, triggered_beams, trig_type or 
+ * dynamic_beam_mask), before any of its waveforms are read. roi_start and roi_length come filled in with the 
+ * samples that would be read (the readout window, if any), and can be narrowed for BN_SELECT_ROI. 
+ * Called with the device locked, from whichever thread reads out, so it must be quick and must not use the device. 
+ */ 
+typedef beacon_selection_t (*beacon_event_selector_t)(const beacon_header_t * hd, uint16_t * roi_start, uint16_t * roi_length, void * arg); 
+
+/** Set a function to decide, event by event, whether to read the waveforms, only a region of interest of them, or 
+ * none at all, e.g. to skip the readout of events a CW-contaminated beam triggered on, which its beam power alone 
+ * gives away. A region of interest is rounded out to the 16 samples the board reads at a time and kept inside the 
+ * readout window; the header and event then have its start and length as readout_window_start and buffer_length, 
+ * the same as with a readout window. Events that aren't read have no samples, and are flagged in the header's 
+ * waveforms_skipped. Dropped events are flagged BN_SKIP_DROPPED; beacon_read_multiple_pooled and beacon_acq leave 
+ * them out, everything else returns them like any other. The selector isn't asked about the reads beacon_reset and 
+ * beacon_qualify_spi_clock do for themselves. selector = 0 (the default) reads everything. 
+ */ 
+void beacon_set_event_selector(beacon_dev_t *d, beacon_event_selector_t selector, void * arg); 
+
 
 /** Send a software trigger to the device
  * @param d the device to send a trigger to. 
@@ -196,7 +313,9 @@ int beacon_calpulse(beacon_dev_t * d, unsigned state) ;
 
 /** Waits for data to be available, or time out, or beacon_cancel_wait. 
  * 
- * Will busy poll beacon_check_buffers (which) 
+ * Will busy poll beacon_check_buffers (which), unless a data ready line has been set up with
+ * beacon_set_ready_gpio or beacon_set_ready_fd, in which case it sleeps until that fires 
+ * (still checking over SPI every now and then in case an edge was missed). 
  *
  * If ready is passed, it will be filled after done waiting. Normally it should
  * be non-zero unless interrupted or the timeout is reached. 
@@ -219,6 +338,26 @@ int beacon_calpulse(beacon_dev_t * d, unsigned state) ;
  **/
 int beacon_wait(beacon_dev_t *d, beacon_buffer_mask_t * ready, float timeout_seconds, beacon_which_board_t which); 
 
+/** Get a file descriptor that becomes readable (POLLIN) when buffers are ready, for use with poll / epoll / select.
+ *
+ * The first call starts a thread that sits in beacon_wait on the given board (so nobody else should call 
+ * beacon_wait: they'll get EBUSY), which uses a data ready line if one is set up (see beacon_set_ready_gpio). 
+ * When the fd becomes readable, call beacon_notify_ack to find out which buffers are ready. The thread stops looking 
+ * until those buffers have been read (or cleared), so the fd doesn't keep firing for the same buffers. 
+ *
+ * beacon_cancel_wait also makes the fd readable, in which case beacon_notify_ack returns EINTR. 
+ * The fd belongs to the library, and is closed by beacon_notify_close or beacon_close. Returns -1 on failure. 
+ */ 
+int beacon_notify_fd(beacon_dev_t *d, beacon_which_board_t which); 
+
+/** Acknowledge the notification fd, filling ready (if not 0) with the buffers that became ready. 
+ * Returns 0, EINTR if the notification was for a beacon_cancel_wait, or -1 if there is no notification fd. 
+ */ 
+int beacon_notify_ack(beacon_dev_t *d, beacon_buffer_mask_t * ready); 
+
+/** Stop the notification thread and close its fd. Returns 0 on success. */ 
+int beacon_notify_close(beacon_dev_t *d); 
+
 /** Checks to see which buffers are ready to be read
  * If next_buffer is non-zero, will fill it with what the board things the next buffer to read is. 
  * */ 
@@ -288,6 +427,16 @@ int beacon_read_single(beacon_dev_t *d, uint8_t buffer,
 int beacon_read_multiple_array(beacon_dev_t *d, beacon_buffer_mask_t mask, 
                                 beacon_header_t *header_arr,  beacon_event_t * event_arr
                                 ); 
+
+/** Same as beacon_read_multiple_array, but also fills ready (if not 0) with the buffers that were ready 
+ * when the last one was cleared. That status is read in the same SPI message as the clear, so when events 
+ * are coming in back to back, they can be read without polling in between. Otherwise beacon_wait (and so 
+ * beacon_wait_for_and_read_multiple_events) uses it instead of its first poll; either way it's only used once. 
+ * ready is 0 if the status couldn't be read. Returns 0 on success. 
+ **/ 
+int beacon_read_multiple_array_and_check(beacon_dev_t *d, beacon_buffer_mask_t mask, 
+                                         beacon_header_t *header_arr,  beacon_event_t * event_arr, 
+                                         beacon_buffer_mask_t * ready); 
  
 /** Reads buffers specified by mask. An pointer to event and header  must exist for each
  * buffer in the array pointed to by header_arr and event_arr ( Clears each
@@ -298,6 +447,39 @@ int beacon_read_multiple_ptr(beacon_dev_t *d, beacon_buffer_mask_t mask,
                               beacon_header_t **header_ptr_arr,  beacon_event_t ** event_ptr_arr
                               ); 
 
+/** Same as beacon_read_multiple_ptr, but reads into compact events (see beacon_compact_event_t), e.g. from a beacon_compact_pool_t. 
+ * Each needs room for the current buffer length. Returns 0 on success. 
+ **/
+int beacon_read_multiple_compact(beacon_dev_t *d, beacon_buffer_mask_t mask, 
+                                 beacon_header_t **header_ptr_arr,  beacon_compact_event_t ** event_ptr_arr); 
+
+/** Same as beacon_read_multiple_ptr, but also reads the FPGA's beamformed waveforms (beacon_beams_t) and / or 
+ * its power sums (beacon_powersum_t) for each buffer, from the master. Pass 0 for whichever isn't wanted, 
+ * otherwise there must be one for each buffer, like the events. These cover the same samples as the events 
+ * (including the readout window) for each of the BN_NUM_BEAMS beams, so they take about 3 times as long to 
+ * read as the master's waveforms each. Returns 0 on success. 
+ **/
+int beacon_read_multiple_products(beacon_dev_t *d, beacon_buffer_mask_t mask, 
+                                  beacon_header_t **header_ptr_arr, beacon_event_t ** event_ptr_arr, 
+                                  beacon_beams_t ** beams_ptr_arr, beacon_powersum_t ** powersum_ptr_arr); 
+
+/** Reads the buffers specified by mask into header / event pairs taken from pool (see beacon_event_pool_t), 
+ * so nothing has to be copied out afterwards. out (which needs room for BN_NUM_BUFFER) is filled with the events read, 
+ * each holding one reference, which the caller releases with beacon_pooled_event_release (after taking more for 
+ * anyone else it hands them to). If the pool doesn't have enough left, only as many buffers are read as it 
+ * has room for (in order), and the rest stay in the board. Events the event selector dropped go straight back 
+ * to the pool, and aren't counted. 
+ *
+ * Returns the number of events read, or -1 on failure (in which case nothing is held). 
+ **/
+int beacon_read_multiple_pooled(beacon_dev_t *d, beacon_buffer_mask_t mask, beacon_event_pool_t * pool, 
+                                beacon_pooled_event_t ** out); 
+
+/** Waits for buffers (on the master) and reads them with beacon_read_multiple_pooled. 
+ * Returns the number of events read (0 if the wait was cancelled or the pool is empty), or -1 on failure. 
+ **/ 
+int beacon_wait_for_and_read_multiple_pooled(beacon_dev_t *d, beacon_event_pool_t * pool, beacon_pooled_event_t ** out); 
+
 
 
 /** Lowest-level waveform read command. 
@@ -308,7 +490,8 @@ int beacon_read_multiple_ptr(beacon_dev_t *d, beacon_buffer_mask_t mask,
 int beacon_read_raw(beacon_dev_t *d, uint8_t buffer, uint8_t channel, uint8_t start_ram, uint8_t end_ram, uint8_t * data, beacon_which_board_t which); 
 
 
-/** Lowest-level write command. Writes 4 bytes from buffer to device (if master/slave, to both) */ 
+/** Lowest-level write command. Writes 4 bytes from buffer to device (if master/slave, to both). 
+ * Like every other write, it's skipped if the register cache knows it wouldn't change anything. */ 
 int beacon_write(beacon_dev_t *d, const uint8_t* buffer); 
 
 /** Lowest-level read command. Reads 4 bytes into buffer */ 
@@ -332,18 +515,216 @@ void beacon_cancel_wait(beacon_dev_t *d) ;
  * @param slave   if 1, read from slave instead of master (or single board) 
  * @return 0 on success
  * 
+ * Configuration registers are answered from the register cache when possible (see beacon_set_register_cache). 
  **/ 
 int beacon_read_register(beacon_dev_t * d, uint8_t address, uint8_t * result, beacon_which_board_t which); 
 
+/** 
+ * The library keeps a cache of what it wrote to (or read from) each board's
+ * configuration registers (thresholds, masks, attenuation, trigger settings, ...) and
+ * the readout state (mode, buffer, channel). Writes that wouldn't change anything are
+ * skipped, and getters are answered from the cache without any SPI. This is on by default. 
+ *
+ * The cache assumes nothing but this handle changes those registers. If something else might 
+ * have (another process, a power cycle, ...), call beacon_resync_registers. Turning it off (or on) clears it. 
+ * Returns 0 on success. 
+ **/ 
+int beacon_set_register_cache(beacon_dev_t *d, int enable); 
+
+/** 1 if the register cache is on */ 
+int beacon_get_register_cache(const beacon_dev_t *d); 
+
+/** Throw away the register cache and read all the cached registers back from every board. 
+ * beacon_reset does this after resetting. Returns 0 on success. */ 
+int beacon_resync_registers(beacon_dev_t *d); 
+
 /** Set the spi clock rate in MHz (default 10MHz)*/ 
 int beacon_set_spi_clock(beacon_dev_t *d, unsigned clock); 
 
+/** Get the spi clock rate in MHz */ 
+unsigned beacon_get_spi_clock(const beacon_dev_t *d); 
+
+/** Maximum number of clock rates beacon_qualify_spi_clock can try */ 
+#define BN_MAX_QUALIFY_CLOCKS 32 
+
+/** SPI clock (in MHz) that the reference waveforms are read at when qualifying */ 
+#define BN_QUALIFY_REFERENCE_CLOCK 1
+
+/** Results of beacon_qualify_spi_clock */ 
+typedef struct beacon_spi_clock_qualification
+{
+  int nclocks;                                    //!< number of clock rates tried 
+  unsigned clock[BN_MAX_QUALIFY_CLOCKS];          //!< the clock rates tried (MHz), in increasing order  
+  uint64_t nbits[BN_MAX_QUALIFY_CLOCKS];          //!< number of bits compared at each rate 
+  uint64_t nbit_errors[BN_MAX_QUALIFY_CLOCKS];    //!< number of bits that differed from the reference at each rate
+  unsigned fastest_clean;                         //!< fastest rate for which it and every slower rate was error-free (0 if none)  
+  unsigned chosen;                                //!< the rate picked after applying the margin (0 if none) 
+} beacon_spi_clock_qualification_t; 
+
+/** Find the fastest SPI clock that reads back data without errors. 
+ *
+ * This turns on verification mode, takes a software trigger, and reads the
+ * waveforms of that buffer at BN_QUALIFY_REFERENCE_CLOCK as a reference.
+ * The same buffer is then read nreads times at each of the given rates and
+ * compared bit-by-bit to the reference. Afterwards the event is read out
+ * (so the buffer is cleared as usual) and verification mode is restored. 
+ *
+ * The chosen clock is the fastest tried rate at most (1-margin) times the
+ * fastest clean rate, and is applied if apply is non-zero (otherwise the
+ * clock is restored to what it was). 
+ *
+ * Triggers should be off (other than software triggers) when calling this. 
+ *
+ * @param d the device
+ * @param clocks the rates to try, in MHz. If 0, 4 to 48 MHz in steps of 4 are tried.  
+ * @param nclocks the number of rates 
+ * @param nreads how many times to read the buffer at each rate 
+ * @param margin  fractional safety margin (e.g. 0.1) 
+ * @param apply  set the clock to the chosen rate 
+ * @param result filled with the bit error rates and the chosen clock 
+ * @returns 0 on success, or -1 if the reference could not be read 
+ */ 
+int beacon_qualify_spi_clock(beacon_dev_t *d, const unsigned * clocks, int nclocks, int nreads, 
+                             float margin, int apply, beacon_spi_clock_qualification_t * result); 
+
 /** toggle chipselect between each transfer (Default yes) */ 
 int beacon_set_toggle_chipselect(beacon_dev_t *d, int cs_toggle); 
 
 /** toggle additional delay between transfers (Default 0) */ 
 int beacon_set_transaction_delay(beacon_dev_t *d, unsigned delay_usecs); 
 
+/** Read waveforms full duplex, reading each chunk while selecting the next
+ * one, which needs almost half as many transfers.  (Default yes). 
+ * If 0, the old half-duplex readout (select, then read, for each chunk) is used.  */ 
+int beacon_set_full_duplex(beacon_dev_t *d, int full_duplex); 
+
+/** 1 if waveforms are read full duplex */ 
+int beacon_get_full_duplex(const beacon_dev_t *d); 
+
+/** Defer clearing each buffer read out until the next SPI message to the master (the next buffer's waveforms, 
+ * or a status poll), instead of flushing the clear on its own. Clears waiting together go out as one, and whatever 
+ * is left at the end of a readout is sent then, along with the status read beacon_wait uses instead of polling, so 
+ * buffers are still freed promptly, but reading 4 buffers takes 3 fewer messages. Only applies with just the master, 
+ * since the boards have to clear in sync. (Default no). */ 
+int beacon_set_deferred_clear(beacon_dev_t *d, int defer); 
+
+/** 1 if clears are deferred */ 
+int beacon_get_deferred_clear(const beacon_dev_t *d); 
+
+/** Set how many transfers go in each SPI message. More means fewer
+ * ioctls per event.  0 (the default when opening) picks the most the
+ * transport allows, which for spidev is set by
+ * /sys/module/spidev/parameters/bufsiz (but can't be more than
+ * BEACON_SPIDEV_MAX_XFERS). Returns 0 on success. */ 
+int beacon_set_max_xfers(beacon_dev_t *d, int max_xfers); 
+
+/** The number of transfers that go in each SPI message */ 
+int beacon_get_max_xfers(const beacon_dev_t *d); 
+
+/** Counters for measuring how much SPI traffic the readout costs */ 
+typedef struct beacon_readout_stats
+{
+  uint64_t nevents;   //!< events read out 
+  uint64_t nmessages; //!< SPI messages (ioctls) sent, including those used for polling
+  uint64_t nxfers;    //!< 32-bit transfers in those messages 
+  uint64_t nplans_built; //!< waveform transfer plans built, which happens the first time each buffer is read and whenever the channel mask, readout range or duplex mode changes 
+  uint64_t nwrites_skipped; //!< register writes skipped since they wouldn't have changed anything 
+  uint64_t nreads_cached;   //!< register reads answered from the register cache 
+  uint64_t nstatus_after_clear; //!< times the buffer status read along with the last clear was used instead of polling (by beacon_wait or beacon_read_multiple_array_and_check)
+  uint64_t nclears_riding; //!< buffers whose clear went out with another SPI message instead of its own (see beacon_set_deferred_clear) 
+} beacon_readout_stats_t; 
+
+/** Get the readout statistics accumulated since opening (or the last reset) */ 
+int beacon_get_readout_stats(beacon_dev_t *d, beacon_readout_stats_t * stats); 
+
+/** Reset the readout statistics (including the timing summary) */ 
+void beacon_reset_readout_stats(beacon_dev_t *d); 
+
+/** The steps of a readout that are timed (see beacon_readout_timing_t) */ 
+typedef enum beacon_readout_step
+{
+  BN_STEP_LATENCY = 0,  //!< from beacon_wait seeing the buffer ready to the readout starting (waiting on whoever reads) 
+  BN_STEP_METADATA,     //!< reading the metadata (once for all the buffers read together) 
+  BN_STEP_WAVEFORMS,    //!< reading an event's waveforms (until the slowest board is done) 
+  BN_STEP_PRODUCTS,     //!< reading the beams and power sums, if asked for 
+  BN_STEP_CLEAR,        //!< clearing the buffer 
+  BN_STEP_TOTAL,        //!< from the buffer being seen ready (or the readout starting) to it being cleared 
+  BN_NUM_READOUT_STEPS 
+} beacon_readout_step_t; 
+
+/** Percentiles of how long each step of the readout took, since opening (or beacon_reset_readout_stats). 
+ * They're binned 8 bins per factor of 2 (so good to about 10%), and each is the top of its bin. */ 
+typedef struct beacon_readout_timing_summary
+{
+  uint64_t n[BN_NUM_READOUT_STEPS];     //!< how many times each step was timed 
+  float p50_us[BN_NUM_READOUT_STEPS];   //!< median, in us 
+  float p90_us[BN_NUM_READOUT_STEPS];   //!< 90th percentile, in us 
+  float p99_us[BN_NUM_READOUT_STEPS];   //!< 99th percentile, in us 
+  float max_us[BN_NUM_READOUT_STEPS];   //!< the longest, in us (exactly) 
+} beacon_readout_timing_summary_t; 
+
+/** The number of recent events whose readout timing is kept */ 
+#define BN_READOUT_TIMING_HISTORY 64 
+
+/** Get the readout timing of one of the last BN_READOUT_TIMING_HISTORY events read out, e.g. to write it 
+ * alongside the header. Returns 0 on success, or -1 if that event isn't there (anymore). */ 
+int beacon_get_readout_timing(beacon_dev_t *d, uint64_t event_number, beacon_readout_timing_t * timing); 
+
+/** Get the percentiles of how long each step of the readout took */ 
+int beacon_get_readout_timing_summary(beacon_dev_t *d, beacon_readout_timing_summary_t * summary); 
+
+/** Print the timing summary prettily */ 
+int beacon_readout_timing_summary_print(FILE * f, const beacon_readout_timing_summary_t * summary); 
+
+
+/** Number of records kept in the SPI trace ring (must be a power of 2) */ 
+#define BN_SPI_TRACE_SIZE 4096 
+
+/** Magic number at the start of each block of an SPI trace file */ 
+#define BN_SPI_TRACE_MAGIC 0x5452 
+
+/** What kind of SPI operation a trace record is for */ 
+typedef enum beacon_spi_trace_op
+{
+  BN_SPI_TRACE_XFER = 0, //!< an SPI_IOC_MESSAGE 
+  BN_SPI_TRACE_WRITE = 1, 
+  BN_SPI_TRACE_READ = 2 
+} beacon_spi_trace_op_t; 
+
+/** One traced SPI operation */ 
+typedef struct beacon_spi_trace_record
+{
+  uint64_t start_ns;    //!< CLOCK_MONOTONIC time when the operation started, in ns 
+  uint32_t duration_ns; //!< how long the syscall took 
+  uint32_t nbytes;      //!< bytes transferred (or requested, if it failed) 
+  int16_t fd;           //!< file descriptor of the device (-1 if it doesn't have one) 
+  uint16_t nxfers;      //!< number of transfers in the message 
+  uint8_t op;           //!< a beacon_spi_trace_op_t 
+  uint8_t failed;       //!< 1 if the operation returned an error 
+  uint16_t reserved; 
+} beacon_spi_trace_record_t; 
+
+/** Each call to beacon_drain_spi_trace writes one of these, followed by nrecords records */ 
+typedef struct beacon_spi_trace_block
+{
+  uint16_t magic;       //!< BN_SPI_TRACE_MAGIC
+  uint16_t record_size; //!< sizeof(beacon_spi_trace_record_t), in case it ever changes 
+  uint32_t nrecords;    //!< number of records following 
+  uint64_t nlost;       //!< records overwritten before they could be drained, since the last block 
+} beacon_spi_trace_block_t; 
+
+/** Turn SPI tracing on or off. When on, every ioctl/read/write is timed
+ * and recorded in a ring of BN_SPI_TRACE_SIZE records. This is cheap enough
+ * to leave on (two clock_gettime's and an atomic increment per SPI message) 
+ * Returns 0 on success. */ 
+int beacon_set_spi_trace(beacon_dev_t *d, int enable); 
+
+/** Write all the trace records collected since the last call to f (as a
+ * beacon_spi_trace_block_t followed by the records), without blocking the readout. 
+ * Only call from one thread at a time. 
+ * Returns the number of records written, or -1 on error. */ 
+int beacon_drain_spi_trace(beacon_dev_t *d, FILE * f); 
+
 
 
 /** Set all the thresholds 
@@ -366,11 +747,12 @@ uint32_t beacon_get_trigger_mask(beacon_dev_t* d);
 
 /** Set the attenuation for each channel .
  *  Should have BN_NUM_CHAN members for both master and slave. If 0, not applied for that board. 
+ *  If there is more than one slave, they all get attenuation_slave. 
  */ 
 int beacon_set_attenuation(beacon_dev_t * d, const uint8_t * attenuation_master, const uint8_t * attenuation_slave); 
 
 /** Get the attenuation for each channel .
- *  Should have BN_NUM_CHAN members. If 0, not read. 
+ *  Should have BN_NUM_CHAN members. If 0, not read. The slave attenuation is read from the first slave. 
  */ 
 int beacon_get_attenuation(beacon_dev_t * d, uint8_t * attenuation_master, uint8_t  *attenuation_slave); 
 
@@ -425,9 +807,43 @@ int beacon_enable_verification_mode(beacon_dev_t * d, int mode);
 /* 0 if not on, 1 if on, -1 if error */ 
 int beacon_query_verification_mode(beacon_dev_t * d); 
 
-/** The poll interval for waiting, in us. If 0, will just do a sched_yield */ 
+/** The poll interval for waiting, in us (default 500). If 0, will just do a sched_yield. Not used with adaptive polling. */ 
 int beacon_set_poll_interval(beacon_dev_t *, unsigned short us); 
 
+/** Have beacon_wait pick the poll interval itself, based on the trigger rate (estimated from the time between events). 
+ * It polls a few times per expected event, but never more than max_latency_us apart, and never so often that 
+ * polling takes more than max_bus_fraction of the SPI bus (which wins if the two conflict). 
+ * max_latency_us = 0 turns it off, going back to the fixed interval from beacon_set_poll_interval. 
+ * Not used if there's a data ready line (see beacon_set_ready_gpio). Returns 0 on success. 
+ */ 
+int beacon_set_adaptive_polling(beacon_dev_t *d, unsigned max_latency_us, float max_bus_fraction); 
+
+/** What beacon_wait's polling is up to */ 
+typedef struct beacon_poll_stats
+{
+  float rate_hz;        //!< estimated event rate 
+  unsigned interval_us; //!< current poll interval 
+  float poll_time_us;   //!< how long a status poll takes 
+  float bus_fraction;   //!< fraction of the bus polling at interval_us takes 
+  uint64_t npolls;      //!< status polls done by beacon_wait since opening 
+  uint64_t nevents;     //!< buffers seen by beacon_wait since opening 
+} beacon_poll_stats_t; 
+
+/** Get the polling statistics. Returns 0 on success. */ 
+int beacon_get_poll_stats(beacon_dev_t *d, beacon_poll_stats_t * st); 
+
+/** Have beacon_wait sleep until a rising edge on the given GPIO (wired to the board's "data ready" output)
+ * instead of polling the status register over SPI. The GPIO is made an input with its edge set to "rising". 
+ * Pass 0 to go back to polling. Returns 0 on success. 
+ */ 
+int beacon_set_ready_gpio(beacon_dev_t *d, int gpio_number); 
+
+/** Like beacon_set_ready_gpio, but with any file descriptor that becomes readable when data may be
+ * ready and is acknowledged by reading 8 bytes from it, like an eventfd (see beacon_emu_ready_fd, to test without hardware). 
+ * The fd is not closed by the library. Pass -1 to go back to polling. Returns 0 on success. 
+ */ 
+int beacon_set_ready_fd(beacon_dev_t *d, int fd); 
+
 /** Sets the trigger delays. Should have BN_NUM_CHAN members */ 
 int beacon_set_trigger_delays(beacon_dev_t *d, const uint8_t * delays); 
 
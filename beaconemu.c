@@ -0,0 +1,884 @@
+#include "beaconemu.h"
+#include "beaconregs.h"
+#include "beacondaq.h"
+#include <linux/spi/spidev.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* In-process FPGA emulator. See beaconemu.h for what it does (and doesn't do).
+ *
+ * The emulator is lazy: nothing happens in the background. Every time a
+ * board is touched, the trigger schedule is advanced to the current time and
+ * any triggers that arrived in the meantime are written into the buffers.
+ * The exception is when someone asks for a ready fd (the emulated "data
+ * ready" line), in which case a ticker thread advances the schedule as the
+ * triggers come due, so the fd fires on time.
+ *
+ * Linked boards (master + slaves) share one group, which holds the trigger
+ * schedule and a lock.
+ */
+
+#define EMU_NUM_REGISTER 256
+#define EMU_MAX_BOARDS 8
+#define EMU_MAX_DEFERRED 64
+#define EMU_BOARD_CLOCK_HZ (500000000/16)
+#define EMU_SAMPLES_PER_ADDRESS (BN_NUM_CHUNK * BN_WORD_SIZE)
+#define EMU_NUM_SCALER_VALUES (BN_NUM_SCALERS * (1 + BN_NUM_BEAMS))
+#define EMU_DEFAULT_CLOCK 20000000
+
+struct emu_event
+{
+  uint64_t event_counter;
+  uint64_t trig_counter;
+  uint64_t trig_time;
+  uint32_t deadtime;
+  uint32_t pps;
+  uint32_t last_beam;
+  uint32_t beam_power;
+  uint32_t beam_mask;
+  uint32_t channel_mask;
+  uint8_t trig_type;
+  uint8_t calpulse;
+  uint8_t pretrigger;
+  uint8_t trig_pol;
+  uint32_t seed;
+};
+
+struct emu_group;
+
+struct emu_board
+{
+  struct emu_group * grp;
+  int index;                           // 0 is master
+  uint32_t reg[EMU_NUM_REGISTER];      // register file, for things that just read back
+  uint8_t latch[BN_WORD_SIZE];         // what will be clocked out on the next transfer
+
+  // readout state
+  uint8_t mode;
+  uint8_t buffer;
+  uint8_t channel;                     // (or beam, in the beam and power sum modes)
+  uint8_t ram_addr;
+  uint8_t scaler_pick;
+  uint16_t scalers[EMU_NUM_SCALER_VALUES];
+
+  // buffers
+  struct emu_event ev[BN_NUM_BUFFER];
+  uint8_t full;
+  uint8_t write_ptr;
+
+  // counters
+  uint64_t event_counter;
+  uint64_t trig_counter;
+  uint32_t deadtime;
+  double t_reset;
+
+  // commands held while the master has sync on (slave only)
+  uint8_t deferred[EMU_MAX_DEFERRED][BN_WORD_SIZE];
+  int ndeferred;
+
+  uint32_t clock_hz;
+  double bits_until_error;
+  beacon_emu_stats_t stats;
+
+  int ready_fd;  // eventfd poked whenever an event is recorded, -1 if nobody asked
+};
+
+struct emu_group
+{
+  pthread_mutex_t mut;
+  beacon_emu_config_t cfg;
+  struct timespec t0;
+  double next_trigger;    // time of the next trigger, in seconds since t0
+  uint32_t rng;
+  int sync;
+  int nboards;
+  struct emu_board * boards[EMU_MAX_BOARDS];
+
+  // ticker thread, only started by beacon_emu_ready_fd
+  pthread_t ticker;
+  pthread_cond_t ticker_cond;
+  int ticker_running;
+  int ticker_quit;
+};
+
+
+static uint32_t xorshift(uint32_t * state)
+{
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+//cheap hash for generating waveform samples on demand
+static uint32_t hash3(uint32_t a, uint32_t b, uint32_t c)
+{
+  uint32_t h = a * 0x9e3779b1u ^ b * 0x85ebca6bu ^ c * 0xc2b2ae35u;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 12;
+  return h;
+}
+
+static double uniform(uint32_t * state)
+{
+  return (xorshift(state) + 0.5) / 4294967296.;
+}
+
+static double now_since(const struct timespec * t0)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t0->tv_sec) + 1e-9 * (now.tv_nsec - t0->tv_nsec);
+}
+
+static double next_interval(struct emu_group * g)
+{
+  double rate = g->cfg.trigger_rate_hz;
+  if (rate <= 0) return INFINITY;
+  if (g->cfg.poisson) return -log(uniform(&g->rng)) / rate;
+  return 1. / rate;
+}
+
+
+
+static void signal_ready(struct emu_board * b)
+{
+  uint64_t one = 1;
+  if (b->ready_fd < 0) return;
+  if (write(b->ready_fd, &one, sizeof(one)) < 0)
+  {
+    // only fails if the counter is about to overflow, in which case it's readable anyway
+  }
+}
+
+/** Write a trigger into the next buffer (if there is room). */
+static void board_trigger(struct emu_board * b, double t, uint8_t trig_type)
+{
+  b->stats.ntriggers++;
+  b->trig_counter++;
+
+  if (b->full & (1 << b->write_ptr))
+  {
+    b->deadtime++;
+    b->stats.ndropped++;
+    return;
+  }
+
+  struct emu_event * ev = &b->ev[b->write_ptr];
+  double since_reset = t - b->t_reset;
+  if (since_reset < 0) since_reset = 0;
+
+  b->event_counter++;
+  ev->event_counter = b->event_counter;
+  ev->trig_counter = b->trig_counter;
+  ev->trig_time = (uint64_t) (since_reset * EMU_BOARD_CLOCK_HZ);
+  ev->deadtime = b->deadtime;
+  ev->pps = (uint32_t) since_reset;
+  ev->trig_type = trig_type;
+  ev->calpulse = b->reg[REG_CALPULSE] & 0xff ? 1 : 0;
+  ev->pretrigger = b->reg[REG_PRETRIGGER] & 0x7;
+  ev->trig_pol = b->reg[REG_TRIG_POLARIZATION] & 0xf;
+  ev->beam_mask = b->reg[REG_TRIGGER_MASK] & 0xffffff;
+  ev->channel_mask = b->reg[REG_CHANNEL_MASK] & 0xff;
+  ev->seed = hash3(b->trig_counter, b->index, 0xbeac);
+  ev->last_beam = trig_type == BN_TRIG_RF ? 1u << (ev->seed % BN_NUM_BEAMS) : 0;
+  ev->beam_power = trig_type == BN_TRIG_RF ? 5000 + (ev->seed >> 8) % 20000 : 0;
+
+  b->full |= 1 << b->write_ptr;
+  b->write_ptr = (b->write_ptr + 1) % BN_NUM_BUFFER;
+  b->stats.nrecorded++;
+  signal_ready(b);
+}
+
+static int rf_enabled(const struct emu_board * b)
+{
+  return b->grp->boards[0]->reg[REG_PHASED_TRIGGER] & 1;
+}
+
+/** Bring every board in the group up to time now*/
+static void group_advance(struct emu_group * g, double now)
+{
+  int ib;
+
+  //nothing gets recorded, so just skip ahead
+  if (!rf_enabled(g->boards[0]) && g->next_trigger <= now)
+  {
+    if (g->cfg.poisson) g->next_trigger = now + next_interval(g);
+    else g->next_trigger += (1 + floor((now - g->next_trigger) * g->cfg.trigger_rate_hz)) / g->cfg.trigger_rate_hz;
+  }
+
+  while (g->next_trigger <= now)
+  {
+    int all_full = 1;
+    for (ib = 0; ib < g->nboards; ib++)
+    {
+      if ((g->boards[ib]->full & 0xf) != 0xf) all_full = 0;
+    }
+
+    // everything is full, so no need to go one at a time.
+    if (all_full && !g->cfg.poisson)
+    {
+      uint64_t n = 1 + (uint64_t) ((now - g->next_trigger) * g->cfg.trigger_rate_hz);
+      for (ib = 0; ib < g->nboards; ib++)
+      {
+        g->boards[ib]->stats.ntriggers += n;
+        g->boards[ib]->stats.ndropped += n;
+        g->boards[ib]->trig_counter += n;
+        g->boards[ib]->deadtime += n;
+      }
+      g->next_trigger += n / g->cfg.trigger_rate_hz;
+      continue;
+    }
+
+    for (ib = 0; ib < g->nboards; ib++)
+    {
+      board_trigger(g->boards[ib], g->next_trigger, BN_TRIG_RF);
+    }
+    g->next_trigger += next_interval(g);
+  }
+}
+
+
+/** Advances the group whenever the next trigger is due (with the group lock held the rest of the time) */
+static void * ticker_main(void * arg)
+{
+  struct emu_group * g = arg;
+
+  pthread_mutex_lock(&g->mut);
+  while (!g->ticker_quit)
+  {
+    group_advance(g, now_since(&g->t0));
+
+    if (isinf(g->next_trigger))
+    {
+      pthread_cond_wait(&g->ticker_cond, &g->mut);
+    }
+    else
+    {
+      struct timespec when = g->t0;
+      double whole = floor(g->next_trigger);
+      when.tv_sec += (time_t) whole;
+      when.tv_nsec += (long) ((g->next_trigger - whole) * 1e9);
+      if (when.tv_nsec >= 1000000000)
+      {
+        when.tv_sec++;
+        when.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&g->ticker_cond, &g->mut, &when);
+    }
+  }
+  pthread_mutex_unlock(&g->mut);
+  return 0;
+}
+
+
+static void board_reset_counters(struct emu_board * b, double now)
+{
+  b->event_counter = 0;
+  b->trig_counter = 0;
+  b->deadtime = 0;
+  b->t_reset = now;
+}
+
+static uint8_t next_to_read(const struct emu_board * b)
+{
+  int i;
+  int best = -1;
+  for (i = 0; i < BN_NUM_BUFFER; i++)
+  {
+    if (!(b->full & (1 << i))) continue;
+    if (best < 0 || b->ev[i].event_counter < b->ev[best].event_counter) best = i;
+  }
+  return best < 0 ? b->write_ptr : best;
+}
+
+static void update_scalers(struct emu_board * b)
+{
+  int i;
+  double rate = rf_enabled(b) ? b->grp->cfg.trigger_rate_hz : 0;
+  for (i = 0; i < EMU_NUM_SCALER_VALUES; i++)
+  {
+    int which_scaler = i / (1 + BN_NUM_BEAMS);
+    int which_channel = i % (1 + BN_NUM_BEAMS);
+    double window = BN_SCALER_TIME(which_scaler);
+    double val = rate * window;
+    if (which_scaler == SCALER_SLOW_GATED) val = 0;
+    if (which_channel) val /= BN_NUM_BEAMS;
+    b->scalers[i] = val > 0xfff ? 0xfff : (uint16_t) val;
+  }
+}
+
+
+static uint32_t register_value(struct emu_board * b, uint8_t addr, double now)
+{
+  const struct emu_event * ev = &b->ev[b->buffer];
+  double since_reset = now - b->t_reset;
+  uint64_t latched;
+
+  switch(addr)
+  {
+    case REG_FIRMWARE_VER:
+      return (b->index == 0 ? 1 << 16 : 0) | 0x10;
+    case REG_FIRMWARE_DATE:
+      return ((2019 >> 4) << 16) | (((2019 & 0xf) << 4 | 10) << 8) | 5;
+    case REG_CHIPID_LOW:
+      return 0xc0ffee;
+    case REG_CHIPID_MID:
+      return 0xbeac00 | b->index;
+    case REG_CHIPID_HI:
+      return 0x00e3;
+    case REG_STATUS:
+      return (next_to_read(b) << 12) | b->full;
+    case REG_CLEAR_STATUS:
+      return b->full;
+    case REG_SCALER_READ:
+    {
+      int i = 2 * b->scaler_pick;
+      uint32_t first = i < EMU_NUM_SCALER_VALUES ? b->scalers[i] : 0;
+      uint32_t second = i + 1 < EMU_NUM_SCALER_VALUES ? b->scalers[i+1] : 0;
+      return (first & 0xfff) | ((second & 0xfff) << 12);
+    }
+    case REG_EVENT_COUNTER_LOW:
+      return ev->event_counter & 0xffffff;
+    case REG_EVENT_COUNTER_HIGH:
+      return (ev->event_counter >> 24) & 0xffffff;
+    case REG_TRIG_COUNTER_LOW:
+      return ev->trig_counter & 0xffffff;
+    case REG_TRIG_COUNTER_HIGH:
+      return (ev->trig_counter >> 24) & 0xffffff;
+    case REG_TRIG_TIME_LOW:
+      return ev->trig_time & 0xffffff;
+    case REG_TRIG_TIME_HIGH:
+      return (ev->trig_time >> 24) & 0xffffff;
+    case REG_DEADTIME:
+      return ev->deadtime & 0xffffff;
+    case REG_TRIG_INFO:
+      return (b->buffer << 22) | (ev->calpulse << 21) | (ev->pretrigger << 17) | ((ev->trig_type & 0x3) << 15) | (ev->trig_pol & 0xf);
+    case REG_CH_MASKS:
+      return (ev->channel_mask << 15) | (ev->beam_mask & 0x7fff);
+    case REG_USER_MASK:
+      return ev->beam_mask;
+    case REG_LAST_BEAM:
+      return ev->last_beam;
+    case REG_TRIG_BEAM_POWER:
+      return ev->beam_power;
+    case REG_PPS_COUNTER:
+      return ev->pps;
+    case REG_HD_DYN_MASK:
+    case REG_VETO_DEADTIME_CTR:
+    case REG_ST_DYN_MASK:
+    case REG_VETO_STATUS:
+      return 0;
+    case REG_LATCHED_PPS_LOW:
+    case REG_LATCHED_PPS_HIGH:
+      latched = (uint64_t) (floor(since_reset > 0 ? since_reset : 0) * EMU_BOARD_CLOCK_HZ);
+      return addr == REG_LATCHED_PPS_LOW ? latched & 0xffffff : (latched >> 24) & 0xffffff;
+    default:
+      return b->reg[addr] & 0xffffff;
+  }
+}
+
+static uint8_t waveform_sample(const struct emu_board * b, int chan, int isamp)
+{
+  const struct emu_event * ev = &b->ev[b->buffer];
+
+  // in verification mode, the firmware sends a fixed pattern
+  if (b->reg[REG_VERIFICATION_MODE] & 1)
+  {
+    return (isamp + 37 * chan + 101 * b->buffer) & 0xff;
+  }
+
+  int val = 64 + (int) (hash3(ev->seed, chan, isamp) % 9) - 4;
+
+  //put a pulse after the pretrigger window
+  if (ev->trig_type == BN_TRIG_RF || ev->calpulse)
+  {
+    int dt = isamp - ev->pretrigger * 8 * 16 - 2 * chan;
+    if (dt >= 0 && dt < 16)
+    {
+      val += (dt % 2 ? -1 : 1) * (40 >> (dt / 2));
+    }
+  }
+  return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+// the master's beamformed waveform: the channels, each delayed for the beam's direction, averaged.
+// Beam 20 lines up the emulated pulse.
+static uint8_t beam_sample(const struct emu_board * b, int beam, int isamp)
+{
+  int chan, sum = 0;
+  for (chan = 0; chan < BN_NUM_CHAN; chan++)
+  {
+    int i = isamp + chan * (beam - 16) / 2;
+    sum += i >= 0 && i < BN_MAX_WAVEFORM_LENGTH ? waveform_sample(b, chan, i) : 64;
+  }
+  return sum / BN_NUM_CHAN;
+}
+
+// the power in BN_POWERSUM_SAMPLES samples of a beam, starting at isamp
+static uint32_t powersum(const struct emu_board * b, int beam, int isamp)
+{
+  int i;
+  uint32_t sum = 0;
+  for (i = isamp; i < isamp + BN_POWERSUM_SAMPLES; i++)
+  {
+    int v = (int) beam_sample(b, beam, i) - 64;
+    sum += v * v;
+  }
+  return sum;
+}
+
+static void set_latch_u24(struct emu_board * b, uint8_t addr, uint32_t val)
+{
+  b->latch[0] = addr;
+  b->latch[1] = (val >> 16) & 0xff;
+  b->latch[2] = (val >> 8) & 0xff;
+  b->latch[3] = val & 0xff;
+}
+
+static void latch_chunk(struct emu_board * b, int chunk)
+{
+  int i;
+  int first = ((int) b->ram_addr - 1) * EMU_SAMPLES_PER_ADDRESS + chunk * BN_WORD_SIZE;
+
+  // only the master beamforms, and each 32-bit chunk in the power sum mode is one sum
+  if (b->mode == MODE_POWERSUM && !b->index && first >= 0 && b->channel < BN_NUM_BEAMS)
+  {
+    uint32_t sum = powersum(b, b->channel, first);
+    for (i = 0; i < BN_WORD_SIZE; i++) b->latch[i] = (sum >> (8 * (BN_WORD_SIZE - 1 - i))) & 0xff;
+    return;
+  }
+
+  if ((b->mode != MODE_WAVEFORMS && b->mode != MODE_BEAMS) || (b->mode == MODE_BEAMS && (b->index || b->channel >= BN_NUM_BEAMS)))
+  {
+    memset(b->latch, 0, sizeof(b->latch));
+    return;
+  }
+
+  for (i = 0; i < BN_WORD_SIZE; i++)
+  {
+    if (first + i < 0) b->latch[i] = 0;
+    else if (b->mode == MODE_BEAMS) b->latch[i] = beam_sample(b, b->channel, first + i);
+    else b->latch[i] = waveform_sample(b, b->channel, first + i);
+  }
+}
+
+static void execute(struct emu_board * b, const uint8_t * w, double now);
+
+static void set_sync(struct emu_group * g, int on, double now)
+{
+  int ib, i;
+  g->sync = on;
+  if (on) return;
+
+  //release whatever the slaves were holding
+  for (ib = 1; ib < g->nboards; ib++)
+  {
+    struct emu_board * s = g->boards[ib];
+    int n = s->ndeferred;
+    s->ndeferred = 0;
+    for (i = 0; i < n; i++) execute(s, s->deferred[i], now);
+  }
+}
+
+/** Process one word sent to the board */
+static void execute(struct emu_board * b, const uint8_t * w, double now)
+{
+  uint8_t addr = w[0];
+  uint32_t val = (w[1] << 16) | (w[2] << 8) | w[3];
+
+  if (addr == 0) return; //just clocking data out
+
+  if (b->index > 0 && b->grp->sync && addr != REG_SET_READ_REG)
+  {
+    if (b->ndeferred < EMU_MAX_DEFERRED) memcpy(b->deferred[b->ndeferred++], w, BN_WORD_SIZE);
+    return;
+  }
+
+  switch (addr)
+  {
+    case REG_SET_READ_REG:
+      set_latch_u24(b, w[3], register_value(b, w[3], now));
+      return;
+    case REG_MODE:
+      b->mode = w[3] & 0x3;
+      break;
+    case REG_BUFFER:
+      b->buffer = w[3] % BN_NUM_BUFFER;
+      break;
+    case REG_CHANNEL:
+      b->channel = val ? __builtin_ctz(val) : 0;
+      break;
+    case REG_RAM_ADDR:
+      b->ram_addr = w[3];
+      break;
+    case REG_CHUNK:
+    case REG_CHUNK+1:
+    case REG_CHUNK+2:
+    case REG_CHUNK+3:
+      latch_chunk(b, addr - REG_CHUNK);
+      return;
+    case REG_FORCE_TRIG:
+      if (w[3] & 1) board_trigger(b, now, BN_TRIG_SW);
+      return;
+    case REG_CLEAR:
+      b->full &= ~(w[3] & 0xf);
+      if (w[2] & 1) b->write_ptr = 0;
+      return;
+    case REG_RESET_COUNTER:
+      board_reset_counters(b, now);
+      return;
+    case REG_RESET_ALL:
+      b->full = 0;
+      b->write_ptr = 0;
+      board_reset_counters(b, now);
+      if (w[3] & 1) memset(b->reg, 0, sizeof(b->reg));
+      return;
+    case REG_SYNC:
+      if (b->index == 0) set_sync(b->grp, w[3] & 1, now);
+      return;
+    case REG_UPDATE_SCALERS:
+      update_scalers(b);
+      return;
+    case REG_PICK_SCALER:
+      b->scaler_pick = w[3];
+      return;
+    default:
+      break;
+  }
+
+  b->reg[addr] = val;
+}
+
+static void flip_bits(struct emu_board * b, uint8_t * rx, int len)
+{
+  struct emu_group * g = b->grp;
+  if (!g->cfg.max_clock_hz || b->clock_hz <= g->cfg.max_clock_hz) return;
+
+  // bit error rate grows quickly with how far above the limit we are
+  double over = (double) b->clock_hz / g->cfg.max_clock_hz - 1;
+  double ber = 1e-3 * over * over * 10;
+  if (ber > 0.05) ber = 0.05;
+
+  b->bits_until_error -= 8 * len;
+  while (b->bits_until_error <= 0)
+  {
+    int bit = 8 * len + (int) b->bits_until_error;
+    if (bit >= 0 && bit < 8 * len)
+    {
+      rx[bit / 8] ^= 1 << (bit % 8);
+      b->stats.nbit_errors++;
+    }
+    b->bits_until_error += 1 + floor(log(uniform(&g->rng)) / log(1 - ber));
+  }
+}
+
+static void burn_bus_time(struct emu_board * b, const struct timespec * start, uint64_t nbytes)
+{
+  struct emu_group * g = b->grp;
+  if (!g->cfg.simulate_bus_time) return;
+
+  double t = 8. * nbytes / b->clock_hz + 1e-6 * g->cfg.ioctl_overhead_us;
+  struct timespec now;
+  do
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec) < t);
+}
+
+static int emu_max_xfers(beacon_transport_t * tp)
+{
+  struct emu_board * b = tp->priv;
+  return b->grp->cfg.max_xfers ? (int) b->grp->cfg.max_xfers : BEACON_SPIDEV_MAX_XFERS;
+}
+
+static int emu_xfer(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfers)
+{
+  struct emu_board * b = tp->priv;
+  struct emu_group * g = b->grp;
+  struct timespec start;
+  int i,j;
+  int total = 0;
+
+  // same as the kernel would do
+  if (n > emu_max_xfers(tp))
+  {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&g->mut);
+  double now = now_since(&g->t0);
+  group_advance(g, now);
+
+  for (i = 0; i < n; i++)
+  {
+    uint8_t * tx = (uint8_t*) (uintptr_t) xfers[i].tx_buf;
+    uint8_t * rx = (uint8_t*) (uintptr_t) xfers[i].rx_buf;
+
+    for (j = 0; j + BN_WORD_SIZE <= (int) xfers[i].len; j+= BN_WORD_SIZE)
+    {
+      if (rx)
+      {
+        memcpy(rx + j, b->latch, BN_WORD_SIZE);
+        flip_bits(b, rx + j, BN_WORD_SIZE);
+      }
+      if (tx) execute(b, tx + j, now);
+    }
+    total += xfers[i].len;
+    b->stats.nxfers++;
+  }
+  b->stats.nmessages++;
+  pthread_mutex_unlock(&g->mut);
+
+  burn_bus_time(b, &start, total);
+  return total;
+}
+
+static int emu_write(beacon_transport_t * tp, const uint8_t * p)
+{
+  struct spi_ioc_transfer xfer;
+  memset(&xfer, 0, sizeof(xfer));
+  xfer.tx_buf = (uintptr_t) p;
+  xfer.len = BN_WORD_SIZE;
+  return emu_xfer(tp, 1, &xfer);
+}
+
+static int emu_read(beacon_transport_t * tp, uint8_t * p)
+{
+  struct spi_ioc_transfer xfer;
+  memset(&xfer, 0, sizeof(xfer));
+  xfer.rx_buf = (uintptr_t) p;
+  xfer.len = BN_WORD_SIZE;
+  return emu_xfer(tp, 1, &xfer);
+}
+
+static int emu_set_speed(beacon_transport_t * tp, uint32_t hz)
+{
+  struct emu_board * b = tp->priv;
+  pthread_mutex_lock(&b->grp->mut);
+  b->clock_hz = hz ? hz : EMU_DEFAULT_CLOCK;
+  pthread_mutex_unlock(&b->grp->mut);
+  return 0;
+}
+
+static void emu_close(beacon_transport_t * tp)
+{
+  struct emu_board * b = tp->priv;
+  struct emu_group * g = b->grp;
+  int ib;
+  int last;
+
+  pthread_mutex_lock(&g->mut);
+  for (ib = b->index + 1; ib < g->nboards; ib++)
+  {
+    g->boards[ib-1] = g->boards[ib];
+    g->boards[ib-1]->index = ib-1;
+  }
+  g->nboards--;
+  last = g->nboards == 0;
+  if (last)
+  {
+    g->ticker_quit = 1;
+    pthread_cond_signal(&g->ticker_cond);
+  }
+  pthread_mutex_unlock(&g->mut);
+
+  if (b->ready_fd >= 0) close(b->ready_fd);
+  free(b);
+  if (last)
+  {
+    if (g->ticker_running) pthread_join(g->ticker, 0);
+    pthread_cond_destroy(&g->ticker_cond);
+    pthread_mutex_destroy(&g->mut);
+    free(g);
+  }
+}
+
+static const beacon_transport_ops_t emu_ops =
+{
+  .name = "emu",
+  .xfer = emu_xfer,
+  .write = emu_write,
+  .read = emu_read,
+  .max_xfers = emu_max_xfers,
+  .set_speed = emu_set_speed,
+  .close = emu_close
+};
+
+
+void beacon_emu_default_config(beacon_emu_config_t * cfg)
+{
+  memset(cfg, 0, sizeof(*cfg));
+  cfg->trigger_rate_hz = 100;
+  cfg->poisson = 0;
+  cfg->simulate_bus_time = 1;
+  cfg->ioctl_overhead_us = 20;
+  cfg->max_clock_hz = 0;
+  cfg->seed = 12345;
+  cfg->max_xfers = BEACON_SPIDEV_MAX_XFERS;
+}
+
+int beacon_emu_is_emulator(const beacon_transport_t * tp)
+{
+  return tp && tp->ops == &emu_ops;
+}
+
+beacon_transport_t * beacon_emu_open(const beacon_emu_config_t * cfg, beacon_transport_t * master)
+{
+  struct emu_group * g;
+
+  if (master)
+  {
+    if (!beacon_emu_is_emulator(master))
+    {
+      fprintf(stderr,"Emulated slave needs an emulated master!\n");
+      return 0;
+    }
+    g = ((struct emu_board*) master->priv)->grp;
+    if (g->nboards >= EMU_MAX_BOARDS)
+    {
+      fprintf(stderr,"Too many emulated boards!\n");
+      return 0;
+    }
+  }
+  else
+  {
+    g = calloc(1, sizeof(struct emu_group));
+    if (cfg) g->cfg = *cfg;
+    else beacon_emu_default_config(&g->cfg);
+    pthread_mutex_init(&g->mut, 0);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&g->ticker_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    clock_gettime(CLOCK_MONOTONIC, &g->t0);
+    g->rng = g->cfg.seed ? g->cfg.seed : 1;
+    g->next_trigger = next_interval(g);
+  }
+
+  struct emu_board * b = calloc(1, sizeof(struct emu_board));
+  b->grp = g;
+  b->clock_hz = EMU_DEFAULT_CLOCK;
+  b->ready_fd = -1;
+
+  pthread_mutex_lock(&g->mut);
+  b->index = g->nboards;
+  g->boards[g->nboards++] = b;
+  board_reset_counters(b, now_since(&g->t0));
+  pthread_mutex_unlock(&g->mut);
+
+  beacon_transport_t * tp = malloc(sizeof(beacon_transport_t));
+  tp->ops = &emu_ops;
+  tp->priv = b;
+  tp->fd = -1;
+  tp->trace = 0;
+  return tp;
+}
+
+
+beacon_transport_t * beacon_emu_open_opts(const char * opts, beacon_transport_t * master)
+{
+  beacon_emu_config_t cfg;
+  beacon_emu_default_config(&cfg);
+
+  char * copy = strdup(opts ? opts : "");
+  char * save = 0;
+  char * tok;
+
+  for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(0, ",", &save))
+  {
+    char * eq = strchr(tok,'=');
+    if (!eq)
+    {
+      fprintf(stderr,"Ignoring malformed emulator option \"%s\"\n", tok);
+      continue;
+    }
+    *eq = 0;
+    const char * val = eq + 1;
+
+    if (!strcmp(tok,"rate")) cfg.trigger_rate_hz = atof(val);
+    else if (!strcmp(tok,"poisson")) cfg.poisson = atoi(val);
+    else if (!strcmp(tok,"bus")) cfg.simulate_bus_time = atoi(val);
+    else if (!strcmp(tok,"overhead")) cfg.ioctl_overhead_us = atoi(val);
+    else if (!strcmp(tok,"maxclock")) cfg.max_clock_hz = atof(val) * 1e6;
+    else if (!strcmp(tok,"seed")) cfg.seed = atoi(val);
+    else if (!strcmp(tok,"maxxfers")) cfg.max_xfers = atoi(val);
+    else fprintf(stderr,"Unknown emulator option \"%s\"\n", tok);
+  }
+
+  free(copy);
+  return beacon_emu_open(&cfg, master);
+}
+
+
+int beacon_emu_set_trigger_rate(beacon_transport_t * tp, double rate_hz)
+{
+  if (!beacon_emu_is_emulator(tp)) return -1;
+  struct emu_group * g = ((struct emu_board*) tp->priv)->grp;
+
+  pthread_mutex_lock(&g->mut);
+  double now = now_since(&g->t0);
+  group_advance(g, now);
+  g->cfg.trigger_rate_hz = rate_hz;
+  g->next_trigger = now + next_interval(g);
+  pthread_cond_signal(&g->ticker_cond);
+  pthread_mutex_unlock(&g->mut);
+  return 0;
+}
+
+int beacon_emu_get_stats(beacon_transport_t * tp, beacon_emu_stats_t * stats)
+{
+  if (!beacon_emu_is_emulator(tp)) return -1;
+  struct emu_board * b = tp->priv;
+
+  pthread_mutex_lock(&b->grp->mut);
+  group_advance(b->grp, now_since(&b->grp->t0));
+  *stats = b->stats;
+  pthread_mutex_unlock(&b->grp->mut);
+  return 0;
+}
+
+int beacon_emu_ready_fd(beacon_transport_t * tp)
+{
+  if (!beacon_emu_is_emulator(tp)) return -1;
+  struct emu_board * b = tp->priv;
+  struct emu_group * g = b->grp;
+  int fd;
+
+  pthread_mutex_lock(&g->mut);
+  if (b->ready_fd < 0)
+  {
+    b->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (b->ready_fd < 0) fprintf(stderr,"Could not create eventfd (errno: %d)\n", errno);
+    else if (b->full) signal_ready(b); // something's already there
+  }
+
+  if (b->ready_fd >= 0 && !g->ticker_running)
+  {
+    g->ticker_quit = 0;
+    if (pthread_create(&g->ticker, 0, ticker_main, g))
+    {
+      fprintf(stderr,"Could not start emulator ticker thread\n");
+    }
+    else
+    {
+      g->ticker_running = 1;
+    }
+  }
+  fd = b->ready_fd;
+  pthread_mutex_unlock(&g->mut);
+  return fd;
+}
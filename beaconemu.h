@@ -0,0 +1,95 @@
+#ifndef _beaconemu_h
+#define _beaconemu_h
+
+#include "beacontransport.h"
+
+/** \file beaconemu.h
+ *
+ * An in-process emulator of the FPGA's SPI interface, so that the readout
+ * code can be exercised (and benchmarked) on any Linux box without a board.
+ *
+ * The emulator implements the parts of the register map that the DAQ uses:
+ * the buffer status/clear registers, the event metadata registers,
+ * waveform RAM (REG_MODE / REG_BUFFER / REG_CHANNEL / REG_RAM_ADDR / REG_CHUNK),
+ * the master's beam and power sum modes (beams made by averaging delayed channels),
+ * scalers, counters and plain configuration registers (which just read back
+ * what was written).
+ *
+ * Triggers arrive at a configurable rate and are written to the four
+ * hardware buffers in order just like the real thing. If all buffers are
+ * full, the trigger is lost and counted as deadtime. Software triggers work
+ * too.
+ *
+ * By default the emulator also burns the time that the transfers would have
+ * taken on a real bus at the current SPI clock, so readout throughput
+ * numbers are meaningful.
+ *
+ * A slave board can be emulated by opening it with the master's transport,
+ * in which case both share the same triggers and REG_SYNC behaves as on
+ * hardware (commands sent to the slave are held until the master turns sync
+ * off).
+ */
+
+/** Device name prefix used to select the emulator in beacon_open */
+#define BEACON_EMU_PREFIX "emu"
+
+/** Emulator configuration */
+typedef struct beacon_emu_config
+{
+  double trigger_rate_hz;     //!< Rate of (RF) triggers. 0 for only software triggers.
+  int poisson;                //!< If non-zero, triggers arrive randomly rather than periodically
+  int simulate_bus_time;      //!< If non-zero, each transfer takes as long as it would on a real bus
+  unsigned ioctl_overhead_us; //!< Extra time per SPI message (only if simulate_bus_time)
+  unsigned max_clock_hz;      //!< Above this SPI clock, bit errors start creeping in. 0 for never.
+  unsigned seed;              //!< random seed
+  unsigned max_xfers;         //!< Maximum transfers per SPI message (like spidev's limit). Longer messages fail. 0 for the spidev limit.
+} beacon_emu_config_t;
+
+/** Emulator statistics */
+typedef struct beacon_emu_stats
+{
+  uint64_t ntriggers;   //!< number of triggers seen since open
+  uint64_t nrecorded;   //!< number of triggers that made it into a buffer
+  uint64_t ndropped;    //!< number of triggers lost because all buffers were full
+  uint64_t nmessages;   //!< number of SPI messages (ioctls, reads, writes)
+  uint64_t nxfers;      //!< number of 32-bit transfers
+  uint64_t nbit_errors; //!< number of bits flipped due to running the clock too fast
+} beacon_emu_stats_t;
+
+
+/** Fill the config with the defaults (100 Hz periodic, bus time simulated, 20 us ioctl overhead, no bit errors, 511 transfers per message) */
+void beacon_emu_default_config(beacon_emu_config_t * cfg);
+
+/** Open an emulated board.
+ *
+ * @param cfg the configuration, or 0 for defaults. Ignored for a slave (which uses the master's).
+ * @param master  0 to emulate a master board, otherwise the master's emulator transport
+ * @returns transport, or 0 on failure
+ */
+beacon_transport_t * beacon_emu_open(const beacon_emu_config_t * cfg, beacon_transport_t * master);
+
+/** Open an emulated board with options in a string, e.g. "rate=1000,poisson=1".
+ *
+ * Options are: rate (Hz), poisson (0/1), bus (0/1, simulate bus time),
+ * overhead (us per message), maxclock (MHz), seed, maxxfers.
+ */
+beacon_transport_t * beacon_emu_open_opts(const char * opts, beacon_transport_t * master);
+
+/** Returns 1 if this transport is an emulator */
+int beacon_emu_is_emulator(const beacon_transport_t * tp);
+
+/** Change the trigger rate of an emulated board (and any linked boards). 0 to turn off. */
+int beacon_emu_set_trigger_rate(beacon_transport_t * tp, double rate_hz);
+
+/** Retrieve statistics for an emulated board */
+int beacon_emu_get_stats(beacon_transport_t * tp, beacon_emu_stats_t * stats);
+
+/** Get an eventfd that stands in for the board's "data ready" GPIO: it becomes readable
+ * (POLLIN) whenever an event is written to a buffer. Read 8 bytes from it to acknowledge.
+ * The first call starts a thread that keeps the trigger schedule up to date.
+ * The fd belongs to the emulator (it's closed with the transport).
+ * Returns -1 if tp is not an emulator or something went wrong.
+ */
+int beacon_emu_ready_fd(beacon_transport_t * tp);
+
+#endif
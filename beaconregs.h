@@ -0,0 +1,95 @@
+#ifndef _beaconregs_h
+#define _beaconregs_h
+
+/** \file beaconregs.h
+ *
+ * The FPGA register map and readout modes. This is internal to libbeacondaq
+ * (shared between beacondaq.c and the emulator) and is not installed.
+ */
+
+//register map TODO
+typedef enum
+{
+  REG_FIRMWARE_VER       = 0x01, 
+  REG_FIRMWARE_DATE      = 0x02, 
+  REG_SCALER_READ        = 0x03, 
+  REG_CHIPID_LOW         = 0x04,  
+  REG_CHIPID_MID         = 0x05,  
+  REG_CHIPID_HI          = 0x06,  
+  REG_STATUS             = 0x07, 
+  REG_CLEAR_STATUS       = 0x09, 
+  REG_EVENT_COUNTER_LOW  = 0xa, 
+  REG_EVENT_COUNTER_HIGH = 0xb, 
+  REG_TRIG_COUNTER_LOW   = 0xc, 
+  REG_TRIG_COUNTER_HIGH  = 0xd, 
+  REG_TRIG_TIME_LOW      = 0xe, 
+  REG_TRIG_TIME_HIGH     = 0xf, 
+  REG_DEADTIME           = 0x10, 
+  REG_TRIG_INFO          = 0x11, //bits 23-22 : event buffer ; bit 21: calpulse, bits 19-17: pretrig window,  bits16-15: trig type ; bits 14-4: 0: bits 3-0: value of REG_TRIG_POLARIZATION
+  REG_CH_MASKS           = 0x12, // bits 22-15 : channel mask ; bits 14-0 : beam mask
+  REG_LAST_BEAM          = 0x14, 
+  REG_TRIG_BEAM_POWER    = 0x15, 
+  REG_PPS_COUNTER        = 0x16, 
+  REG_HD_DYN_MASK        = 0x17, 
+  REG_USER_MASK          = 0x18,  
+  REG_VETO_DEADTIME_CTR  = 0x19, 
+  REG_VETO_STATUS        = 0x21, 
+  REG_ST_DYN_MASK        = 0x22, 
+  REG_CHUNK              = 0x23, //which 32-bit chunk  + i 
+  REG_SYNC               = 0x27, 
+  REG_UPDATE_SCALERS     = 0x28, 
+  REG_PICK_SCALER        = 0x29, 
+  REG_CALPULSE           = 0x2a, //cal pulse
+  REG_LATCHED_PPS_LOW    = 0x2c, 
+  REG_LATCHED_PPS_HIGH   = 0x2d, 
+  REG_CHANNEL_MASK       = 0x30, 
+  REG_ATTEN_012          = 0x32, 
+  REG_ATTEN_345          = 0x33, 
+  REG_ATTEN_67           = 0x34, 
+  REG_ATTEN_APPLY        = 0x35, 
+  REG_ADC_CLK_RST        = 0x37,  
+  REG_ADC_DELAYS         = 0x38, //add buffer number to get all 
+  REG_TRIG_DELAY_012     = 0x3d, 
+  REG_TRIG_DELAY_345     = 0x3e, 
+  REG_TRIG_DELAY_67      = 0x3f, 
+  REG_FORCE_TRIG         = 0x40, 
+  REG_CHANNEL            = 0x41, //select channel to read
+  REG_MODE               = 0x42, //readout mode
+  REG_RAM_ADDR           = 0x45, //ram address
+  REG_READ               = 0x47, //send data to spi miso 
+  REG_EXT_INPUT_CONFIG   = 0x4b, 
+  REG_PRETRIGGER         = 0x4c, 
+  REG_CLEAR              = 0x4d, //clear buffers 
+  REG_BUFFER             = 0x4e,
+  REG_TRIG_POLARIZATION  = 0x4f, // which polarization(s) to trigger on, LSB 0=H, 1=V, 2=both (unimplemented)
+  REG_TRIGGER_MASK       = 0x50, 
+  REG_TRIG_HOLDOFF       = 0x51, 
+  REG_TRIG_ENABLE        = 0x52, 
+  REG_TRIGOUT_CONFIG     = 0x53, 
+  REG_PHASED_TRIGGER     = 0x54, 
+  REG_VERIFICATION_MODE  = 0x55, 
+  REG_TIMESTAMP_SELECT   = 0x58, 
+  REG_TRIGGER_VETOS      = 0x5f,
+  REG_VETO_CUT_0         = 0x60, 
+  REG_VETO_CUT_1         = 0x61, 
+  REG_SET_READ_REG       = 0x6d, 
+  REG_TRIGGER_LOWPASS    = 0x5a, 
+  REG_DYN_MASK           = 0x5d, 
+  REG_DYN_HOLDOFF        = 0x5e, 
+  REG_RESET_COUNTER      = 0x7e, 
+  REG_RESET_ALL          = 0x7f,
+  REG_THRESHOLDS         = 0x81 // add the threshold to this to get the right register
+
+} beacon_register_t; 
+
+
+//readout modes 
+typedef enum 
+{
+  MODE_REGISTER=0,
+  MODE_WAVEFORMS=1,
+  MODE_BEAMS=2,
+  MODE_POWERSUM=3
+} beacon_readout_mode_t; 
+
+#endif
@@ -0,0 +1,452 @@
+#include "beaconreplay.h"
+#include "beacondaq.h"
+#include <linux/spi/spidev.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+/* Recording and replay transports. See beaconreplay.h for the file format. */
+
+#define MAX_MISMATCH_PRINTS 10
+
+struct recorder
+{
+  beacon_transport_t * inner;
+  FILE * f;
+  struct timespec t0;
+  pthread_mutex_t mut;
+};
+
+struct replayer
+{
+  FILE * f;
+  beacon_spi_session_header_t hdr;
+  uint64_t nops;
+  uint64_t nmismatch;
+  int eof;
+  pthread_mutex_t mut;
+};
+
+static uint64_t ns_since(const struct timespec * t0, const struct timespec * t)
+{
+  return (t->tv_sec - t0->tv_sec) * (uint64_t) 1000000000 + t->tv_nsec - t0->tv_nsec;
+}
+
+/*********************** Recording ********************************/
+
+static void record_header(struct recorder * r, uint8_t op, int nxfers, int ret, uint32_t arg,
+                          const struct timespec * start, const struct timespec * end)
+{
+  beacon_spi_session_record_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.op = op;
+  rec.nxfers = nxfers;
+  rec.ret = ret;
+  rec.arg = arg;
+  rec.start_ns = ns_since(&r->t0, start);
+  rec.duration_ns = ns_since(start, end);
+  fwrite(&rec, sizeof(rec), 1, r->f);
+}
+
+static int record_xfer(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfers)
+{
+  struct recorder * r = tp->priv;
+  struct timespec start, end;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = r->inner->ops->xfer(r->inner, n, xfers);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&r->mut);
+  record_header(r, BN_SPI_SESSION_XFER, n, ret, 0, &start, &end);
+  for (i = 0; i < n; i++)
+  {
+    uint16_t len = xfers[i].len;
+    uint8_t flags = (xfers[i].tx_buf ? 1 : 0) | (xfers[i].rx_buf ? 2 : 0);
+    fwrite(&len, sizeof(len), 1, r->f);
+    fwrite(&flags, sizeof(flags), 1, r->f);
+    if (xfers[i].tx_buf) fwrite((const uint8_t*) (uintptr_t) xfers[i].tx_buf, 1, len, r->f);
+    if (xfers[i].rx_buf) fwrite((const uint8_t*) (uintptr_t) xfers[i].rx_buf, 1, len, r->f);
+  }
+  pthread_mutex_unlock(&r->mut);
+
+  return ret;
+}
+
+static int record_write(beacon_transport_t * tp, const uint8_t * p)
+{
+  struct recorder * r = tp->priv;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = r->inner->ops->write(r->inner, p);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&r->mut);
+  record_header(r, BN_SPI_SESSION_WRITE, 1, ret, 0, &start, &end);
+  fwrite(p, 1, BN_WORD_SIZE, r->f);
+  pthread_mutex_unlock(&r->mut);
+  return ret;
+}
+
+static int record_read(beacon_transport_t * tp, uint8_t * p)
+{
+  struct recorder * r = tp->priv;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = r->inner->ops->read(r->inner, p);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&r->mut);
+  record_header(r, BN_SPI_SESSION_READ, 1, ret, 0, &start, &end);
+  fwrite(p, 1, BN_WORD_SIZE, r->f);
+  pthread_mutex_unlock(&r->mut);
+  return ret;
+}
+
+static int record_max_xfers(beacon_transport_t * tp)
+{
+  struct recorder * r = tp->priv;
+  return beacon_transport_max_xfers(r->inner);
+}
+
+static int record_set_speed(beacon_transport_t * tp, uint32_t hz)
+{
+  struct recorder * r = tp->priv;
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = r->inner->ops->set_speed(r->inner, hz);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  pthread_mutex_lock(&r->mut);
+  record_header(r, BN_SPI_SESSION_SET_SPEED, 0, ret, hz, &start, &end);
+  pthread_mutex_unlock(&r->mut);
+  return ret;
+}
+
+static void record_close(beacon_transport_t * tp)
+{
+  struct recorder * r = tp->priv;
+  beacon_transport_close(r->inner);
+  fclose(r->f);
+  pthread_mutex_destroy(&r->mut);
+  free(r);
+}
+
+static const beacon_transport_ops_t record_ops =
+{
+  .name = "record",
+  .xfer = record_xfer,
+  .write = record_write,
+  .read = record_read,
+  .max_xfers = record_max_xfers,
+  .set_speed = record_set_speed,
+  .close = record_close
+};
+
+
+beacon_transport_t * beacon_record_open(const char * path, beacon_transport_t * inner)
+{
+  if (!inner) return 0;
+
+  FILE * f = fopen(path, "w");
+  if (!f)
+  {
+    fprintf(stderr,"Could not open %s for recording\n", path);
+    beacon_transport_close(inner);
+    return 0;
+  }
+
+  beacon_spi_session_header_t hdr;
+  hdr.magic = BN_SPI_SESSION_MAGIC;
+  hdr.version = BN_SPI_SESSION_VERSION;
+  hdr.max_xfers = beacon_transport_max_xfers(inner);
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  struct recorder * r = calloc(1, sizeof(struct recorder));
+  beacon_transport_t * tp = malloc(sizeof(beacon_transport_t));
+  if (!r || !tp)
+  {
+    fprintf(stderr,"Could not allocate recording transport\n");
+    free(r);
+    free(tp);
+    fclose(f);
+    beacon_transport_close(inner);
+    return 0;
+  }
+
+  r->inner = inner;
+  r->f = f;
+  clock_gettime(CLOCK_MONOTONIC, &r->t0);
+  pthread_mutex_init(&r->mut, 0);
+
+  tp->ops = &record_ops;
+  tp->priv = r;
+  tp->fd = inner->fd;
+  tp->trace = 0;
+  return tp;
+}
+
+beacon_transport_t * beacon_record_inner(beacon_transport_t * tp)
+{
+  if (tp && tp->ops == &record_ops) return ((struct recorder*) tp->priv)->inner;
+  return tp;
+}
+
+
+/*********************** Replay ********************************/
+
+static void mismatch(struct replayer * r, const char * what)
+{
+  if (r->nmismatch++ < MAX_MISMATCH_PRINTS)
+  {
+    fprintf(stderr,"Replay diverged from recording at operation %"PRIu64": %s\n", r->nops, what);
+  }
+}
+
+// reads the next record, returns 0 on success
+static int next_record(struct replayer * r, beacon_spi_session_record_t * rec)
+{
+  if (r->eof) return -1;
+  if (fread(rec, sizeof(*rec), 1, r->f) != 1)
+  {
+    fprintf(stderr,"Reached end of SPI recording after %"PRIu64" operations\n", r->nops);
+    r->eof = 1;
+    return -1;
+  }
+  r->nops++;
+  return 0;
+}
+
+static int replay_xfer(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfers)
+{
+  struct replayer * r = tp->priv;
+  beacon_spi_session_record_t rec;
+  int i;
+  int ret = -1;
+
+  pthread_mutex_lock(&r->mut);
+  if (next_record(r, &rec)) goto done;
+
+  if (rec.op != BN_SPI_SESSION_XFER)
+  {
+    mismatch(r,"expected a transfer");
+    // skip over the payload of whatever it was
+    if (rec.op == BN_SPI_SESSION_WRITE || rec.op == BN_SPI_SESSION_READ) fseek(r->f, BN_WORD_SIZE, SEEK_CUR);
+    errno = EIO;
+    goto done;
+  }
+
+  if (rec.nxfers != n) mismatch(r, "different number of transfers");
+
+  int tx_mismatch = 0;
+  for (i = 0; i < rec.nxfers; i++)
+  {
+    uint16_t len;
+    uint8_t flags;
+    uint8_t tx[BN_MAX_WAVEFORM_LENGTH];
+    uint8_t rx[BN_MAX_WAVEFORM_LENGTH];
+
+    if (fread(&len, sizeof(len), 1, r->f) != 1 || fread(&flags, sizeof(flags), 1, r->f) != 1 || len > sizeof(tx)
+        || ((flags & 1) && fread(tx, 1, len, r->f) != len)
+        || ((flags & 2) && fread(rx, 1, len, r->f) != len))
+    {
+      fprintf(stderr,"Truncated SPI recording\n");
+      r->eof = 1;
+      goto done;
+    }
+
+    if (i >= n) continue;
+
+    if ((flags & 1) && xfers[i].tx_buf && memcmp(tx, (const uint8_t*) (uintptr_t) xfers[i].tx_buf, len < xfers[i].len ? len : xfers[i].len))
+    {
+      tx_mismatch = 1;
+    }
+
+    if (xfers[i].rx_buf)
+    {
+      uint8_t * dest = (uint8_t*) (uintptr_t) xfers[i].rx_buf;
+      if (flags & 2) memcpy(dest, rx, len < xfers[i].len ? len : xfers[i].len);
+      else memset(dest, 0, xfers[i].len);
+    }
+  }
+
+  // anything that wasn't recorded reads back as zero
+  for (i = rec.nxfers; i < n; i++)
+  {
+    if (xfers[i].rx_buf) memset((uint8_t*) (uintptr_t) xfers[i].rx_buf, 0, xfers[i].len);
+  }
+
+  if (tx_mismatch) mismatch(r, "sent different data");
+
+  ret = rec.nxfers == n ? rec.ret : n * BN_WORD_SIZE;
+
+done:
+  pthread_mutex_unlock(&r->mut);
+  return ret;
+}
+
+static int replay_word(beacon_transport_t * tp, uint8_t op, uint8_t * p)
+{
+  struct replayer * r = tp->priv;
+  beacon_spi_session_record_t rec;
+  uint8_t word[BN_WORD_SIZE];
+  int ret = -1;
+
+  pthread_mutex_lock(&r->mut);
+  if (next_record(r, &rec)) goto done;
+
+  if (rec.op != op)
+  {
+    mismatch(r, op == BN_SPI_SESSION_WRITE ? "expected a write" : "expected a read");
+    if (rec.op == BN_SPI_SESSION_XFER)
+    {
+      // put it back so the next transfer might still line up
+      fseek(r->f, -(long) sizeof(rec), SEEK_CUR);
+      r->nops--;
+    }
+    errno = EIO;
+    goto done;
+  }
+
+  if (fread(word, 1, BN_WORD_SIZE, r->f) != BN_WORD_SIZE)
+  {
+    fprintf(stderr,"Truncated SPI recording\n");
+    r->eof = 1;
+    goto done;
+  }
+
+  if (op == BN_SPI_SESSION_WRITE)
+  {
+    if (memcmp(word, p, BN_WORD_SIZE)) mismatch(r, "wrote different data");
+  }
+  else
+  {
+    memcpy(p, word, BN_WORD_SIZE);
+  }
+  ret = rec.ret;
+
+done:
+  pthread_mutex_unlock(&r->mut);
+  return ret;
+}
+
+static int replay_write(beacon_transport_t * tp, const uint8_t * p)
+{
+  return replay_word(tp, BN_SPI_SESSION_WRITE, (uint8_t*) p);
+}
+
+static int replay_read(beacon_transport_t * tp, uint8_t * p)
+{
+  return replay_word(tp, BN_SPI_SESSION_READ, p);
+}
+
+static int replay_max_xfers(beacon_transport_t * tp)
+{
+  struct replayer * r = tp->priv;
+  return r->hdr.max_xfers;
+}
+
+static int replay_set_speed(beacon_transport_t * tp, uint32_t hz)
+{
+  struct replayer * r = tp->priv;
+  beacon_spi_session_record_t rec;
+  int ret = 0;
+
+  pthread_mutex_lock(&r->mut);
+  long pos = ftell(r->f);
+  if (!r->eof && fread(&rec, sizeof(rec), 1, r->f) == 1)
+  {
+    if (rec.op == BN_SPI_SESSION_SET_SPEED)
+    {
+      r->nops++;
+      if (rec.arg != hz) mismatch(r, "set a different clock");
+      ret = rec.ret;
+    }
+    else
+    {
+      //the clock doesn't affect what we read back, so don't count this against the replay
+      fseek(r->f, pos, SEEK_SET);
+    }
+  }
+  pthread_mutex_unlock(&r->mut);
+  return ret;
+}
+
+static void replay_close(beacon_transport_t * tp)
+{
+  struct replayer * r = tp->priv;
+  fclose(r->f);
+  pthread_mutex_destroy(&r->mut);
+  free(r);
+}
+
+static const beacon_transport_ops_t replay_ops =
+{
+  .name = "replay",
+  .xfer = replay_xfer,
+  .write = replay_write,
+  .read = replay_read,
+  .max_xfers = replay_max_xfers,
+  .set_speed = replay_set_speed,
+  .close = replay_close
+};
+
+
+beacon_transport_t * beacon_replay_open(const char * path)
+{
+  FILE * f = fopen(path, "r");
+  if (!f)
+  {
+    fprintf(stderr,"Could not open %s for replay\n", path);
+    return 0;
+  }
+
+  struct replayer * r = calloc(1, sizeof(struct replayer));
+  beacon_transport_t * tp = malloc(sizeof(beacon_transport_t));
+  if (!r || !tp)
+  {
+    fprintf(stderr,"Could not allocate replay transport\n");
+    free(r);
+    free(tp);
+    fclose(f);
+    return 0;
+  }
+
+  if (fread(&r->hdr, sizeof(r->hdr), 1, f) != 1 || r->hdr.magic != BN_SPI_SESSION_MAGIC || r->hdr.version > BN_SPI_SESSION_VERSION)
+  {
+    fprintf(stderr,"%s is not an SPI recording\n", path);
+    fclose(f);
+    free(r);
+    free(tp);
+    return 0;
+  }
+  r->f = f;
+  pthread_mutex_init(&r->mut, 0);
+
+  tp->ops = &replay_ops;
+  tp->priv = r;
+  tp->fd = -1;
+  tp->trace = 0;
+  return tp;
+}
+
+int beacon_replay_status(beacon_transport_t * tp, uint64_t * nops, uint64_t * nmismatch)
+{
+  if (!tp || tp->ops != &replay_ops) return -1;
+  struct replayer * r = tp->priv;
+
+  pthread_mutex_lock(&r->mut);
+  if (nops) *nops = r->nops;
+  if (nmismatch) *nmismatch = r->nmismatch;
+  int eof = r->eof;
+  pthread_mutex_unlock(&r->mut);
+  return eof;
+}
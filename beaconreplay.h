@@ -0,0 +1,96 @@
+#ifndef _beaconreplay_h
+#define _beaconreplay_h
+
+#include "beacontransport.h"
+
+/** \file beaconreplay.h
+ *
+ * Recording and replaying SPI sessions.
+ *
+ * A recording transport wraps another transport and writes every exchange
+ * (what was sent, what came back, and how long it took) to a file. A replay
+ * transport reads such a file and hands the recorded data back, in order,
+ * without any hardware. Since beacondaq.c only makes decisions based on what
+ * it reads back, replaying a session makes it issue exactly the same
+ * sequence of transfers, which makes it possible to profile the readout
+ * against a real high-rate run on any machine.
+ *
+ * Select these in beacon_open with:
+ *
+ *   - "record:FILE:DEVICE"  e.g. "record:/tmp/run.spi:/dev/spidev2.0" or "record:/tmp/run.spi:emu:rate=1000"
+ *   - "replay:FILE"
+ *
+ * The replay doesn't wait for the recorded durations, so it runs as fast as
+ * the CPU allows. If the DAQ sends something different from what was
+ * recorded, the replay keeps going but counts a mismatch (and complains
+ * about the first few), since the responses are probably meaningless after
+ * that.
+ *
+ * File format: a beacon_spi_session_header_t, then for each operation a
+ * beacon_spi_session_record_t. For BN_SPI_SESSION_XFER, the record is
+ * followed by, for each transfer, a uint16_t length, a uint8_t
+ * flags (1 = has tx, 2 = has rx), and then the tx and/or rx bytes. For
+ * BN_SPI_SESSION_WRITE/READ it's followed by the BN_WORD_SIZE bytes written
+ * or read. Everything is in host byte order.
+ */
+
+/** Device name prefix for recording */
+#define BEACON_RECORD_PREFIX "record:"
+
+/** Device name prefix for replaying */
+#define BEACON_REPLAY_PREFIX "replay:"
+
+#define BN_SPI_SESSION_MAGIC 0x5350
+#define BN_SPI_SESSION_VERSION 0
+
+/** Start of a session file */
+typedef struct beacon_spi_session_header
+{
+  uint16_t magic;      //!< BN_SPI_SESSION_MAGIC
+  uint16_t version;    //!< BN_SPI_SESSION_VERSION
+  uint32_t max_xfers;  //!< transfers per message the recorded transport took
+} beacon_spi_session_header_t;
+
+/** Recorded operation types */
+typedef enum beacon_spi_session_op
+{
+  BN_SPI_SESSION_XFER = 0,
+  BN_SPI_SESSION_WRITE = 1,
+  BN_SPI_SESSION_READ = 2,
+  BN_SPI_SESSION_SET_SPEED = 3
+} beacon_spi_session_op_t;
+
+/** One recorded operation */
+typedef struct beacon_spi_session_record
+{
+  uint8_t op;           //!< a beacon_spi_session_op_t
+  uint8_t reserved;
+  uint16_t nxfers;      //!< number of transfers (for BN_SPI_SESSION_XFER)
+  int32_t ret;          //!< what the operation returned
+  uint32_t arg;         //!< the clock for BN_SPI_SESSION_SET_SPEED, otherwise 0
+  uint32_t duration_ns; //!< how long the operation took
+  uint64_t start_ns;    //!< when the operation started, relative to opening the recording
+} beacon_spi_session_record_t;
+
+
+/** Wrap a transport so everything going through it is recorded to path.
+ * The recording transport takes ownership of inner. Returns 0 on failure (in which case inner is closed).
+ */
+beacon_transport_t * beacon_record_open(const char * path, beacon_transport_t * inner);
+
+/** Open a recorded session for replay. Returns 0 on failure. */
+beacon_transport_t * beacon_replay_open(const char * path);
+
+/** If tp is a recording transport, returns the transport it wraps, otherwise tp */
+beacon_transport_t * beacon_record_inner(beacon_transport_t * tp);
+
+/** Get replay progress. Returns -1 if tp is not a replay transport.
+ *
+ * @param tp the replay transport
+ * @param nops  if not 0, filled with the number of operations replayed so far
+ * @param nmismatch if not 0, filled with the number of operations that didn't match the recording
+ * @returns 1 if the end of the recording has been reached, 0 if not, -1 if not a replay
+ */
+int beacon_replay_status(beacon_transport_t * tp, uint64_t * nops, uint64_t * nmismatch);
+
+#endif
@@ -0,0 +1,144 @@
+#include "beacontransport.h"
+#include "beaconemu.h"
+#include "beaconreplay.h"
+#include "beacondaq.h"
+#include <linux/spi/spidev.h>
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+
+/* The spidev backend. This is just a thin wrapper around the syscalls we used to make directly */
+
+static int spidev_xfer(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfers)
+{
+  return ioctl(tp->fd, SPI_IOC_MESSAGE(n), xfers);
+}
+
+static int spidev_write(beacon_transport_t * tp, const uint8_t * p)
+{
+  return write(tp->fd, p, BN_WORD_SIZE);
+}
+
+static int spidev_read(beacon_transport_t * tp, uint8_t * p)
+{
+  return read(tp->fd, p, BN_WORD_SIZE);
+}
+
+// spidev refuses messages with more than bufsiz bytes in either direction
+static int spidev_max_xfers(beacon_transport_t * tp)
+{
+  (void) tp;
+  int bufsiz = 4096; //the default
+  FILE * f = fopen("/sys/module/spidev/parameters/bufsiz","r");
+  if (f)
+  {
+    if (fscanf(f,"%d", &bufsiz) != 1) bufsiz = 4096;
+    fclose(f);
+  }
+
+  int n = bufsiz / BN_WORD_SIZE;
+  return n < BEACON_SPIDEV_MAX_XFERS ? n : BEACON_SPIDEV_MAX_XFERS;
+}
+
+static int spidev_set_speed(beacon_transport_t * tp, uint32_t hz)
+{
+  return ioctl(tp->fd, SPI_IOC_WR_MAX_SPEED_HZ, &hz) < 0;
+}
+
+static void spidev_close(beacon_transport_t * tp)
+{
+  flock(tp->fd, LOCK_UN);
+  close(tp->fd);
+}
+
+static const beacon_transport_ops_t spidev_ops =
+{
+  .name = "spidev",
+  .xfer = spidev_xfer,
+  .write = spidev_write,
+  .read = spidev_read,
+  .max_xfers = spidev_max_xfers,
+  .set_speed = spidev_set_speed,
+  .close = spidev_close
+};
+
+
+beacon_transport_t * beacon_transport_spidev_open(const char * device)
+{
+  int fd = open(device, O_RDWR);
+  if (fd < 0)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 0;
+  }
+
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+  {
+    fprintf(stderr,"Could not get exclusive access to %s\n", device);
+    close(fd);
+    return 0;
+  }
+
+  //Configure the SPI protocol
+  uint8_t mode = SPI_MODE_0;  //we could change the chip select here too
+  ioctl(fd, SPI_IOC_WR_MODE, &mode);
+
+  beacon_transport_t * tp = malloc(sizeof(beacon_transport_t));
+  tp->ops = &spidev_ops;
+  tp->priv = 0;
+  tp->fd = fd;
+  tp->trace = 0;
+  return tp;
+}
+
+
+beacon_transport_t * beacon_transport_open(const char * name, beacon_transport_t * master)
+{
+  if (!strncmp(name, BEACON_REPLAY_PREFIX, strlen(BEACON_REPLAY_PREFIX)))
+  {
+    return beacon_replay_open(name + strlen(BEACON_REPLAY_PREFIX));
+  }
+
+  if (!strncmp(name, BEACON_RECORD_PREFIX, strlen(BEACON_RECORD_PREFIX)))
+  {
+    const char * path = name + strlen(BEACON_RECORD_PREFIX);
+    const char * colon = strchr(path, ':');
+    if (!colon)
+    {
+      fprintf(stderr,"Expected record:FILE:DEVICE, got %s\n", name);
+      return 0;
+    }
+    char * file = strndup(path, colon - path);
+    beacon_transport_t * inner = beacon_transport_open(colon + 1, beacon_record_inner(master));
+    beacon_transport_t * tp = inner ? beacon_record_open(file, inner) : 0;
+    free(file);
+    return tp;
+  }
+
+  if (!strncmp(name, BEACON_EMU_PREFIX, strlen(BEACON_EMU_PREFIX)))
+  {
+    const char * opts = name + strlen(BEACON_EMU_PREFIX);
+    if (*opts == ':') opts++;
+    return beacon_emu_open_opts(opts, master);
+  }
+
+  return beacon_transport_spidev_open(name);
+}
+
+int beacon_transport_max_xfers(beacon_transport_t * tp)
+{
+  return tp->ops->max_xfers ? tp->ops->max_xfers(tp) : BEACON_SPIDEV_MAX_XFERS;
+}
+
+void beacon_transport_close(beacon_transport_t * tp)
+{
+  if (!tp) return;
+  tp->ops->close(tp);
+  free(tp);
+}
@@ -0,0 +1,85 @@
+#ifndef _beacontransport_h
+#define _beacontransport_h
+
+#include <stdint.h>
+
+/** \file beacontransport.h
+ *
+ * Pluggable transports for talking to the FPGA's.
+ *
+ * Everything in beacondaq.c that touches the hardware goes through one of
+ * these, so the same readout code can run against a real spidev device or
+ * against something that just pretends to be one (see beaconemu.h).
+ *
+ * A transport is picked by name when opening:
+ *
+ *   - "emu" or "emu:opt=val,opt=val"  the in-process FPGA emulator (see beacon_emu_open_opts for options)
+ *   - "record:FILE:DEVICE" opens DEVICE and records everything sent to it to FILE (see beaconreplay.h)
+ *   - "replay:FILE" replays a recording 
+ *   - anything else is treated as a spidev device (e.g. /dev/spidev2.0)
+ */
+
+struct spi_ioc_transfer;
+struct beacon_spi_trace;
+
+/** The most transfers spidev can take in one SPI_IOC_MESSAGE. The ioctl size
+ * field is 14 bits and each transfer is 32 bytes, so we can't go above 511 no
+ * matter what the spidev bufsiz is. */
+#define BEACON_SPIDEV_MAX_XFERS 511
+
+/** opaque-ish transport handle */
+typedef struct beacon_transport beacon_transport_t;
+
+/** The operations a transport must implement. These mirror the syscalls the spidev backend does. */
+typedef struct beacon_transport_ops
+{
+  const char * name; //!< short name of the backend, for printouts
+
+  /** Do n full-duplex transfers, like SPI_IOC_MESSAGE(n). Returns the number of bytes transferred, or negative on error*/
+  int (*xfer)(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfers);
+
+  /** Write BN_WORD_SIZE bytes. Returns number of bytes written */
+  int (*write)(beacon_transport_t * tp, const uint8_t * p);
+
+  /** Read BN_WORD_SIZE bytes. Returns number of bytes read */
+  int (*read)(beacon_transport_t * tp, uint8_t * p);
+
+  /** The maximum number of transfers that fit in one call to xfer */
+  int (*max_xfers)(beacon_transport_t * tp);
+
+  /** Set the SPI clock, in Hz. Returns 0 on success */
+  int (*set_speed)(beacon_transport_t * tp, uint32_t hz);
+
+  /** Release everything held by the transport (but not the transport itself) */
+  void (*close)(beacon_transport_t * tp);
+
+} beacon_transport_ops_t;
+
+
+struct beacon_transport
+{
+  const beacon_transport_ops_t * ops;
+  void * priv;    //!< backend-specific state
+  int fd;         //!< file descriptor, if the backend has one, otherwise -1 (only used for printouts)
+  struct beacon_spi_trace * trace; //!< where beacondaq records SPI timing, 0 if not attached to a device
+};
+
+
+/** Open a transport by name (see above for the naming scheme).
+ *
+ * @param name the device name
+ * @param master If this is a slave board, the master's transport (so e.g. emulated boards can share triggers) , otherwise 0
+ * @returns the transport or 0 if something went wrong
+ */
+beacon_transport_t * beacon_transport_open(const char * name, beacon_transport_t * master);
+
+/** Open a spidev device. This also takes an exclusive lock on the device and sets SPI mode 0. */
+beacon_transport_t * beacon_transport_spidev_open(const char * device);
+
+/** The maximum number of transfers per message the transport supports */
+int beacon_transport_max_xfers(beacon_transport_t * tp);
+
+/** Close and free a transport */
+void beacon_transport_close(beacon_transport_t * tp);
+
+#endif
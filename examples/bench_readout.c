@@ -0,0 +1,123 @@
+#include "beacondaq.h"
+#include "beaconemu.h"
+#include "beaconreplay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Benchmarks the readout. By default this runs against the emulator, so it can run anywhere.
+ *
+ *  bench_readout [device=emu:rate=100] [nevents=1000] [buffer_length=624] [max_xfers=0 (as many as possible)] [spi_trace_file]
+ *
+ * If a trace file is given, SPI tracing is turned on and drained there (see dump_spi_trace).
+ */
+
+static double elapsed(struct timespec * start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=100";
+  int nevents = nargs > 2 ? atoi(args[2]) : 1000;
+  int buffer_length = nargs > 3 ? atoi(args[3]) : 624;
+  int max_xfers = nargs > 4 ? atoi(args[4]) : 0;
+  FILE * trace = 0;
+  if (nargs > 5)
+  {
+    trace = fopen(args[5], "w");
+    if (!trace)
+    {
+      fprintf(stderr,"Could not open %s\n", args[5]);
+      return 1;
+    }
+  }
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_set_buffer_length(d, buffer_length);
+  beacon_set_max_xfers(d, max_xfers);
+  printf("using up to %d transfers per SPI message\n", beacon_get_max_xfers(d));
+  beacon_phased_trigger_readout(d, 1);
+  beacon_reset_readout_stats(d);
+  if (trace) beacon_set_spi_trace(d, 1);
+
+  beacon_header_t (*headers)[BN_NUM_BUFFER] = malloc(sizeof(*headers));
+  beacon_event_t (*events)[BN_NUM_BUFFER] = malloc(sizeof(*events));
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int nread = 0;
+  while (nread < nevents)
+  {
+    beacon_buffer_mask_t mask = 0;
+    beacon_wait(d, &mask, 1, MASTER);
+
+    // a replay can run out
+    if (!mask && beacon_replay_status(beacon_get_transport(d, MASTER), 0, 0) == 1) break;
+    if (!mask) continue;
+
+    if (beacon_read_multiple_array(d, mask, *headers, *events))
+    {
+      fprintf(stderr,"Readout failed!\n");
+      break;
+    }
+    nread += __builtin_popcount(mask);
+    if (trace) beacon_drain_spi_trace(d, trace);
+  }
+
+  double t = elapsed(&start);
+
+  beacon_status_t st;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  beacon_read_status(d, &st, MASTER);
+  double tstatus = elapsed(&start);
+
+  printf("read %d events in %g s (%g Hz)\n", nread, t, nread / t);
+  printf("beacon_read_status took %g ms\n", tstatus * 1e3);
+
+  beacon_readout_stats_t rs;
+  beacon_get_readout_stats(d, &rs);
+  printf("readout: %lu ioctls, %lu transfers (%g ioctls/event, %g transfers/event)\n",
+          rs.nmessages, rs.nxfers, rs.nevents ? 1. * rs.nmessages / rs.nevents : 0.,
+          rs.nevents ? 1. * rs.nxfers / rs.nevents : 0.);
+  printf("register cache: %lu writes skipped, %lu reads cached\n", rs.nwrites_skipped, rs.nreads_cached);
+  printf("status read with the clears answered %lu waits without polling\n", rs.nstatus_after_clear);
+
+  beacon_readout_timing_summary_t ts;
+  beacon_get_readout_timing_summary(d, &ts);
+  beacon_readout_timing_summary_print(stdout, &ts);
+
+  beacon_emu_stats_t stats;
+  if (!beacon_emu_get_stats(beacon_get_transport(d, MASTER), &stats))
+  {
+    printf("emulator: %lu triggers, %lu recorded, %lu dropped (%g%% deadtime)\n",
+            stats.ntriggers, stats.nrecorded, stats.ndropped,
+            stats.ntriggers ? 100. * stats.ndropped / stats.ntriggers : 0.);
+    printf("emulator: %lu SPI messages, %lu transfers (%g messages/event)\n",
+            stats.nmessages, stats.nxfers, nread ? 1. * stats.nmessages / nread : 0.);
+  }
+
+  uint64_t nops, nmismatch;
+  if (beacon_replay_status(beacon_get_transport(d, MASTER), &nops, &nmismatch) >= 0)
+  {
+    printf("replay: %lu operations, %lu did not match the recording\n", nops, nmismatch);
+  }
+
+  if (trace) fclose(trace);
+  free(headers);
+  free(events);
+  beacon_close(d);
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include "beacondaq.h" 
+#include <stdio.h> 
+#include <stdlib.h> 
+#include <string.h> 
+
+
+/* Prints an SPI trace file written by beacon_drain_spi_trace. 
+ * If a threshold is given, only operations that took at least that long are printed. 
+ *
+ *  dump_spi_trace trace.dat [min_us=0]
+ */ 
+
+static const char * op_names[] = { "XFER", "WRITE", "READ" }; 
+
+int main(int nargs, char ** args) 
+{
+
+  if (nargs < 2) 
+  {
+    fprintf(stderr,"dump_spi_trace trace.dat [min_us=0]\n"); 
+    return 1; 
+  }
+
+  double min_us = nargs > 2 ? atof(args[2]) : 0; 
+
+  FILE * f = fopen(args[1], "r"); 
+  if (!f) 
+  {
+    fprintf(stderr,"Could not open %s\n", args[1]); 
+    return 1; 
+  }
+
+  beacon_spi_trace_block_t block; 
+  uint64_t ntotal = 0; 
+  uint64_t nlost = 0; 
+  double max_us = 0; 
+
+  while (fread(&block, sizeof(block), 1, f) == 1)
+  {
+    if (block.magic != BN_SPI_TRACE_MAGIC || block.record_size != sizeof(beacon_spi_trace_record_t))
+    {
+      fprintf(stderr,"Bad block (magic 0x%x, record size %u)\n", block.magic, block.record_size); 
+      fclose(f); 
+      return 1; 
+    }
+
+    nlost += block.nlost; 
+    if (block.nlost) printf("(%lu records lost)\n", block.nlost); 
+
+    uint32_t i; 
+    for (i = 0; i < block.nrecords; i++)
+    {
+      beacon_spi_trace_record_t r; 
+      if (fread(&r, sizeof(r), 1, f) != 1)
+      {
+        fprintf(stderr,"Truncated file\n"); 
+        fclose(f); 
+        return 1; 
+      }
+
+      double us = r.duration_ns / 1e3; 
+      ntotal++; 
+      if (us > max_us) max_us = us; 
+      if (us < min_us) continue; 
+
+      printf("%lu.%09lu fd=%d %-5s nxfers=%u nbytes=%u %.1f us%s\n", 
+             r.start_ns / 1000000000, r.start_ns % 1000000000, r.fd, 
+             r.op < 3 ? op_names[r.op] : "???", r.nxfers, r.nbytes, us, r.failed ? " FAILED" : ""); 
+    }
+  }
+
+  printf("%lu records (%lu lost), slowest took %.1f us\n", ntotal, nlost, max_us); 
+  fclose(f); 
+  return 0; 
+}
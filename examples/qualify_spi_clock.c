@@ -0,0 +1,43 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+/* Finds the fastest SPI clock that reads back data cleanly, and prints the bit error rate at each clock.
+ *
+ *  qualify_spi_clock [device=emu:rate=0,maxclock=30] [nreads=4] [margin=0.1]
+ */
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0,maxclock=30";
+  int nreads = nargs > 2 ? atoi(args[2]) : 4;
+  float margin = nargs > 3 ? atof(args[3]) : 0.1;
+  int i;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_spi_clock_qualification_t q;
+  if (beacon_qualify_spi_clock(d, 0, 0, nreads, margin, 0, &q))
+  {
+    fprintf(stderr,"Qualification failed\n");
+    beacon_close(d);
+    return 1;
+  }
+
+  printf("clock (MHz)    bits          errors     BER\n");
+  for (i = 0; i < q.nclocks; i++)
+  {
+    printf("%8u  %12lu  %12lu  %8.2e\n", q.clock[i], q.nbits[i], q.nbit_errors[i],
+           q.nbits[i] ? 1. * q.nbit_errors[i] / q.nbits[i] : 0.);
+  }
+  printf("fastest clean clock: %u MHz, chosen with %g%% margin: %u MHz\n", q.fastest_clean, margin * 100, q.chosen);
+
+  beacon_close(d);
+  return 0;
+}
@@ -0,0 +1,159 @@
+#include "beaconacq.h"
+#include "beaconemu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/* Checks background acquisition (beaconacq.h) against the emulator.
+ *
+ * A slow consumer (one that spends process_us on each event, standing in for compression and
+ * writing) reads nevents events, first in the same thread as the readout, then popping them from
+ * an acquisition ring (dropping when full), then with a tiny ring that blocks when full. Prints the
+ * emulator's deadtime for each. Events popped from the ring must come out in order, without any
+ * missing unless they were counted as dropped. Returns nonzero if anything doesn't work.
+ *
+ *  test_acq [nevents=300] [rate=200] [process_us=4000]
+ */
+
+static int process_us;
+static beacon_emu_stats_t before;
+
+static void process(void)
+{
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < process_us);
+}
+
+static void start_counting(beacon_dev_t * d)
+{
+  beacon_emu_get_stats(beacon_get_transport(d, MASTER), &before);
+}
+
+static void print_deadtime(beacon_dev_t * d, const char * what, double t)
+{
+  beacon_emu_stats_t stats;
+  beacon_emu_get_stats(beacon_get_transport(d, MASTER), &stats);
+  uint64_t ntriggers = stats.ntriggers - before.ntriggers;
+  uint64_t ndropped = stats.ndropped - before.ndropped;
+  printf("%s: %g s, %lu triggers, %lu dropped by the board (%g%% deadtime)\n", what, t,
+         ntriggers, ndropped, ntriggers ? 100. * ndropped / ntriggers : 0.);
+}
+
+static double since(struct timespec * start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+}
+
+static int run_acq(beacon_dev_t * d, int nevents, unsigned capacity, beacon_acq_full_policy_t policy, const char * what)
+{
+  beacon_header_t * hd = malloc(sizeof(beacon_header_t));
+  beacon_event_t * ev = malloc(sizeof(beacon_event_t));
+  beacon_acq_stats_t st;
+  struct timespec start;
+  uint64_t last = 0;
+  int nbad = 0, npopped = 0, ngaps = 0;
+
+  start_counting(d);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  beacon_acq_t * acq = beacon_acq_start(d, capacity, policy);
+  if (!acq) return 1;
+
+  while (npopped < nevents)
+  {
+    if (beacon_acq_pop_wait(acq, hd, ev, 5) != 1)
+    {
+      fprintf(stderr,"%s: no event for 5 seconds!\n", what);
+      nbad++;
+      break;
+    }
+    if (hd->event_number != ev->event_number)
+    {
+      fprintf(stderr,"%s: header and event don't match (%lu vs. %lu)\n", what, hd->event_number, ev->event_number);
+      nbad++;
+    }
+    if (last && hd->event_number != last + 1) ngaps += hd->event_number - last - 1;
+    if (last && hd->event_number <= last)
+    {
+      fprintf(stderr,"%s: event %lu came after %lu\n", what, hd->event_number, last);
+      nbad++;
+    }
+    last = hd->event_number;
+    npopped++;
+    process();
+  }
+
+  double t = since(&start);
+  beacon_acq_stop(acq);
+
+  //everything left can still be popped, and then we're told it's over
+  while (beacon_acq_pop_wait(acq, hd, ev, 1) == 1) npopped++;
+
+  beacon_acq_get_stats(acq, &st);
+  print_deadtime(d, what, t);
+  printf("%s: ring of %u, %lu read, %lu pushed, %lu popped, %lu dropped from the ring, at most %u in the ring\n",
+         what, st.capacity, st.nread, st.npushed, st.npopped, st.ndropped, st.max_occupancy);
+
+  if (st.npopped != (uint64_t) npopped || st.npushed != st.npopped || st.occupancy) nbad++;
+  if (st.nread != st.npushed + st.ndropped + st.nrejected || st.nerrors) nbad++;
+  if (policy == BN_ACQ_BLOCK && st.ndropped) nbad++;
+  if (ngaps > (int) st.ndropped)
+  {
+    fprintf(stderr,"%s: %d events missing, but only %lu dropped\n", what, ngaps, st.ndropped);
+    nbad++;
+  }
+
+  beacon_acq_close(acq);
+  free(hd);
+  free(ev);
+  return nbad;
+}
+
+int main(int nargs, char ** args)
+{
+  int nevents = nargs > 1 ? atoi(args[1]) : 300;
+  const char * rate = nargs > 2 ? args[2] : "200";
+  char device[64];
+  int nbad = 0, nread = 0;
+  process_us = nargs > 3 ? atoi(args[3]) : 4000;
+
+  snprintf(device, sizeof(device), "emu:rate=%s", rate);
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_phased_trigger_readout(d, 1);
+
+  // the old way: processing holds up the readout
+  beacon_header_t (*headers)[BN_NUM_BUFFER] = malloc(sizeof(*headers));
+  beacon_event_t (*events)[BN_NUM_BUFFER] = malloc(sizeof(*events));
+  struct timespec start;
+  start_counting(d);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (nread < nevents)
+  {
+    int i, n = beacon_wait_for_and_read_multiple_events(d, headers, events);
+    if (n < 0) break;
+    for (i = 0; i < n; i++) process();
+    nread += n;
+  }
+  print_deadtime(d, "same thread", since(&start));
+  free(headers);
+  free(events);
+
+  nbad += run_acq(d, nevents, 256, BN_ACQ_DROP, "ring (drop)");
+  nbad += run_acq(d, nevents, BN_NUM_BUFFER, BN_ACQ_BLOCK, "small ring (block)");
+
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,119 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Checks reading the FPGA's beams and power sums (beacon_read_multiple_products).
+ *
+ * Calpulser triggers are read with their beams and power sums, which must have the event's number and
+ * length. The beam with the most power must be the one with the biggest pulse in its waveform (with the
+ * emulator, that's beam 20). Everything is written out and read back. Returns nonzero if anything doesn't work.
+ *
+ *  test_beams [device=emu:rate=0] [nevents=8] [buffer_length=512]
+ */
+
+static int peak_to_peak(const uint8_t * wf, int n)
+{
+  int i, lo = 255, hi = 0;
+  for (i = 0; i < n; i++)
+  {
+    if (wf[i] < lo) lo = wf[i];
+    if (wf[i] > hi) hi = wf[i];
+  }
+  return hi - lo;
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0";
+  int nevents = nargs > 2 ? atoi(args[2]) : 8;
+  int buffer_length = nargs > 3 ? atoi(args[3]) : 512;
+  int nbad = 0;
+  int ievent, ibeam, i;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_set_buffer_length(d, buffer_length);
+  beacon_calpulse(d, 3);
+
+  beacon_header_t hd;
+  beacon_event_t * ev = malloc(sizeof(beacon_event_t));
+  beacon_beams_t * beams = calloc(1, sizeof(beacon_beams_t));
+  beacon_powersum_t * ps = calloc(1, sizeof(beacon_powersum_t));
+  beacon_beams_t * beams_back = calloc(1, sizeof(beacon_beams_t));
+  beacon_powersum_t * ps_back = calloc(1, sizeof(beacon_powersum_t));
+  char fname[] = "/tmp/test_beamsXXXXXX";
+  int fd = mkstemp(fname);
+  if (fd < 0) return 1;
+  close(fd);
+
+  for (ievent = 0; ievent < nevents; ievent++)
+  {
+    beacon_buffer_mask_t ready = 0;
+    beacon_sw_trigger(d);
+    while (!ready) beacon_wait(d, &ready, 1, MASTER);
+
+    beacon_header_t * hdp = &hd;
+    if (beacon_read_multiple_products(d, ready & -ready, &hdp, &ev, &beams, &ps))
+    {
+      fprintf(stderr,"Readout failed\n");
+      return 1;
+    }
+
+    if (beams->event_number != hd.event_number || ps->event_number != hd.event_number || ev->event_number != hd.event_number
+        || beams->buffer_length != ev->buffer_length || ps->nsums != ev->buffer_length / BN_POWERSUM_SAMPLES)
+    {
+      fprintf(stderr,"Event %lu: beams (%lu, %d samples) or power sums (%lu, %d sums) don't go with it\n", hd.event_number,
+              beams->event_number, beams->buffer_length, ps->event_number, ps->nsums);
+      nbad++;
+    }
+
+    // the most power should be where the pulse is biggest
+    int best_power = 0, best_beam = 0;
+    uint64_t most = 0, most_p2p = 0;
+    for (ibeam = 0; ibeam < BN_NUM_BEAMS; ibeam++)
+    {
+      uint64_t power = 0;
+      for (i = 0; i < ps->nsums; i++) power += ps->data[ibeam][i];
+      if (power > most) { most = power; best_power = ibeam; }
+      uint64_t p2p = peak_to_peak(beams->data[ibeam], beams->buffer_length);
+      if (p2p > most_p2p) { most_p2p = p2p; best_beam = ibeam; }
+    }
+    if (best_power != best_beam)
+    {
+      fprintf(stderr,"Event %lu: beam %d has the most power, but beam %d the biggest pulse\n", hd.event_number, best_power, best_beam);
+      nbad++;
+    }
+    if (ievent == 0) printf("beam %d has the most power (%lu)\n", best_power, most);
+
+    gzFile f = gzopen(fname, "w");
+    beacon_beams_gzwrite(f, beams);
+    beacon_powersum_gzwrite(f, ps);
+    gzclose(f);
+    f = gzopen(fname, "r");
+    if (beacon_beams_gzread(f, beams_back) || beacon_powersum_gzread(f, ps_back)
+        || memcmp(beams_back, beams, sizeof(*beams)) || memcmp(ps_back, ps, sizeof(*ps)))
+    {
+      fprintf(stderr,"Event %lu: beams or power sums did not come back the same\n", hd.event_number);
+      nbad++;
+    }
+    gzclose(f);
+  }
+
+  printf("%d events checked, %d problems\n", nevents, nbad);
+  beacon_calpulse(d, 0);
+  unlink(fname);
+  free(ev);
+  free(beams);
+  free(ps);
+  free(beams_back);
+  free(ps_back);
+  beacon_close(d);
+  return nbad != 0;
+}
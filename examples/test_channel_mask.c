@@ -0,0 +1,164 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+/* Checks the channel read mask (beacon_set_channel_read_mask).
+ *
+ * Software triggers are read with all channels and then with only the channels in mask, into both
+ * kinds of events. Channels left out must be zero, the others must match a raw read, the header and
+ * event must record the mask, and the events (written to disk and read back) must come back the same
+ * but take less room. Returns nonzero if anything doesn't work.
+ *
+ *  test_channel_mask [mask=0x0f] [device=emu:rate=0] [nevents=16]
+ */
+
+static int nbad = 0;
+
+static int read_one(beacon_dev_t * d, uint8_t mask, beacon_header_t * hd, beacon_event_t * ev,
+                    beacon_compact_event_t * cev, uint8_t * raw)
+{
+  beacon_buffer_mask_t ready = 0;
+  uint8_t next = 0;
+  int ichan;
+  uint16_t len = beacon_get_buffer_length(d);
+
+  beacon_sw_trigger(d);
+  while (!ready) beacon_wait(d, &ready, 1, MASTER);
+  beacon_check_buffers(d, &next, MASTER);
+
+  for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+  {
+    beacon_read_raw(d, next, ichan, 1, len / (BN_WORD_SIZE * BN_NUM_CHUNK), raw + ichan * BN_MAX_WAVEFORM_LENGTH, MASTER);
+  }
+
+  // the compact event gets the same waveforms
+  if (beacon_read_single(d, next, hd, ev)) return 1;
+  beacon_compact_event_from_event(cev, ev);
+
+  if (hd->channel_read_mask[MASTER] != mask || ev->channel_read_mask[MASTER] != mask || cev->channel_read_mask[MASTER] != mask)
+  {
+    fprintf(stderr,"Mask not recorded (header 0x%x, event 0x%x, wanted 0x%x)\n",
+            hd->channel_read_mask[MASTER], ev->channel_read_mask[MASTER], mask);
+    nbad++;
+  }
+
+  for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+  {
+    static const uint8_t zeros[BN_MAX_WAVEFORM_LENGTH];
+    const uint8_t * want = (mask & (1 << ichan)) ? raw + ichan * BN_MAX_WAVEFORM_LENGTH : zeros;
+    if (memcmp(ev->data[MASTER][ichan], want, len))
+    {
+      fprintf(stderr,"Event %lu, channel %d (%s) is wrong\n", ev->event_number, ichan, want == zeros ? "masked" : "read");
+      nbad++;
+    }
+  }
+  return 0;
+}
+
+static long file_size(const char * fname)
+{
+  struct stat st;
+  return stat(fname, &st) ? -1 : st.st_size;
+}
+
+// write the events both ways to fname, read them back and compare, returning the size of the file
+static long write_and_check(const char * fname, int n, beacon_event_t * evs, beacon_compact_event_t ** cevs,
+                            beacon_event_t * back)
+{
+  int i;
+  gzFile f = gzopen(fname, "wT"); // uncompressed, so the sizes mean something
+  for (i = 0; i < n; i++)
+  {
+    beacon_event_gzwrite(f, &evs[i]);
+    beacon_compact_event_gzwrite(f, cevs[i]);
+  }
+  gzclose(f);
+
+  f = gzopen(fname, "r");
+  for (i = 0; i < 2 * n; i++)
+  {
+    const beacon_event_t * want = &evs[i / 2];
+    if (beacon_event_gzread(f, back))
+    {
+      fprintf(stderr,"Could not read back event %d\n", i);
+      nbad++;
+      break;
+    }
+    if (back->event_number != want->event_number || back->channel_read_mask[MASTER] != want->channel_read_mask[MASTER] ||
+        memcmp(back->data[MASTER], want->data[MASTER], sizeof(want->data[MASTER])))
+    {
+      fprintf(stderr,"Event %lu did not come back the same\n", want->event_number);
+      nbad++;
+    }
+  }
+  gzclose(f);
+  return file_size(fname);
+}
+
+int main(int nargs, char ** args)
+{
+  uint8_t mask = nargs > 1 ? strtol(args[1], 0, 0) : 0x0f;
+  const char * device = nargs > 2 ? args[2] : "emu:rate=0";
+  int nevents = nargs > 3 ? atoi(args[3]) : 16;
+  int i;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  uint16_t len = beacon_get_buffer_length(d);
+  uint8_t * raw = malloc(BN_NUM_CHAN * BN_MAX_WAVEFORM_LENGTH);
+  beacon_header_t hd;
+  beacon_event_t * evs = calloc(nevents, sizeof(beacon_event_t));
+  beacon_event_t * back = calloc(1, sizeof(beacon_event_t));
+  beacon_compact_event_t ** cevs = calloc(nevents, sizeof(*cevs));
+  for (i = 0; i < nevents; i++) cevs[i] = beacon_compact_event_alloc(len);
+  char fname[] = "/tmp/test_channel_maskXXXXXX";
+  int fd = mkstemp(fname);
+  if (fd < 0) return 1;
+  close(fd);
+
+  if (beacon_set_channel_read_mask(d, mask, BN_MAX_BOARDS) != -1) nbad++;
+
+  long size[2];
+  uint8_t masks[2] = { 0xff, mask };
+  for (int imask = 0; imask < 2; imask++)
+  {
+    beacon_set_channel_read_mask(d, masks[imask], MASTER);
+    if (beacon_get_channel_read_mask(d, MASTER) != masks[imask]) nbad++;
+    for (i = 0; i < nevents; i++)
+    {
+      if (read_one(d, masks[imask], &hd, &evs[i], cevs[i], raw))
+      {
+        fprintf(stderr,"Readout failed\n");
+        return 1;
+      }
+    }
+    size[imask] = write_and_check(fname, nevents, evs, cevs, back);
+    printf("mask 0x%02x: %d events (%d channels of %d samples) take %ld bytes\n",
+           masks[imask], 2 * nevents, __builtin_popcount(masks[imask]), len, size[imask]);
+  }
+
+  if (mask != 0xff && size[1] >= size[0])
+  {
+    fprintf(stderr,"Masked events are not any smaller\n");
+    nbad++;
+  }
+
+  printf("%d problems\n", nbad);
+  unlink(fname);
+  for (i = 0; i < nevents; i++) beacon_compact_event_free(cevs[i]);
+  free(cevs);
+  free(evs);
+  free(back);
+  free(raw);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,143 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Checks compact events (beacon_compact_event_t).
+ *
+ * Software triggers are taken and each buffer is read with beacon_read_raw and then into a compact
+ * event from a pool, and the two are compared. Each event is also written out compact and read back
+ * as a beacon_event_t, and the other way around. Returns nonzero if anything differs.
+ *
+ *  test_compact_event [device=emu:rate=0] [nevents=16] [buffer_length=624]
+ */
+
+static int compare(const beacon_compact_event_t * cev, const beacon_event_t * ev, const char * what, int ievent)
+{
+  int ichan, nbad = 0;
+  if (cev->event_number != ev->event_number || cev->buffer_length != ev->buffer_length || cev->board_id[0] != ev->board_id[0])
+  {
+    fprintf(stderr,"Event %d: %s: event number, buffer length or board id differ\n", ievent, what);
+    return 1;
+  }
+  for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+  {
+    if (memcmp(beacon_compact_event_waveform(cev, MASTER, ichan), ev->data[MASTER][ichan], ev->buffer_length))
+    {
+      fprintf(stderr,"Event %d, channel %d: %s differs\n", ievent, ichan, what);
+      nbad++;
+    }
+  }
+  return nbad;
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0";
+  int nevents = nargs > 2 ? atoi(args[2]) : 16;
+  int buffer_length = nargs > 3 ? atoi(args[3]) : 624;
+  int nbad = 0;
+  int ievent, ichan;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_set_buffer_length(d, buffer_length);
+
+  beacon_compact_pool_t * pool = beacon_compact_pool_create(BN_NUM_BUFFER, buffer_length);
+  beacon_compact_event_t * back = beacon_compact_event_alloc(buffer_length);
+  beacon_event_t * ev = calloc(1, sizeof(beacon_event_t));
+  beacon_header_t hd;
+  uint8_t * raw = malloc(BN_NUM_CHAN * BN_MAX_WAVEFORM_LENGTH);
+  char fname[] = "/tmp/test_compact_eventXXXXXX";
+  int fd = mkstemp(fname);
+
+  if (!pool || !back || fd < 0)
+  {
+    fprintf(stderr,"Setup failed\n");
+    return 1;
+  }
+  close(fd);
+
+  printf("%zu bytes per beacon_event_t, %d bytes of waveforms per compact event\n",
+         sizeof(beacon_event_t), BN_MAX_BOARDS * BN_NUM_CHAN * buffer_length);
+
+  for (ievent = 0; ievent < nevents; ievent++)
+  {
+    beacon_buffer_mask_t ready = 0;
+    uint8_t next = 0;
+
+    beacon_sw_trigger(d);
+    while (!ready)
+    {
+      beacon_wait(d, &ready, 1, MASTER);
+    }
+    beacon_check_buffers(d, &next, MASTER);
+
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      beacon_read_raw(d, next, ichan, 1, buffer_length / (BN_WORD_SIZE * BN_NUM_CHUNK),
+                      raw + ichan * BN_MAX_WAVEFORM_LENGTH, MASTER);
+    }
+
+    beacon_compact_event_t * cev = beacon_compact_pool_get(pool);
+    beacon_header_t * hd_ptr = &hd;
+    if (!cev || beacon_read_multiple_compact(d, 1 << next, &hd_ptr, &cev) != 0)
+    {
+      fprintf(stderr,"Readout failed for event %d\n", ievent);
+      beacon_compact_pool_put(pool, cev);
+      nbad++;
+      continue;
+    }
+
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      if (memcmp(raw + ichan * BN_MAX_WAVEFORM_LENGTH, beacon_compact_event_waveform(cev, MASTER, ichan), buffer_length))
+      {
+        fprintf(stderr,"Event %d (buffer %d), channel %d: raw read does not match compact event read\n", ievent, next, ichan);
+        nbad++;
+      }
+    }
+
+    // write compact, read full
+    gzFile f = gzopen(fname, "w");
+    beacon_compact_event_gzwrite(f, cev);
+    gzclose(f);
+    f = gzopen(fname, "r");
+    if (beacon_event_gzread(f, ev)) nbad++;
+    gzclose(f);
+    nbad += compare(cev, ev, "compact written, read as event", ievent);
+
+    // write full, read compact
+    f = gzopen(fname, "w");
+    beacon_event_gzwrite(f, ev);
+    gzclose(f);
+    f = gzopen(fname, "r");
+    if (beacon_compact_event_gzread(f, back)) nbad++;
+    gzclose(f);
+    nbad += compare(back, ev, "event written, read as compact", ievent);
+
+    beacon_compact_pool_put(pool, cev);
+  }
+
+  if (beacon_compact_pool_available(pool) != BN_NUM_BUFFER)
+  {
+    fprintf(stderr,"Pool lost events\n");
+    nbad++;
+  }
+
+  printf("%d events checked, %d mismatches\n", nevents, nbad);
+
+  unlink(fname);
+  free(raw);
+  free(ev);
+  beacon_compact_event_free(back);
+  beacon_compact_pool_destroy(pool);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,209 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+
+/* Checks deferred buffer clears (beacon_set_deferred_clear).
+ *
+ * All the buffers are filled with software triggers and read in one go, with clears sent right away and then
+ * deferred. Each buffer has to be read once and come back empty afterwards, and deferring has to save a message
+ * per buffer but the last. Each buffer's clear_ns has to be after its waveforms were read, and with deferred clears,
+ * after the next buffer's waveforms started being read (since that's the message it goes out with). Then RF triggers are read for a while with deferred clears, and the event numbers
+ * must follow on without repeats. Last, buffers are filled again and read as beacon_notify_fd announces them,
+ * still with deferred clears: each buffer has to be announced once, and nothing may be announced once
+ * they've all been read. Prints the SPI messages per readout both ways. Returns nonzero if anything
+ * doesn't work.
+ *
+ *  test_deferred_clear [device=emu:rate=1000] [nreadouts=20] [nevents=500]
+ */
+
+static uint64_t messages(beacon_dev_t * d)
+{
+  beacon_readout_stats_t st;
+  beacon_get_readout_stats(d, &st);
+  return st.nmessages;
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=1000";
+  int nreadouts = nargs > 2 ? atoi(args[2]) : 20;
+  int nevents = nargs > 3 ? atoi(args[3]) : 500;
+  int nbad = 0;
+  int idefer, iread, i;
+  double per_readout[2];
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_header_t (*headers)[BN_NUM_BUFFER] = malloc(sizeof(*headers));
+  beacon_event_t (*events)[BN_NUM_BUFFER] = malloc(sizeof(*events));
+  uint64_t last = 0;
+
+  for (idefer = 0; idefer < 2; idefer++)
+  {
+    uint64_t nmessages = 0;
+    beacon_set_deferred_clear(d, idefer);
+    if (beacon_get_deferred_clear(d) != idefer) nbad++;
+
+    for (iread = 0; iread < nreadouts; iread++)
+    {
+      beacon_buffer_mask_t ready = 0;
+      for (i = 0; i < BN_NUM_BUFFER; i++) beacon_sw_trigger(d);
+      while (beacon_check_buffers(d, 0, MASTER) != (1 << BN_NUM_BUFFER) - 1);
+      beacon_wait(d, &ready, 1, MASTER);
+
+      uint64_t before = messages(d);
+      if (ready != (1 << BN_NUM_BUFFER) - 1 || beacon_read_multiple_array(d, ready, *headers, *events))
+      {
+        fprintf(stderr,"Readout of 0x%x failed\n", ready);
+        return 1;
+      }
+      nmessages += messages(d) - before;
+
+      for (i = 0; i < BN_NUM_BUFFER; i++)
+      {
+        if (last && (*headers)[i].event_number != last + 1)
+        {
+          fprintf(stderr,"Event %lu came after %lu\n", (*headers)[i].event_number, last);
+          nbad++;
+        }
+        last = (*headers)[i].event_number;
+      }
+
+      // the clear times are when they went out
+      beacon_readout_timing_t t[BN_NUM_BUFFER];
+      for (i = 0; i < BN_NUM_BUFFER; i++)
+      {
+        if (beacon_get_readout_timing(d, (*headers)[i].event_number, &t[i])) nbad++;
+      }
+      for (i = 0; i < BN_NUM_BUFFER; i++)
+      {
+        uint64_t after = t[i].waveforms_ns[MASTER];
+        if (idefer && i + 1 < BN_NUM_BUFFER) after = t[i + 1].waveforms_start_ns;
+        if (t[i].clear_ns < after)
+        {
+          fprintf(stderr,"Event %lu (%s clears): cleared %g us too early\n", (*headers)[i].event_number,
+                  idefer ? "deferred" : "immediate", (after - t[i].clear_ns) * 1e-3);
+          nbad++;
+        }
+      }
+
+      beacon_buffer_mask_t left = beacon_check_buffers(d, 0, MASTER);
+      if (left)
+      {
+        fprintf(stderr,"Buffers 0x%x still full after reading them\n", left);
+        nbad++;
+      }
+    }
+    per_readout[idefer] = (double) nmessages / nreadouts;
+    printf("%s clears: %g SPI messages to read %d buffers\n", idefer ? "deferred" : "immediate",
+           per_readout[idefer], BN_NUM_BUFFER);
+  }
+
+  if (per_readout[0] - per_readout[1] < BN_NUM_BUFFER - 1)
+  {
+    fprintf(stderr,"Deferring clears didn't save a message per buffer\n");
+    nbad++;
+  }
+
+  // and keeping up with RF triggers
+  beacon_readout_stats_t st;
+  int nread = 0;
+  beacon_reset_readout_stats(d);
+  beacon_phased_trigger_readout(d, 1);
+  while (nread < nevents)
+  {
+    int n = beacon_wait_for_and_read_multiple_events(d, headers, events);
+    if (n < 0)
+    {
+      fprintf(stderr,"Readout failed\n");
+      return 1;
+    }
+    for (i = 0; i < n; i++)
+    {
+      if ((*headers)[i].event_number != last + 1)
+      {
+        fprintf(stderr,"Event %lu came after %lu\n", (*headers)[i].event_number, last);
+        nbad++;
+      }
+      last = (*headers)[i].event_number;
+    }
+    nread += n;
+  }
+  beacon_phased_trigger_readout(d, 0);
+  beacon_get_readout_stats(d, &st);
+  printf("%lu RF events: %g SPI messages per event, %lu clears went out with other messages, %lu waits didn't poll\n",
+         st.nevents, (double) st.nmessages / st.nevents, st.nclears_riding, st.nstatus_after_clear);
+
+  // and with the notification fd, which mustn't hear about buffers whose clear hasn't gone out yet
+  beacon_buffer_mask_t stragglers;
+  while ((stragglers = beacon_check_buffers(d, 0, MASTER))) beacon_read_multiple_array(d, stragglers, *headers, *events);
+  last = 0;
+  struct pollfd pfd = { .fd = beacon_notify_fd(d, MASTER), .events = POLLIN };
+  int nstale = 0;
+  for (iread = 0; iread < nreadouts; iread++)
+  {
+    beacon_buffer_mask_t ready = 0, done = 0, full = (1 << BN_NUM_BUFFER) - 1;
+    for (i = 0; i < BN_NUM_BUFFER; i++) beacon_sw_trigger(d);
+    while (beacon_check_buffers(d, 0, MASTER) != full);
+
+    // the notifier may have caught some while the others were still filling
+    while (done != full && poll(&pfd, 1, 1000) > 0)
+    {
+      beacon_notify_ack(d, &ready);
+      if (ready & done)
+      {
+        fprintf(stderr,"The notification fd announced 0x%x, but 0x%x was already read\n", ready, ready & done);
+        nstale++;
+      }
+      if (!ready) continue;
+      if (beacon_read_multiple_array(d, ready, *headers, *events))
+      {
+        fprintf(stderr,"Readout of 0x%x announced by the notification fd failed\n", ready);
+        return 1;
+      }
+      for (i = 0; i < __builtin_popcount(ready); i++)
+      {
+        if (last && (*headers)[i].event_number != last + 1)
+        {
+          fprintf(stderr,"Event %lu came after %lu\n", (*headers)[i].event_number, last);
+          nbad++;
+        }
+        last = (*headers)[i].event_number;
+      }
+      done |= ready;
+    }
+    if (done != full)
+    {
+      fprintf(stderr,"The notification fd only announced 0x%x\n", done);
+      return 1;
+    }
+
+    // everything was read, so there's nothing to announce
+    if (poll(&pfd, 1, 20) > 0)
+    {
+      beacon_notify_ack(d, &ready);
+      if (ready)
+      {
+        fprintf(stderr,"The notification fd announced 0x%x after reading everything\n", ready);
+        nstale++;
+      }
+    }
+  }
+  printf("%d readouts from the notification fd, %d buffers announced again\n", nreadouts, nstale);
+  nbad += nstale;
+  beacon_notify_close(d);
+
+  printf("%d problems\n", nbad);
+  free(headers);
+  free(events);
+  beacon_close(d);
+  return nbad != 0;
+}
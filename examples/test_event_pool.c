@@ -0,0 +1,199 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+/* Checks reference counted pooled events (beacon_event_pool_t).
+ *
+ * Events are read into a small pool, and each one is handed (without copying) to two threads:
+ * a writer, which writes them to a file, and a monitor, which looks at the waveforms. Each
+ * releases its reference when done, and the reader releases its own right after handing it off,
+ * so an event goes back to the pool once both are done with it. Afterwards, the file is read
+ * back and compared, and every event must be back in the pool. Returns nonzero if anything doesn't work.
+ *
+ *  test_event_pool [nevents=200] [device=emu:rate=500] [pool_size=16]
+ */
+
+#define QUEUE_SIZE 64
+
+// a minimal queue of pooled events, one per consumer thread
+struct consumer
+{
+  beacon_pooled_event_t * q[QUEUE_SIZE];
+  int head, tail, done;
+  pthread_mutex_t mut;
+  pthread_cond_t cond;
+  pthread_t thread;
+  unsigned long nhandled;
+  void * arg;
+};
+
+static void push(struct consumer * c, beacon_pooled_event_t * ev)
+{
+  pthread_mutex_lock(&c->mut);
+  c->q[c->head++ % QUEUE_SIZE] = ev;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->mut);
+}
+
+static beacon_pooled_event_t * pop(struct consumer * c)
+{
+  beacon_pooled_event_t * ev = 0;
+  pthread_mutex_lock(&c->mut);
+  while (c->tail == c->head && !c->done) pthread_cond_wait(&c->cond, &c->mut);
+  if (c->tail != c->head) ev = c->q[c->tail++ % QUEUE_SIZE];
+  pthread_mutex_unlock(&c->mut);
+  return ev;
+}
+
+static void * writer(void * arg)
+{
+  struct consumer * c = arg;
+  gzFile f = c->arg;
+  beacon_pooled_event_t * ev;
+  while ((ev = pop(c)))
+  {
+    beacon_header_gzwrite(f, &ev->header);
+    beacon_compact_event_gzwrite(f, ev->event);
+    beacon_pooled_event_release(ev);
+    c->nhandled++;
+  }
+  return 0;
+}
+
+static void * monitor(void * arg)
+{
+  struct consumer * c = arg;
+  double * sum = c->arg;
+  beacon_pooled_event_t * ev;
+  while ((ev = pop(c)))
+  {
+    int ichan, i;
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      const uint8_t * wf = beacon_compact_event_waveform(ev->event, MASTER, ichan);
+      for (i = 0; i < ev->event->buffer_length; i++) *sum += wf[i];
+    }
+    usleep(500); // a slow monitor
+    beacon_pooled_event_release(ev);
+    c->nhandled++;
+  }
+  return 0;
+}
+
+static void start(struct consumer * c, void * (*fn)(void*), void * arg)
+{
+  memset(c, 0, sizeof(*c));
+  pthread_mutex_init(&c->mut, 0);
+  pthread_cond_init(&c->cond, 0);
+  c->arg = arg;
+  pthread_create(&c->thread, 0, fn, c);
+}
+
+static void finish(struct consumer * c)
+{
+  pthread_mutex_lock(&c->mut);
+  c->done = 1;
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->mut);
+  pthread_join(c->thread, 0);
+}
+
+int main(int nargs, char ** args)
+{
+  int nevents = nargs > 1 ? atoi(args[1]) : 200;
+  const char * device = nargs > 2 ? args[2] : "emu:rate=500";
+  int pool_size = nargs > 3 ? atoi(args[3]) : 16;
+  int nread = 0, nbad = 0, nempty = 0;
+  uint64_t * numbers = calloc(nevents + BN_NUM_BUFFER, sizeof(uint64_t));
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_phased_trigger_readout(d, 1);
+
+  beacon_event_pool_t * pool = beacon_event_pool_create(pool_size, beacon_get_buffer_length(d));
+  char fname[] = "/tmp/test_event_poolXXXXXX";
+  int fd = mkstemp(fname);
+  if (!pool || fd < 0)
+  {
+    fprintf(stderr,"Setup failed\n");
+    return 1;
+  }
+  close(fd);
+
+  gzFile f = gzopen(fname, "w");
+  double sum = 0;
+  struct consumer cw, cm;
+  start(&cw, writer, f);
+  start(&cm, monitor, &sum);
+
+  while (nread < nevents)
+  {
+    beacon_pooled_event_t * out[BN_NUM_BUFFER];
+    int i, n = beacon_wait_for_and_read_multiple_pooled(d, pool, out);
+    if (n < 0)
+    {
+      fprintf(stderr,"Readout failed\n");
+      nbad++;
+      break;
+    }
+    if (!n && !beacon_event_pool_available(pool))
+    {
+      nempty++; // everything is still in use, give the consumers a moment
+      usleep(1000);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      numbers[nread++] = out[i]->header.event_number;
+      push(&cw, beacon_pooled_event_ref(out[i]));
+      push(&cm, beacon_pooled_event_ref(out[i]));
+      beacon_pooled_event_release(out[i]);
+    }
+  }
+
+  finish(&cw);
+  finish(&cm);
+  gzclose(f);
+
+  printf("%d events read with a pool of %d (%d times it was all in use), written %lu, monitored %lu\n",
+         nread, pool_size, nempty, cw.nhandled, cm.nhandled);
+
+  if (beacon_event_pool_available(pool) != (unsigned) pool_size)
+  {
+    fprintf(stderr,"Only %u of %d events went back to the pool\n", beacon_event_pool_available(pool), pool_size);
+    nbad++;
+  }
+
+  // read it all back
+  beacon_header_t hd;
+  beacon_event_t * ev = malloc(sizeof(beacon_event_t));
+  int nback = 0;
+  f = gzopen(fname, "r");
+  while (!beacon_header_gzread(f, &hd) && !beacon_event_gzread(f, ev))
+  {
+    if (nback >= nread || hd.event_number != numbers[nback] || ev->event_number != numbers[nback])
+    {
+      fprintf(stderr,"Event %d in the file is %lu, expected %lu\n", nback, hd.event_number, nback < nread ? numbers[nback] : 0);
+      nbad++;
+    }
+    nback++;
+  }
+  gzclose(f);
+  if (nback != nread) nbad++;
+  printf("%d events read back from the file\n", nback);
+
+  unlink(fname);
+  free(ev);
+  free(numbers);
+  beacon_event_pool_destroy(pool);
+  beacon_close(d);
+  return nbad != 0;
+}
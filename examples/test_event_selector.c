@@ -0,0 +1,213 @@
+#include "beacondaq.h"
+#include "beaconacq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Checks selecting events from their headers before their waveforms are read (beacon_set_event_selector).
+ *
+ * RF triggers are read with a selector that drops what the "CW" beam triggered on, skips the waveforms
+ * of events with less than min_power, reads only a window of roi samples around the trigger for those
+ * with more than roi_power, and reads the rest. Every event must have been treated that way, and dropped
+ * events must not come out of beacon_read_multiple_pooled or a beacon_acq ring. Prints how many of the
+ * triggers were kept with and without the selector. Then the DAQ's own reads (the calibration in beacon_reset
+ * and beacon_qualify_spi_clock) must get their waveforms with a selector that drops everything, without
+ * asking it. Returns nonzero if anything doesn't work.
+ *
+ *  test_event_selector [cw_beam=3] [min_power=10000] [roi_power=20000] [roi=64] [device=emu:rate=2000] [nevents=400]
+ */
+
+struct selection
+{
+  int cw_beam;
+  uint32_t min_power;
+  uint32_t roi_power;
+  uint16_t roi;
+  uint64_t ncalled;
+};
+
+static beacon_selection_t selector(const beacon_header_t * hd, uint16_t * roi_start, uint16_t * roi_length, void * arg)
+{
+  struct selection * sel = arg;
+  sel->ncalled++;
+  if (hd->trig_type != BN_TRIG_RF) return BN_SELECT_READ;
+  if (hd->triggered_beams & (1u << sel->cw_beam)) return BN_SELECT_DROP;
+  if (hd->beam_power < sel->min_power) return BN_SELECT_SKIP;
+  if (hd->beam_power > sel->roi_power)
+  {
+    *roi_start = hd->pretrigger_samples > sel->roi / 2 ? hd->pretrigger_samples - sel->roi / 2 : 0;
+    *roi_length = sel->roi;
+    return BN_SELECT_ROI;
+  }
+  return BN_SELECT_READ;
+}
+
+static beacon_selection_t drop_all(const beacon_header_t * hd, uint16_t * roi_start, uint16_t * roi_length, void * arg)
+{
+  (void) hd;
+  (void) roi_start;
+  (void) roi_length;
+  (*(uint64_t *) arg)++;
+  return BN_SELECT_DROP;
+}
+
+static int nbad = 0;
+
+// what the selector should have done with an event, and how many samples it should have
+static void check(const struct selection * sel, const beacon_header_t * hd, const beacon_compact_event_t * ev, uint16_t length)
+{
+  uint8_t want = BN_SKIP_NONE;
+  if (hd->trig_type == BN_TRIG_RF && (hd->triggered_beams & (1u << sel->cw_beam))) want = BN_SKIP_DROPPED;
+  else if (hd->trig_type == BN_TRIG_RF && hd->beam_power < sel->min_power) want = BN_SKIP_SELECTED;
+
+  int roi = !want && hd->trig_type == BN_TRIG_RF && hd->beam_power > sel->roi_power;
+  int want_first = hd->pretrigger_samples > sel->roi / 2 ? hd->pretrigger_samples - sel->roi / 2 : 0;
+  int want_last = want_first + sel->roi < length ? want_first + sel->roi : length;
+  int ok = hd->waveforms_skipped == want && ev->event_number == hd->event_number;
+  if (want) ok = ok && ev->buffer_length == 0;
+  else if (roi) ok = ok && ev->buffer_length == hd->buffer_length && ev->buffer_length < length
+                    && ev->buffer_length <= sel->roi + 32 && hd->readout_window_start <= want_first
+                    && hd->readout_window_start + hd->buffer_length >= want_last;
+  else ok = ok && ev->buffer_length == length && hd->buffer_length == length && hd->readout_window_start == 0;
+
+  if (!ok)
+  {
+    fprintf(stderr,"Event %lu (beam 0x%x, power %u): waveforms_skipped %d (wanted %d), %d samples from %d\n",
+            hd->event_number, hd->triggered_beams, hd->beam_power, hd->waveforms_skipped, want,
+            ev->buffer_length, hd->readout_window_start);
+    nbad++;
+  }
+}
+
+static void drain(beacon_dev_t * d, beacon_event_pool_t * pool)
+{
+  beacon_pooled_event_t * out[BN_NUM_BUFFER];
+  beacon_buffer_mask_t ready = 0;
+  int i, n;
+  beacon_phased_trigger_readout(d, 0);
+  beacon_wait(d, &ready, 0.05, MASTER);
+  if (ready && (n = beacon_read_multiple_pooled(d, ready, pool, out)) > 0)
+  {
+    for (i = 0; i < n; i++) beacon_pooled_event_release(out[i]);
+  }
+}
+
+int main(int nargs, char ** args)
+{
+  struct selection sel = { 3, 10000, 20000, 64, 0 };
+  if (nargs > 1) sel.cw_beam = atoi(args[1]);
+  if (nargs > 2) sel.min_power = atoi(args[2]);
+  if (nargs > 3) sel.roi_power = atoi(args[3]);
+  if (nargs > 4) sel.roi = atoi(args[4]);
+  const char * device = nargs > 5 ? args[5] : "emu:rate=2000";
+  int nevents = nargs > 6 ? atoi(args[6]) : 400;
+  int ipass;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_set_pretrigger(d, 2);
+  uint16_t length = beacon_get_readout_length(d);
+  beacon_event_pool_t * pool = beacon_event_pool_create(2 * BN_NUM_BUFFER, length);
+  if (!pool) return 1;
+
+  for (ipass = 0; ipass < 2; ipass++)
+  {
+    int nread = 0, nfull = 0, nroi = 0, nskipped = 0;
+    uint64_t first_trig = 0, last_trig = 0;
+    beacon_set_event_selector(d, ipass ? selector : 0, &sel);
+    beacon_phased_trigger_readout(d, 1);
+
+    while (nread < nevents)
+    {
+      beacon_pooled_event_t * out[BN_NUM_BUFFER];
+      int i, n = beacon_wait_for_and_read_multiple_pooled(d, pool, out);
+      if (n < 0)
+      {
+        fprintf(stderr,"Readout failed\n");
+        return 1;
+      }
+
+      for (i = 0; i < n; i++)
+      {
+        const beacon_header_t * hd = &out[i]->header;
+        if (!first_trig) first_trig = hd->trig_number;
+        last_trig = hd->trig_number;
+        if (hd->waveforms_skipped) nskipped++;
+        else if (hd->buffer_length < length) nroi++;
+        else nfull++;
+
+        if (!ipass && (hd->waveforms_skipped || out[i]->event->buffer_length != length)) nbad++;
+        if (ipass) check(&sel, hd, out[i]->event, length);
+        beacon_pooled_event_release(out[i]);
+        nread++;
+      }
+    }
+    drain(d, pool);
+
+    printf("%s: %d events kept (%d read, %d region of interest, %d skipped) out of %lu triggers\n",
+           ipass ? "with selector" : "without selector", nread, nfull, nroi, nskipped,
+           (unsigned long) (last_trig - first_trig + 1));
+  }
+
+  if (beacon_event_pool_available(pool) != 2 * BN_NUM_BUFFER)
+  {
+    fprintf(stderr,"Pool lost events\n");
+    nbad++;
+  }
+
+  // the acquisition ring leaves out the dropped ones too
+  beacon_header_t * hd = malloc(sizeof(beacon_header_t));
+  beacon_event_t * ev = malloc(sizeof(beacon_event_t));
+  beacon_acq_stats_t st;
+  int npopped = 0;
+  beacon_acq_t * acq = beacon_acq_start(d, 64, BN_ACQ_BLOCK);
+  beacon_phased_trigger_readout(d, 1);
+  while (npopped < nevents && beacon_acq_pop_wait(acq, hd, ev, 1) == 1)
+  {
+    if (hd->waveforms_skipped == BN_SKIP_DROPPED)
+    {
+      fprintf(stderr,"Dropped event %lu came out of the ring\n", hd->event_number);
+      nbad++;
+    }
+    npopped++;
+  }
+  beacon_phased_trigger_readout(d, 0);
+  beacon_acq_stop(acq);
+  while (beacon_acq_pop_wait(acq, hd, ev, 1) == 1) npopped++;
+  beacon_acq_get_stats(acq, &st);
+  printf("ring: %lu read, %lu rejected by the selector, %lu pushed\n", st.nread, st.nrejected, st.npushed);
+  if (!st.nrejected || st.nread != st.npushed + st.nrejected + st.ndropped || st.npushed != (uint64_t) npopped) nbad++;
+  beacon_acq_close(acq);
+
+  // the DAQ's own reads don't go past the selector
+  uint64_t ndropped = 0;
+  beacon_spi_clock_qualification_t q;
+  unsigned clock = beacon_get_spi_clock(d);
+  beacon_set_event_selector(d, drop_all, &ndropped);
+  if (beacon_reset(d, BN_RESET_CALIBRATE))
+  {
+    fprintf(stderr,"Calibration failed with a selector that drops everything\n");
+    nbad++;
+  }
+  if (beacon_qualify_spi_clock(d, &clock, 1, 1, 0.1, 0, &q)) nbad++;
+  if (ndropped)
+  {
+    fprintf(stderr,"The selector was asked about %lu of the DAQ's own reads\n", ndropped);
+    nbad++;
+  }
+  beacon_set_event_selector(d, 0, 0);
+
+  printf("selector called %lu times, %d problems\n", sel.ncalled, nbad);
+  free(hd);
+  free(ev);
+  beacon_event_pool_destroy(pool);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,90 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Checks that full-duplex and half-duplex waveform readout give the same data.
+ *
+ * With verification mode on, software triggers are taken and each buffer is
+ * read twice: once with beacon_read_raw in one mode and then through the
+ * normal event readout in the other. Returns nonzero if anything differs.
+ *
+ *  test_full_duplex [device=emu:rate=0] [nevents=16] [buffer_length=624]
+ */
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0";
+  int nevents = nargs > 2 ? atoi(args[2]) : 16;
+  int buffer_length = nargs > 3 ? atoi(args[3]) : 624;
+  int nbad = 0;
+  int ievent, ichan;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_set_buffer_length(d, buffer_length);
+  beacon_enable_verification_mode(d, 1);
+  if (beacon_query_verification_mode(d) != 1)
+  {
+    fprintf(stderr,"Could not turn on verification mode\n");
+    beacon_close(d);
+    return 1;
+  }
+
+  beacon_header_t hd;
+  beacon_event_t ev;
+  uint8_t * raw = malloc(BN_NUM_CHAN * BN_MAX_WAVEFORM_LENGTH);
+
+  for (ievent = 0; ievent < nevents; ievent++)
+  {
+    //alternate which mode is used for which read
+    int raw_full_duplex = ievent % 2;
+    beacon_buffer_mask_t ready = 0;
+    uint8_t next = 0;
+
+    beacon_sw_trigger(d);
+    while (!ready)
+    {
+      beacon_wait(d, &ready, 1, MASTER);
+    }
+    beacon_check_buffers(d, &next, MASTER);
+
+    beacon_set_full_duplex(d, raw_full_duplex);
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      beacon_read_raw(d, next, ichan, 1, buffer_length / (BN_WORD_SIZE * BN_NUM_CHUNK),
+                      raw + ichan * BN_MAX_WAVEFORM_LENGTH, MASTER);
+    }
+
+    beacon_set_full_duplex(d, !raw_full_duplex);
+    if (beacon_read_multiple_array(d, 1 << next, &hd, &ev) != 0)
+    {
+      fprintf(stderr,"Readout failed for event %d\n", ievent);
+      nbad++;
+      continue;
+    }
+
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      if (memcmp(raw + ichan * BN_MAX_WAVEFORM_LENGTH, ev.data[MASTER][ichan], buffer_length))
+      {
+        fprintf(stderr,"Event %d (buffer %d), channel %d: %s-duplex raw read does not match %s-duplex event read\n",
+                ievent, next, ichan, raw_full_duplex ? "full" : "half", raw_full_duplex ? "half" : "full");
+        nbad++;
+      }
+    }
+  }
+
+  printf("%d events checked, %d mismatches\n", nevents, nbad);
+
+  free(raw);
+  beacon_enable_verification_mode(d, 0);
+  beacon_close(d);
+  return nbad != 0;
+}
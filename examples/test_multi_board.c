@@ -0,0 +1,152 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+
+/* Checks reading out several boards at once (the library needs to be built with MAX_BOARDS > 1).
+ *
+ * Opens the same device for every board (for "emu", the slaves are linked to the master),
+ * takes software triggers and reads each buffer once with beacon_read_raw, one board at a time,
+ * and then through the normal (concurrent) event readout. Meanwhile, another thread keeps
+ * doing housekeeping (status reads, thresholds, attenuation) on all the boards. Returns nonzero
+ * if anything differs or the headers report a sync problem.
+ *
+ *  test_multi_board [nboards=BN_MAX_BOARDS] [nevents=16] [device=emu:rate=0] [buffer_length=624]
+ */
+
+static volatile int done = 0;
+static unsigned long nhk = 0;
+
+static void * housekeeping(void * arg)
+{
+  beacon_dev_t * d = arg;
+  beacon_status_t st;
+  uint32_t thresholds[BN_NUM_BEAMS];
+  uint8_t atten[BN_NUM_CHAN] = {0};
+  int ibd;
+
+  while (!done)
+  {
+    for (ibd = 0; ibd < beacon_get_num_boards(d); ibd++)
+    {
+      beacon_read_status(d, &st, ibd);
+    }
+    beacon_get_thresholds(d, thresholds);
+    beacon_set_attenuation(d, atten, atten);
+    nhk++;
+  }
+  return 0;
+}
+
+int main(int nargs, char ** args)
+{
+  int nboards = nargs > 1 ? atoi(args[1]) : BN_MAX_BOARDS;
+  int nevents = nargs > 2 ? atoi(args[2]) : 16;
+  const char * device = nargs > 3 ? args[3] : "emu:rate=0";
+  int buffer_length = nargs > 4 ? atoi(args[4]) : 624;
+  const char * names[BN_MAX_BOARDS];
+  int nbad = 0;
+  int ievent, ibd, ichan;
+
+  if (nboards < 1 || nboards > BN_MAX_BOARDS)
+  {
+    fprintf(stderr,"Need between 1 and %d boards\n", BN_MAX_BOARDS);
+    return 1;
+  }
+
+  for (ibd = 0; ibd < nboards; ibd++) names[ibd] = device;
+
+  beacon_dev_t * d = beacon_open_boards(names, nboards, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %d boards\n", nboards);
+    return 1;
+  }
+
+  beacon_set_buffer_length(d, buffer_length);
+
+  beacon_header_t hd;
+  beacon_event_t ev;
+  uint8_t * raw = malloc(BN_MAX_BOARDS * BN_NUM_CHAN * BN_MAX_WAVEFORM_LENGTH);
+  uint8_t mask[BN_MAX_BOARDS];
+
+  for (ibd = 0; ibd < nboards; ibd++) mask[ibd] = ibd ? 0xf : 0xff;
+
+  struct timespec start, end;
+  double treadout = 0;
+
+  pthread_t hk_thread;
+  pthread_create(&hk_thread, 0, housekeeping, d);
+
+  for (ievent = 0; ievent < nevents; ievent++)
+  {
+    beacon_buffer_mask_t ready = 0;
+    uint8_t next = 0;
+
+    beacon_sw_trigger(d);
+    while (!ready)
+    {
+      beacon_wait(d, &ready, 1, MASTER);
+    }
+    beacon_check_buffers(d, &next, MASTER);
+
+    for (ibd = 0; ibd < nboards; ibd++)
+    {
+      for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+      {
+        if ((mask[ibd] & (1 << ichan)) == 0) continue;
+        beacon_read_raw(d, next, ichan, 1, buffer_length / (BN_WORD_SIZE * BN_NUM_CHUNK),
+                        raw + (ibd * BN_NUM_CHAN + ichan) * BN_MAX_WAVEFORM_LENGTH, ibd);
+      }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (beacon_read_multiple_array(d, 1 << next, &hd, &ev) != 0)
+    {
+      fprintf(stderr,"Readout failed for event %d\n", ievent);
+      nbad++;
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    treadout += (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+
+    if (hd.sync_problem)
+    {
+      fprintf(stderr,"Event %d: sync problem 0x%x\n", ievent, hd.sync_problem);
+      nbad++;
+    }
+
+    for (ibd = 0; ibd < nboards; ibd++)
+    {
+      if (hd.board_id[ibd] != beacon_get_board_id(d, ibd))
+      {
+        fprintf(stderr,"Event %d: wrong board id for board %d\n", ievent, ibd);
+        nbad++;
+      }
+
+      for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+      {
+        if ((mask[ibd] & (1 << ichan)) == 0) continue;
+        if (memcmp(raw + (ibd * BN_NUM_CHAN + ichan) * BN_MAX_WAVEFORM_LENGTH, ev.data[ibd][ichan], buffer_length))
+        {
+          fprintf(stderr,"Event %d (buffer %d), board %d, channel %d: raw read does not match event read\n",
+                  ievent, next, ibd, ichan);
+          nbad++;
+        }
+      }
+    }
+  }
+
+  done = 1;
+  pthread_join(hk_thread, 0);
+
+  printf("%d boards, %d events checked, %d mismatches (%g ms per event readout, %lu housekeeping rounds)\n",
+         nboards, nevents, nbad, nevents ? 1e3 * treadout / nevents : 0., nhk);
+
+  free(raw);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,120 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+
+/* Runs acquisition and housekeeping from a single epoll loop, using beacon_notify_fd.
+ *
+ * Reads nevents events as they're announced on the notification fd while a timerfd
+ * triggers a status read every 10 ms, then calls beacon_cancel_wait and checks that it
+ * shows up on the fd. Returns nonzero if anything doesn't work.
+ *
+ *  test_notify_fd [nevents=200] [device=emu:rate=200]
+ */
+
+int main(int nargs, char ** args)
+{
+  int nevents = nargs > 1 ? atoi(args[1]) : 200;
+  const char * device = nargs > 2 ? args[2] : "emu:rate=200";
+  int nread = 0, nstatus = 0, nwakeups = 0, nbad = 0;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_phased_trigger_readout(d, 1);
+
+  int notify_fd = beacon_notify_fd(d, MASTER);
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  struct itimerspec period = { { 0, 10000000 }, { 0, 10000000 } };
+  timerfd_settime(timer_fd, 0, &period, 0);
+
+  int ep = epoll_create1(0);
+  struct epoll_event ee;
+  memset(&ee, 0, sizeof(ee));
+  ee.events = EPOLLIN;
+  ee.data.fd = notify_fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, notify_fd, &ee);
+  ee.data.fd = timer_fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, timer_fd, &ee);
+
+  beacon_header_t hd[BN_NUM_BUFFER];
+  beacon_event_t * ev = malloc(BN_NUM_BUFFER * sizeof(beacon_event_t));
+  beacon_status_t st;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (nread < nevents)
+  {
+    struct epoll_event events[2];
+    int i, n = epoll_wait(ep, events, 2, 5000);
+    if (n <= 0)
+    {
+      fprintf(stderr,"Nothing happened for 5 seconds!\n");
+      nbad++;
+      break;
+    }
+    nwakeups++;
+
+    for (i = 0; i < n; i++)
+    {
+      if (events[i].data.fd == timer_fd)
+      {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) > 0 && !beacon_read_status(d, &st, MASTER)) nstatus++;
+      }
+      else
+      {
+        beacon_buffer_mask_t ready = 0;
+        if (beacon_notify_ack(d, &ready)) nbad++;
+        if (!ready) continue;
+        if (beacon_read_multiple_array(d, ready, hd, ev))
+        {
+          fprintf(stderr,"Readout failed\n");
+          nbad++;
+          break;
+        }
+        nread += __builtin_popcount(ready);
+      }
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double t = (now.tv_sec - start.tv_sec) + 1e-9 * (now.tv_nsec - start.tv_nsec);
+  printf("%d events and %d status reads in %g s from %d wakeups\n", nread, nstatus, t, nwakeups);
+
+  // cancelling should wake up the loop too
+  beacon_phased_trigger_readout(d, 0);
+  beacon_cancel_wait(d);
+  int cancelled = 0;
+  while (!cancelled)
+  {
+    struct epoll_event event;
+    if (epoll_wait(ep, &event, 1, 1000) <= 0) break;
+    if (event.data.fd != notify_fd)
+    {
+      uint64_t expirations;
+      if (read(timer_fd, &expirations, sizeof(expirations)) < 0) break;
+      continue;
+    }
+    beacon_buffer_mask_t ready = 0;
+    if (beacon_notify_ack(d, &ready) == EINTR) cancelled = 1;
+    else if (ready) beacon_read_multiple_array(d, ready, hd, ev); // stragglers
+  }
+  printf("cancel %s\n", cancelled ? "woke up the fd" : "did NOT wake up the fd");
+  if (!cancelled) nbad++;
+
+  close(ep);
+  close(timer_fd);
+  free(ev);
+  beacon_close(d);
+  return nbad != 0;
+}
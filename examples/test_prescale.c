@@ -0,0 +1,196 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Checks the waveform prescaler (beacon_set_waveform_prescale).
+ *
+ * RF triggers (with a software trigger now and then) are read with every waveform read and then with
+ * only one in prescale RF events' waveforms read. Every event must still have its header, exactly every
+ * prescale-th RF event (and every software event) must have its waveforms, the others must be flagged and
+ * have none, and the flag must survive being written out. Prints how many of the triggers were kept both
+ * ways. Then the DAQ's own reads (the calibration in beacon_reset and beacon_qualify_spi_clock) must get
+ * their waveforms even with software triggers prescaled away, and mustn't count towards the prescale.
+ * Last, with every other software trigger prescaled, all the buffers are read together (with clears sent
+ * right away and deferred): the skipped buffers have to be cleared before the waveforms of any buffer
+ * read with them are done. Returns nonzero if anything doesn't work.
+ *
+ *  test_prescale [prescale=8] [device=emu:rate=2000] [nevents=400]
+ */
+
+// reads one software trigger, returning whether its waveforms were skipped (or -1)
+static int read_sw(beacon_dev_t * d, beacon_header_t * hd, beacon_event_t * ev)
+{
+  beacon_buffer_mask_t ready = 0;
+  beacon_sw_trigger(d);
+  beacon_wait(d, &ready, 1, MASTER);
+  if (!ready || beacon_read_multiple_array(d, ready, hd, ev)) return -1;
+  return hd->waveforms_skipped;
+}
+
+int main(int nargs, char ** args)
+{
+  unsigned prescale = nargs > 1 ? atoi(args[1]) : 8;
+  const char * device = nargs > 2 ? args[2] : "emu:rate=2000";
+  int nevents = nargs > 3 ? atoi(args[3]) : 400;
+  int nbad = 0;
+  int ipass;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  if (beacon_set_waveform_prescale(d, 4, 2) != -1 || beacon_get_waveform_prescale(d, BN_TRIG_RF) != 1) nbad++;
+
+  beacon_header_t (*headers)[BN_NUM_BUFFER] = malloc(sizeof(*headers));
+  beacon_event_t (*events)[BN_NUM_BUFFER] = malloc(sizeof(*events));
+  beacon_header_t back;
+  char fname[] = "/tmp/test_prescaleXXXXXX";
+  int fd = mkstemp(fname);
+  if (fd < 0) return 1;
+  close(fd);
+  uint16_t length = beacon_get_readout_length(d);
+  uint8_t * skipped = malloc(nevents + BN_NUM_BUFFER);
+
+  for (ipass = 0; ipass < 2; ipass++)
+  {
+    unsigned ps = ipass ? prescale : 1;
+    int nread = 0, nrf = 0, nfull = 0;
+    uint64_t first_trig = 0, last_trig = 0;
+
+    beacon_set_waveform_prescale(d, BN_TRIG_RF, ps);
+    if (beacon_get_waveform_prescale(d, BN_TRIG_RF) != ps) nbad++;
+    beacon_phased_trigger_readout(d, 1);
+    gzFile f = gzopen(fname, "w");
+
+    while (nread < nevents)
+    {
+      int i, n;
+      if (nread % 50 == 25) beacon_sw_trigger(d);
+      n = beacon_wait_for_and_read_multiple_events(d, headers, events);
+      if (n < 0)
+      {
+        fprintf(stderr,"Readout failed\n");
+        return 1;
+      }
+
+      for (i = 0; i < n; i++)
+      {
+        const beacon_header_t * hd = &(*headers)[i];
+        const beacon_event_t * ev = &(*events)[i];
+        int want_skipped = hd->trig_type == BN_TRIG_RF && nrf++ % ps;
+
+        if (!first_trig) first_trig = hd->trig_number;
+        last_trig = hd->trig_number;
+        if (!hd->waveforms_skipped) nfull++;
+
+        if (hd->waveforms_skipped != want_skipped || ev->event_number != hd->event_number
+            || hd->buffer_length != length || ev->buffer_length != (want_skipped ? 0 : length))
+        {
+          fprintf(stderr,"Event %lu (%s trigger): waveforms_skipped is %d, event has %d samples\n", hd->event_number,
+                  hd->trig_type == BN_TRIG_RF ? "RF" : "other", hd->waveforms_skipped, ev->buffer_length);
+          nbad++;
+        }
+        beacon_header_gzwrite(f, hd);
+        skipped[nread++] = hd->waveforms_skipped;
+      }
+    }
+
+    beacon_phased_trigger_readout(d, 0);
+    gzclose(f);
+
+    // drain what was left
+    beacon_buffer_mask_t ready = 0;
+    beacon_wait(d, &ready, 0.05, MASTER);
+    if (ready) beacon_read_multiple_array(d, ready, *headers, *events);
+
+    // the flag has to survive being written out
+    int i;
+    f = gzopen(fname, "r");
+    for (i = 0; !beacon_header_gzread(f, &back); i++)
+    {
+      if (i >= nread || back.waveforms_skipped != skipped[i])
+      {
+        fprintf(stderr,"Header %d did not come back the same\n", i);
+        nbad++;
+        break;
+      }
+    }
+    gzclose(f);
+    if (i != nread) nbad++;
+
+    printf("prescale %u: %d events read (%d with waveforms) out of %lu triggers\n", ps, nread, nfull,
+           (unsigned long) (last_trig - first_trig + 1));
+  }
+
+  // the DAQ's own reads aren't prescaled
+  beacon_set_waveform_prescale(d, BN_TRIG_RF, 1);
+  beacon_set_waveform_prescale(d, BN_TRIG_SW, 0);
+  if (beacon_reset(d, BN_RESET_CALIBRATE))
+  {
+    fprintf(stderr,"Calibration failed with software triggers prescaled away\n");
+    nbad++;
+  }
+
+  beacon_spi_clock_qualification_t q;
+  unsigned clock = beacon_get_spi_clock(d);
+  beacon_set_waveform_prescale(d, BN_TRIG_SW, 2);
+  int first = read_sw(d, *headers, *events);
+  if (beacon_qualify_spi_clock(d, &clock, 1, 1, 0.1, 0, &q)) nbad++;
+  int second = read_sw(d, *headers, *events);
+  int third = read_sw(d, *headers, *events);
+  printf("software triggers prescaled by 2 around a clock qualification: skipped %d, %d, %d\n", first, second, third);
+  if (first != BN_SKIP_NONE || second != BN_SKIP_PRESCALED || third != BN_SKIP_NONE)
+  {
+    fprintf(stderr,"Clock qualification counted towards the prescale\n");
+    nbad++;
+  }
+
+  // skipped buffers are let go before the waveforms of the others are read, wherever they are in the batch
+  int idefer;
+  for (idefer = 0; idefer < 2; idefer++)
+  {
+    beacon_readout_timing_t t;
+    beacon_buffer_mask_t full = (1 << BN_NUM_BUFFER) - 1;
+    uint64_t first_waveforms = 0, last_clear = 0;
+    int i, nskipped = 0;
+
+    beacon_set_deferred_clear(d, idefer);
+    for (i = 0; i < BN_NUM_BUFFER; i++) beacon_sw_trigger(d);
+    while (beacon_check_buffers(d, 0, MASTER) != full);
+    if (beacon_read_multiple_array(d, full, *headers, *events)) return 1;
+
+    for (i = 0; i < BN_NUM_BUFFER; i++)
+    {
+      if (beacon_get_readout_timing(d, (*headers)[i].event_number, &t)) nbad++;
+      if ((*headers)[i].waveforms_skipped)
+      {
+        nskipped++;
+        if (!t.clear_ns) nbad++;
+        if (t.clear_ns > last_clear) last_clear = t.clear_ns;
+      }
+      else if (!first_waveforms || t.waveforms_ns[MASTER] < first_waveforms) first_waveforms = t.waveforms_ns[MASTER];
+    }
+    printf("%s clears: %d of %d buffers skipped, cleared %g us before the first waveforms were read\n",
+           idefer ? "deferred" : "immediate", nskipped, BN_NUM_BUFFER, ((double) first_waveforms - last_clear) * 1e-3);
+    if (nskipped != BN_NUM_BUFFER / 2 || last_clear > first_waveforms)
+    {
+      fprintf(stderr,"Skipped buffers weren't cleared before the other buffers' waveforms were read\n");
+      nbad++;
+    }
+  }
+  beacon_set_deferred_clear(d, 0);
+
+  printf("%d problems\n", nbad);
+  unlink(fname);
+  free(skipped);
+  free(headers);
+  free(events);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,108 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Checks the per-event readout timing (beacon_get_readout_timing).
+ *
+ * Events are waited for and read, and each one's timing record must be there, have its steps in order,
+ * and come back the same after being written out next to its header. Prints the timing summary.
+ * Returns nonzero if anything doesn't work.
+ *
+ *  test_readout_timing [device=emu:rate=500] [nevents=200]
+ */
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=500";
+  int nevents = nargs > 2 ? atoi(args[2]) : 200;
+  int nread = 0, nbad = 0, nback = 0;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_phased_trigger_readout(d, 1);
+  beacon_reset_readout_stats(d);
+
+  beacon_header_t (*headers)[BN_NUM_BUFFER] = malloc(sizeof(*headers));
+  beacon_event_t (*events)[BN_NUM_BUFFER] = malloc(sizeof(*events));
+  char fname[] = "/tmp/test_readout_timingXXXXXX";
+  int fd = mkstemp(fname);
+  if (fd < 0) return 1;
+  close(fd);
+  gzFile f = gzopen(fname, "w");
+
+  while (nread < nevents)
+  {
+    int i, n = beacon_wait_for_and_read_multiple_events(d, headers, events);
+    if (n < 0)
+    {
+      fprintf(stderr,"Readout failed\n");
+      return 1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      beacon_readout_timing_t t;
+      const beacon_header_t * hd = &(*headers)[i];
+      if (beacon_get_readout_timing(d, hd->event_number, &t))
+      {
+        fprintf(stderr,"No timing for event %lu\n", hd->event_number);
+        nbad++;
+        continue;
+      }
+
+      if (!t.ready_ns || t.start_ns < t.ready_ns || t.metadata_ns < t.start_ns || t.waveforms_start_ns < t.metadata_ns
+          || t.waveforms_ns[MASTER] < t.waveforms_start_ns || t.clear_ns < t.waveforms_ns[MASTER])
+      {
+        fprintf(stderr,"Event %lu: steps out of order\n", hd->event_number);
+        beacon_readout_timing_print(stderr, &t);
+        nbad++;
+      }
+      if (nread + i < 3) beacon_readout_timing_print(stdout, &t);
+
+      beacon_header_gzwrite(f, hd);
+      beacon_readout_timing_gzwrite(f, &t);
+    }
+    nread += n;
+  }
+  gzclose(f);
+
+  // read them back
+  beacon_header_t hd;
+  beacon_readout_timing_t t;
+  f = gzopen(fname, "r");
+  while (!beacon_header_gzread(f, &hd) && !beacon_readout_timing_gzread(f, &t))
+  {
+    if (t.event_number != hd.event_number)
+    {
+      fprintf(stderr,"Timing record for %lu is next to header %lu\n", t.event_number, hd.event_number);
+      nbad++;
+    }
+    nback++;
+  }
+  gzclose(f);
+  if (nback != nread)
+  {
+    fprintf(stderr,"Only %d of %d records came back\n", nback, nread);
+    nbad++;
+  }
+
+  beacon_readout_timing_summary_t ts;
+  beacon_get_readout_timing_summary(d, &ts);
+  beacon_readout_timing_summary_print(stdout, &ts);
+  if (ts.n[BN_STEP_WAVEFORMS] != (uint64_t) nread || ts.n[BN_STEP_TOTAL] != (uint64_t) nread || ts.n[BN_STEP_PRODUCTS]) nbad++;
+  if (ts.p50_us[BN_STEP_TOTAL] > ts.p99_us[BN_STEP_TOTAL] || ts.p99_us[BN_STEP_TOTAL] > ts.max_us[BN_STEP_TOTAL]) nbad++;
+
+  printf("%d events, %d problems\n", nread, nbad);
+  unlink(fname);
+  free(headers);
+  free(events);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,110 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Checks reading out only a window around the trigger (beacon_set_readout_window).
+ *
+ * Each software trigger's buffer is read raw in full first, then read as an event with the window
+ * set, which must match the raw read starting at the header's readout_window_start, and cover the
+ * window. Prints how long the readouts took with and without the window. Returns nonzero if anything
+ * doesn't work.
+ *
+ *  test_readout_window [pre=32] [post=96] [pretrigger=2] [device=emu:rate=0] [nevents=16] [buffer_length=1024]
+ */
+
+static double elapsed(struct timespec * start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+}
+
+int main(int nargs, char ** args)
+{
+  int pre = nargs > 1 ? atoi(args[1]) : 32;
+  int post = nargs > 2 ? atoi(args[2]) : 96;
+  int pretrigger = nargs > 3 ? atoi(args[3]) : 2;
+  const char * device = nargs > 4 ? args[4] : "emu:rate=0";
+  int nevents = nargs > 5 ? atoi(args[5]) : 16;
+  int buffer_length = nargs > 6 ? atoi(args[6]) : 1024;
+  int nbad = 0;
+  int ievent, ichan, iwindow;
+  double t[2] = {0,0};
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  beacon_set_buffer_length(d, buffer_length);
+  beacon_set_pretrigger(d, pretrigger);
+
+  uint8_t * raw = malloc(BN_NUM_CHAN * BN_MAX_WAVEFORM_LENGTH);
+  beacon_event_t * ev = malloc(sizeof(beacon_event_t));
+  beacon_header_t hd;
+  int trigger = pretrigger * 8 * 16;
+
+  for (iwindow = 0; iwindow < 2; iwindow++)
+  {
+    beacon_set_readout_window(d, iwindow ? pre : 0, iwindow ? post : 0);
+    uint16_t length = beacon_get_readout_length(d);
+
+    for (ievent = 0; ievent < nevents; ievent++)
+    {
+      beacon_buffer_mask_t ready = 0;
+      uint8_t next = 0;
+      struct timespec start;
+
+      beacon_sw_trigger(d);
+      while (!ready) beacon_wait(d, &ready, 1, MASTER);
+      beacon_check_buffers(d, &next, MASTER);
+
+      for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+      {
+        beacon_read_raw(d, next, ichan, 1, buffer_length / (BN_WORD_SIZE * BN_NUM_CHUNK),
+                        raw + ichan * BN_MAX_WAVEFORM_LENGTH, MASTER);
+      }
+
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      if (beacon_read_single(d, next, &hd, ev))
+      {
+        fprintf(stderr,"Readout failed\n");
+        return 1;
+      }
+      t[iwindow] += elapsed(&start);
+
+      // what we want covered, within the buffer
+      int want_first = iwindow && trigger > pre ? trigger - pre : 0;
+      int want_last = iwindow && trigger + post < buffer_length ? trigger + post : buffer_length;
+      int first = hd.readout_window_start;
+      if (hd.buffer_length != length || ev->buffer_length != length || first + length > buffer_length
+          || first > want_first || first + length < want_last || (!iwindow && length != buffer_length))
+      {
+        fprintf(stderr,"Event %d: read samples %d to %d, but wanted %d to %d\n", ievent, first, first + length, want_first, want_last);
+        nbad++;
+      }
+
+      for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+      {
+        if (memcmp(ev->data[MASTER][ichan], raw + ichan * BN_MAX_WAVEFORM_LENGTH + first, length))
+        {
+          fprintf(stderr,"Event %d, channel %d does not match the raw read\n", ievent, ichan);
+          nbad++;
+        }
+      }
+    }
+
+    printf("%s: %d samples per channel, %g ms per readout\n", iwindow ? "window" : "whole buffer",
+           length, 1e3 * t[iwindow] / nevents);
+  }
+
+  printf("%d events checked, %d problems\n", nevents, nbad);
+  free(raw);
+  free(ev);
+  beacon_close(d);
+  return nbad != 0;
+}
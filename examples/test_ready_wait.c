@@ -0,0 +1,139 @@
+#include "beacondaq.h"
+#include "beaconemu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+/* Checks the ways beacon_wait can wait: fixed SPI polling, adaptive polling, and a data ready
+ * line (using the emulator's eventfd in place of the GPIO).
+ *
+ * Reads events each way, comparing how many SPI messages and how much CPU each takes per event,
+ * then checks that a blocked wait still times out and can still be cancelled. Returns nonzero if
+ * anything doesn't work.
+ *
+ *  test_ready_wait [nevents=200] [rate=200]
+ */
+
+static double elapsed(struct timespec * start, clockid_t clk)
+{
+  struct timespec now;
+  clock_gettime(clk, &now);
+  return (now.tv_sec - start->tv_sec) + 1e-9 * (now.tv_nsec - start->tv_nsec);
+}
+
+static int read_events(beacon_dev_t * d, int nevents, const char * what)
+{
+  beacon_header_t hd[BN_NUM_BUFFER];
+  beacon_event_t * ev = malloc(BN_NUM_BUFFER * sizeof(beacon_event_t));
+  beacon_readout_stats_t rs;
+  struct timespec wall, cpu;
+  int nread = 0;
+  int nwaits = 0;
+
+  beacon_reset_readout_stats(d);
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+  while (nread < nevents && nwaits < 10 * nevents)
+  {
+    beacon_buffer_mask_t mask = 0;
+    nwaits++;
+    beacon_wait(d, &mask, 1, MASTER);
+    if (!mask) continue;
+    if (beacon_read_multiple_array(d, mask, hd, ev)) break;
+    nread += __builtin_popcount(mask);
+  }
+
+  double twall = elapsed(&wall, CLOCK_MONOTONIC);
+  double tcpu = elapsed(&cpu, CLOCK_PROCESS_CPUTIME_ID);
+  beacon_get_readout_stats(d, &rs);
+  printf("%s: %d events in %g s, %g SPI messages/event, %g ms CPU/event\n", what, nread, twall,
+         nread ? 1. * rs.nmessages / nread : 0., nread ? 1e3 * tcpu / nread : 0.);
+
+  free(ev);
+  return nread < nevents;
+}
+
+static void * cancel_soon(void * arg)
+{
+  usleep(50000);
+  beacon_cancel_wait(arg);
+  return 0;
+}
+
+int main(int nargs, char ** args)
+{
+  int nevents = nargs > 1 ? atoi(args[1]) : 200;
+  const char * rate = nargs > 2 ? args[2] : "200";
+  char device[64];
+  int nbad = 0;
+
+  snprintf(device, sizeof(device), "emu:rate=%s", rate);
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_transport_t * tp = beacon_get_transport(d, MASTER);
+  beacon_phased_trigger_readout(d, 1);
+
+  nbad += read_events(d, nevents, "SPI polling");
+
+  // at most 2 ms latency, and at most 10% of the bus
+  beacon_poll_stats_t ps;
+  beacon_set_adaptive_polling(d, 2000, 0.1);
+  nbad += read_events(d, nevents, "adaptive polling");
+  beacon_get_poll_stats(d, &ps);
+  printf("adaptive polling: rate estimate %g Hz, polling every %u us (%g us per poll, %g%% of the bus)\n",
+         ps.rate_hz, ps.interval_us, ps.poll_time_us, 100 * ps.bus_fraction);
+  if (ps.rate_hz <= 0 || ps.interval_us > 2000) nbad++;
+  beacon_set_adaptive_polling(d, 0, 0);
+
+  int fd = beacon_emu_ready_fd(tp);
+  if (fd < 0 || beacon_set_ready_fd(d, fd))
+  {
+    fprintf(stderr,"Could not set up the ready fd\n");
+    beacon_close(d);
+    return 1;
+  }
+
+  nbad += read_events(d, nevents, "ready fd");
+
+  // with no triggers, a wait should time out on time...
+  beacon_emu_set_trigger_rate(tp, 0);
+  beacon_clear_buffer(d, 0xf);
+
+  struct timespec start;
+  beacon_buffer_mask_t mask = 0xf;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = beacon_wait(d, &mask, 0.25, MASTER);
+  double t = elapsed(&start, CLOCK_MONOTONIC);
+  printf("timeout: returned %d, mask 0x%x after %g s\n", ret, mask, t);
+  if (ret || mask || t < 0.2 || t > 0.5) nbad++;
+
+  // ... and be woken up by beacon_cancel_wait
+  pthread_t thread;
+  pthread_create(&thread, 0, cancel_soon, d);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ret = beacon_wait(d, &mask, -1, MASTER);
+  t = elapsed(&start, CLOCK_MONOTONIC);
+  pthread_join(thread, 0);
+  printf("cancel: returned %d (EINTR is %d) after %g s\n", ret, EINTR, t);
+  if (ret != EINTR || t > 0.5) nbad++;
+
+  // and a software trigger should wake it up right away
+  beacon_sw_trigger(d);
+  ret = beacon_wait(d, &mask, 1, MASTER);
+  printf("software trigger: returned %d, mask 0x%x\n", ret, mask);
+  if (ret || !mask) nbad++;
+
+  beacon_close(d);
+  return nbad != 0;
+}
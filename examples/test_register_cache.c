@@ -0,0 +1,207 @@
+#include "beacondaq.h"
+#include "beaconregs.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+/* Checks the register cache (beacon_set_register_cache).
+ *
+ * The emulator is wrapped in a transport that counts what goes over the bus and can be told to fail.
+ * Writing what a register already holds must be skipped, getters must be answered without any SPI
+ * traffic, a failed transfer or write and a REG_RESET_ALL must make the next read go to the board, and
+ * beacon_resync_registers must pick up what was changed behind the cache's back. Returns nonzero if
+ * anything doesn't work.
+ *
+ *  test_register_cache [device=emu:rate=0]
+ */
+
+struct counting
+{
+  beacon_transport_t * inner;
+  uint64_t nops;
+  int fail_next;
+};
+
+static int fail(struct counting * c)
+{
+  if (!c->fail_next) return 0;
+  c->fail_next = 0;
+  errno = EIO;
+  return 1;
+}
+
+static int counting_xfer(beacon_transport_t * tp, int n, struct spi_ioc_transfer * xfers)
+{
+  struct counting * c = tp->priv;
+  if (fail(c)) return -1;
+  c->nops++;
+  return c->inner->ops->xfer(c->inner, n, xfers);
+}
+
+static int counting_write(beacon_transport_t * tp, const uint8_t * p)
+{
+  struct counting * c = tp->priv;
+  if (fail(c)) return -1;
+  c->nops++;
+  return c->inner->ops->write(c->inner, p);
+}
+
+static int counting_read(beacon_transport_t * tp, uint8_t * p)
+{
+  struct counting * c = tp->priv;
+  if (fail(c)) return -1;
+  c->nops++;
+  return c->inner->ops->read(c->inner, p);
+}
+
+static int counting_max_xfers(beacon_transport_t * tp)
+{
+  struct counting * c = tp->priv;
+  return beacon_transport_max_xfers(c->inner);
+}
+
+static int counting_set_speed(beacon_transport_t * tp, uint32_t hz)
+{
+  struct counting * c = tp->priv;
+  return c->inner->ops->set_speed(c->inner, hz);
+}
+
+static void counting_close(beacon_transport_t * tp)
+{
+  struct counting * c = tp->priv;
+  beacon_transport_close(c->inner);
+}
+
+static const beacon_transport_ops_t counting_ops =
+{
+  .name = "counting",
+  .xfer = counting_xfer,
+  .write = counting_write,
+  .read = counting_read,
+  .max_xfers = counting_max_xfers,
+  .set_speed = counting_set_speed,
+  .close = counting_close
+};
+
+static struct counting bus;
+static int nbad = 0;
+
+// checks whether something went over the bus since the last call
+static void expect_traffic(const char * what, int want)
+{
+  static uint64_t last = 0;
+  int got = bus.nops != last;
+  if (got != want)
+  {
+    fprintf(stderr,"%s: %s SPI traffic\n", what, got ? "unexpected" : "no");
+    nbad++;
+  }
+  last = bus.nops;
+}
+
+static void expect_mask(beacon_dev_t * d, const char * what, uint32_t want, int traffic)
+{
+  uint32_t mask = beacon_get_trigger_mask(d);
+  if (mask != want)
+  {
+    fprintf(stderr,"%s: trigger mask is 0x%x, wanted 0x%x\n", what, mask, want);
+    nbad++;
+  }
+  expect_traffic(what, traffic);
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0";
+  uint32_t thresholds[BN_NUM_BEAMS], back[BN_NUM_BEAMS], other[BN_NUM_BEAMS];
+  beacon_readout_stats_t st;
+  int i;
+
+  bus.inner = beacon_transport_open(device, 0);
+  beacon_transport_t * tp = malloc(sizeof(beacon_transport_t));
+  if (!bus.inner || !tp) return 1;
+  tp->ops = &counting_ops;
+  tp->priv = &bus;
+  tp->fd = -1;
+  tp->trace = 0;
+
+  beacon_dev_t * d = beacon_open_transport(tp, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+  if (!beacon_get_register_cache(d)) nbad++;
+  for (i = 0; i < BN_NUM_BEAMS; i++)
+  {
+    thresholds[i] = 5000 + 100 * i;
+    other[i] = 7000 + i;
+  }
+
+  // redundant writes are skipped, and getters come from the cache
+  beacon_reset_readout_stats(d);
+  expect_traffic("opening", 1);
+  beacon_set_trigger_mask(d, 0x1234);
+  expect_traffic("new trigger mask", 1);
+  beacon_set_trigger_mask(d, 0x1234);
+  expect_traffic("same trigger mask", 0);
+  expect_mask(d, "cached trigger mask", 0x1234, 0);
+  beacon_set_thresholds(d, thresholds, 0);
+  expect_traffic("new thresholds", 1);
+  beacon_set_thresholds(d, thresholds, 0);
+  expect_traffic("same thresholds", 0);
+  beacon_get_thresholds(d, back);
+  expect_traffic("cached thresholds", 0);
+  if (memcmp(back, thresholds, sizeof(back))) nbad++;
+  beacon_get_readout_stats(d, &st);
+  printf("%lu writes skipped, %lu reads from the cache\n", st.nwrites_skipped, st.nreads_cached);
+  if (st.nwrites_skipped < 1 + BN_NUM_BEAMS || st.nreads_cached < 1 + BN_NUM_BEAMS) nbad++;
+
+  // a failed transfer means we don't know what the board has anymore
+  bus.fail_next = 1;
+  if (!beacon_set_thresholds(d, other, 0)) nbad++;
+  beacon_get_thresholds(d, back);
+  expect_traffic("thresholds after a failed transfer", 1);
+  if (memcmp(back, thresholds, sizeof(back)))
+  {
+    fprintf(stderr,"Thresholds read back after a failed transfer are wrong\n");
+    nbad++;
+  }
+  expect_mask(d, "trigger mask after a failed transfer", 0x1234, 1);
+  expect_mask(d, "trigger mask after reading it back", 0x1234, 0);
+
+  // and so does a failed write
+  bus.fail_next = 1;
+  if (!beacon_set_trigger_mask(d, 0x4321)) nbad++;
+  expect_traffic("failed write", 0);
+  beacon_set_trigger_mask(d, 0x1234);
+  expect_traffic("same trigger mask after a failed write", 1);
+
+  // a reset puts the registers back to what the board starts with
+  uint8_t reset[BN_WORD_SIZE] = { REG_RESET_ALL, 0, 0, 1 };
+  beacon_write(d, reset);
+  expect_traffic("reset", 1);
+  expect_mask(d, "trigger mask after a reset", 0, 1);
+
+  // changed behind our back, which only a resync notices
+  uint8_t behind[BN_WORD_SIZE] = { REG_TRIGGER_MASK, 0, 0x0f, 0xf0 };
+  bus.inner->ops->write(bus.inner, behind);
+  expect_mask(d, "trigger mask changed behind the cache", 0, 0);
+  if (beacon_resync_registers(d)) nbad++;
+  expect_traffic("resync", 1);
+  expect_mask(d, "trigger mask after a resync", 0xff0, 0);
+
+  // and with the cache off, everything goes to the board
+  beacon_set_register_cache(d, 0);
+  if (beacon_get_register_cache(d)) nbad++;
+  beacon_set_trigger_mask(d, 0xff0);
+  expect_traffic("same trigger mask without the cache", 1);
+  expect_mask(d, "trigger mask without the cache", 0xff0, 1);
+  beacon_set_register_cache(d, 1);
+
+  printf("%lu SPI operations, %d problems\n", bus.nops, nbad);
+  beacon_close(d);
+  return nbad != 0;
+}
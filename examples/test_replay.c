@@ -0,0 +1,137 @@
+#include "beacondaq.h"
+#include "beaconreplay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Checks recording and replaying an SPI session (beaconreplay.h).
+ *
+ * A session with software triggers is recorded against the emulator and then replayed. The replay must
+ * read back the same headers and waveforms, must not diverge from the recording, and must go through
+ * exactly as many operations as were recorded. Returns nonzero if anything doesn't work.
+ *
+ *  test_replay [device=emu] [nreadouts=10]
+ */
+
+// opens the device and reads nreadouts full sets of buffers
+static beacon_dev_t * session(const char * device, int nreadouts, beacon_header_t * hd, beacon_event_t * ev)
+{
+  int iread, i;
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 0;
+  }
+
+  // these come from the host, not from what is read back
+  beacon_set_readout_number_offset(d, 0);
+  beacon_set_board_id(d, 1, MASTER);
+
+  for (iread = 0; iread < nreadouts; iread++)
+  {
+    for (i = 0; i < BN_NUM_BUFFER; i++) beacon_sw_trigger(d);
+    while (beacon_check_buffers(d, 0, MASTER) != (1 << BN_NUM_BUFFER) - 1);
+    if (beacon_read_multiple_array(d, (1 << BN_NUM_BUFFER) - 1, hd + iread * BN_NUM_BUFFER, ev + iread * BN_NUM_BUFFER))
+    {
+      fprintf(stderr,"Readout %d failed on %s\n", iread, device);
+      beacon_close(d);
+      return 0;
+    }
+  }
+  return d;
+}
+
+// counts the operations in a recording
+static uint64_t count_records(const char * path)
+{
+  beacon_spi_session_header_t hdr;
+  beacon_spi_session_record_t rec;
+  uint64_t n = 0;
+  int i;
+  FILE * f = fopen(path, "r");
+  if (!f || fread(&hdr, sizeof(hdr), 1, f) != 1) return 0;
+
+  while (fread(&rec, sizeof(rec), 1, f) == 1)
+  {
+    n++;
+    if (rec.op == BN_SPI_SESSION_WRITE || rec.op == BN_SPI_SESSION_READ) fseek(f, BN_WORD_SIZE, SEEK_CUR);
+    else if (rec.op == BN_SPI_SESSION_XFER)
+    {
+      for (i = 0; i < rec.nxfers; i++)
+      {
+        uint16_t len;
+        uint8_t flags;
+        if (fread(&len, sizeof(len), 1, f) != 1 || fread(&flags, sizeof(flags), 1, f) != 1) break;
+        fseek(f, ((flags & 1) ? len : 0) + ((flags & 2) ? len : 0), SEEK_CUR);
+      }
+    }
+  }
+  fclose(f);
+  return n;
+}
+
+int main(int nargs, char ** args)
+{
+  const char * emu = nargs > 1 ? args[1] : "emu";
+  int nreadouts = nargs > 2 ? atoi(args[2]) : 10;
+  int nbad = 0;
+  int n = nreadouts * BN_NUM_BUFFER;
+  int i;
+  char fname[] = "/tmp/test_replayXXXXXX";
+  char device[512];
+  uint64_t nops = 0, nmismatch = 0;
+
+  int fd = mkstemp(fname);
+  if (fd < 0) return 1;
+  close(fd);
+
+  beacon_header_t * hd[2];
+  beacon_event_t * ev[2];
+  for (i = 0; i < 2; i++)
+  {
+    hd[i] = calloc(n, sizeof(beacon_header_t));
+    ev[i] = calloc(n, sizeof(beacon_event_t));
+  }
+
+  snprintf(device, sizeof(device), "%s%s:%s", BEACON_RECORD_PREFIX, fname, emu);
+  beacon_dev_t * d = session(device, nreadouts, hd[0], ev[0]);
+  if (!d) return 1;
+  beacon_close(d);
+  uint64_t nrecorded = count_records(fname);
+
+  snprintf(device, sizeof(device), "%s%s", BEACON_REPLAY_PREFIX, fname);
+  d = session(device, nreadouts, hd[1], ev[1]);
+  if (!d) return 1;
+  int eof = beacon_replay_status(beacon_get_transport(d, MASTER), &nops, &nmismatch);
+  beacon_close(d);
+
+  for (i = 0; i < n; i++)
+  {
+    // the readout time and the approximate trigger time come from the host's clock
+    memcpy(hd[1][i].readout_time, hd[0][i].readout_time, sizeof(hd[0][i].readout_time));
+    memcpy(hd[1][i].readout_time_ns, hd[0][i].readout_time_ns, sizeof(hd[0][i].readout_time_ns));
+    hd[1][i].approx_trigger_time = hd[0][i].approx_trigger_time;
+    hd[1][i].approx_trigger_time_nsecs = hd[0][i].approx_trigger_time_nsecs;
+    if (memcmp(&hd[0][i], &hd[1][i], sizeof(beacon_header_t)) || memcmp(&ev[0][i], &ev[1][i], sizeof(beacon_event_t)))
+    {
+      fprintf(stderr,"Event %d (%lu) came back different\n", i, hd[0][i].event_number);
+      nbad++;
+    }
+  }
+
+  // nothing is left queued at the close, so the replay must have gone through every recorded operation
+  printf("%lu operations recorded, %lu replayed, %lu did not match\n", nrecorded, nops, nmismatch);
+  if (eof != 0 || nmismatch || !nops || nops != nrecorded) nbad++;
+
+  printf("%d problems\n", nbad);
+  unlink(fname);
+  for (i = 0; i < 2; i++)
+  {
+    free(hd[i]);
+    free(ev[i]);
+  }
+  return nbad != 0;
+}
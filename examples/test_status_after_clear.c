@@ -0,0 +1,106 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Checks the buffer status read along with each clear (beacon_read_multiple_array_and_check).
+ *
+ * Two buffers are filled with software triggers and read one at a time. Reading the first has to
+ * report the second as ready, without a message of its own, and then beacon_wait has to poll rather
+ * than hand out the same buffer again. Reading the second has to report nothing ready. When the caller
+ * doesn't ask for it, the status has to go to the next beacon_wait instead, which then mustn't poll.
+ * Returns nonzero if anything doesn't work.
+ *
+ *  test_status_after_clear [device=emu:rate=0] [nrounds=10]
+ */
+
+static int nbad = 0;
+
+static beacon_readout_stats_t stats(beacon_dev_t * d)
+{
+  beacon_readout_stats_t st;
+  beacon_get_readout_stats(d, &st);
+  return st;
+}
+
+// fills two buffers, returning the one that will be read first and the full mask
+static uint8_t fill_two(beacon_dev_t * d, beacon_buffer_mask_t * full)
+{
+  uint8_t next = 0;
+  beacon_sw_trigger(d);
+  beacon_sw_trigger(d);
+  while (__builtin_popcount(*full = beacon_check_buffers(d, &next, MASTER)) < 2);
+  return next;
+}
+
+static void check(const char * what, int ok)
+{
+  if (!ok)
+  {
+    fprintf(stderr,"%s\n", what);
+    nbad++;
+  }
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0";
+  int nrounds = nargs > 2 ? atoi(args[2]) : 10;
+  int iround;
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_header_t hd;
+  beacon_event_t * ev = malloc(sizeof(beacon_event_t));
+
+  for (iround = 0; iround < nrounds; iround++)
+  {
+    beacon_buffer_mask_t full, ready, waited;
+    beacon_readout_stats_t before, after;
+
+    // asking for it takes it
+    uint8_t first = fill_two(d, &full);
+    beacon_buffer_mask_t second = full & ~(1 << first);
+    before = stats(d);
+    if (beacon_read_multiple_array_and_check(d, 1 << first, &hd, ev, &ready)) return 1;
+    after = stats(d);
+    check("The status after the first clear isn't the other buffer", ready == second);
+    check("The status after the first clear wasn't counted", after.nstatus_after_clear == before.nstatus_after_clear + 1);
+
+    before = after;
+    beacon_wait(d, &waited, 1, MASTER);
+    after = stats(d);
+    check("beacon_wait didn't find the other buffer", waited == second);
+    check("beacon_wait reused a status that was already handed out",
+          after.nstatus_after_clear == before.nstatus_after_clear && after.nmessages > before.nmessages);
+
+    before = after;
+    if (beacon_read_multiple_array_and_check(d, second, &hd, ev, &ready)) return 1;
+    after = stats(d);
+    check("The status after the last clear isn't empty", ready == 0);
+    check("An empty status was counted", after.nstatus_after_clear == before.nstatus_after_clear);
+
+    // not asking for it leaves it for beacon_wait
+    first = fill_two(d, &full);
+    second = full & ~(1 << first);
+    if (beacon_read_multiple_array_and_check(d, 1 << first, &hd, ev, 0)) return 1;
+    before = stats(d);
+    beacon_wait(d, &waited, 1, MASTER);
+    after = stats(d);
+    check("beacon_wait didn't get the other buffer from the status", waited == second);
+    check("beacon_wait polled although it had the status",
+          after.nstatus_after_clear == before.nstatus_after_clear + 1 && after.nmessages == before.nmessages);
+    if (beacon_read_multiple_array(d, second, &hd, ev)) return 1;
+  }
+
+  printf("%d rounds, %lu statuses used instead of polling, %d problems\n", nrounds, stats(d).nstatus_after_clear, nbad);
+  free(ev);
+  beacon_close(d);
+  return nbad != 0;
+}
@@ -0,0 +1,160 @@
+#include "beacondaq.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* Checks that the cached waveform transfer plans follow the readout settings.
+ *
+ * With verification mode on, all the buffers are filled with software triggers and read out while the
+ * channel mask, buffer length and duplex mode are changed. Each change has to rebuild the plan of every
+ * buffer (and reading again without a change has to rebuild none), the number of transfers has to move
+ * the way the change says it should, and the waveforms have to match raw reads. Then the same is read
+ * with small_xfers transfers per SPI message (beacon_set_max_xfers) and with the default, which must not
+ * need new plans, must not put more than that in any message, and must take more messages with fewer
+ * transfers in each. Returns nonzero if anything doesn't work.
+ *
+ *  test_xfer_plan [device=emu:rate=0] [buffer_length=624] [small_xfers=8]
+ */
+
+static int nbad = 0;
+static uint8_t raw[BN_NUM_BUFFER][BN_NUM_CHAN][BN_MAX_WAVEFORM_LENGTH];
+
+// reads all the buffers, checking them against raw reads. Fills in the plans built and transfers for the readout itself
+static int read_all(beacon_dev_t * d, const char * what, uint64_t * nbuilt, uint64_t * nxfers, uint64_t * nmessages)
+{
+  beacon_header_t hd[BN_NUM_BUFFER];
+  static beacon_event_t ev[BN_NUM_BUFFER];
+  beacon_readout_stats_t st;
+  uint16_t len = beacon_get_buffer_length(d);
+  uint8_t mask = beacon_get_channel_read_mask(d, MASTER);
+  int i, ichan;
+
+  for (i = 0; i < BN_NUM_BUFFER; i++) beacon_sw_trigger(d);
+  while (beacon_check_buffers(d, 0, MASTER) != (1 << BN_NUM_BUFFER) - 1);
+
+  for (i = 0; i < BN_NUM_BUFFER; i++)
+  {
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      beacon_read_raw(d, i, ichan, 1, len / (BN_WORD_SIZE * BN_NUM_CHUNK), raw[i][ichan], MASTER);
+    }
+  }
+
+  beacon_reset_readout_stats(d);
+  if (beacon_read_multiple_array(d, (1 << BN_NUM_BUFFER) - 1, hd, ev))
+  {
+    fprintf(stderr,"%s: readout failed\n", what);
+    return 1;
+  }
+  beacon_get_readout_stats(d, &st);
+  *nbuilt = st.nplans_built;
+  *nxfers = st.nxfers;
+  if (nmessages) *nmessages = st.nmessages;
+
+  for (i = 0; i < BN_NUM_BUFFER; i++)
+  {
+    for (ichan = 0; ichan < BN_NUM_CHAN; ichan++)
+    {
+      static const uint8_t zeros[BN_MAX_WAVEFORM_LENGTH];
+      const uint8_t * want = (mask & (1 << ichan)) ? raw[i][ichan] : zeros;
+      if (ev[i].buffer_length != len || memcmp(ev[i].data[MASTER][ichan], want, len))
+      {
+        fprintf(stderr,"%s: buffer %d, channel %d is wrong\n", what, i, ichan);
+        nbad++;
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+// what reading again should have done to the number of transfers
+enum change { SAME, FEWER, MORE };
+
+static int step(beacon_dev_t * d, const char * what, enum change change, uint64_t * last_xfers)
+{
+  uint64_t nbuilt, nxfers;
+  if (read_all(d, what, &nbuilt, &nxfers, 0)) return 1;
+
+  uint64_t want_built = change == SAME ? 0 : BN_NUM_BUFFER;
+  int ok = nbuilt == want_built;
+  if (change == SAME) ok = ok && nxfers == *last_xfers;
+  if (change == FEWER) ok = ok && nxfers < *last_xfers;
+  if (change == MORE) ok = ok && nxfers > *last_xfers;
+  printf("%-24s %lu plans built, %lu transfers\n", what, nbuilt, nxfers);
+  if (!ok)
+  {
+    fprintf(stderr,"%s: %lu plans built (wanted %lu), %lu transfers (had %lu)\n", what, nbuilt, want_built, nxfers, *last_xfers);
+    nbad++;
+  }
+  *last_xfers = nxfers;
+  return 0;
+}
+
+int main(int nargs, char ** args)
+{
+  const char * device = nargs > 1 ? args[1] : "emu:rate=0";
+  int buffer_length = nargs > 2 ? atoi(args[2]) : 624;
+  int small_xfers = nargs > 3 ? atoi(args[3]) : 8;
+  int i;
+  uint64_t nxfers = 0;
+  // a whole number of RAM addresses, so the raw reads cover it
+  int short_length = buffer_length / 2 / (BN_WORD_SIZE * BN_NUM_CHUNK) * (BN_WORD_SIZE * BN_NUM_CHUNK);
+
+  beacon_dev_t * d = beacon_open(device, 0, 0, 1);
+  if (!d)
+  {
+    fprintf(stderr,"Could not open %s\n", device);
+    return 1;
+  }
+
+  beacon_set_buffer_length(d, buffer_length);
+  beacon_set_full_duplex(d, 0);
+  beacon_enable_verification_mode(d, 1);
+
+  if (step(d, "first read", MORE, &nxfers)
+      || step(d, "nothing changed", SAME, &nxfers)
+      || beacon_set_channel_read_mask(d, 0x0f, MASTER) || step(d, "channel mask 0x0f", FEWER, &nxfers)
+      || beacon_set_channel_read_mask(d, 0xff, MASTER) || step(d, "channel mask 0xff", MORE, &nxfers)
+      || (beacon_set_buffer_length(d, short_length), step(d, "shorter buffer", FEWER, &nxfers))
+      || (beacon_set_buffer_length(d, buffer_length), step(d, "full buffer", MORE, &nxfers))
+      || beacon_set_full_duplex(d, 1) || step(d, "full duplex", FEWER, &nxfers)
+      || step(d, "nothing changed", SAME, &nxfers)
+      || beacon_set_full_duplex(d, 0) || step(d, "half duplex", MORE, &nxfers))
+  {
+    beacon_close(d);
+    return 1;
+  }
+
+  // the batch size only changes how the plans are sent
+  uint64_t nmessages[2];
+  for (i = 0; i < 2; i++)
+  {
+    uint64_t nbuilt;
+    int max_xfers = i ? 0 : small_xfers;
+    const char * what = i ? "default batch size" : "small batch size";
+    if (beacon_set_max_xfers(d, max_xfers) || (max_xfers && beacon_get_max_xfers(d) != max_xfers) || beacon_get_max_xfers(d) <= 0)
+    {
+      fprintf(stderr,"Could not set the batch size to %d\n", max_xfers);
+      nbad++;
+    }
+    if (read_all(d, what, &nbuilt, &nxfers, &nmessages[i]))
+    {
+      beacon_close(d);
+      return 1;
+    }
+    printf("%-24s %d transfers per message, %lu messages, %lu transfers\n", what, beacon_get_max_xfers(d), nmessages[i], nxfers);
+    if (nbuilt || nmessages[i] * beacon_get_max_xfers(d) < nxfers)
+    {
+      fprintf(stderr,"%s: %lu plans built, %lu transfers in %lu messages\n", what, nbuilt, nxfers, nmessages[i]);
+      nbad++;
+    }
+  }
+  if (nmessages[0] <= nmessages[1]) nbad++;
+
+  printf("%d problems\n", nbad);
+  beacon_enable_verification_mode(d, 0);
+  beacon_close(d);
+  return nbad != 0;
+}